@@ -27,8 +27,24 @@ function Application() {
 	};
 	disconnectType = disconnectTypes.unexpected;
 	
+	/// The formats used by the deferred logging messages.
+	var logFormats = {};
+	/// The logging messages which have arrived before their format.
+	var pendingLogMessages = {};
+	/// Decodes the string arguments of the logging messages.
+	var utf8Decoder = new TextDecoder('utf-8');
+	
 	/// The websocket server connection.
 	var ws = null;
+	/// The time when the messages which are being parsed have arrived.
+	var receiveTime = 0;
+	/// The server's clock estimate (see network.clock).
+	var clockOffset = 0;
+	/// The requests which wait for a response, keyed by the requestId.
+	var pendingRequests = {};
+	var nextRequestId = 1;
+	/// The last values of the delta encoded messages, keyed by the type.
+	var deltaBases = {};
 	if(window) {
 		window.onbeforeunload = function(){
 			if(ws) {
@@ -65,7 +81,117 @@ function Application() {
 	function unknownMessageError(msg,object) {
 		application.error("Unknown message - " + JSON.stringify(object));	
 	}
+	/// The element types of the binary fields - size and typed array.
+	var binaryTypes = {
+		u8: [1,Uint8Array], i32: [4,Int32Array], u32: [4,Uint32Array],
+		f32: [4,Float32Array], f64: [8,Float64Array], i64: [8,null],
+		u64: [8,null]
+	};
+	/// Replaces the descriptors of the binary fields with their values,
+	/// and returns the size of the binary values.
+	function decodeBinaryFields(object,buffer,begin) {
+		var size = 0;
+		for(var name in object) {
+			var field = object[name];
+			if(field === null || (typeof field) !== "object" || 
+				!(field.binary in binaryTypes)) continue;
+			var type = binaryTypes[field.binary];
+			var isArray = (typeof field.count) === "number";
+			var count = isArray? field.count : 1;
+			var offset = begin + field.offset;
+			var values;
+			if(type[1] !== null) {
+				// Copied, as the typed arrays have to be aligned.
+				values = new type[1](buffer.slice(offset,offset + count*type[0]));
+			} else {
+				// The numbers lose the precision above 2^53.
+				var view = new DataView(buffer,offset,count*8);
+				values = [];
+				for(var i = 0;i < count;++i) {
+					var high = field.binary === "i64"? 
+						view.getInt32(i*8+4,true) : view.getUint32(i*8+4,true);
+					values.push(high*4294967296 + view.getUint32(i*8,true));
+				}
+			}
+			object[name] = isArray? values : values[0];
+			size += count*type[0];
+		}
+		return size;
+	}
+	/// Reads a varint from the bytes at reader.offset.
+	function readVarint(bytes,reader) {
+		var value = 0;
+		for(var scale = 1;;scale *= 128) {
+			var b = bytes[reader.offset++];
+			value += (b & 0x7F)*scale;
+			if(b < 0x80) return value;
+		}
+	}
+	/// Remembers the keyframes of the delta encoded messages, and returns
+	/// the full message for a delta. Returns null when a message for that
+	/// key was missed, until the next keyframe.
+	function applyDelta(object) {
+		var bases,key;
+		if((typeof object.keyframe) === "object") {
+			var keyframe = object.keyframe;
+			delete object.keyframe;
+			bases = deltaBases[object.type];
+			if(!bases) bases = deltaBases[object.type] = { key: null, values: {} };
+			bases.key = keyframe.key || null;
+			key = bases.key? object[bases.key] : "";
+			var names = [];
+			for(var name in object) {
+				if(name !== "type" && name !== "dataSize" && name !== "binaryData")
+					names.push(name);
+			}
+			bases.values[key] = { seq: keyframe.seq, names: names,
+				types: keyframe.types, object: object };
+			return object;
+		}
+		bases = deltaBases[object.type];
+		if(!bases) return null;
+		key = bases.key? object[bases.key] : "";
+		var base = bases.values[key];
+		if(!base || base.seq + 1 !== object.deltaSeq) {
+			delete bases.values[key];
+			return null;
+		}
+		var result = {};
+		for(var name in base.object) result[name] = base.object[name];
+		var bytes = object.binaryData;
+		var reader = { offset: (base.types.length + 7) >> 3 };
+		for(var i = 0;i < base.types.length;++i) {
+			if(!(bytes[i >> 3] & (1 << (i & 7)))) continue;
+			var name = base.names[i];
+			switch(base.types.charAt(i)) {
+			case 'b':
+				result[name] = !result[name];
+				break;
+			case 'f':
+				result[name] = new DataView(bytes.buffer,bytes.byteOffset + 
+					reader.offset,8).getFloat64(0,true);
+				reader.offset += 8;
+				break;
+			case 's':
+				var length = readVarint(bytes,reader);
+				var str = "";
+				for(var end = reader.offset + length;reader.offset < end;
+					++reader.offset) str += String.fromCharCode(bytes[reader.offset]);
+				result[name] = str;
+				break;
+			default:
+				// Zig-zag - the odd values are negative.
+				var value = readVarint(bytes,reader);
+				result[name] += value % 2? -(value + 1)/2 : value/2;
+				break;
+			}
+		}
+		base.seq = object.deltaSeq;
+		base.object = result;
+		return result;
+	}
 	function parseMessages () {
+		receiveTime = this.receiveTime;
 		var u8view = new Uint8Array(this.result);
 		var offset = 0;
 		while(offset < u8view.length){
@@ -79,18 +205,69 @@ function Application() {
 			}
 			var object = JSON.parse(str);
 			if((typeof object.dataSize) === "number"){
-				var binaryDataLength = object.dataSize;
+				// The binary values of the fields follow the binary data.
+				var binaryDataLength = object.dataSize - 
+					decodeBinaryFields(object,this.result,offset);
 				object.binaryData = new Uint8Array(this.result,offset,
 					binaryDataLength);
-				offset += binaryDataLength;
+				offset += object.dataSize;
+			}
+			if((typeof object.keyframe) === "object" || "deltaSeq" in object) {
+				object = applyDelta(object);
+				if(object === null) continue;
 			}
 			// Act based on the header.
+			if((typeof object.requestId) === "number" && 
+				object.requestId in pendingRequests) {
+				completeRequest(object.requestId,object);
+				continue;
+			}
 			var handler = handlers[object.type];
 			if(handler) handler(object);
 			else application.unknownMessageError(object);
 		}
 	}
 	
+	/// Decodes the binary arguments of a deferred logging message.
+	function decodeLogArguments(bytes) {
+		var args = [];
+		if(!bytes) return args;
+		var view = new DataView(bytes.buffer,bytes.byteOffset,bytes.byteLength);
+		var offset = 0;
+		while(offset < bytes.length) {
+			var tag = String.fromCharCode(bytes[offset]);
+			offset++;
+			switch(tag) {
+			case 'b': args.push(bytes[offset] !== 0); offset += 1; break;
+			case 'i': args.push(view.getInt32(offset,true)); offset += 4; break;
+			case 'u': args.push(view.getUint32(offset,true)); offset += 4; break;
+			case 'I': 
+				args.push(view.getInt32(offset+4,true)*4294967296 + 
+					view.getUint32(offset,true)); 
+				offset += 8; break;
+			case 'U': case 'p':
+				args.push(view.getUint32(offset+4,true)*4294967296 + 
+					view.getUint32(offset,true)); 
+				offset += 8; break;
+			case 'd': args.push(view.getFloat64(offset,true)); offset += 8; break;
+			case 's':
+				var length = view.getUint16(offset,true);
+				offset += 2;
+				args.push(utf8Decoder.decode(bytes.subarray(offset,
+					offset + length)));
+				offset += length;
+				break;
+			default:
+				return args;
+			}
+		}
+		return args;
+	}
+	function logFormatted(format,args) {
+		application.logging.message(application.logging.Remote,
+			format.lvl,core.format(format.fmt,args));
+	}
+	
 //----------------------------------------------------------------------
 // Public:
 	
@@ -166,11 +343,13 @@ function Application() {
 	this.connect = function(url) {			
 		ws = new WebSocket('ws://' + url);
 		ws.onopen = function() {
+			deltaBases = {};
 			application.log('Connected to ws://' + url);
 			application.raiseEvent('connected');
 		};
 		ws.onmessage = function(message){
 			var reader = new FileReader();
+			reader.receiveTime = performance.now()/1000.0;
 			reader.onloadend = parseMessages;
 			reader.readAsArrayBuffer(message.data);
 		};			
@@ -220,6 +399,47 @@ function Application() {
 		ws.send(buffer);	
 	}
 	
+	/**
+	 * Sends a request to the server, the callback(response,error) is 
+	 * called with the response message, or with an error string when 
+	 * the request fails or it times out (in seconds, 10 by default).
+	 */
+	this.request = function(type,value,callback,timeout) {
+		if(ws === null) {
+			callback(null,"The application isn't connected");
+			return;
+		}
+		if(!value) value = {};
+		var id = nextRequestId;
+		nextRequestId = nextRequestId >= 0x7FFFFFFF? 1 : nextRequestId + 1;
+		value.requestId = id;
+		pendingRequests[id] = { 
+			callback: callback,
+			timer: setTimeout(function() {
+				completeRequest(id,{ type: "rpc.error", 
+					error: "The request has timed out" });
+			},(timeout? timeout : 10)*1000)
+		};
+		application.send(type,value);
+	}
+	function completeRequest(id,message) {
+		var request = pendingRequests[id];
+		if(!request) return;
+		delete pendingRequests[id];
+		clearTimeout(request.timer);
+		if(message.type === "rpc.error") request.callback(null,message.error);
+		else request.callback(message,null);
+	}
+	
+	/**
+	 * Maps a server time (the 't' fields) onto the browser's clock, which
+	 * is performance.now() in seconds - the clock used by the event 
+	 * timestamps.
+	 */
+	this.toClientTime = function(t) {
+		return t + clockOffset;
+	}
+	
 	/**
 	 * Binds a callback to the specified message type.
 	 */
@@ -360,6 +580,8 @@ function Application() {
 	// Default event handlers
 	this.on('connected',function() {
 		disconnectType = disconnectTypes.unexpected;
+		logFormats = {};
+		pendingLogMessages = {};
 		application.data.reset();
 	});
 	this.on("disconnected",function(event) {
@@ -369,6 +591,10 @@ function Application() {
 			application.log('Disconnected from the application.');
 		disconnectType = disconnectTypes.unexpected;
 		ws = null;
+		for(var id in pendingRequests) {
+			completeRequest(id,{ type: "rpc.error", 
+				error: "The connection to the application was lost" });
+		}
 	});
 	
 	// Core message handlers.
@@ -377,6 +603,14 @@ function Application() {
 			"The application doesn't recognise the message with the type '"+
 			msg.msgtype+"'");
 	});
+	// The clock synchronisation.
+	this.handle("network.ping", function(val) {
+		application.send("network.pong",{ id: val.id, t1: receiveTime,
+			t2: performance.now()/1000.0 });
+	});
+	this.handle("network.clock", function(val) {
+		clockOffset = val.offset;
+	});
 	this.handle("tooling.pipe.application.connected", function(frameId,val){
 		application.log('The application connected to the piping server.');
 	});
@@ -388,6 +622,41 @@ function Application() {
 		(typeof val.lvl) == "number"? val.lvl : application.logging.Fatal,
 		(typeof val.msg) == "string"? val.msg : "");
 	});
+	this.handle("logging.format", function(val) {
+		logFormats[val.id] = val;
+		var pending = pendingLogMessages[val.id];
+		if(pending) {
+			delete pendingLogMessages[val.id];
+			for(var i = 0;i < pending.length;++i)
+				logFormatted(val,pending[i]);
+		}
+	});
+	this.handle("logging.fmsg", function(val) {
+		var args = decodeLogArguments(val.binaryData);
+		var format = logFormats[val.id];
+		if(format) logFormatted(format,args);
+		else if(val.id in pendingLogMessages) 
+			pendingLogMessages[val.id].push(args);
+		else pendingLogMessages[val.id] = [ args ];
+	});
+	this.handle("logging.repeat", function(val) {
+		var format = logFormats[val.id];
+		if(!format) return;
+		application.logging.message(application.logging.Remote,format.lvl,
+			'"'+format.fmt+'" was repeated '+val.count+' more times this frame');
+	});
+	this.handle("logging.dropped", function(val) {
+		var from = (typeof val.category) === "string"? 
+			"in the category '"+val.category+"'" : 
+			"with the level "+val.lvl;
+		application.warning(val.count+" logging messages "+from+
+			" were dropped by the rate limit");
+	});
+	this.handle("replay.position", function(val) {
+		// The replay server has moved the playback to another frame.
+		application.data.reset();
+		application.log('Replaying from the frame '+val.frame);
+	});
 	this.handle("application.information",function(info) {
 		var change = false;
 		if((typeof info.name) == "string") {
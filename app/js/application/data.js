@@ -253,6 +253,54 @@ function ApplicationData() {
 			this.clear();
 		}).bind(this));
 	}
+	/**
+	 * A collection of the message totals for each message type.
+	 * Stores the last totals for each type along with the rates
+	 * computed from the previous totals.
+	 */
+	this.MessageStatisticsCollection = function() {
+		this.types = {};
+		var self = this;
+		
+		var changeCallbacks = [];
+		
+		this.push = function(val) {
+			var prev = self.types[val.type];
+			var item = {
+				type: val.type,
+				messages: val.messages,
+				bytes: val.headerBytes + val.dataBytes,
+				headerBytes: val.headerBytes,
+				dataBytes: val.dataBytes,
+				encodeTime: val.encodeTime,
+				t: val.t,
+				messageRate: 0,
+				byteRate: 0
+			};
+			if(prev && val.t > prev.t && val.messages >= prev.messages) {
+				var dt = val.t - prev.t;
+				item.messageRate = (item.messages - prev.messages)/dt;
+				item.byteRate = (item.bytes - prev.bytes)/dt;
+			}
+			self.types[val.type] = item;
+			for(var i = 0;i<changeCallbacks.length;++i)
+				changeCallbacks[i](self.types);
+		}
+		this.on = function(event,callback) {
+			bindChangeCallback(changeCallbacks,event,callback);
+		}
+		this.clear = function() {
+			self.types = {};
+			for(var i = 0;i<changeCallbacks.length;++i)
+				changeCallbacks[i](self.types);
+		}
+		
+		// Automatic reset.
+		application.on('data.reset',(function() {
+			this.clear();
+		}).bind(this));
+	}
+	
 	this.MemoryUsageCollection.prototype.getAllocator = function(index) {
 		var self = this.allocators;
 		for (var key in self) {
@@ -267,10 +315,18 @@ function ApplicationData() {
 	this.frameDt = new this.ArrayCollection(this.Type.eachFrame);
 	/// frame raw(unfiltered) dt
 	this.frameRawDt = new this.ArrayCollection(this.Type.eachFrame);
+	/// time spent in the application's tooling service each frame
+	this.serviceTime = new this.ArrayCollection(this.Type.eachFrame);
+	/// the last statistics reported by the tooling service
+	this.serviceStatistics = null;
+	/// the last connection statistics of each client, by client index
+	this.clientStatistics = {};
 	/// profiling results
 	this.profilingResults = new this.ArrayCollection;
 	/// memory usage
 	this.memoryUsage = new this.MemoryUsageCollection;
+	/// the sent messages for each message type
+	this.messageStatistics = new this.MessageStatisticsCollection;
 	/// task profiling results.
 	this.frameTasksProfilingResults = 
 		new this.ArrayEachFrameMultiCollection;
@@ -298,6 +354,21 @@ function ApplicationData() {
 	application.handle("profiling.task", function(val){
 		data.frameTasksProfilingResults.push(val.frame,val);
 	});
+	application.handle("profiling.tasks", function(val){
+		// The names are zero terminated, and the name column has their indices.
+		var names = [];
+		for(var begin = 0,i = 0;i < val.names.length;++i) {
+			if(val.names[i] !== 0) continue;
+			names.push(utf8toString(val.names.subarray(begin,i)));
+			begin = i + 1;
+		}
+		for(var i = 0;i < val.count;++i) {
+			data.frameTasksProfilingResults.push(val.frame,{
+				name: names[val.name[i]], thread: val.thread[i],
+				depth: val.depth[i], t: val.t[i], dt: val.dt[i],
+				frame: val.frame });
+		}
+	});
 	application.handle("monitoring.memory", function(val) {
 		// Convert B to MiB
 		data.memoryUsage.push(val.name,val.t,val.size/(1024*1024));
@@ -308,4 +379,15 @@ function ApplicationData() {
 		if((typeof val.rawDt) === "number")
 			data.frameRawDt.push([val.t,val.rawDt*1000.0]);
 	});
+	application.handle("monitoring.messages", function(val){
+		data.messageStatistics.push(val);
+	});
+	application.handle("monitoring.client", function(val){
+		data.clientStatistics[val.client] = val;
+	});
+	application.handle("monitoring.service", function(val){
+		data.serviceStatistics = val;
+		// Convert s to ms.
+		data.serviceTime.push([val.t,(val.send + val.update)*1000.0]);
+	});
 }
@@ -33,6 +33,99 @@ checkEnumValue: function(value,enumObject,defaultValue) {
 		}
 	}
 	throw new Error("value isn't a member of enum");
+},
+
+/**
+ * Returns the integer value as an unsigned integer - the 32 bit 
+ * values are converted like C does, the 64 bit values approximately.
+ */
+unsignedValue: function(value) {
+	var v = Math.trunc(Number(value));
+	if(v >= 0) return v;
+	return v >= -2147483648? v >>> 0 : v + 18446744073709551616;
+},
+
+/**
+ * Formats the arguments using a printf style format string.
+ * Supports the flags '-', '+', ' ', '0', '#', the width and
+ * the precision, and the conversions d i u x X o f F e E g G c s p %.
+ * The length modifiers (l, ll, h, z, etc.) are ignored.
+ */
+format: function(fmt,args) {
+	var result = '';
+	var arg = 0;
+	var spec = /%([-+ 0#]*)(\*|\d+)?(?:\.(\*|\d+))?(?:hh|h|ll|l|L|z|j|t|q|I64|I32|I)?([diuxXofFeEgGcsp%])/g;
+	var last = 0;
+	var match;
+	while((match = spec.exec(fmt)) !== null) {
+		result += fmt.substring(last,match.index);
+		last = spec.lastIndex;
+		var conversion = match[4];
+		if(conversion === '%') {
+			result += '%';
+			continue;
+		}
+		var flags = match[1];
+		var width = match[2] === '*'? args[arg++] : parseInt(match[2] || '0');
+		var precision = match[3] === '*'? args[arg++] : 
+			(match[3] === undefined? undefined : parseInt(match[3]));
+		var value = args[arg++];
+		var str;
+		switch(conversion) {
+		case 'd': case 'i': case 'u':
+			str = conversion === 'u'? core.unsignedValue(value).toString() :
+				Math.abs(Math.trunc(Number(value))).toString();
+			if(precision !== undefined) while(str.length < precision) str = '0' + str;
+			break;
+		case 'x': case 'X': case 'o':
+			// Like in C, the negative values are printed in two's complement.
+			str = core.unsignedValue(value).toString(conversion === 'o'? 8 : 16);
+			if(conversion === 'X') str = str.toUpperCase();
+			if(flags.indexOf('#') >= 0 && Number(value) !== 0) 
+				str = (conversion === 'o'? '0' : (conversion === 'X'? '0X' : '0x')) + str;
+			break;
+		case 'f': case 'F':
+			str = Math.abs(Number(value)).toFixed(precision === undefined? 6 : precision);
+			break;
+		case 'e': case 'E':
+			str = Math.abs(Number(value)).toExponential(precision === undefined? 6 : precision);
+			str = str.replace(/e([+-])(\d)$/,'e$10$2');
+			if(conversion === 'E') str = str.toUpperCase();
+			break;
+		case 'g': case 'G':
+			str = Math.abs(Number(value)).toPrecision(precision === undefined? 6 : 
+				(precision === 0? 1 : precision));
+			if(flags.indexOf('#') < 0 && str.indexOf('e') < 0 && str.indexOf('.') >= 0)
+				str = str.replace(/\.?0+$/,'');
+			if(conversion === 'G') str = str.toUpperCase();
+			break;
+		case 'c':
+			str = typeof value === "number"? String.fromCharCode(value) : String(value);
+			break;
+		case 's':
+			str = String(value);
+			if(precision !== undefined) str = str.substring(0,precision);
+			break;
+		case 'p':
+			str = '0x' + Number(value).toString(16);
+			break;
+		}
+		// Sign.
+		if('difFeEgG'.indexOf(conversion) >= 0) {
+			var sign = Number(value) < 0? '-' : 
+				(flags.indexOf('+') >= 0? '+' : (flags.indexOf(' ') >= 0? ' ' : ''));
+			if(flags.indexOf('0') >= 0 && flags.indexOf('-') < 0)
+				while(str.length + sign.length < width) str = '0' + str;
+			str = sign + str;
+		}
+		// Padding.
+		while(str.length < width) {
+			if(flags.indexOf('-') >= 0) str += ' ';
+			else str = ' ' + str;
+		}
+		result += str;
+	}
+	return result + fmt.substring(last);
 }
 
 };
@@ -2,20 +2,24 @@ application.on('tools.create',function() {
 
 /**
  * Delta time graph - 
- * plots raw and filtered(if present) dt for last N frames.
+ * plots raw and filtered(if present) dt for last N frames, and
+ * the time spent in the tooling service(if it profiles itself).
  * 
  * Uses:
  * 	 tab with id profilingTimeGraphView.
- *   application.data.frameDt, application.data.frameRawDt]
+ *   application.data.frameDt, application.data.frameRawDt,
+ *   application.data.serviceTime]
  */
 function FrameDtView() {
 	FrameDtView.superclass.constructor.call(this,
 	'profilingTimeGraphView',
-	[application.data.frameDt.array, application.data.frameRawDt.array],
+	[application.data.frameDt.array, application.data.frameRawDt.array,
+	 application.data.serviceTime.array],
 	{
 		labels: [
 		["Frame start (s): ","DT (ms): "],
-		["Frame start (s): ","Raw(unfiltered) DT (ms): "] ]
+		["Frame start (s): ","Raw(unfiltered) DT (ms): "],
+		["Frame start (s): ","Tooling service (ms): "] ]
 	});
 	// Plot 0 to 60 ms.
 	this.setYValueLimits(0,60);
@@ -23,6 +27,8 @@ function FrameDtView() {
 		this.update.bind(this));
 	application.data.frameRawDt.on(application.data.EventType.any,
 		this.update.bind(this));
+	application.data.serviceTime.on(application.data.EventType.any,
+		this.update.bind(this));
 }
 core.extend(FrameDtView,GraphView);
 
@@ -93,6 +99,40 @@ function ProfilingTimerView() {
 	});
 }
 
+/**
+ * A table of the messages sent by the application for each message type.
+ * Uses:
+ *   application.data.messageStatistics
+ */
+function MessageStatisticsView() {
+	this.widget = $("#messageStatisticsView");
+	this.tableBody =  $("#messageStatisticsView table tbody");
+	
+	function itemToHtml(val) {
+		return '<tr><td>'+
+		val.type+'</td><td>'+val.messages+'</td>'+
+		'<td>'+val.messageRate.toFixed(1)+'</td>'+
+		'<td>'+(val.headerBytes/1024).toFixed(1)+' KiB</td>'+
+		'<td>'+(val.dataBytes/1024).toFixed(1)+' KiB</td>'+
+		'<td>'+(val.byteRate/1024).toFixed(1)+' KiB/s</td>'+
+		'<td>'+(val.encodeTime*1000.0).toFixed(3)+' ms</td>'+
+		'</tr>';
+	}
+	var self = this;
+	application.data.messageStatistics.on(application.data.EventType.change,
+	function(types){
+		var items = [];
+		for(var type in types) {
+			if(types.hasOwnProperty(type)) items.push(types[type]);
+		}
+		// The heaviest types first.
+		items.sort(function(a,b) { return b.byteRate - a.byteRate; });
+		var html = '';
+		for(var i = 0;i<items.length;++i)
+			html += itemToHtml(items[i]);
+		self.tableBody.html(html);
+	});
+}
 
 application.tools.frameDt = new FrameDtView();
 application.tools.memoryUsage = new MemoryUsageView();
@@ -107,5 +147,6 @@ application.data.frameTasksProfilingResults.on(application.data.EventType.any,
 	(function() { this.update(true); }).bind(application.tools.profilingThreads));
 	
 application.tools.profilingResults = new ProfilingTimerView();
+application.tools.messageStatistics = new MessageStatisticsView();
 
 });
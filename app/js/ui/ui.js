@@ -286,6 +286,8 @@ function Ui() {
 	connectSubTabToTool("Monitor","Threads",application.tools.profilingThreads);
 	connectSubTabToTool("Monitor","Timers",application.tools.profilingResults);
 	connectSubTabToTool("Monitor","Memory",application.tools.memoryUsage);
+	connectSubTabToTool("Monitor","Messages",
+		application.tools.messageStatistics);
 	
 	// Data/Assets tab
 	//this.internal.connectSubTabButton($("#tabDataTabShaders"),this.shaders);
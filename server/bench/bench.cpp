@@ -0,0 +1,464 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../gamedevwebtools.cpp"
+
+using namespace gamedevwebtools;
+
+/**
+ * Microbenchmarks for the hot paths of the service.
+ */
+
+static uint64_t now() {
+	return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+/** The producer thread id, used by BenchService::currentThreadId. */
+static thread_local size_t threadIndex = 0;
+
+/** A service which counts the allocations. */
+class BenchService : public Service {
+public:
+	std::atomic<uint64_t> allocations;
+	std::atomic<uint64_t> allocatedBytes;
+
+	bool failed;
+
+	BenchService() : allocations(0), allocatedBytes(0), failed(false) {}
+	size_t currentThreadId() const { return threadIndex; }
+	void onError(const char *error) {
+		fprintf(stderr,"%s\n",error);
+		failed = true;
+	}
+	void *onMalloc(size_t size) {
+		allocations.fetch_add(1,std::memory_order_relaxed);
+		allocatedBytes.fetch_add(size,std::memory_order_relaxed);
+		return Service::onMalloc(size);
+	}
+
+	/** Drops the sent messages, as there are no clients. */
+	void flush() {
+		frameStart(0.0);
+		update();
+	}
+};
+
+/**
+ * The state of a single benchmark run. The time and the allocations
+ * are measured only between resume and pause.
+ */
+struct State {
+	BenchService *service;
+	uint64_t iterations;
+	uint64_t bytes;       // The amount of bytes processed in total.
+	uint64_t elapsed;     // ns
+	uint64_t allocations;
+	uint64_t startTime,startAllocations;
+	
+	State(BenchService *service,uint64_t iterations) : service(service),
+		iterations(iterations), bytes(0), elapsed(0), allocations(0),
+		startTime(0), startAllocations(0) {}
+
+	void resume() {
+		startAllocations = service->allocations.load();
+		startTime = now();
+	}
+	void pause() {
+		elapsed += now() - startTime;
+		allocations += service->allocations.load() - startAllocations;
+	}
+};
+
+struct Options {
+	const char *filter;
+	uint64_t iterations;
+	size_t maxThreads;
+	bool json;
+};
+
+static bool firstResult = true;
+
+static void report(const Options &options,const char *name,
+	const State &state)
+{
+	auto ops = double(state.iterations);
+	auto seconds = double(state.elapsed)*1e-9;
+	auto nsPerOp = double(state.elapsed)/ops;
+	auto bytesPerSecond = seconds > 0.0? double(state.bytes)/seconds : 0.0;
+	auto allocationsPerOp = double(state.allocations)/ops;
+	if(options.json) {
+		printf("%s\n  {\"name\":\"%s\",\"iterations\":%llu,\"nsPerOp\":%.3f,"
+			"\"bytesPerSecond\":%.0f,\"allocationsPerOp\":%.6f}",
+			firstResult? "[" : ",",name,
+			(unsigned long long)state.iterations,nsPerOp,bytesPerSecond,
+			allocationsPerOp);
+	} else {
+		printf("%-28s %12llu %12.2f %12.2f %12.4f\n",name,
+			(unsigned long long)state.iterations,nsPerOp,
+			bytesPerSecond/(1024.0*1024.0),allocationsPerOp);
+	}
+	firstResult = false;
+}
+
+static bool selected(const Options &options,const char *name) {
+	return !options.filter || strstr(name,options.filter);
+}
+
+/* Message encoding */
+
+static const size_t kFlushInterval = 1024;
+
+static void encode(State &state,const Message &message) {
+	auto &service = *state.service;
+	for(uint64_t i = 0;i < state.iterations;) {
+		auto queued = service.queuedBytes();
+		state.resume();
+		for(size_t j = 0;j < kFlushInterval && i < state.iterations;++j,++i)
+			service.send(message);
+		state.pause();
+		state.bytes += service.queuedBytes() - queued;
+		service.flush();
+	}
+}
+
+static void benchEncoding(BenchService &service,const Options &options) {
+	int dummy;
+	struct Case {
+		const char *name;
+		Message message;
+	} cases[] = {
+		{ "encode.empty", Message("bench") },
+		{ "encode.bool", Message("bench",Message::Field("x",true)) },
+		{ "encode.i32", Message("bench",Message::Field("x",int32_t(-123456))) },
+		{ "encode.isz", Message("bench",Message::Field("x",
+			size_t(1234567890123ULL))) },
+		{ "encode.f64", Message("bench",Message::Field("x",3.14159265)) },
+		{ "encode.cstr", Message("bench",Message::Field("x",
+			"A string field")) },
+		{ "encode.cstr.escaped", Message("bench",Message::Field("x",
+			"A \"string\"\n\twith escapes")) },
+		{ "encode.ptr", Message("bench",Message::Field("x",(void*)&dummy)) },
+		{ "encode.3fields", Message("bench",Message::Field("name","task"),
+			Message::Field("t",0.25),Message::Field("size",size_t(4096))) },
+	};
+	for(size_t i = 0;i < sizeof(cases)/sizeof(cases[0]);++i) {
+		if(!selected(options,cases[i].name)) continue;
+		State state = { &service,options.iterations };
+		encode(state,cases[i].message);
+		report(options,cases[i].name,state);
+	}
+
+	static char binary[1024];
+	if(selected(options,"encode.binary1k")) {
+		State state = { &service,options.iterations/4 };
+		for(uint64_t i = 0;i < state.iterations;) {
+			auto queued = service.queuedBytes();
+			state.resume();
+			for(size_t j = 0;j < kFlushInterval && i < state.iterations;
+				++j,++i)
+				service.send(Message("bench"),binary,sizeof(binary));
+			state.pause();
+			state.bytes += service.queuedBytes() - queued;
+			service.flush();
+		}
+		report(options,"encode.binary1k",state);
+	}
+	if(selected(options,"encode.typed.3fields")) {
+		State state = { &service,options.iterations };
+		for(uint64_t i = 0;i < state.iterations;) {
+			auto queued = service.queuedBytes();
+			state.resume();
+			for(size_t j = 0;j < kFlushInterval && i < state.iterations;
+				++j,++i)
+				service.sendFields("bench",field("name","task"),
+					field("t",0.25),field("size",size_t(4096)));
+			state.pause();
+			state.bytes += service.queuedBytes() - queued;
+			service.flush();
+		}
+		report(options,"encode.typed.3fields",state);
+	}
+	if(selected(options,"encode.template.3fields")) {
+		static const MessageTemplate<const char*,double,size_t> task("bench",
+			"name","t","size");
+		State state = { &service,options.iterations };
+		for(uint64_t i = 0;i < state.iterations;) {
+			auto queued = service.queuedBytes();
+			state.resume();
+			for(size_t j = 0;j < kFlushInterval && i < state.iterations;
+				++j,++i)
+				service.send(task,"task",0.25,size_t(4096));
+			state.pause();
+			state.bytes += service.queuedBytes() - queued;
+			service.flush();
+		}
+		report(options,"encode.template.3fields",state);
+	}
+	if(selected(options,"profile.tasks")) {
+		// Includes the columnar batch which is sent by frameStart.
+		const char *names[] = { "update", "render", "physics", "audio" };
+		State state = { &service,options.iterations };
+		for(uint64_t i = 0;i < state.iterations;) {
+			auto queued = service.queuedBytes();
+			state.resume();
+			for(size_t j = 0;j < kFlushInterval && i < state.iterations;
+				++j,++i)
+				service.profileTask(names[j%4],0,int32_t(j%4),0.25,0.125);
+			service.frameStart(0.0);
+			state.pause();
+			state.bytes += service.queuedBytes() - queued;
+			service.update();
+		}
+		report(options,"profile.tasks",state);
+	}
+}
+
+/* Thread buffer throughput with N producer threads */
+
+static void benchThreadBuffers(BenchService &service,const Options &options,
+	size_t threads)
+{
+	char name[64];
+	snprintf(name,sizeof(name),"send.threads%d",int(threads));
+	if(!selected(options,name)) return;
+
+	State state = { &service,0 };
+	auto perThread = options.iterations/threads;
+	// Each producer sends kFlushInterval messages per frame.
+	for(uint64_t sent = 0;sent < perThread;sent += kFlushInterval) {
+		auto count = perThread - sent < kFlushInterval?
+			perThread - sent : kFlushInterval;
+		std::vector<std::thread> producers;
+		std::atomic<size_t> ready(0);
+		std::atomic<bool> go(false);
+		for(size_t t = 0;t < threads;++t) {
+			producers.push_back(std::thread([&,t]() {
+				threadIndex = t;
+				ready.fetch_add(1);
+				while(!go.load()) ;
+				for(uint64_t i = 0;i < count;++i) {
+					service.send(Message("bench",
+						Message::Field("thread",int32_t(t)),
+						Message::Field("t",double(i))));
+				}
+			}));
+		}
+		while(ready.load() != threads) ;
+		auto queued = service.queuedBytes();
+		state.resume();
+		go.store(true);
+		for(size_t t = 0;t < threads;++t) producers[t].join();
+		state.pause();
+		state.iterations += count*threads;
+		state.bytes += service.queuedBytes() - queued;
+		service.flush();
+	}
+	report(options,name,state);
+}
+
+/* HashTable lookup */
+
+static void benchHashTable(BenchService &service,const Options &options,
+	size_t keyCount)
+{
+	char name[64];
+	snprintf(name,sizeof(name),"hashtable.find%d",int(keyCount));
+	if(!selected(options,name)) return;
+
+	std::vector<std::string> keys;
+	core::HashTable table(&service);
+	for(size_t i = 0;i < keyCount;++i) {
+		char key[64];
+		snprintf(key,sizeof(key),"application.message.%d",int(i));
+		keys.push_back(key);
+	}
+	for(size_t i = 0;i < keyCount;++i)
+		table.insert(keys[i].c_str(),uint32_t(i));
+
+	State state = { &service,options.iterations };
+	uint32_t sum = 0;
+	state.resume();
+	for(uint64_t i = 0;i < state.iterations;++i) {
+		auto &key = keys[(i*7919) % keyCount];
+		sum += table.find(key.c_str());
+		state.bytes += key.size();
+	}
+	state.pause();
+	if(sum == 0xFFFFFFFF) printf(" ");
+	report(options,name,state);
+}
+
+/* Inbound message parsing */
+
+static void benchParse(BenchService &service,const Options &options) {
+	struct Case {
+		const char *name;
+		const char *json;
+	} cases[] = {
+		{ "parse.small", "{\"type\":\"input.keydown\",\"key\":65}" },
+		{ "parse.mixed", "{\"type\":\"application.tool\",\"name\":\"camera\","
+			"\"enabled\":true,\"x\":-12.5e2,\"y\":0.125,\"id\":12345}" },
+		{ "parse.escaped", "{\"type\":\"application.command\",\"cmd\":"
+			"\"say \\\"Hello\\\"\\n\\tworld\"}" },
+	};
+	for(size_t i = 0;i < sizeof(cases)/sizeof(cases[0]);++i) {
+		if(!selected(options,cases[i].name)) continue;
+		// NB: The message is parsed in place, so the time includes a copy.
+		char message[256];
+		auto size = strlen(cases[i].json);
+		// NB: Message::Field isn't default constructible outside the service.
+		std::aligned_storage<sizeof(Message::Field)*ParseResult::kMaxFields,
+			alignof(Message::Field)>::type fields;
+		ParseResult result;
+		result.fields = (Message::Field*)&fields;
+
+		State state = { &service,options.iterations };
+		state.resume();
+		for(uint64_t j = 0;j < state.iterations;++j) {
+			memcpy(message,cases[i].json,size);
+			result.type = nullptr;
+			result.binaryDataSize = 0;
+			parseJSON(&service,result,message,size);
+		}
+		state.pause();
+		assert(result.type);
+		state.bytes = state.iterations*size;
+		report(options,cases[i].name,state);
+	}
+}
+
+/* Websocket framing */
+
+static const size_t kFrameSize = 256*1024;
+
+static void benchFraming(BenchService &service,const Options &options,
+	size_t size)
+{
+	char name[64];
+	snprintf(name,sizeof(name),"websocket.write%d",int(size));
+	if(!selected(options,name)) return;
+
+	std::vector<uint8_t> payload(size,0x42);
+	network::Listener listener;
+	network::MemoryTransport transport; // Only the clock is used.
+	State state = { &service,options.iterations };
+	if(size >= 65536) state.iterations /= 64;
+	// The write buffer holds about a frame's worth of messages.
+	auto batch = size < kFrameSize? kFrameSize/size : 1;
+	const uint32_t weights[Message::kPriorityCount] = { 1, 4, 16 };
+	for(uint64_t i = 0;i < state.iterations;) {
+		network::websocket::Server ws(&service,&transport,&listener,weights);
+		state.resume();
+		for(size_t j = 0;j < batch && i < state.iterations;++j,++i)
+			ws.write(payload.data(),size);
+		state.pause();
+	}
+	state.bytes = state.iterations*size;
+	report(options,name,state);
+}
+
+/* The whole pipeline over the memory transport */
+
+static void benchPipeline(const Options &options,size_t threads,
+	bool ordered) 
+{
+	char name[64];
+	if(threads == 1) snprintf(name,sizeof(name),"pipeline.memory");
+	else snprintf(name,sizeof(name),"pipeline.threads%d%s",
+		int(threads),ordered? ".ordered" : "");
+	if(!selected(options,name)) return;
+	
+	network::MemoryTransport transport;
+	BenchService service;
+	Service::NetworkOptions netOptions;
+	netOptions.transport = &transport;
+	netOptions.orderedThreadMessages = ordered;
+	service.init(Service::ApplicationInformation(),netOptions,threads);
+	auto client = transport.connect();
+	auto request = "GET / HTTP/1.1\r\nUpgrade: websocket\r\n"
+		"Connection: Upgrade\r\n"
+		"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n";
+	client->write(request,strlen(request));
+	service.update();
+	
+	// Send the messages, write them to the client and read them.
+	static char buffer[64*1024];
+	State state = { &service,options.iterations };
+	state.resume();
+	for(uint64_t i = 0;i < state.iterations;) {
+		// The messages of the threads are interleaved.
+		for(size_t j = 0;j < kFlushInterval && i < state.iterations;++j,++i) {
+			threadIndex = j%threads;
+			service.send(Message("bench",Message::Field("name","task"),
+				Message::Field("t",0.25),Message::Field("size",size_t(4096))));
+		}
+		threadIndex = 0;
+		service.frameStart(0.0);
+		service.update();
+		for(;;) {
+			auto n = client->read(buffer,sizeof(buffer));
+			if(!n) break;
+			state.bytes += n;
+		}
+	}
+	state.pause();
+	report(options,name,state);
+	transport.close(client);
+}
+
+int main(int argc,char **argv) {
+	Options options = { nullptr,1000000,
+		size_t(std::thread::hardware_concurrency()),false };
+	int port = 0;
+	for(int i = 1;i < argc;++i) {
+		if(!strcmp(argv[i],"-json")) options.json = true;
+		else if(!strcmp(argv[i],"-filter") && i+1 < argc)
+			options.filter = argv[++i];
+		else if(!strcmp(argv[i],"-iterations") && i+1 < argc)
+			options.iterations = strtoull(argv[++i],nullptr,10);
+		else if(!strcmp(argv[i],"-threads") && i+1 < argc)
+			options.maxThreads = size_t(atoi(argv[++i]));
+		else if(!strcmp(argv[i],"-port") && i+1 < argc)
+			port = atoi(argv[++i]);
+		else {
+			printf("Usage: bench [-json] [-filter name] [-iterations N]"
+				" [-threads N] [-port N]\n");
+			return 1;
+		}
+	}
+	if(options.iterations < 1) options.iterations = 1;
+	if(options.maxThreads < 1) options.maxThreads = 1;
+
+	BenchService service;
+	Service::ApplicationInformation info;
+	info.name = "bench";
+	Service::NetworkOptions netOptions;
+	netOptions.port = port;
+	service.init(info,netOptions,options.maxThreads);
+	if(service.failed) return 1;
+	service.flush();
+
+	if(!options.json) {
+		printf("%-28s %12s %12s %12s %12s\n","benchmark","iterations",
+			"ns/op","MiB/s","allocs/op");
+	}
+	benchEncoding(service,options);
+	for(size_t threads = 1;threads <= options.maxThreads;threads *= 2)
+		benchThreadBuffers(service,options,threads);
+	benchHashTable(service,options,16);
+	benchHashTable(service,options,1024);
+	benchParse(service,options);
+	benchFraming(service,options,64);
+	benchFraming(service,options,1024);
+	benchFraming(service,options,65536);
+	benchPipeline(options,1,false);
+	benchPipeline(options,4,false);
+	benchPipeline(options,4,true);
+	if(options.json) printf("%s]\n",firstResult? "[" : "\n");
+	return 0;
+}
@@ -0,0 +1,305 @@
+#ifndef GAMEDEVWEBTOOLS_CLIENT_H
+#define GAMEDEVWEBTOOLS_CLIENT_H
+
+/**
+ * A headless websocket client which speaks the same protocol as the
+ * web client. It's used by the loopback harness to receive the messages
+ * without a browser.
+ *
+ * NB: This file has to be included after gamedevwebtools.cpp, as it
+ * uses the service's SHA1 and base64 implementation to verify the
+ * handshake.
+ */
+
+#include <vector>
+
+#ifndef GAMEDEVWEBTOOLS_PLATFORM_WIN32
+	#include <netdb.h>
+#endif
+
+namespace gamedevwebtools {
+namespace client {
+
+class WebsocketClient {
+public:
+	WebsocketClient();
+	~WebsocketClient();
+
+	bool connect(const char *host,int port);
+	void close();
+
+	/** Sends a message, which consists of a JSON header and binary data */
+	bool send(const char *json,const void *data = nullptr,
+		size_t dataSize = 0);
+
+	/**
+	 * Reads the data from the server and calls
+	 * onMessage(const char *json,size_t jsonSize,const uint8_t *data,
+	 *   size_t dataSize) for each recieved message.
+	 * Returns false when the connection is closed.
+	 */
+	template<typename F>
+	bool receive(F onMessage);
+
+	inline uint64_t bytesReceived() const { return received; }
+
+private:
+	enum {
+		OpContinuation = 0, OpBinary = 2, OpClose = 8, OpPing = 9,
+		OpPong = 10
+	};
+
+	bool handshake(const char *host,int port);
+	bool readSome();
+	bool writeAll(const void *data,size_t size);
+	bool writeFrame(int opcode,const void *data,size_t size);
+
+	network::Socket socket;
+	std::vector<uint8_t> readBuffer;
+	size_t readOffset;
+	std::vector<uint8_t> payload; // The current websocket message.
+	uint64_t received;
+	uint32_t maskSeed;
+};
+
+WebsocketClient::WebsocketClient()
+	: socket(network::invalidSocket()), readOffset(0), received(0),
+	maskSeed(0x9E3779B9) {}
+WebsocketClient::~WebsocketClient() {
+	close();
+}
+
+bool WebsocketClient::connect(const char *host,int port) {
+	core::Buffer portString;
+	portString.fmt("%d",port);
+	addrinfo hints,*addresses = nullptr;
+	memset(&hints,0,sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	if(getaddrinfo(host,portString.cString(),&hints,&addresses))
+		return false;
+	for(auto address = addresses;address;address = address->ai_next) {
+		socket = ::socket(address->ai_family,address->ai_socktype,
+			address->ai_protocol);
+		if(socket == network::invalidSocket()) continue;
+		if(::connect(socket,address->ai_addr,
+			(int)address->ai_addrlen) == 0) break;
+		close();
+	}
+	freeaddrinfo(addresses);
+	if(socket == network::invalidSocket()) return false;
+
+	int flag = 1;
+	setsockopt(socket,IPPROTO_TCP,TCP_NODELAY,(const char*)&flag,
+		sizeof(int));
+	if(!handshake(host,port)) {
+		close();
+		return false;
+	}
+	return true;
+}
+void WebsocketClient::close() {
+	if(socket == network::invalidSocket()) return;
+#ifndef GAMEDEVWEBTOOLS_PLATFORM_WIN32
+	::shutdown(socket,SHUT_RDWR);
+	::close(socket);
+#else
+	::shutdown(socket,SD_BOTH);
+	::closesocket(socket);
+#endif
+	socket = network::invalidSocket();
+}
+
+/** Sends the HTTP upgrade request and verifies the server's response */
+bool WebsocketClient::handshake(const char *host,int port) {
+	uint8_t nonce[16];
+	for(size_t i = 0;i < sizeof(nonce);++i)
+		nonce[i] = uint8_t(rand());
+	core::Buffer key;
+	network::websocket::base64Encode(key,nonce,sizeof(nonce));
+
+	core::Buffer request;
+	request.put("GET / HTTP/1.1\r\nHost: ");
+	request.put(host);
+	request.fmt(":%d",port);
+	request.put("\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+		"Sec-WebSocket-Key: ");
+	request.put(key.cString());
+	request.put("\r\nSec-WebSocket-Version: 13\r\n\r\n");
+	if(!writeAll(request.base(),request.length())) return false;
+
+	// The expected Sec-WebSocket-Accept.
+	key.put("258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
+	SHA1Context sha;
+	SHA1Reset(&sha);
+	SHA1Input(&sha,(const unsigned char *)key.base(),key.length());
+	if(!SHA1Result(&sha)) return false;
+	for(int i = 0; i < 5 ; i++)
+		sha.Message_Digest[i] = htonl(sha.Message_Digest[i]);
+	core::Buffer accept;
+	network::websocket::base64Encode(accept,
+		(const uint8_t*)sha.Message_Digest,20);
+
+	// Read the response.
+	for(;;) {
+		readBuffer.push_back(0);
+		auto begin = (const char*)readBuffer.data() + readOffset;
+		auto end = strstr(begin,"\r\n\r\n");
+		readBuffer.pop_back();
+		if(end) {
+			if(strncmp(begin,"HTTP/1.1 101",12)) return false;
+			auto field = strstr(begin,"Sec-WebSocket-Accept:");
+			if(!field || field > end) return false;
+			field += strlen("Sec-WebSocket-Accept:");
+			while(*field == ' ') ++field;
+			if(strncmp(field,accept.cString(),accept.length()))
+				return false;
+			readOffset += size_t(end + 4 - begin);
+			return true;
+		}
+		if(!readSome()) return false;
+	}
+}
+
+bool WebsocketClient::readSome() {
+	if(readOffset && readOffset == readBuffer.size()) {
+		readBuffer.clear();
+		readOffset = 0;
+	}
+	uint8_t data[64*1024];
+	auto n = ::recv(socket,(char*)data,sizeof(data),0);
+	if(n <= 0) return false;
+	readBuffer.insert(readBuffer.end(),data,data + n);
+	received += uint64_t(n);
+	return true;
+}
+bool WebsocketClient::writeAll(const void *data,size_t size) {
+	auto bytes = (const char*)data;
+	while(size) {
+		auto n = ::send(socket,bytes,(int)size,0);
+		if(n <= 0) return false;
+		bytes += n;
+		size -= size_t(n);
+	}
+	return true;
+}
+
+/** Writes a single masked websocket frame */
+bool WebsocketClient::writeFrame(int opcode,const void *data,size_t size) {
+	std::vector<uint8_t> frame;
+	frame.reserve(size + 14);
+	frame.push_back(uint8_t(0x80 | opcode));
+	if(size < 126) frame.push_back(uint8_t(0x80 | size));
+	else if(size <= 0xFFFF) {
+		frame.push_back(0x80 | 126);
+		frame.push_back(uint8_t(size >> 8));
+		frame.push_back(uint8_t(size));
+	} else {
+		frame.push_back(0x80 | 127);
+		for(int i = 7;i >= 0;--i)
+			frame.push_back(uint8_t(uint64_t(size) >> (i*8)));
+	}
+	// Xorshift is enough for the masking key.
+	maskSeed ^= maskSeed << 13;maskSeed ^= maskSeed >> 17;
+	maskSeed ^= maskSeed << 5;
+	uint8_t mask[4];
+	memcpy(mask,&maskSeed,4);
+	frame.insert(frame.end(),mask,mask + 4);
+	auto bytes = (const uint8_t*)data;
+	for(size_t i = 0;i < size;++i)
+		frame.push_back(bytes[i] ^ mask[i%4]);
+	return writeAll(frame.data(),frame.size());
+}
+
+bool WebsocketClient::send(const char *json,const void *data,
+	size_t dataSize)
+{
+	auto size = strlen(json);
+	assert(size <= 0xFFFF);
+	std::vector<uint8_t> message(2 + size + dataSize);
+	message[0] = uint8_t(size&0xFF);
+	message[1] = uint8_t((size/256)&0xFF);
+	memcpy(message.data() + 2,json,size);
+	if(dataSize) memcpy(message.data() + 2 + size,data,dataSize);
+	return writeFrame(OpBinary,message.data(),message.size());
+}
+
+/** Returns the value of the dataSize field of a message's JSON header */
+static size_t messageDataSize(const char *json,size_t size) {
+	const char *field = "\"dataSize\":";
+	auto fieldLength = strlen(field);
+	for(size_t i = 0;i + fieldLength < size;++i) {
+		if(memcmp(json + i,field,fieldLength)) continue;
+		size_t result = 0;
+		for(i += fieldLength;i < size && isdigit(json[i]);++i)
+			result = result*10 + size_t(json[i] - '0');
+		return result;
+	}
+	return 0;
+}
+
+template<typename F>
+bool WebsocketClient::receive(F onMessage) {
+	if(!readSome()) return false;
+	for(;;) {
+		// Decode the frame header.
+		auto begin = readBuffer.data() + readOffset;
+		auto available = readBuffer.size() - readOffset;
+		if(available < 2) break;
+		auto isFinal = (begin[0] & 0x80) != 0;
+		auto opcode = begin[0] & 0x0F;
+		auto isMasked = (begin[1] & 0x80) != 0;
+		uint64_t length = begin[1] & 0x7F;
+		size_t headerLength = 2;
+		if(length == 126) {
+			if(available < 4) break;
+			length = (uint64_t(begin[2]) << 8) | begin[3];
+			headerLength = 4;
+		} else if(length == 127) {
+			if(available < 10) break;
+			length = 0;
+			for(int i = 0;i < 8;++i) length = (length << 8) | begin[2+i];
+			headerLength = 10;
+		}
+		uint8_t mask[4] = { 0, 0, 0, 0 };
+		if(isMasked) {
+			if(available < headerLength + 4) break;
+			memcpy(mask,begin + headerLength,4);
+			headerLength += 4;
+		}
+		if(available < headerLength + length) break;
+		auto data = begin + headerLength;
+		readOffset += headerLength + size_t(length);
+
+		if(opcode == OpClose) return false;
+		if(opcode == OpPing) {
+			writeFrame(OpPong,data,size_t(length));
+			continue;
+		}
+		if(opcode == OpPong) continue;
+		auto offset = payload.size();
+		payload.insert(payload.end(),data,data + length);
+		if(isMasked) {
+			for(size_t i = 0;i < length;++i)
+				payload[offset + i] ^= mask[i%4];
+		}
+		if(!isFinal) continue;
+
+		// Decode the messages.
+		size_t i = 0;
+		while(i + 2 <= payload.size()) {
+			auto jsonSize = size_t(payload[i]) + size_t(payload[i+1])*256;
+			auto json = (const char*)payload.data() + i + 2;
+			auto dataSize = messageDataSize(json,jsonSize);
+			onMessage(json,jsonSize,(const uint8_t*)json + jsonSize,dataSize);
+			i += 2 + jsonSize + dataSize;
+		}
+		payload.clear();
+	}
+	return true;
+}
+
+} } // gamedevwebtools::client
+
+#endif
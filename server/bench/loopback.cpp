@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "../gamedevwebtools.cpp"
+#include "client.h"
+
+using namespace gamedevwebtools;
+
+/**
+ * The loopback harness drives a service over localhost and measures
+ * the whole pipeline - from Service::send to the bytes arriving at the
+ * headless clients.
+ */
+
+static std::chrono::steady_clock::time_point startTime;
+
+/** Returns the time since the start of the harness in microseconds. */
+static int64_t now() {
+	return int64_t(std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - startTime).count());
+}
+
+struct Options {
+	int port;
+	size_t clients;
+	double rate;         // Messages per second.
+	double fps;
+	size_t payloadSize;  // The size of the message's binary data.
+	double duration;     // Seconds.
+	bool json;
+};
+
+/** The statistics of a single client. */
+struct ClientThread {
+	std::thread thread;
+	client::WebsocketClient client;
+	std::atomic<bool> connected;
+	std::atomic<bool> failed;
+	std::atomic<uint64_t> messages;
+	uint64_t bytes;
+	std::vector<int64_t> latencies; // us
+
+	ClientThread() : connected(false), failed(false), messages(0),
+		bytes(0) {}
+
+	void run(const Options &options) {
+		if(!client.connect("localhost",options.port)) {
+			failed = true;
+			return;
+		}
+		connected = true;
+		const char *sent = "\"sent\":";
+		auto sentLength = strlen(sent);
+		while(client.receive([&](const char *json,size_t jsonSize,
+			const uint8_t */*data*/,size_t dataSize) {
+			bytes += 2 + jsonSize + dataSize;
+			auto field = std::search(json,json + jsonSize,sent,
+				sent + sentLength);
+			if(field == json + jsonSize) return;
+			auto time = strtoll(field + sentLength,nullptr,10);
+			latencies.push_back(now() - time);
+			messages.fetch_add(1,std::memory_order_relaxed);
+		})) ;
+	}
+};
+
+static int64_t percentile(std::vector<int64_t> &values,double p) {
+	if(values.empty()) return 0;
+	auto i = size_t(p*double(values.size() - 1));
+	std::nth_element(values.begin(),values.begin() + i,values.end());
+	return values[i];
+}
+
+int main(int argc,char **argv) {
+	Options options = { 9300, 1, 60000.0, 60.0, 64, 5.0, false };
+	for(int i = 1;i < argc;++i) {
+		if(!strcmp(argv[i],"-json")) options.json = true;
+		else if(!strcmp(argv[i],"-port") && i+1 < argc)
+			options.port = atoi(argv[++i]);
+		else if(!strcmp(argv[i],"-clients") && i+1 < argc)
+			options.clients = size_t(atoi(argv[++i]));
+		else if(!strcmp(argv[i],"-rate") && i+1 < argc)
+			options.rate = atof(argv[++i]);
+		else if(!strcmp(argv[i],"-fps") && i+1 < argc)
+			options.fps = atof(argv[++i]);
+		else if(!strcmp(argv[i],"-size") && i+1 < argc)
+			options.payloadSize = size_t(atoi(argv[++i]));
+		else if(!strcmp(argv[i],"-duration") && i+1 < argc)
+			options.duration = atof(argv[++i]);
+		else {
+			printf("Usage: loopback [-json] [-port N] [-clients N] [-rate N]"
+				" [-fps N] [-size N] [-duration seconds]\n");
+			return 1;
+		}
+	}
+	if(options.clients < 1) options.clients = 1;
+	if(options.fps <= 0.0) options.fps = 60.0;
+	startTime = std::chrono::steady_clock::now();
+
+	Service service;
+	Service::ApplicationInformation info;
+	info.name = "loopback";
+	Service::NetworkOptions netOptions;
+	netOptions.port = options.port;
+	netOptions.maxConnectedClients = options.clients;
+	service.init(info,netOptions);
+
+	// Connect the clients.
+	std::vector<ClientThread*> clients;
+	for(size_t i = 0;i < options.clients;++i) {
+		auto client = new ClientThread;
+		client->thread = std::thread([=]() { client->run(options); });
+		clients.push_back(client);
+	}
+	for(auto deadline = now() + 5000000;;) {
+		service.frameStart(0.0);
+		service.update();
+		size_t connected = 0;
+		for(auto client : clients) {
+			if(client->failed) {
+				fprintf(stderr,"A client failed to connect\n");
+				return 1;
+			}
+			connected += client->connected? 1 : 0;
+		}
+		if(connected == clients.size()) break;
+		if(now() > deadline) {
+			fprintf(stderr,"The clients failed to connect\n");
+			return 1;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	// Run the frames.
+	std::vector<uint8_t> payload(options.payloadSize,0x42);
+	std::vector<int64_t> updateTimes;
+	uint64_t sent = 0;
+	int64_t sendTime = 0;
+	double pending = 0.0;
+	auto frameDuration = int64_t(1000000.0/options.fps);
+	auto begin = now();
+	auto end = begin + int64_t(options.duration*1000000.0);
+	auto frameEnd = begin;
+	for(;;) {
+		auto frameBegin = now();
+		auto running = frameBegin < end;
+		if(running) {
+			pending += options.rate/options.fps;
+			auto count = uint64_t(pending);
+			pending -= double(count);
+			auto t = now();
+			for(uint64_t i = 0;i < count;++i,++sent) {
+				service.send(Message("loopback.msg",
+					Message::Field("sent",int32_t(now())),
+					Message::Field("seq",size_t(sent))),
+					payload.data(),payload.size());
+			}
+			sendTime += now() - t;
+		} else {
+			// Wait until the clients recieve all the messages.
+			size_t done = 0;
+			for(auto client : clients)
+				done += client->messages.load() == sent? 1 : 0;
+			if(done == clients.size() || frameBegin > end + 5000000) break;
+		}
+		service.frameStart(double(frameBegin)*1e-6);
+		auto t = now();
+		service.update();
+		if(running) updateTimes.push_back(now() - t);
+
+		frameEnd += frameDuration;
+		auto sleep = frameEnd - now();
+		if(sleep > 0)
+			std::this_thread::sleep_for(std::chrono::microseconds(sleep));
+	}
+	auto elapsed = double(end - begin)*1e-6;
+
+	// Collect the results.
+	uint64_t messages = 0,bytes = 0;
+	std::vector<int64_t> latencies;
+	for(auto client : clients) {
+		client->client.close();
+		client->thread.join();
+		messages += client->messages.load();
+		bytes += client->bytes;
+		latencies.insert(latencies.end(),client->latencies.begin(),
+			client->latencies.end());
+		delete client;
+	}
+	auto messagesPerSecond = double(messages)/elapsed;
+	auto bytesPerSecond = double(bytes)/elapsed;
+	auto p50 = percentile(latencies,0.5);
+	auto p99 = percentile(latencies,0.99);
+	int64_t updateTotal = 0;
+	for(auto t : updateTimes) updateTotal += t;
+	auto updateMean = updateTimes.empty()? 0.0 :
+		double(updateTotal)/double(updateTimes.size());
+	auto updateP99 = percentile(updateTimes,0.99);
+	auto updateMax = updateTimes.empty()? 0 :
+		*std::max_element(updateTimes.begin(),updateTimes.end());
+	auto sendNs = sent? double(sendTime)*1000.0/double(sent) : 0.0;
+
+	if(options.json) {
+		printf("{\"clients\":%d,\"sent\":%llu,\"received\":%llu,"
+			"\"messagesPerSecond\":%.0f,\"bytesPerSecond\":%.0f,"
+			"\"latencyP50Us\":%lld,\"latencyP99Us\":%lld,"
+			"\"sendNsPerMessage\":%.1f,\"updateMeanUs\":%.1f,"
+			"\"updateP99Us\":%lld,\"updateMaxUs\":%lld}\n",
+			int(options.clients),(unsigned long long)sent,
+			(unsigned long long)messages,messagesPerSecond,bytesPerSecond,
+			(long long)p50,(long long)p99,sendNs,updateMean,
+			(long long)updateP99,(long long)updateMax);
+	} else {
+		printf("clients:           %d\n",int(options.clients));
+		printf("sent:              %llu messages\n",(unsigned long long)sent);
+		printf("received:          %llu messages\n",
+			(unsigned long long)messages);
+		printf("throughput:        %.0f messages/s, %.2f MiB/s\n",
+			messagesPerSecond,bytesPerSecond/(1024.0*1024.0));
+		printf("latency:           p50 %lld us, p99 %lld us\n",
+			(long long)p50,(long long)p99);
+		printf("send:              %.1f ns/message\n",sendNs);
+		printf("update:            mean %.1f us, p99 %lld us, max %lld us\n",
+			updateMean,(long long)updateP99,(long long)updateMax);
+	}
+	return messages == sent*options.clients? 0 : 1;
+}
@@ -22,8 +22,11 @@
 #include <assert.h>
 #include <errno.h>
 #include <ctype.h>
+#include <algorithm>
 #include <limits>
 #include <new>
+#include <atomic>
+#include <chrono>
 
 #include "gamedevwebtools.h"
 
@@ -33,8 +36,14 @@
 	#include <fcntl.h>
 	#include <sys/types.h> 
 	#include <sys/socket.h>
+	#include <sys/mman.h>
 	#include <netinet/in.h>
 	#include <netinet/tcp.h>
+	
+	#ifdef __linux__
+		#include <sys/ioctl.h>
+		#include <linux/sockios.h>
+	#endif
 
 #else
 
@@ -525,6 +534,12 @@ void SHA1PadMessage(SHA1Context *context)
 namespace gamedevwebtools {
 namespace core {
 
+/** Returns the time of a monotonic clock in nanoseconds */
+static uint64_t clock() {
+	return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
 /**
  * A small stack buffer for string and data building.
  */
@@ -580,17 +595,35 @@ void Buffer::put(const char *str,size_t size) {
 void Buffer::put(const char *str) {
 	put(str,strlen(str));
 }
-/** Appends a string to the buffer, replacing " with \" */
+/** 
+ * Appends a string to the buffer, escaping the characters which can't
+ * appear in a JSON string.
+ */
 void Buffer::putEscaped(const char *str) {
-	for(;str[0] !='\0';++str,++alloc){
-		if(alloc >= end) break;
-		if(*str != '"') *alloc = uint8_t(*str);
-		else {
-			*alloc = '\\';
-			++alloc;
+	for(;str[0] !='\0';++str){
+		auto c = uint8_t(*str);
+		if(c >= 0x20 && c != '"' && c != '\\') {
 			if(alloc >= end) break;
-			*alloc = '"';
+			*alloc = c;
+			++alloc;
+			continue;
+		}
+		char escaped[8];
+		size_t length = 2;
+		escaped[0] = '\\';
+		switch(c) {
+		case '"':  escaped[1] = '"'; break;
+		case '\\': escaped[1] = '\\'; break;
+		case '\n': escaped[1] = 'n'; break;
+		case '\r': escaped[1] = 'r'; break;
+		case '\t': escaped[1] = 't'; break;
+		default:
+			length = size_t(snprintf(escaped,sizeof(escaped),"\\u%04x",c));
+			break;
 		}
+		if(alloc + length > end) break;
+		memcpy(alloc,escaped,length);
+		alloc += length;
 	}
 }
 /** Appends a formatted string to the buffer. */
@@ -650,6 +683,7 @@ public:
 	Arena(Service *allocator,size_t preallocate = 0);
 	~Arena();
 	void *allocate(size_t size);
+	void *tryAllocate(size_t size);
 	void reset();
 	void reset(size_t offset);
 	void *base() const;
@@ -658,30 +692,35 @@ public:
 	size_t size() const;
 	size_t capacity() const;
 	void grow(size_t size);
+	void setLimit(size_t limit);
+	void swap(Arena &other);
 private:
 	uint8_t *alloc,*end,*begin;
 	Service *allocator;
+	size_t limit;
 };
 
 Arena::Arena(Service *allocator,size_t preallocate) {
 	begin = preallocate > 0? 
-		(uint8_t*)allocator->onMalloc(preallocate) : nullptr;
+		(uint8_t*)allocator->allocate(preallocate) : nullptr;
 	end = begin + preallocate;
 	alloc = begin;
 	this->allocator = allocator;
+	limit = ~size_t(0);
 }
 Arena::~Arena() {
-	if(begin) allocator->onFree(begin);
+	if(begin) allocator->deallocate(begin);
 	begin = end = alloc = nullptr;
 }
 /** Grows the arena by size bytes */
 void Arena::grow(size_t size) {
+	allocator->growCount.fetch_add(1,std::memory_order_relaxed);
 	auto capacity = size_t(end - begin) 
 		+ (size < 4096? 4096 : size + 4096);
 	auto sz = size_t(alloc - begin);
-	auto dest = (uint8_t*)allocator->onMalloc(capacity);
+	auto dest = (uint8_t*)allocator->allocate(capacity);
 	memcpy(dest,begin,sz);
-	allocator->onFree(begin);
+	if(begin) allocator->deallocate(begin);
 	begin = dest;end = begin + capacity;
 	alloc = begin + sz;
 }
@@ -692,6 +731,26 @@ void *Arena::allocate(size_t size) {
 	alloc += size;
 	return p;
 }
+/** 
+ * Allocates size bytes, or returns nullptr when the arena would have
+ * to grow beyond its limit.
+ */
+void *Arena::tryAllocate(size_t size) {
+	if(size_t(alloc - begin) + size > limit) return nullptr;
+	// An allocation which fills the arena exactly doesn't grow it.
+	if((alloc + size) > end) grow(size);
+	auto p = alloc;
+	alloc += size;
+	return p;
+}
+/** Limits the capacity of the arena when allocating with tryAllocate */
+void Arena::setLimit(size_t limit) { this->limit = limit; }
+/** Swaps the memory of two arenas, the limits stay with the arenas */
+void Arena::swap(Arena &other) {
+	std::swap(alloc,other.alloc);
+	std::swap(end,other.end);
+	std::swap(begin,other.begin);
+}
 /** Resets the amount of allocated bytes to zero */
 void Arena::reset() { alloc = begin; }
 /** */
@@ -710,6 +769,90 @@ size_t Arena::remaining() const { return size_t(end - alloc); }
 /** Returns the maximum amount of bytes which can be allocated */
 size_t Arena::capacity() const { return size_t(end - begin); }
 
+/**
+ * Budget allocates the memory from a block supplied by the application.
+ * It's a first fit allocator which keeps the blocks in the address
+ * order, so that the neighbouring free blocks can be merged. Searching 
+ * is slow, but the service rarely allocates once it's warmed up.
+ */
+class Budget {
+public:
+	enum { kAlignment = 16 };
+	
+	Budget(void *memory,size_t size);
+	void *allocate(size_t size);
+	void free(void *ptr);
+	bool owns(const void *ptr) const;
+	size_t used() const;
+private:
+	struct Block {
+		size_t size; // Including the header.
+		size_t used;
+	};
+	
+	uint8_t *begin,*end;
+	size_t usedBytes;
+	std::atomic_flag lock;
+};
+
+Budget::Budget(void *memory,size_t size) {
+	auto p = (uintptr_t(memory) + kAlignment - 1) & ~uintptr_t(kAlignment-1);
+	begin = (uint8_t*)p;
+	end = begin + 
+		((size - (p - uintptr_t(memory))) & ~size_t(kAlignment - 1));
+	usedBytes = 0;
+	lock.clear();
+	if(end - begin >= ptrdiff_t(sizeof(Block))) {
+		auto block = (Block*)begin;
+		block->size = size_t(end - begin);
+		block->used = 0;
+	} else end = begin;
+}
+/** Returns nullptr when the budget is exhausted */
+void *Budget::allocate(size_t size) {
+	size = sizeof(Block) + ((size + kAlignment - 1) & ~size_t(kAlignment-1));
+	while(lock.test_and_set(std::memory_order_acquire)) ;
+	void *result = nullptr;
+	for(auto p = begin;p < end;) {
+		auto block = (Block*)p;
+		if(!block->used) {
+			// Merge the following free blocks.
+			for(auto next = (Block*)(p + block->size);
+				(uint8_t*)next < end && !next->used;
+				next = (Block*)(p + block->size))
+				block->size += next->size;
+			if(block->size >= size) {
+				if(block->size - size >= sizeof(Block) + kAlignment) {
+					auto rest = (Block*)(p + size);
+					rest->size = block->size - size;
+					rest->used = 0;
+					block->size = size;
+				}
+				block->used = 1;
+				usedBytes += block->size;
+				result = block + 1;
+				break;
+			}
+		}
+		p += block->size;
+	}
+	lock.clear(std::memory_order_release);
+	return result;
+}
+void Budget::free(void *ptr) {
+	auto block = (Block*)ptr - 1;
+	while(lock.test_and_set(std::memory_order_acquire)) ;
+	assert(block->used);
+	block->used = 0;
+	usedBytes -= block->size;
+	lock.clear(std::memory_order_release);
+}
+bool Budget::owns(const void *ptr) const {
+	return ptr >= begin && ptr < end;
+}
+/** Returns the amount of allocated bytes, including the headers */
+size_t Budget::used() const { return usedBytes; }
+
 } // memory
 
 } } // gamedevwebtools::core
@@ -767,17 +910,33 @@ private:
 /**
  * A nonblocking socket listener.
  */
-class Listener {
+class Listener : public Connection {
 public:
 	Listener();
 	~Listener();
 	void   close();
-	bool   write(const void *data,size_t size);
+	size_t write(const void *data,size_t size);
 	size_t read (void *data,size_t size);
+	size_t queuedBytes() const;
 	
 protected:
 	Socket socket;
 	friend class Server;
+	friend class TcpTransport;
+};
+
+/**
+ * The default transport which uses the nonblocking sockets.
+ */
+class TcpTransport : public Transport {
+public:
+	TcpTransport(Service *allocator,IP ip);
+	int listen(int port);
+	Connection *accept(bool &error);
+	void close(Connection *connection);
+private:
+	Service *allocator;
+	Server server;
 };
 
 /** */
@@ -983,18 +1142,27 @@ void   Listener::close() {
 	socket = invalidSocket();
 }
 
-/** Writes bytes to the socket. */
-bool Listener::write(const void *data,size_t size) {
+/** 
+ * Writes bytes to the socket. Returns the amount of bytes written, 
+ * which is less than size when the socket's buffer is full.
+ */
+size_t Listener::write(const void *data,size_t size) {
 #ifndef GAMEDEVWEBTOOLS_PLATFORM_WIN32
 	assert(socket >= 0);
 	
 	auto n = ::send(socket,data,size,MSG_NOSIGNAL);
+	if(n < 0) {
+		auto e = errno;
+		return e == EWOULDBLOCK || e == EAGAIN? size_t(0) : size_t(kError);
+	}
 #else
 	assert(socket != invalidSocket());
 	auto n = ::send(socket, 
-		(const char*)data, size, 0);
+		(const char*)data, int(size), 0);
+	if(n == SOCKET_ERROR) 
+		return WSAGetLastError() == WSAEWOULDBLOCK? size_t(0) : size_t(kError);
 #endif
-	return n > 0 && size_t(n) == size;
+	return size_t(n);
 }
 /** Reads bytes from the socket. Returns the amount of bytes read. */
 size_t Listener::read (void *data,size_t size) {
@@ -1011,11 +1179,223 @@ size_t Listener::read (void *data,size_t size) {
 	return size_t(n);
 
 }
+/** Returns the amount of bytes in the socket's send queue */
+size_t Listener::queuedBytes() const {
+#ifdef SIOCOUTQ
+	int n = 0;
+	if(::ioctl(socket,SIOCOUTQ,&n) == 0 && n > 0) return size_t(n);
+#endif
+	return 0;
+}
+
+uint64_t Transport::clock() const { return core::clock(); }
+
+TcpTransport::TcpTransport(Service *allocator,IP ip) 
+	: allocator(allocator), server(ip) {}
+int TcpTransport::listen(int port) {
+	return int(server.listen(port));
+}
+Connection *TcpTransport::accept(bool &error) {
+	Listener listener;
+	auto result = server.accept(listener);
+	if(result != Server::ErrorNone) {
+		error = result != Server::ErrorNoConnections;
+		return nullptr;
+	}
+	auto connection = new(allocator->allocate(sizeof(Listener))) Listener();
+	connection->socket = listener.socket;
+	listener.socket = invalidSocket();
+	return connection;
+}
+void TcpTransport::close(Connection *connection) {
+	connection->~Connection();
+	allocator->deallocate(connection);
+}
 
 } } // gamedevwebtools::network
 
 #endif // GAMEDEVWEBTOOLS_NO_TCP
 
+/*----------------------------------------------------------------------
+ * In-memory transport.
+ */
+namespace gamedevwebtools {
+namespace network {
+
+/** 
+ * One direction of a memory connection. The written bytes are stored
+ * in chunks, which can be read after their arrival time.
+ */
+struct MemoryPipe {
+	struct Chunk {
+		double arrival;
+		uint32_t size;
+		uint32_t consumed;
+	};
+	
+	uint8_t *data;
+	size_t size,capacity;
+	size_t readOffset;  // The offset of the first unread chunk.
+	size_t pending;     // The amount of bytes which weren't read yet.
+	double linkTime;    // The time when the last write leaves the link.
+	
+	MemoryPipe() : data(nullptr), size(0), capacity(0), readOffset(0), 
+		pending(0), linkTime(0.0) {}
+	~MemoryPipe() { ::free(data); }
+	uint8_t *allocate(size_t length) {
+		if(size + length > capacity) {
+			capacity = (size + length)*2;
+			data = (uint8_t*)::realloc(data,capacity);
+		}
+		auto p = data + size;
+		size += length;
+		return p;
+	}
+};
+
+class MemoryConnection : public Connection {
+public:
+	MemoryConnection(MemoryTransport *transport,MemoryPipe *input,
+		MemoryPipe *output);
+	size_t write(const void *data,size_t size);
+	size_t read(void *data,size_t size);
+	size_t queuedBytes() const;
+	
+	MemoryTransport *transport;
+	MemoryPipe *input,*output;
+	MemoryConnection *peer; // nullptr when the peer has closed.
+	MemoryConnection *next; // The list of the pending connections.
+};
+
+MemoryConnection::MemoryConnection(MemoryTransport *transport,
+	MemoryPipe *input,MemoryPipe *output) 
+	: transport(transport), input(input), output(output), peer(nullptr),
+	next(nullptr) {}
+
+size_t MemoryConnection::write(const void *data,size_t size) {
+	if(!peer) return kError;
+	auto &options = transport->options;
+	if(options.maxWriteSize && size > options.maxWriteSize)
+		size = options.maxWriteSize;
+	auto space = options.bufferSize > output->pending? 
+		options.bufferSize - output->pending : 0;
+	if(size > space) size = space;
+	if(size > 0xFFFFFFFF) size = 0xFFFFFFFF;
+	if(!size) return 0;
+	
+	// The bytes arrive once they have passed through the link.
+	auto time = transport->time;
+	auto start = output->linkTime > time? output->linkTime : time;
+	output->linkTime = options.bandwidth > 0.0? 
+		start + double(size)/options.bandwidth : start;
+	
+	MemoryPipe::Chunk chunk;
+	chunk.arrival = output->linkTime + options.latency;
+	chunk.size = uint32_t(size);
+	chunk.consumed = 0;
+	auto dest = output->allocate(sizeof(chunk) + size);
+	memcpy(dest,&chunk,sizeof(chunk));
+	memcpy(dest + sizeof(chunk),data,size);
+	output->pending += size;
+	return size;
+}
+size_t MemoryConnection::read(void *data,size_t size) {
+	auto base = input->data;
+	auto end = input->size;
+	auto dest = (uint8_t*)data;
+	size_t result = 0;
+	while(result < size && input->readOffset < end) {
+		MemoryPipe::Chunk chunk;
+		memcpy(&chunk,base + input->readOffset,sizeof(chunk));
+		if(chunk.arrival > transport->time) break;
+		auto n = size_t(chunk.size - chunk.consumed);
+		if(n > size - result) n = size - result;
+		memcpy(dest + result,base + input->readOffset + sizeof(chunk) + 
+			chunk.consumed,n);
+		result += n;
+		chunk.consumed += uint32_t(n);
+		if(chunk.consumed == chunk.size) 
+			input->readOffset += sizeof(chunk) + chunk.size;
+		else memcpy(base + input->readOffset,&chunk,sizeof(chunk));
+	}
+	input->pending -= result;
+	
+	// Release the read chunks.
+	if(input->readOffset == end) {
+		input->size = 0;
+		input->readOffset = 0;
+	} else if(input->readOffset > end/2) {
+		memmove(base,base + input->readOffset,end - input->readOffset);
+		input->size = end - input->readOffset;
+		input->readOffset = 0;
+	}
+	return result;
+}
+/** Returns the amount of the written bytes which the peer hasn't read */
+size_t MemoryConnection::queuedBytes() const { return output->pending; }
+
+} // network
+
+using namespace network;
+
+MemoryTransport::MemoryTransport(const Options &options)
+	: options(options), time(0.0), pending(nullptr) {}
+MemoryTransport::~MemoryTransport() {
+	while(pending) {
+		auto connection = pending;
+		pending = pending->next;
+		close(connection);
+	}
+}
+Connection *MemoryTransport::connect() {
+	MemoryPipe *pipes[2];
+	for(int i = 0;i < 2;++i)
+		pipes[i] = new(::malloc(sizeof(MemoryPipe))) MemoryPipe();
+	auto server = new(::malloc(sizeof(MemoryConnection)))
+		MemoryConnection(this,pipes[0],pipes[1]);
+	auto client = new(::malloc(sizeof(MemoryConnection)))
+		MemoryConnection(this,pipes[1],pipes[0]);
+	server->peer = client;
+	client->peer = server;
+	
+	// Append to the pending connections.
+	auto last = &pending;
+	while(*last) last = &(*last)->next;
+	*last = server;
+	return client;
+}
+void MemoryTransport::setTime(double seconds) {
+	time = seconds;
+}
+uint64_t MemoryTransport::clock() const {
+	return uint64_t(time*1e9);
+}
+int MemoryTransport::listen(int /*port*/) {
+	return 0;
+}
+Connection *MemoryTransport::accept(bool &error) {
+	error = false;
+	auto connection = pending;
+	if(connection) pending = connection->next;
+	return connection;
+}
+/** The pipes are released by the end which is closed last. */
+void MemoryTransport::close(Connection *connection) {
+	auto self = static_cast<MemoryConnection*>(connection);
+	if(self->peer) self->peer->peer = nullptr;
+	else {
+		MemoryPipe *pipes[2] = { self->input, self->output };
+		for(int i = 0;i < 2;++i) {
+			pipes[i]->~MemoryPipe();
+			::free(pipes[i]);
+		}
+	}
+	self->~MemoryConnection();
+	::free(self);
+}
+
+} // gamedevwebtools
+
 /*----------------------------------------------------------------------
  * Websockets.
  */
@@ -1049,21 +1429,66 @@ enum ParseState {
  * A SINGLE client limitation causes inefficiencies when sending identical
  * messages to multiple clients, 
  * but the resulting code is simpler and more self contained.
+ * 
+ * The messages are queued for each priority class, and the queues are
+ * written to the client by a deficit round robin scheduler, so that the
+ * higher priority classes get a larger share of a congested connection.
+ * The control frames (pong and close) are written before the messages.
  */
 class Server {
 public:
-	Server(Service *allocator,Listener *listener);
+	/// The amount of bytes a class with the weight 1 can write each round.
+	enum { kQuantum = 4096 };
+	/// The number of the recent clock samples.
+	enum { kClockSamples = 8 };
 	
+	Server(Service *allocator,const Transport *transport,
+		Connection *connection,const uint32_t *weights);
+	
+	void reset(Connection *connection);
 	void update();
-	void write(const void *data,size_t size);
+	void send();
+	void write(const void *data,size_t size,
+		Message::Priority priority = Message::Normal);
+	uint8_t *beginWrite(size_t size,
+		Message::Priority priority = Message::Normal);
 	std::pair<uint8_t*,size_t> messages();
 	void close();
 	bool isClosed() const;
 	bool hasErrors() const;
 	size_t memoryUsage() const;
+	size_t queuedBytes() const;
+	bool ping(uint64_t time);
+	
+	/// The written bytes, the round trip time and the activity are 
+	/// measured by the server, the rest is updated by the service.
+	/// The clock times are in ns, the rest of the times in seconds.
+	struct ClockSample {
+		double offset;
+		double delay;
+	};
+	struct Statistics {
+		uint64_t written;
+		uint64_t rtt; // The smoothed round trip time, 0 if unknown.
+		uint64_t rttDeviation;
+		uint64_t rttMin,rttMax;
+		uint64_t lastActivity; // When the last bytes were received.
+		uint64_t lastWritten;
+		uint64_t lastTime;
+		double throughput;
+		uint32_t samplingLevel;
+		// The server's times of the recent network.ping messages.
+		uint32_t pingId;
+		double pingTimes[kClockSamples];
+		ClockSample clockSamples[kClockSamples];
+		size_t clockSampleCount;
+		ClockSample clock; // The sample with the lowest delay.
+	};
 
-	Listener *net;
+	Connection *net;
+	Statistics statistics;
 private:
+	const Transport *transport; // The clock of the statistics.
 	enum State {
 		Default,
 		Error,
@@ -1075,7 +1500,16 @@ private:
 	State state;
 	core::memory::Arena readBuffer; // Buffer for raw network bytes.
 	core::memory::Arena wsReadBuffer; // Buffer for parsed ws messages.
-	core::memory::Arena writeBuffer;
+	core::memory::Arena writeBuffer; // The handshake and control frames.
+	
+	/// The message frames of each priority class.
+	core::memory::Arena queues[Message::kPriorityCount];
+	int64_t deficits[Message::kPriorityCount];
+	const uint32_t *weights;
+	/// The frame at the front of this queue was partially written, and 
+	/// its remaining bytes have to be written before anything else.
+	int partialQueue;
+	size_t partialSize;
 	
 	ParseState onHttpHeader(const char *header,size_t headerLength,
 		const char* data,size_t dataLength);
@@ -1084,27 +1518,68 @@ private:
 	void abortConnection(int code,const char *reason);
 	
 	size_t emitHeader(uint8_t header[],OpCode opcode,size_t size);
+	uint8_t *beginControl(size_t size,OpCode opcode);
+	bool flush();
+	bool schedule(size_t offsets[]);
 	void parseData(const uint8_t *data,size_t size,bool isFinal,
 		bool isMasked,uint32_t mask);
 	void pong(const void *data,size_t size);
+	void onPong(const uint8_t *data,size_t size,bool isMasked,
+		uint32_t mask);
 	void ws();
 };
 
-Server::Server(Service *allocator,Listener *listener)
-	: readBuffer(allocator,4096), writeBuffer(allocator,4096),
-	wsReadBuffer(allocator,4096)
+static_assert(Message::kPriorityCount == 3,
+	"The queues are initialized for each priority class");
+Server::Server(Service *allocator,const Transport *transport,
+	Connection *connection,const uint32_t *weights)
+	: readBuffer(allocator,4096), writeBuffer(allocator,1024),
+	wsReadBuffer(allocator,4096),
+	queues{ {allocator,4096}, {allocator,4096}, {allocator,4096} }
 {
 	assert(allocator);
-	assert(listener);
+	assert(connection);
+	assert(weights);
+	state = WaitingForHandshake;
+	net = connection;
+	this->transport = transport;
+	this->weights = weights;
+	memset(deficits,0,sizeof(deficits));
+	partialQueue = 0;
+	partialSize = 0;
+	memset(&statistics,0,sizeof(statistics));
+	statistics.lastActivity = transport->clock();
+}
+/** Reuses the server and its buffers for a new client */
+void Server::reset(Connection *connection) {
+	assert(connection);
+	readBuffer.reset();
+	wsReadBuffer.reset();
+	writeBuffer.reset();
+	for(size_t i = 0;i < Message::kPriorityCount;++i) queues[i].reset();
+	memset(deficits,0,sizeof(deficits));
+	partialSize = 0;
+	memset(&statistics,0,sizeof(statistics));
+	statistics.lastActivity = transport->clock();
 	state = WaitingForHandshake;
-	net = listener;
+	net = connection;
 }
 
 bool Server::isClosed() const { return state == Closed; }
 bool Server::hasErrors() const { return state == Error; }
 size_t Server::memoryUsage() const {
-	return readBuffer.capacity() + wsReadBuffer.capacity() + 
-	writeBuffer.capacity();
+	auto size = readBuffer.capacity() + wsReadBuffer.capacity() + 
+		writeBuffer.capacity();
+	for(size_t i = 0;i < Message::kPriorityCount;++i) 
+		size += queues[i].capacity();
+	return size;
+}
+/** Returns the amount of bytes which weren't sent to the client yet */
+size_t Server::queuedBytes() const { 
+	auto size = writeBuffer.size();
+	for(size_t i = 0;i < Message::kPriorityCount;++i) 
+		size += queues[i].size();
+	return size;
 }
 
 /** Returns the data from the recieved message frames. */
@@ -1117,6 +1592,10 @@ void Server::update() {
 	if(state == WaitingForHandshake) handshake();
 	else if(state == Default) ws();
 }
+/** Sends the written messages to the client */
+void Server::send() {
+	if(state == Default && !flush()) state = Error;
+}
 
 /*
  * HTTP handshaking.
@@ -1214,7 +1693,11 @@ ParseState Server::onHttpHeader(const char *header,size_t headerLength,
 		base64Encode(response,(const uint8_t*)sha.Message_Digest,20);
 
 		response.put("\r\n\r\n");
-		net->write(response.base(),response.length());
+		
+		// The messages which were written while waiting for the 
+		// handshake are queued, so the response is sent before them.
+		memcpy(writeBuffer.allocate(response.length()),response.base(),
+			response.length());
 	}
 	return ParseOk;
 }
@@ -1316,7 +1799,7 @@ void Server::handshake() {
 		// Handshake complete - move to websocket state.
 		else {
 			readBuffer.reset();
-			state = Default;
+			state = flush()? Default : Error;
 		}
 	}
 	else if(parseState == ParseError){
@@ -1361,30 +1844,182 @@ size_t Server::emitHeader(uint8_t header[],OpCode opcode,size_t size) {
 		return 10;
 	}
 }
+/** Returns the size of the frame which was generated by emitHeader */
+static size_t frameSize(const uint8_t *frame) {
+	auto length = frame[1] & 0x7F;
+	if(length == FrameU16LengthId) {
+		uint16_t u16;
+		memcpy(&u16,frame+2,2);
+		return 4 + size_t(ntohs(u16));
+	} else if(length == FrameU64LengthId) {
+		uint64_t u64;
+		memcpy(&u64,frame+2,8);
+		return 10 + size_t(ntohu64(u64));
+	}
+	return 2 + size_t(length);
+}
 /** Write some data using websocket protocol */
-void Server::write(const void *data,size_t size) {
+void Server::write(const void *data,size_t size,Message::Priority priority) {
+	memcpy(beginWrite(size,priority),data,size);
+}
+/** 
+ * Starts a websocket message of the given size, and returns the pointer
+ * to the message's payload which has to be filled in by the caller.
+ */
+uint8_t *Server::beginWrite(size_t size,Message::Priority priority) {
+	assert(priority >= Message::Low && priority < Message::kPriorityCount);
 	uint8_t header[10];
 	auto headerSize = emitHeader(header,Binary,size);
 
+	auto dest = (uint8_t*)queues[priority].allocate(size + headerSize);
+	memcpy(dest,header,headerSize);
+	return dest+headerSize;
+}
+/** Starts a control frame, which is sent before the queued messages */
+uint8_t *Server::beginControl(size_t size,OpCode opcode) {
+	uint8_t header[10];
+	auto headerSize = emitHeader(header,opcode,size);
+
 	auto dest = (uint8_t*)writeBuffer.allocate(size + headerSize);
 	memcpy(dest,header,headerSize);
-	memcpy(dest+headerSize,data,size);
+	return dest+headerSize;
 }
 /** Close the websocket connection by sending an appropriate message */
 void Server::close() {
 	if(state == Default){
-		uint8_t header[10];
-		auto size = emitHeader(header,Close,0);
-		net->write(header,size);
+		beginControl(0,Close);
+		flush();
 	}
 	state = Closed;
 }
 /** Respond to a websocket PING message */
 void Server::pong(const void *data,size_t size) {
-	uint8_t header[10];
-	auto headerSize = emitHeader(header,Pong,size);
-	net->write(header,headerSize);
-	if(size) net->write(data,size);
+	auto dest = beginControl(size,Pong);
+	if(size) memcpy(dest,data,size);
+}
+/** 
+ * Sends a PING message with the given time, which the client echoes.
+ * Returns false when the handshake isn't complete yet.
+ */
+bool Server::ping(uint64_t time) {
+	if(state != Default) return false;
+	memcpy(beginControl(sizeof(time),Ping),&time,sizeof(time));
+	return true;
+}
+/** Measures the round trip time when the client echoes a ping */
+void Server::onPong(const uint8_t *data,size_t size,bool isMasked,
+	uint32_t mask) 
+{
+	uint64_t time;
+	if(size != sizeof(time)) return;
+	uint8_t payload[sizeof(time)];
+	uint8_t maskBytes[4];
+	memcpy(maskBytes,&mask,4);
+	for(size_t i = 0;i < size;++i)
+		payload[i] = isMasked? data[i] ^ maskBytes[i%4] : data[i];
+	memcpy(&time,payload,sizeof(time));
+	auto now = transport->clock();
+	if(time > now) return;
+	// Smoothed like the TCP's round trip time (RFC 6298).
+	auto sample = now - time;
+	if(!statistics.rtt) {
+		statistics.rtt = sample;
+		statistics.rttDeviation = sample/2;
+		statistics.rttMin = statistics.rttMax = sample;
+		return;
+	}
+	auto deviation = sample > statistics.rtt? 
+		sample - statistics.rtt : statistics.rtt - sample;
+	statistics.rttDeviation = (statistics.rttDeviation*3 + deviation)/4;
+	statistics.rtt = (statistics.rtt*7 + sample)/8;
+	if(sample < statistics.rttMin) statistics.rttMin = sample;
+	if(sample > statistics.rttMax) statistics.rttMax = sample;
+}
+/** Removes the first n bytes from the buffer */
+static void consume(core::memory::Arena &buffer,size_t n) {
+	auto size = buffer.size();
+	if(n == size) buffer.reset();
+	else if(n) {
+		auto base = (uint8_t*)buffer.base();
+		memmove(base,base + n,size - n);
+		buffer.reset(size - n);
+	}
+}
+/** 
+ * Writes as much of the buffered data as the connection accepts, the 
+ * rest is written in the next update.
+ */
+bool Server::flush() {
+	size_t offsets[Message::kPriorityCount] = { 0 };
+	auto result = schedule(offsets);
+	for(size_t i = 0;i < Message::kPriorityCount;++i) 
+		consume(queues[i],offsets[i]);
+	return result;
+}
+/** 
+ * Writes the queued frames using the deficit round robin. Each round
+ * a class gets kQuantum times its weight bytes, and writes the whole 
+ * frames which fit into its deficit. The deficit is carried over to the
+ * next round, so the large frames are written too. The written bytes
+ * are stored in offsets.
+ */
+bool Server::schedule(size_t offsets[]) {
+	// The frames can't be interleaved, so a partially written frame
+	// has to be completed first.
+	if(partialSize) {
+		auto n = net->write(queues[partialQueue].base(),partialSize);
+		if(n == Connection::kError) return false;
+		statistics.written += n;
+		offsets[partialQueue] = n;
+		deficits[partialQueue] -= int64_t(n);
+		partialSize -= n;
+		if(partialSize) return true;
+	}
+	if(auto size = writeBuffer.size()) {
+		auto n = net->write(writeBuffer.base(),size);
+		if(n == Connection::kError) return false;
+		statistics.written += n;
+		consume(writeBuffer,n);
+		if(n < size) return true;
+	}
+	for(bool pending = true;pending;) {
+		pending = false;
+		for(int i = Message::kPriorityCount - 1;i >= 0;--i) {
+			auto base = (const uint8_t*)queues[i].base();
+			auto size = queues[i].size();
+			auto offset = offsets[i];
+			if(offset == size) {
+				deficits[i] = 0;
+				continue;
+			}
+			pending = true;
+			deficits[i] += int64_t(kQuantum)*int64_t(weights[i]);
+			auto end = offset;
+			while(end < size) {
+				auto next = end + frameSize(base + end);
+				if(int64_t(next - offset) > deficits[i]) break;
+				end = next;
+			}
+			if(end == offset) continue;
+			
+			auto n = net->write(base + offset,end - offset);
+			if(n == Connection::kError) return false;
+			statistics.written += n;
+			offsets[i] += n;
+			deficits[i] -= int64_t(n);
+			if(n < end - offset) {
+				// Find the end of the partially written frame.
+				auto written = offset + n;
+				auto frameEnd = offset;
+				while(frameEnd < written) 
+					frameEnd += frameSize(base + frameEnd);
+				partialQueue = i;
+				partialSize = frameEnd - written;
+				return true;
+			}
+		}
+	}
+	return true;
 }
 
 struct Header {
@@ -1473,24 +2108,17 @@ void Server::parseData(const uint8_t *data,size_t size,bool isFinal,
 }
 
 /** 
- * update WebSocket - send and recieve websocket messages 
+ * update WebSocket - recieve websocket messages 
  * via the network listener.
  * 
  * TODO: Recieving continuation frames.
  * */
 void Server::ws() { 
-	if(writeBuffer.size()) {
-		if(!net->write(writeBuffer.base(),writeBuffer.size())) {
-			state = Error;
-			return;
-		}
-		writeBuffer.reset();
-	}
-	
 	// Read the raw byte stream.
 	while(true) {
 		auto n = net->read(readBuffer.top(),readBuffer.remaining());
 		if(!n) break;
+		statistics.lastActivity = transport->clock();
 		readBuffer.allocate(n);
 		if(!readBuffer.remaining()) readBuffer.grow(1024);
 	}
@@ -1513,6 +2141,10 @@ void Server::ws() {
 				pong(begin + offset + header.headerLength,
 				header.payloadSize);			
 			}
+			else if(header.opcode == Pong && header.isFinal) {
+				onPong(begin + offset + header.headerLength,
+					header.payloadSize,header.isMasked,header.mask);
+			}
 			else if(header.opcode == Close) {
 				this->state = Closed;
 				readBuffer.reset();
@@ -1686,6 +2318,7 @@ uint32_t mask;
 uint32_t size;
 Service *allocator;
 
+public:
 static uint32_t hashKey(const char *key) {
 	auto h = fnv_32a_str(key,FNV1_32A_INIT);
 	// MSB is used to indicate a deleted element
@@ -1695,6 +2328,7 @@ static uint32_t hashKey(const char *key) {
 	return h;
 }
 
+private:
 static bool isDeleted(uint32_t hash) {
 	// MSB set indicates that this hash is a "tombstone"
 	return (hash >> 31) != 0;	
@@ -1710,7 +2344,7 @@ uint32_t probeDistance(uint32_t hash, uint32_t slotIndex) const {
  
 // alloc buffer according to currently set capacity
 void alloc() {	
-	buffer = (Element*)(allocator->onMalloc(capacity*sizeof(Element)));
+	buffer = (Element*)(allocator->allocate(capacity*sizeof(Element)));
 	for(uint32_t i = 0; i < capacity; ++i) 
 		buffer[i].hash = 0;
 	resizeThreshold = (capacity * kLoadFactorPercentage) / 100;
@@ -1728,7 +2362,7 @@ void grow() {
 		if(hash != 0 && !isDeleted(hash))
 			insertHelper(hash,old[i].key,old[i].value);
 	}
-	allocator->onFree(old);
+	allocator->deallocate(old);
 }
 
 void insertHelper(uint32_t hash, const char *key, uint32_t value) {
@@ -1767,8 +2401,7 @@ void insertHelper(uint32_t hash, const char *key, uint32_t value) {
 	}
 }
 
-uint32_t lookupIndex(const char *key) const {
-	const uint32_t hash = hashKey(key);
+uint32_t lookupIndex(const char *key,uint32_t hash) const {
 	auto pos = desiredPosition(hash);
 	uint32_t dist = 0;
 	for(;;) {
@@ -1795,22 +2428,39 @@ HashTable(Service *allocator)
 }
 
 ~HashTable() {
-	if(buffer) allocator->onFree(buffer);
+	if(buffer) allocator->deallocate(buffer);
 }
 
 void insert(const char *key, uint32_t value) {
+	insert(key,hashKey(key),value);
+}
+/** Inserts a key which was hashed already, e.g. by MessageType */
+void insert(const char *key, uint32_t hash, uint32_t value) {
+	assert(hash == hashKey(key));
 	size+=1;
 	if(size >= resizeThreshold) grow();
-	insertHelper(hashKey(key),key,value);
+	insertHelper(hash,key,value);
 }
 
 const uint32_t find(const char *key) {
-	auto idx = lookupIndex(key);
+	return find(key,hashKey(key));
+}
+uint32_t find(const char *key, uint32_t hash) {
+	auto idx = lookupIndex(key,hash);
 	return idx != kInvalidIndex? buffer[idx].value : kInvalidValue;
 }
 
+/** Calls f(key,value) for each element */
+template<typename F>
+void forEach(F f) const {
+	for(uint32_t i = 0; i < capacity; ++i) {
+		auto hash = buffer[i].hash;
+		if(hash != 0 && !isDeleted(hash)) f(buffer[i].key,buffer[i].value);
+	}
+}
+
 void remove(const char *key) {
-	auto idx = lookupIndex(key);
+	auto idx = lookupIndex(key,hashKey(key));
 	if(idx == kInvalidIndex) return;
 	buffer[idx].hash |= 0x80000000; // Mark as deleted.
 	size-=1;
@@ -1825,369 +2475,3717 @@ size_t memoryUsage() const {
 } } // gamedevwebtools::core
 
 /*----------------------------------------------------------------------
- * Actual tooling service. 
+ * Typed field encoding
  */
 namespace gamedevwebtools {
-
-Message::Message(const char *type,const Field *fields,size_t count) {
-	this->name = type;this->fieldArray = fields;this->length = count;
+namespace encoding {
+
+/** Returns the length of a string with the JSON escapes */
+size_t escapedLength(const char *str,size_t length) {
+	auto result = length;
+	for(size_t i = 0;i < length;++i) {
+		auto c = uint8_t(str[i]);
+		if(c >= 0x20 && c != '"' && c != '\\') continue;
+		// \n or \u00XX, like core::Buffer::putEscaped.
+		result += c == '"' || c == '\\' || c == '\n' || c == '\r' || 
+			c == '\t'? 1 : 5;
+	}
+	return result;
 }
-Message::Message(const char *type) {
-	this->name = type;this->fieldArray = nullptr;this->length = 0;
+char *putEscaped(char *dest,const char *str,size_t length) {
+	static const char digits[] = "0123456789abcdef";
+	for(size_t i = 0;i < length;++i) {
+		auto c = uint8_t(str[i]);
+		if(c >= 0x20 && c != '"' && c != '\\') {
+			*dest++ = char(c);
+			continue;
+		}
+		*dest++ = '\\';
+		switch(c) {
+		case '"':  *dest++ = '"'; break;
+		case '\\': *dest++ = '\\'; break;
+		case '\n': *dest++ = 'n'; break;
+		case '\r': *dest++ = 'r'; break;
+		case '\t': *dest++ = 't'; break;
+		default:
+			memcpy(dest,"u00",3);
+			dest[3] = digits[c >> 4];
+			dest[4] = digits[c & 0xF];
+			dest += 5;
+			break;
+		}
+	}
+	return dest;
 }
-Message::Message(const char *type,const Field &a) {
-	this->name = type;this->fieldArray = inlineStorage;this->length = 1;
-	inlineStorage[0] = a;
+char *putInteger(char *dest,uint64_t x) {
+	char digits[20];
+	size_t length = 0;
+	do {
+		digits[length++] = char(x % 10) + '0';
+		x /= 10;
+	} while(x != 0);
+	while(length) *dest++ = digits[--length];
+	return dest;
 }
-Message::Message(const char *type,const Field &a,const Field &b) {
-	this->name = type;this->fieldArray = inlineStorage;this->length = 2;
-	inlineStorage[0] = a;inlineStorage[1] = b;
+char *putInteger(char *dest,int64_t x) {
+	if(x >= 0) return putInteger(dest,uint64_t(x));
+	*dest = '-';
+	return putInteger(dest + 1,uint64_t(0) - uint64_t(x));
 }
-Message::Message(const char *type,const Field &a,const Field &b,
-	const Field &c) {
-	this->name = type;this->fieldArray = inlineStorage;this->length = 3;
-	inlineStorage[0] = a;inlineStorage[1] = b;inlineStorage[2] = c;
+/** Writes a number with %g just like the Message fields */
+char *putReal(char *dest,double x) {
+	return dest + snprintf(dest,kMaxNumberLength,"%g",x);
 }
 
-/**
- * The messaging service uses double buffering to send messages.
+static const char *binaryTypeNames[] = {
+	"u8", "i32", "u32", "f32", "f64", "i64", "u64"
+};
+static const uint8_t binaryTypeSizes[] = { 1, 4, 4, 4, 8, 8, 8 };
+
+const char *binaryTypeName(BinaryType type) { 
+	return binaryTypeNames[type]; 
+}
+size_t binaryTypeSize(BinaryType type) { return binaryTypeSizes[type]; }
+/** 
+ * Writes the descriptor of a binary value, the scalars don't have
+ * the count:
+ *   {"binary":"f32","count":4,"offset":0}
  */
-Service::Service() {
-	threadMessageBackBuffers = threadMessageBuffers = nullptr;
-	server = nullptr;
-	clients = nullptr;
-	clientCount = 0;
-	activeClientCount = 0;
-	threadCount = 0;
-	active_ = false;
-	memusage = 0;
+char *putBinaryField(char *dest,BinaryType type,size_t count,
+	bool scalar,size_t offset) 
+{
+	memcpy(dest,"{\"binary\":\"",11);
+	auto name = binaryTypeNames[type];
+	auto nameLength = strlen(name);
+	memcpy(dest + 11,name,nameLength);
+	dest += 11 + nameLength;
+	*dest++ = '"';
+	if(!scalar) {
+		memcpy(dest,",\"count\":",9);
+		dest = putInteger(dest + 9,uint64_t(count));
+	}
+	memcpy(dest,",\"offset\":",10);
+	dest = putInteger(dest + 10,uint64_t(offset));
+	*dest++ = '}';
+	return dest;
 }
-
-void Service::init(
-	const ApplicationInformation &appInfo,
-	const NetworkOptions &netOptions,
-	size_t threadCount) 
+/** Writes the elements in little endian */
+char *putLittleEndian(char *dest,const void *data,size_t count,
+	size_t elementSize) 
 {
-	if(threadCount < 1){
-		assert(false && "Thread count must be at least 1!");
-		threadCount = 1;
+	auto size = count*elementSize;
+#ifndef GAMEDEVWEBTOOLS_PLATFORM_BIG_ENDIAN
+	memcpy(dest,data,size);
+#else
+	auto src = (const char*)data;
+	for(size_t i = 0;i < size;i += elementSize) {
+		for(size_t j = 0;j < elementSize;++j) 
+			dest[i + j] = src[i + elementSize - 1 - j];
 	}
-	this->threadCount = threadCount;
-	
-	//Get the thread message buffers.
+#endif
+	return dest + size;
+}
+
+/** 
+ * Encodes the constant parts of a MessageTemplate - the part i ends with
+ * the name of the field i, and the last part closes the object, or 
+ * starts the dataSize when the message has binary values.
+ * Returns the length of the encoded parts, or 0 when they don't fit.
+ */
+size_t encodeTemplate(char *dest,size_t capacity,const char *type,
+	const char *const *names,size_t count,bool binary,uint16_t *offsets) 
+{
+	auto typeLength = strlen(type);
+	auto length = 11 + escapedLength(type,typeLength) + (binary? 12 : 0);
+	for(size_t i = 0;i < count;++i) 
+		length += 4 + escapedLength(names[i],strlen(names[i]));
+	if(length > capacity) return 0;
 	
-	threadMessageBuffers = (core::memory::Arena*)
-		onMalloc(sizeof(core::memory::Arena)*threadCount);
-	threadMessageBackBuffers = (core::memory::Arena*)
-		onMalloc(sizeof(core::memory::Arena)*threadCount);
-	auto initialSize = netOptions.threadMessageBufferInitialSize;
-	assert(initialSize > 0);
-	for(size_t i = 0;i <  threadCount;++i) {
-		new(threadMessageBuffers + i) 
-			core::memory::Arena(this,initialSize);
-		new(threadMessageBackBuffers + i) 
-			core::memory::Arena(this,initialSize);
+	auto p = dest;
+	memcpy(p,"{\"type\":\"",9);
+	p = putEscaped(p + 9,type,typeLength);
+	*p++ = '"';
+	for(size_t i = 0;i < count;++i) {
+		p[0] = ',';p[1] = '"';
+		p = putEscaped(p + 2,names[i],strlen(names[i]));
+		p[0] = '"';p[1] = ':';
+		p += 2;
+		offsets[i + 1] = uint16_t(p - dest);
 	}
+	offsets[0] = 0;
+	if(binary) {
+		memcpy(p,",\"dataSize\":",12);
+		return size_t(p + 12 - dest);
+	}
+	*p++ = '}';
+	return size_t(p - dest);
+}
+
+} } // gamedevwebtools::encoding
+
+/*----------------------------------------------------------------------
+ * Flight recorder
+ */
+namespace gamedevwebtools {
+namespace capture {
+
+/**
+ * Mirrors the sent messages into the per thread rings in a shared 
+ * memory mapped file. The operating system writes the mapped pages
+ * to the file, so the recorded messages survive the application's
+ * crash without any system calls when recording.
+ */
+class FlightRecorder {
+public:
+	FlightRecorder();
+	~FlightRecorder();
+	bool open(const char *filename,size_t threadCount,size_t ringSize);
+	void close();
+	void frame(uint64_t frameId,double time);
+	void record(size_t threadId,const void *data,size_t size);
+private:
+	static size_t alignRecord(size_t size);
+	void evict(FlightRecorderRing *ring,uint64_t head);
 	
-	messageTypeMapping =
-		new(onMalloc(sizeof(core::HashTable))) core::HashTable(this);
-	messageHandlers =
-		new(onMalloc(sizeof(core::memory::Arena))) core::memory::Arena(this,4096);
-	
-	assert(netOptions.maxConnectedClients > 0);
-	
-	netInit = netOptions.initializeSystemLibraries;
-	if(netInit)
-		network::init();
-	
-	// Create a networking server.
-	server = new(onMalloc(sizeof(network::Server)))
-		network::Server(netOptions.ipv6? network::IPv6 : network::IPvDefault);
-		
+	uint8_t *data;
+	size_t size;
+	FlightRecorderHeader *header;
+	FlightRecorderRing *rings;
+	uint64_t ringSize;
+	// The current frame.
+	uint64_t frameId;
+	double time;
+#ifdef GAMEDEVWEBTOOLS_PLATFORM_WIN32
+	HANDLE file;
+	HANDLE mapping;
+#endif
+};
+
+FlightRecorder::FlightRecorder() 
+	: data(nullptr), size(0), header(nullptr), rings(nullptr),
+	ringSize(0), frameId(0), time(0.0) {
+#ifdef GAMEDEVWEBTOOLS_PLATFORM_WIN32
+	file = INVALID_HANDLE_VALUE;
+	mapping = NULL;
+#endif
+}
+FlightRecorder::~FlightRecorder() {
+	close();
+}
+
+/** Creates and maps the flight recorder file */
+bool FlightRecorder::open(const char *filename,size_t threadCount,
+	size_t ringSize) 
+{
+	// Keep the rings and the records aligned.
+	ringSize = (ringSize + 63) & ~size_t(63);
+	auto ringsOffset = (sizeof(FlightRecorderHeader) + 63) & ~size_t(63);
+	auto dataOffset = ringsOffset + sizeof(FlightRecorderRing)*threadCount;
+	size = dataOffset + ringSize*threadCount;
+	
+#ifndef GAMEDEVWEBTOOLS_PLATFORM_WIN32
+	auto fd = ::open(filename,O_RDWR | O_CREAT | O_TRUNC,0644);
+	if(fd < 0) return false;
+	if(::ftruncate(fd,off_t(size)) != 0) {
+		::close(fd);
+		return false;
+	}
+	auto p = ::mmap(nullptr,size,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+	::close(fd);
+	if(p == MAP_FAILED) return false;
+	data = (uint8_t*)p;
+#else
+	file = CreateFileA(filename,GENERIC_READ | GENERIC_WRITE,
+		FILE_SHARE_READ,NULL,CREATE_ALWAYS,FILE_ATTRIBUTE_NORMAL,NULL);
+	if(file == INVALID_HANDLE_VALUE) return false;
+	mapping = CreateFileMappingA(file,NULL,PAGE_READWRITE,
+		DWORD(uint64_t(size) >> 32),DWORD(size & 0xFFFFFFFF),NULL);
+	if(!mapping) {
+		close();
+		return false;
+	}
+	data = (uint8_t*)MapViewOfFile(mapping,FILE_MAP_WRITE,0,0,size);
+	if(!data) {
+		close();
+		return false;
+	}
+#endif
+	memset(data,0,dataOffset);
+	this->ringSize = ringSize;
+	header = (FlightRecorderHeader*)data;
+	header->magic = kFlightRecorderMagic;
+	header->version = kVersion;
+	header->threadCount = uint32_t(threadCount);
+	header->running = 1;
+	header->ringSize = ringSize;
+	rings = (FlightRecorderRing*)(data + ringsOffset);
+	for(size_t i = 0;i < threadCount;++i)
+		rings[i].offset = dataOffset + ringSize*i;
+	return true;
+}
+
+/** Marks the recording as finished and unmaps the file */
+void FlightRecorder::close() {
+	if(header) header->running = 0;
+#ifndef GAMEDEVWEBTOOLS_PLATFORM_WIN32
+	if(data) ::munmap(data,size);
+#else
+	if(data) UnmapViewOfFile(data);
+	if(mapping) CloseHandle(mapping);
+	if(file != INVALID_HANDLE_VALUE) CloseHandle(file);
+	mapping = NULL;
+	file = INVALID_HANDLE_VALUE;
+#endif
+	data = nullptr;
+	header = nullptr;
+	rings = nullptr;
+}
+
+void FlightRecorder::frame(uint64_t frameId,double time) {
+	this->frameId = frameId;
+	this->time = time;
+	header->frameId = frameId;
+	header->frameTime = time;
+}
+
+size_t FlightRecorder::alignRecord(size_t size) {
+	return (sizeof(FlightRecorderRecord) + size + 7) & ~size_t(7);
+}
+
+/** Moves the tail forward until the ring has space for the new head */
+void FlightRecorder::evict(FlightRecorderRing *ring,uint64_t head) {
+	auto tail = ring->tail;
+	if(head - tail <= ringSize) return;
+	auto base = data + ring->offset;
+	while(head - tail > ringSize) {
+		auto offset = size_t(tail % ringSize);
+		auto rec = (const FlightRecorderRecord*)(base + offset);
+		if(rec->flags & kPaddingRecord) tail += ringSize - offset;
+		else tail += alignRecord(rec->size);
+	}
+	// The tail must be visible before the old records are overwritten.
+	ring->tail = tail;
+	std::atomic_thread_fence(std::memory_order_release);
+}
+
+/** Appends a record to the thread's ring */
+void FlightRecorder::record(size_t threadId,const void *messages,
+	size_t length) 
+{
+	auto ring = rings + threadId;
+	auto recordSize = alignRecord(length);
+	// Can't fit the record.
+	if(recordSize > ringSize/2) {
+		ring->dropped++;
+		return;
+	}
+	
+	auto base = data + ring->offset;
+	auto head = ring->head;
+	auto offset = size_t(head % ringSize);
+	if(offset + recordSize > ringSize) {
+		// Records don't wrap around, pad the end of the ring.
+		evict(ring,head + (ringSize - offset));
+		auto padding = (FlightRecorderRecord*)(base + offset);
+		padding->size = 0;
+		padding->flags = kPaddingRecord;
+		head += ringSize - offset;
+		offset = 0;
+	}
+	evict(ring,head + recordSize);
+	
+	auto rec = (FlightRecorderRecord*)(base + offset);
+	rec->size = uint32_t(length);
+	rec->flags = 0;
+	rec->frameId = frameId;
+	rec->time = time;
+	memcpy(rec + 1,messages,length);
+	
+	// Publish the record.
+	std::atomic_thread_fence(std::memory_order_release);
+	ring->head = head + recordSize;
+}
+
+/** 
+ * Returns the record at the position and moves the position past it.
+ * The padding at the end of the ring is skipped - it's marked by the 
+ * flags, or it's shorter than a record header.
+ */
+const FlightRecorderRecord *readRecord(const uint8_t *ring,
+	uint64_t ringSize,uint64_t &position,uint64_t head)
+{
+	while(position < head) {
+		auto offset = size_t(position % ringSize);
+		auto rest = size_t(ringSize) - offset;
+		auto rec = (const FlightRecorderRecord*)(ring + offset);
+		if(rest < sizeof(FlightRecorderRecord) || 
+			(rec->flags & kPaddingRecord)) 
+		{
+			position += rest;
+			continue;
+		}
+		if(rec->size > rest - sizeof(FlightRecorderRecord)) return nullptr;
+		position += (sizeof(FlightRecorderRecord) + rec->size + 7) & 
+			~uint64_t(7);
+		return rec;
+	}
+	return nullptr;
+}
+
+} } // gamedevwebtools::capture
+
+/*----------------------------------------------------------------------
+ * Late joiner snapshot
+ */
+namespace gamedevwebtools {
+
+/**
+ * Snapshot remembers the state which is sent to a client that connects
+ * later - the last message for each key of the last value message types,
+ * and the recent messages of the history message types.
+ * 
+ * The sending threads record the matching messages into the per thread
+ * candidate arenas, which are double buffered just like the thread 
+ * message buffers. The candidates are merged by update after the 
+ * corresponding messages were written to the clients, so that a new 
+ * client receives each message only once.
+ */
+class Snapshot {
+public:
+	enum { kMaxTypes = 16, kNone = 0xFFFF, kEmptySlot = 0xFFFFFFFF };
+	
+	Snapshot(Service *allocator,size_t threadCount,size_t maxValues,
+		size_t historySize);
+	~Snapshot();
+	void add(const char *type,const char *keyField,bool history);
+	void record(size_t threadId,const char *type,const void *keyData,
+		size_t keyLength,const void *json,size_t jsonSize,const void *data,
+		size_t dataSize);
+	const char *keyField(const char *type) const;
+	static const void *key(const Message::Field &field,size_t &length);
+	void swap();
+	void merge();
+	void setLimits();
+	size_t size() const;
+	void copy(uint8_t *dest) const;
+	size_t memoryUsage() const;
+private:
+	struct Type {
+		const char *name;
+		const char *keyField;
+		bool history;
+	};
+	struct Value {
+		uint32_t hash;
+		uint16_t type;
+		uint16_t keyLength;
+		uint32_t size;
+		uint32_t capacity;
+		uint8_t *data; // The key followed by the message.
+	};
+	/// A candidate record is followed by the key and the message.
+	struct Record {
+		uint32_t size;
+		uint16_t type;
+		uint16_t keyLength;
+	};
+	
+	size_t find(const char *type) const;
+	void mergeValue(const Record &record,const uint8_t *key,
+		const uint8_t *message);
+	void mergeHistory(const uint8_t *message,size_t size);
+	
+	Service *allocator;
+	Type types[kMaxTypes];
+	size_t typeCount;
+	Value *values;
+	size_t valueCount,valueCapacity,maxValues;
+	/// The open addressing index of the values - the value indices.
+	uint32_t *slots;
+	size_t slotMask;
+	core::memory::Arena history;
+	size_t historySize;
+	core::memory::Arena *candidates,*backCandidates;
+	size_t threadCount;
+};
+
+Snapshot::Snapshot(Service *allocator,size_t threadCount,size_t maxValues,
+	size_t historySize) 
+	: allocator(allocator), typeCount(0), values(nullptr), valueCount(0),
+	valueCapacity(0), maxValues(maxValues), slots(nullptr), slotMask(0),
+	history(allocator), historySize(historySize), threadCount(threadCount) 
+{
+	if(maxValues) {
+		// Keep the index at most half full.
+		size_t slotCount = 16;
+		while(slotCount < maxValues*2) slotCount *= 2;
+		slots = (uint32_t*)allocator->allocate(sizeof(uint32_t)*slotCount);
+		memset(slots,0xFF,sizeof(uint32_t)*slotCount);
+		slotMask = slotCount - 1;
+	}
+	candidates = (core::memory::Arena*)
+		allocator->allocate(sizeof(core::memory::Arena)*threadCount);
+	backCandidates = (core::memory::Arena*)
+		allocator->allocate(sizeof(core::memory::Arena)*threadCount);
+	for(size_t i = 0;i < threadCount;++i) {
+		new(candidates + i) core::memory::Arena(allocator);
+		new(backCandidates + i) core::memory::Arena(allocator);
+	}
+}
+Snapshot::~Snapshot() {
+	for(size_t i = 0;i < threadCount;++i) {
+		candidates[i].~Arena();
+		backCandidates[i].~Arena();
+	}
+	allocator->deallocate(candidates);
+	allocator->deallocate(backCandidates);
+	for(size_t i = 0;i < valueCount;++i)
+		allocator->deallocate(values[i].data);
+	if(values) allocator->deallocate(values);
+	if(slots) allocator->deallocate(slots);
+}
+
+/** Registers a message type which is remembered by the snapshot */
+void Snapshot::add(const char *type,const char *keyField,bool history) {
+	if(history? historySize == 0 : maxValues == 0) return;
+	auto i = find(type);
+	if(i == kNone) {
+		if(typeCount >= kMaxTypes) {
+			assert(false && "Too many snapshot message types!");
+			return;
+		}
+		i = typeCount++;
+	}
+	types[i].name = type;
+	types[i].keyField = keyField;
+	types[i].history = history;
+}
+size_t Snapshot::find(const char *type) const {
+	for(size_t i = 0;i < typeCount;++i) {
+		if(types[i].name == type || !strcmp(types[i].name,type)) 
+			return i;
+	}
+	return kNone;
+}
+/** Returns the bytes which identify the value of the key field */
+const void *Snapshot::key(const Message::Field &field,size_t &length) {
+	switch(field.type) {
+	case Message::Field::t_boolean:
+		length = sizeof(field.value.boolean);
+		return &field.value.boolean;
+	case Message::Field::t_i32:
+		length = sizeof(field.value.i32);
+		return &field.value.i32;
+	case Message::Field::t_isz:
+		length = sizeof(field.value.isz);
+		return &field.value.isz;
+	case Message::Field::t_f64:
+		length = sizeof(field.value.f64);
+		return &field.value.f64;
+	case Message::Field::t_cstr:
+		length = strlen(field.value.cstr);
+		if(length > 0xFFFF) length = 0xFFFF;
+		return field.value.cstr;
+	case Message::Field::t_ptr:
+		length = sizeof(field.value.ptr);
+		return &field.value.ptr;
+	case Message::Field::t_i64:
+		length = sizeof(field.value.i64);
+		return &field.value.i64;
+	case Message::Field::t_u64:
+		length = sizeof(field.value.u64);
+		return &field.value.u64;
+	case Message::Field::t_array:
+		break;
+	}
+	length = 0;
+	return nullptr;
+}
+
+/** 
+ * Returns the name of the key field of a tracked message type, or null
+ * when the type isn't tracked or doesn't have a key.
+ */
+const char *Snapshot::keyField(const char *type) const {
+	auto typeIndex = find(type);
+	if(typeIndex == kNone || types[typeIndex].history) return nullptr;
+	return types[typeIndex].keyField;
+}
+/** 
+ * Records a sent message if it's a part of the snapshot, the key is 
+ * the value of the type's key field (see key).
+ */
+void Snapshot::record(size_t threadId,const char *type,const void *keyData,
+	size_t keyLength,const void *json,size_t jsonSize,const void *data,
+	size_t dataSize) 
+{
+	auto typeIndex = find(type);
+	if(typeIndex == kNone) return;
+	if(types[typeIndex].history || !types[typeIndex].keyField) 
+		keyLength = 0;
+	
+	Record record;
+	record.size = uint32_t(2 + jsonSize + dataSize);
+	record.type = uint16_t(typeIndex);
+	record.keyLength = uint16_t(keyLength);
+	auto dest = (uint8_t*)candidates[threadId].tryAllocate(sizeof(Record) + 
+		keyLength + record.size);
+	if(!dest) return;
+	memcpy(dest,&record,sizeof(Record));
+	dest += sizeof(Record);
+	if(keyLength) memcpy(dest,keyData,keyLength);
+	dest += keyLength;
+	// The message in the network format.
+	dest[0] = uint8_t(jsonSize&0xFF);
+	dest[1] = uint8_t((jsonSize/256)&0xFF);
+	memcpy(dest+2,json,jsonSize);
+	if(dataSize) memcpy(dest+2+jsonSize,data,dataSize);
+}
+/** NB: Thread Safety: Same as Service::frameStart */
+/** Stops the candidate arenas from growing after the warmup */
+void Snapshot::setLimits() {
+	for(size_t i = 0;i < threadCount;++i) {
+		auto capacity = candidates[i].capacity();
+		if(backCandidates[i].capacity() > capacity)
+			capacity = backCandidates[i].capacity();
+		candidates[i].setLimit(capacity);
+		backCandidates[i].setLimit(capacity);
+	}
+}
+void Snapshot::swap() {
+	auto back = backCandidates;
+	backCandidates = candidates;
+	candidates = back;
+}
+/** Merges the candidates from the last frame into the snapshot */
+void Snapshot::merge() {
+	for(size_t i = 0;i < threadCount;++i) {
+		auto begin = (const uint8_t*)backCandidates[i].base();
+		auto end = begin + backCandidates[i].size();
+		while(begin < end) {
+			Record record;
+			memcpy(&record,begin,sizeof(Record));
+			auto key = begin + sizeof(Record);
+			auto message = key + record.keyLength;
+			if(types[record.type].history) 
+				mergeHistory(message,record.size);
+			else mergeValue(record,key,message);
+			begin = message + record.size;
+		}
+		backCandidates[i].reset();
+	}
+}
+void Snapshot::mergeValue(const Record &record,const uint8_t *key,
+	const uint8_t *message) 
+{
+	auto hash = FNV1_32A_INIT ^ Fnv32_t(record.type);
+	for(size_t i = 0;i < record.keyLength;++i) {
+		hash ^= Fnv32_t(key[i]);
+		hash *= FNV_32_PRIME;
+	}
+	
+	Value *value = nullptr;
+	auto slot = size_t(hash) & slotMask;
+	for(;slots[slot] != kEmptySlot;slot = (slot + 1) & slotMask) {
+		auto &v = values[slots[slot]];
+		if(v.hash == hash && v.type == record.type && 
+			v.keyLength == record.keyLength && 
+			!memcmp(v.data,key,record.keyLength)) {
+			value = &v;
+			break;
+		}
+	}
+	if(!value) {
+		if(valueCount >= maxValues) return;
+		if(valueCount >= valueCapacity) {
+			auto capacity = valueCapacity? valueCapacity*2 : 16;
+			if(capacity > maxValues) capacity = maxValues;
+			auto dest = (Value*)allocator->allocate(sizeof(Value)*capacity);
+			if(values) {
+				memcpy(dest,values,sizeof(Value)*valueCount);
+				allocator->deallocate(values);
+			}
+			values = dest;
+			valueCapacity = capacity;
+		}
+		slots[slot] = uint32_t(valueCount);
+		value = values + valueCount++;
+		value->hash = hash;
+		value->type = record.type;
+		value->keyLength = record.keyLength;
+		value->capacity = 0;
+		value->data = nullptr;
+	}
+	
+	auto size = size_t(record.keyLength) + record.size;
+	if(size > value->capacity) {
+		if(value->data) allocator->deallocate(value->data);
+		value->data = (uint8_t*)allocator->allocate(size);
+		value->capacity = uint32_t(size);
+	}
+	memcpy(value->data,key,record.keyLength);
+	memcpy(value->data + record.keyLength,message,record.size);
+	value->size = record.size;
+}
+void Snapshot::mergeHistory(const uint8_t *message,size_t size) {
+	if(size + sizeof(uint32_t) > historySize) return;
+	auto length = uint32_t(size);
+	auto dest = (uint8_t*)history.allocate(sizeof(uint32_t) + size);
+	memcpy(dest,&length,sizeof(uint32_t));
+	memcpy(dest+sizeof(uint32_t),message,size);
+	if(history.size() <= historySize) return;
+	
+	// Drop the oldest messages, leaving some space for the next ones.
+	auto base = (uint8_t*)history.base();
+	size_t offset = 0,end = history.size();
+	while(end - offset > historySize/4*3) {
+		memcpy(&length,base + offset,sizeof(uint32_t));
+		offset += sizeof(uint32_t) + length;
+	}
+	memmove(base,base + offset,end - offset);
+	history.reset(end - offset);
+}
+
+/** Returns the size of the snapshot in the network format */
+size_t Snapshot::size() const {
+	size_t result = 0;
+	for(size_t i = 0;i < valueCount;++i) result += values[i].size;
+	auto begin = (const uint8_t*)history.base();
+	auto end = begin + history.size();
+	while(begin < end) {
+		uint32_t length;
+		memcpy(&length,begin,sizeof(uint32_t));
+		result += length;
+		begin += sizeof(uint32_t) + length;
+	}
+	return result;
+}
+/** Copies the snapshot in the network format - last values first */
+void Snapshot::copy(uint8_t *dest) const {
+	for(size_t i = 0;i < valueCount;++i) {
+		auto &value = values[i];
+		memcpy(dest,value.data + value.keyLength,value.size);
+		dest += value.size;
+	}
+	auto begin = (const uint8_t*)history.base();
+	auto end = begin + history.size();
+	while(begin < end) {
+		uint32_t length;
+		memcpy(&length,begin,sizeof(uint32_t));
+		memcpy(dest,begin + sizeof(uint32_t),length);
+		dest += length;
+		begin += sizeof(uint32_t) + length;
+	}
+}
+size_t Snapshot::memoryUsage() const {
+	auto size = sizeof(core::memory::Arena)*threadCount*2 + 
+		sizeof(Value)*valueCapacity + history.capacity() + 
+		(slots? sizeof(uint32_t)*(slotMask + 1) : 0);
+	for(size_t i = 0;i < valueCount;++i) size += values[i].capacity;
+	for(size_t i = 0;i < threadCount;++i) 
+		size += candidates[i].capacity() + backCandidates[i].capacity();
+	return size;
+}
+
+} // gamedevwebtools
+
+/*----------------------------------------------------------------------
+ * Message type statistics
+ */
+namespace gamedevwebtools {
+
+/**
+ * Counts the sent messages for each message type.
+ * 
+ * Each thread counts into its own small table which is keyed by the 
+ * address of the type string, so counting a message is a pointer hash
+ * and a few additions. The thread tables are merged into the totals,
+ * which are keyed by the type name, at the start of each frame.
+ */
+class TypeStatistics {
+public:
+	enum { 
+		kThreadCapacity = 128, //Should be a power of two
+		kMaxProbes = 8
+	};
+	
+	TypeStatistics(Service *allocator,size_t threadCount);
+	~TypeStatistics();
+	inline void count(size_t threadId,const char *type,size_t headerBytes,
+		size_t dataBytes,uint64_t encodeTime);
+	void merge();
+	void reset();
+	inline size_t size() const { return totalCount; }
+	void get(size_t i,Service::MessageStatistics &statistics) const;
+	size_t find(const char *type);
+	size_t memoryUsage() const;
+private:
+	/// The times are in nanoseconds.
+	struct Counters {
+		const char *type;
+		uint64_t messages;
+		uint64_t headerBytes;
+		uint64_t dataBytes;
+		uint64_t encodeTime;
+	};
+	
+	Service *allocator;
+	size_t threadCount;
+	/// kThreadCapacity slots and the overflow slot for each thread.
+	Counters *threads;
+	Counters *totals;
+	size_t totalCount,totalCapacity;
+	core::HashTable index;
+};
+
+TypeStatistics::TypeStatistics(Service *allocator,size_t threadCount) 
+	: allocator(allocator), threadCount(threadCount), totals(nullptr),
+	totalCount(0), totalCapacity(0), index(allocator)
+{
+	auto size = sizeof(Counters)*(kThreadCapacity + 1)*threadCount;
+	threads = (Counters*)allocator->allocate(size);
+	memset(threads,0,size);
+	for(size_t i = 0;i < threadCount;++i)
+		threads[i*(kThreadCapacity + 1) + kThreadCapacity].type = "other";
+}
+TypeStatistics::~TypeStatistics() {
+	allocator->deallocate(threads);
+	if(totals) allocator->deallocate(totals);
+}
+
+inline void TypeStatistics::count(size_t threadId,const char *type,
+	size_t headerBytes,size_t dataBytes,uint64_t encodeTime) 
+{
+	auto table = threads + threadId*(kThreadCapacity + 1);
+	auto hash = uint32_t((uint64_t(uintptr_t(type))*
+		0x9E3779B97F4A7C15ull) >> 32);
+	auto counters = table + kThreadCapacity;
+	for(uint32_t i = 0;i < kMaxProbes;++i) {
+		auto slot = table + ((hash + i) & (kThreadCapacity - 1));
+		if(slot->type == type) { counters = slot; break; }
+		if(!slot->type) {
+			slot->type = type;
+			counters = slot;
+			break;
+		}
+	}
+	counters->messages++;
+	counters->headerBytes += headerBytes;
+	counters->dataBytes += dataBytes;
+	counters->encodeTime += encodeTime;
+}
+
+/**
+ * Adds the thread counters to the totals.
+ * NB: Thread Safety: Must be called when no messages are sent.
+ */
+void TypeStatistics::merge() {
+	auto end = threads + (kThreadCapacity + 1)*threadCount;
+	for(auto counters = threads;counters < end;++counters) {
+		if(!counters->messages) continue;
+		auto i = find(counters->type);
+		if(i == totalCount) {
+			if(totalCount >= totalCapacity) {
+				totalCapacity = totalCapacity? totalCapacity*2 : 32;
+				auto newTotals = (Counters*)
+					allocator->allocate(sizeof(Counters)*totalCapacity);
+				if(totals) {
+					memcpy(newTotals,totals,sizeof(Counters)*totalCount);
+					allocator->deallocate(totals);
+				}
+				totals = newTotals;
+			}
+			memset(totals + i,0,sizeof(Counters));
+			totals[i].type = counters->type;
+			index.insert(counters->type,uint32_t(i));
+			++totalCount;
+		}
+		auto &total = totals[i];
+		total.messages += counters->messages;
+		total.headerBytes += counters->headerBytes;
+		total.dataBytes += counters->dataBytes;
+		total.encodeTime += counters->encodeTime;
+		// Keep the type, so that the slot remains assigned to it.
+		counters->messages = counters->headerBytes = 0;
+		counters->dataBytes = counters->encodeTime = 0;
+	}
+}
+/** Returns the index of the totals for the type or size() */
+size_t TypeStatistics::find(const char *type) {
+	auto i = index.find(type);
+	return i != core::HashTable::kInvalidValue? size_t(i) : totalCount;
+}
+void TypeStatistics::reset() {
+	for(size_t i = 0;i < totalCount;++i) {
+		auto &total = totals[i];
+		total.messages = total.headerBytes = 0;
+		total.dataBytes = total.encodeTime = 0;
+	}
+}
+void TypeStatistics::get(size_t i,
+	Service::MessageStatistics &statistics) const 
+{
+	auto &total = totals[i];
+	statistics.type = total.type;
+	statistics.messages = total.messages;
+	statistics.headerBytes = total.headerBytes;
+	statistics.dataBytes = total.dataBytes;
+	statistics.encodeTime = double(total.encodeTime)*1e-9;
+}
+size_t TypeStatistics::memoryUsage() const {
+	return sizeof(Counters)*((kThreadCapacity + 1)*threadCount + 
+		totalCapacity) + index.memoryUsage();
+}
+
+} // gamedevwebtools
+
+/*----------------------------------------------------------------------
+ * Inbound message queue
+ */
+namespace gamedevwebtools {
+
+/**
+ * A lock-free single producer, single consumer queue of the received
+ * messages.
+ * 
+ * The thread which calls update parses the messages and copies them into
+ * a ring - each entry owns a copy of the message's JSON, and the type 
+ * and the field strings point into this copy. The entries are consumed 
+ * by the thread which calls dispatchMessages. The ring doesn't grow, so 
+ * a message which doesn't fit is dropped.
+ */
+class InboundQueue {
+public:
+	struct Entry {
+		uint32_t size; // The size of the entry, 0 marks the end of the ring.
+		uint32_t fieldCount;
+		const char *type;
+		uint32_t client; // The id of the client which sent the message.
+		
+		inline Message message() const {
+			return Message(type,(const Message::Field*)(this + 1),
+				fieldCount);
+		}
+	};
+	
+	InboundQueue(Service *allocator,size_t capacity);
+	~InboundQueue();
+	bool push(uint32_t client,const char *type,const Message::Field *fields,
+		size_t count,const char *json,size_t jsonSize);
+	const Entry *front();
+	void pop(const Entry *entry);
+	inline size_t memoryUsage() const { return capacity; }
+private:
+	Service *allocator;
+	uint8_t *ring;
+	size_t capacity;
+	/// The positions only grow, the offset is the position % capacity.
+	std::atomic<uint64_t> head; // Written by the producer.
+	uint8_t padding[56];        // Avoid the false sharing.
+	std::atomic<uint64_t> tail; // Written by the consumer.
+};
+
+InboundQueue::InboundQueue(Service *allocator,size_t capacity) 
+	: allocator(allocator), capacity(capacity & ~size_t(7)), head(0), 
+	tail(0) 
+{
+	ring = (uint8_t*)allocator->allocate(this->capacity);
+}
+InboundQueue::~InboundQueue() {
+	allocator->deallocate(ring);
+}
+
+bool InboundQueue::push(uint32_t client,const char *type,
+	const Message::Field *fields,size_t count,const char *json,
+	size_t jsonSize)
+{
+	auto size = (sizeof(Entry) + sizeof(Message::Field)*count + jsonSize + 
+		7) & ~size_t(7);
+	auto head = this->head.load(std::memory_order_relaxed);
+	auto tail = this->tail.load(std::memory_order_acquire);
+	auto offset = size_t(head%capacity);
+	// The entry is contiguous - skip the end of the ring if it won't fit.
+	size_t skip = capacity - offset >= size? 0 : capacity - offset;
+	if(head + skip + size - tail > capacity) return false;
+	if(skip) {
+		((Entry*)(ring + offset))->size = 0;
+		head += skip;
+		offset = 0;
+	}
+	
+	auto entry = (Entry*)(ring + offset);
+	auto fieldArray = (Message::Field*)(entry + 1);
+	auto copy = (char*)(fieldArray + count);
+	memcpy(copy,json,jsonSize);
+	auto rebase = [=](const char *str) -> const char * {
+		return str >= json && str < json + jsonSize? copy + (str - json) :
+			str;
+	};
+	entry->size = uint32_t(size);
+	entry->fieldCount = uint32_t(count);
+	entry->type = rebase(type);
+	entry->client = client;
+	for(size_t i = 0;i < count;++i) {
+		fieldArray[i] = fields[i];
+		fieldArray[i].id = rebase(fields[i].id);
+		if(fields[i].type == Message::Field::t_cstr)
+			fieldArray[i].value.cstr = rebase(fields[i].value.cstr);
+	}
+	this->head.store(head + size,std::memory_order_release);
+	return true;
+}
+
+const InboundQueue::Entry *InboundQueue::front() {
+	auto tail = this->tail.load(std::memory_order_relaxed);
+	while(tail != head.load(std::memory_order_acquire)) {
+		auto offset = size_t(tail%capacity);
+		auto entry = (const Entry*)(ring + offset);
+		if(entry->size) return entry;
+		tail += capacity - offset;
+		this->tail.store(tail,std::memory_order_release);
+	}
+	return nullptr;
+}
+void InboundQueue::pop(const Entry *entry) {
+	tail.store(tail.load(std::memory_order_relaxed) + entry->size,
+		std::memory_order_release);
+}
+
+} // gamedevwebtools
+
+/*----------------------------------------------------------------------
+ * Profiling task batches
+ */
+namespace gamedevwebtools {
+
+/**
+ * Collects the profiling tasks of a frame, and sends them as a single
+ * profiling.tasks message with a binary column for each field.
+ * 
+ * Each thread appends its tasks to its own arena. At the start of the 
+ * next frame the tasks are transposed into the columns, and the task 
+ * names are replaced by the indices into a table of the frame's names,
+ * which are interned by the address of the name string.
+ */
+class TaskBatch {
+public:
+	TaskBatch(Service *allocator,size_t threadCount);
+	~TaskBatch();
+	inline void add(size_t threadId,const char *name,uint32_t thread,
+		int32_t depth,double t,double dt);
+	void send(Service *service,uint64_t frame);
+	void setLimits();
+	size_t memoryUsage() const;
+private:
+	struct Task {
+		const char *name;
+		uint32_t thread;
+		int32_t depth;
+		double t;
+		double dt;
+	};
+	struct Name {
+		const char *name;
+		uint32_t id;
+	};
+	
+	Service *allocator;
+	size_t threadCount;
+	core::memory::Arena *tasks;
+	/// The columns followed by the name table.
+	core::memory::Arena columns;
+	/// The zero terminated names.
+	core::memory::Arena names;
+};
+
+TaskBatch::TaskBatch(Service *allocator,size_t threadCount) 
+	: allocator(allocator), threadCount(threadCount), columns(allocator),
+	names(allocator)
+{
+	tasks = (core::memory::Arena*)allocator->allocate(
+		sizeof(core::memory::Arena)*threadCount);
+	for(size_t i = 0;i < threadCount;++i) 
+		new(tasks + i) core::memory::Arena(allocator);
+}
+TaskBatch::~TaskBatch() {
+	for(size_t i = 0;i < threadCount;++i) tasks[i].~Arena();
+	allocator->deallocate(tasks);
+}
+
+inline void TaskBatch::add(size_t threadId,const char *name,
+	uint32_t thread,int32_t depth,double t,double dt) 
+{
+	auto task = (Task*)tasks[threadId].tryAllocate(sizeof(Task));
+	if(!task) return;
+	task->name = name;
+	task->thread = thread;
+	task->depth = depth;
+	task->t = t;
+	task->dt = dt;
+}
+
+/** NB: Thread Safety: Same as Service::frameStart */
+void TaskBatch::send(Service *service,uint64_t frame) {
+	size_t count = 0;
+	for(size_t i = 0;i < threadCount;++i) 
+		count += tasks[i].size()/sizeof(Task);
+	if(!count) return;
+	
+	size_t tableCapacity = 16;
+	while(tableCapacity < count*2) tableCapacity *= 2;
+	columns.reset();
+	names.reset();
+	// The name table goes first, as the columns of the 4 byte values 
+	// can leave the end unaligned.
+	auto table = (Name*)columns.allocate(tableCapacity*sizeof(Name) + 
+		count*(2*sizeof(double) + 3*sizeof(uint32_t)));
+	memset(table,0,tableCapacity*sizeof(Name));
+	auto times = (double*)(table + tableCapacity);
+	auto durations = times + count;
+	auto ids = (uint32_t*)(durations + count);
+	auto threads = ids + count;
+	auto depths = (int32_t*)(threads + count);
+	
+	uint32_t nameCount = 0;
+	size_t j = 0;
+	for(size_t i = 0;i < threadCount;++i) {
+		auto begin = (const Task*)tasks[i].base();
+		auto end = begin + tasks[i].size()/sizeof(Task);
+		for(auto task = begin;task < end;++task,++j) {
+			// Intern the name.
+			auto slot = (uintptr_t(task->name) >> 3)*0x9E3779B1u;
+			for(;;slot++) {
+				auto &entry = table[slot & (tableCapacity - 1)];
+				if(entry.name == task->name) {
+					ids[j] = entry.id;
+					break;
+				}
+				if(entry.name) continue;
+				entry.name = task->name;
+				entry.id = nameCount++;
+				auto length = strlen(task->name) + 1;
+				memcpy(names.allocate(length),task->name,length);
+				ids[j] = entry.id;
+				break;
+			}
+			times[j] = task->t;
+			durations[j] = task->dt;
+			threads[j] = task->thread;
+			depths[j] = task->depth;
+		}
+		tasks[i].reset();
+	}
+	
+	Message::Field fields[] = {
+		Message::Field("frame",size_t(frame)),
+		Message::Field("count",count),
+		Message::Field("names",ArrayView<uint8_t>(
+			(const uint8_t*)names.base(),names.size())),
+		Message::Field("name",ArrayView<uint32_t>(ids,count)),
+		Message::Field("thread",ArrayView<uint32_t>(threads,count)),
+		Message::Field("depth",ArrayView<int32_t>(depths,count)),
+		Message::Field("t",ArrayView<double>(times,count)),
+		Message::Field("dt",ArrayView<double>(durations,count))
+	};
+	service->send(Message("profiling.tasks",fields,
+		sizeof(fields)/sizeof(fields[0])).setPriority(Message::Low));
+}
+/** Stops the task arenas from growing after the warmup */
+void TaskBatch::setLimits() {
+	for(size_t i = 0;i < threadCount;++i) 
+		tasks[i].setLimit(tasks[i].capacity());
+}
+size_t TaskBatch::memoryUsage() const {
+	auto size = sizeof(core::memory::Arena)*threadCount + 
+		columns.capacity() + names.capacity();
+	for(size_t i = 0;i < threadCount;++i) size += tasks[i].capacity();
+	return size;
+}
+
+} // gamedevwebtools
+
+/*----------------------------------------------------------------------
+ * Delta encoding
+ */
+namespace gamedevwebtools {
+
+/**
+ * Remembers the previous message for each key of the delta encoded 
+ * message types, and encodes the changes from it.
+ * 
+ * A keyframe is the message in the usual format with an additional
+ * "keyframe":{"seq":S,"key":"keyField","types":"..."} field, where 
+ * the types has a character for each field - b(oolean), i(nteger),
+ * f(loat) or s(tring). A delta has just the key field and a 
+ * "deltaSeq":S field, and its binary data has a bit for each field which
+ * is set when the field has changed, followed by the changed values:
+ * the zig-zag varint difference for the integers, the 8 byte double 
+ * for the floats and the varint length and the bytes for the strings.
+ * The booleans are flipped. S increases by one with each message for 
+ * the key, so a client can tell when it has missed a message.
+ * 
+ * The messages are encoded once for all the clients, so the new 
+ * clients are resynced by sending the keyframes again. 
+ */
+class DeltaEncoder {
+public:
+	enum { kMaxTypes = 16, kMaxKeys = 4096, kNone = 0xFFFF };
+	
+	/// A delta encoded message which is being sent (see begin).
+	struct Encoding {
+		void *state;
+		uint64_t frame;
+		uint32_t seq;
+		bool keyframe;
+	};
+	
+	DeltaEncoder(Service *allocator,uint32_t keyframeInterval);
+	~DeltaEncoder();
+	void add(const char *type,const char *keyField);
+	inline size_t find(const char *type) const;
+	size_t maxSize(size_t type,const Message &message) const;
+	bool begin(Encoding &encoding,size_t type,const Message &message,
+		uint64_t frame);
+	char *putKeyframe(char *dest,const Encoding &encoding,
+		const Message &message) const;
+	char *putDelta(char *dest,const Encoding &encoding,
+		const Message &message,size_t &dataSize) const;
+	void end(const Encoding &encoding,const Message &message);
+	void resync();
+	size_t memoryUsage() const;
+private:
+	struct Type {
+		const char *name;
+		const char *keyField;
+	};
+	/// The previous value of a field. The field name and the string 
+	/// values are stored after the slots, at the given offsets.
+	struct Slot {
+		uint32_t id;
+		uint32_t idLength;
+		uint32_t type;
+		uint32_t length;
+		uint64_t bits;
+	};
+	struct State {
+		uint32_t hash; // 0 when the state is unused.
+		uint16_t type;
+		uint16_t keyLength;
+		uint32_t seq;
+		uint32_t fieldCount;
+		uint64_t keyframe;
+		uint64_t epoch;
+		uint32_t capacity;
+		uint8_t *data; // The key, followed by the slots and the strings.
+	};
+	
+	static size_t slotOffset(size_t keyLength);
+	static uint64_t bits(const Message::Field &field);
+	static bool changed(const State &state,const Slot &slot,
+		const Message::Field &field);
+	static bool sameField(const State &state,const Slot &slot,
+		const Message::Field &field);
+	static size_t deltaSize(const State &state,const Message &message);
+	State *state(size_t type,const Message &message);
+	void grow();
+	
+	Service *allocator;
+	Type types[kMaxTypes];
+	size_t typeCount;
+	State *states;
+	size_t stateCount,stateCapacity;
+	uint64_t keyframeInterval;
+	uint64_t epoch;
+	std::atomic_flag lock;
+};
+
+/** Writes a varint - 7 bits per byte, the high bit marks the next byte */
+static inline char *putVarint(char *dest,uint64_t value) {
+	while(value >= 0x80) {
+		*dest++ = char(uint8_t(value) | 0x80);
+		value >>= 7;
+	}
+	*dest++ = char(value);
+	return dest;
+}
+static inline size_t varintSize(uint64_t value) {
+	size_t size = 1;
+	for(;value >= 0x80;value >>= 7) ++size;
+	return size;
+}
+/** Maps the small negative numbers to the small positive numbers */
+static inline uint64_t zigZag(uint64_t difference) {
+	return (difference << 1) ^ uint64_t(int64_t(difference) >> 63);
+}
+
+DeltaEncoder::DeltaEncoder(Service *allocator,uint32_t keyframeInterval) 
+	: allocator(allocator), typeCount(0), states(nullptr), stateCount(0),
+	stateCapacity(0), keyframeInterval(keyframeInterval), epoch(0)
+{
+	lock.clear();
+}
+DeltaEncoder::~DeltaEncoder() {
+	for(size_t i = 0;i < stateCapacity;++i) {
+		if(states[i].hash) allocator->deallocate(states[i].data);
+	}
+	if(states) allocator->deallocate(states);
+}
+
+/** Registers a delta encoded message type */
+void DeltaEncoder::add(const char *type,const char *keyField) {
+	auto i = find(type);
+	if(i == kNone) {
+		if(typeCount >= kMaxTypes) {
+			assert(false && "Too many delta encoded message types!");
+			return;
+		}
+		i = typeCount++;
+	}
+	types[i].name = type;
+	types[i].keyField = keyField;
+}
+inline size_t DeltaEncoder::find(const char *type) const {
+	for(size_t i = 0;i < typeCount;++i) {
+		if(types[i].name == type || !strcmp(types[i].name,type)) 
+			return i;
+	}
+	return kNone;
+}
+
+/** Returns the upper bound of the size which is added to a message */
+size_t DeltaEncoder::maxSize(size_t type,const Message &message) const {
+	// The delta and the dataSize fields, or the keyframe field.
+	auto keyField = types[type].keyField;
+	auto size = 96 + (keyField? 
+		encoding::escapedLength(keyField,strlen(keyField)) : 0) + 
+		message.length/8 + 1;
+	for(size_t i = 0;i < message.length;++i) {
+		auto &field = message.fieldArray[i];
+		// The varint length of the string can be longer than the quotes.
+		size += field.type == Message::Field::t_cstr? 8 : 1;
+	}
+	return size;
+}
+
+size_t DeltaEncoder::slotOffset(size_t keyLength) {
+	return (keyLength + 7) & ~size_t(7);
+}
+/** Returns the bits of a field's value, the strings are compared apart */
+uint64_t DeltaEncoder::bits(const Message::Field &field) {
+	switch(field.type) {
+	case Message::Field::t_boolean:
+		return field.value.boolean? 1 : 0;
+	case Message::Field::t_i32:
+		return uint64_t(int64_t(field.value.i32));
+	case Message::Field::t_isz:
+		return uint64_t(field.value.isz);
+	case Message::Field::t_f64: {
+		uint64_t result;
+		memcpy(&result,&field.value.f64,sizeof(result));
+		return result;
+	}
+	case Message::Field::t_ptr:
+		return uint64_t(uintptr_t(field.value.ptr));
+	case Message::Field::t_i64:
+	case Message::Field::t_u64:
+		return field.value.u64;
+	default:
+		return 0;
+	}
+}
+bool DeltaEncoder::changed(const State &state,const Slot &slot,
+	const Message::Field &field) 
+{
+	if(field.type != Message::Field::t_cstr) return slot.bits != bits(field);
+	auto length = strlen(field.value.cstr);
+	return length != slot.length || memcmp(state.data + slot.bits,
+		field.value.cstr,length);
+}
+
+bool DeltaEncoder::sameField(const State &state,const Slot &slot,
+	const Message::Field &field) 
+{
+	return slot.type == uint32_t(field.type) && 
+		slot.idLength == strlen(field.id) &&
+		!memcmp(state.data + slot.id,field.id,slot.idLength);
+}
+
+/** Finds or creates the state for the key of a message */
+DeltaEncoder::State *DeltaEncoder::state(size_t type,
+	const Message &message) 
+{
+	const void *key = nullptr;
+	size_t keyLength = 0;
+	if(auto keyField = types[type].keyField) {
+		for(size_t i = 0;i < message.length;++i) {
+			auto &field = message.fieldArray[i];
+			if(strcmp(field.id,keyField)) continue;
+			key = Snapshot::key(field,keyLength);
+			break;
+		}
+	}
+	auto hash = FNV1_32A_INIT ^ Fnv32_t(type);
+	for(size_t i = 0;i < keyLength;++i) {
+		hash ^= Fnv32_t(((const uint8_t*)key)[i]);
+		hash *= FNV_32_PRIME;
+	}
+	hash |= hash == 0? 1 : 0;
+	
+	if(stateCount*2 >= stateCapacity && stateCount < kMaxKeys) grow();
+	auto mask = stateCapacity - 1;
+	for(auto i = size_t(hash) & mask;;i = (i + 1) & mask) {
+		auto &state = states[i];
+		if(!state.hash) {
+			// The new keys are sent in full when there are too many.
+			if(stateCount >= kMaxKeys) return nullptr;
+			state.hash = hash;
+			state.type = uint16_t(type);
+			state.keyLength = uint16_t(keyLength);
+			state.seq = 0;
+			state.fieldCount = 0;
+			state.keyframe = 0;
+			state.epoch = 0;
+			state.capacity = uint32_t(slotOffset(keyLength));
+			state.data = (uint8_t*)allocator->allocate(state.capacity + 1);
+			if(keyLength) memcpy(state.data,key,keyLength);
+			stateCount++;
+			return &state;
+		}
+		if(state.hash == hash && state.type == type && 
+			state.keyLength == keyLength && 
+			!memcmp(state.data,key,keyLength)) return &state;
+	}
+}
+void DeltaEncoder::grow() {
+	auto capacity = stateCapacity? stateCapacity*2 : 64;
+	auto dest = (State*)allocator->allocate(sizeof(State)*capacity);
+	for(size_t i = 0;i < capacity;++i) dest[i].hash = 0;
+	for(size_t i = 0;i < stateCapacity;++i) {
+		if(!states[i].hash) continue;
+		auto j = size_t(states[i].hash) & (capacity - 1);
+		while(dest[j].hash) j = (j + 1) & (capacity - 1);
+		dest[j] = states[i];
+	}
+	if(states) allocator->deallocate(states);
+	states = dest;
+	stateCapacity = capacity;
+}
+
+/** 
+ * Decides whether the message is sent as a keyframe or as a delta.
+ * Returns false when the message isn't delta encoded at all. Otherwise
+ * the encoder is locked until end. 
+ */
+bool DeltaEncoder::begin(Encoding &encoding,size_t type,
+	const Message &message,uint64_t frame) 
+{
+	for(size_t i = 0;i < message.length;++i) {
+		if(message.fieldArray[i].type == Message::Field::t_array) 
+			return false;
+	}
+	while(lock.test_and_set(std::memory_order_acquire)) ;
+	auto state = this->state(type,message);
+	if(!state) {
+		lock.clear(std::memory_order_release);
+		return false;
+	}
+	encoding.state = state;
+	encoding.frame = frame;
+	encoding.seq = ++state->seq;
+	encoding.keyframe = state->seq == 1 || state->epoch != epoch ||
+		state->fieldCount != message.length ||
+		(keyframeInterval && frame - state->keyframe >= keyframeInterval);
+	auto slots = (const Slot*)(state->data + slotOffset(state->keyLength));
+	for(size_t i = 0;i < message.length && !encoding.keyframe;++i) {
+		if(!sameField(*state,slots[i],message.fieldArray[i])) 
+			encoding.keyframe = true;
+	}
+	return true;
+}
+
+/** Writes the keyframe field, which goes before the dataSize */
+char *DeltaEncoder::putKeyframe(char *dest,const Encoding &encoding,
+	const Message &message) const 
+{
+	auto state = (const State*)encoding.state;
+	memcpy(dest,",\"keyframe\":{\"seq\":",19);
+	dest = encoding::putInteger(dest + 19,uint64_t(encoding.seq));
+	if(auto keyField = types[state->type].keyField) {
+		memcpy(dest,",\"key\":\"",8);
+		dest = encoding::putEscaped(dest + 8,keyField,strlen(keyField));
+		*dest++ = '"';
+	}
+	memcpy(dest,",\"types\":\"",10);
+	dest += 10;
+	for(size_t i = 0;i < message.length;++i) {
+		switch(message.fieldArray[i].type) {
+		case Message::Field::t_boolean: *dest++ = 'b'; break;
+		case Message::Field::t_f64: *dest++ = 'f'; break;
+		case Message::Field::t_cstr:
+		case Message::Field::t_ptr: *dest++ = 's'; break;
+		default: *dest++ = 'i'; break;
+		}
+	}
+	dest[0] = '"';dest[1] = '}';
+	return dest + 2;
+}
+
+size_t DeltaEncoder::deltaSize(const State &state,const Message &message) {
+	auto slots = (const Slot*)(state.data + slotOffset(state.keyLength));
+	auto size = (message.length + 7)/8;
+	for(size_t i = 0;i < message.length;++i) {
+		auto &field = message.fieldArray[i];
+		if(!changed(state,slots[i],field)) continue;
+		switch(field.type) {
+		case Message::Field::t_boolean:
+			break;
+		case Message::Field::t_f64:
+			size += 8;
+			break;
+		case Message::Field::t_cstr: {
+			auto length = strlen(field.value.cstr);
+			size += varintSize(length) + length;
+			break;
+		}
+		case Message::Field::t_ptr: {
+			char str[encoding::kMaxNumberLength];
+			auto length = size_t(snprintf(str,sizeof(str),"%p",
+				field.value.ptr));
+			size += varintSize(length) + length;
+			break;
+		}
+		default:
+			size += varintSize(zigZag(bits(field) - slots[i].bits));
+			break;
+		}
+	}
+	return size;
+}
+/** 
+ * Writes the rest of a delta message after its type - the key field and
+ * the sequence number, and the changed values after the JSON. Returns 
+ * the end of the JSON.
+ */
+char *DeltaEncoder::putDelta(char *dest,const Encoding &encoding,
+	const Message &message,size_t &dataSize) const 
+{
+	auto &state = *(const State*)encoding.state;
+	if(auto keyField = types[state.type].keyField) {
+		for(size_t i = 0;i < message.length;++i) {
+			auto &field = message.fieldArray[i];
+			if(strcmp(field.id,keyField)) continue;
+			dest[0] = ',';dest[1] = '"';
+			dest = encoding::putEscaped(dest + 2,field.id,strlen(field.id));
+			dest[0] = '"';dest[1] = ':';
+			dest += 2;
+			switch(field.type) {
+			case Message::Field::t_boolean:
+				dest = encoding::put(dest,field.value.boolean);
+				break;
+			case Message::Field::t_i32:
+				dest = encoding::put(dest,field.value.i32);
+				break;
+			case Message::Field::t_isz:
+				dest = encoding::put(dest,field.value.isz);
+				break;
+			case Message::Field::t_f64:
+				dest = encoding::put(dest,field.value.f64);
+				break;
+			case Message::Field::t_cstr:
+				dest = encoding::put(dest,field.value.cstr);
+				break;
+			case Message::Field::t_ptr:
+				*dest++ = '"';
+				dest += snprintf(dest,encoding::kMaxNumberLength - 2,"%p",
+					field.value.ptr);
+				*dest++ = '"';
+				break;
+			case Message::Field::t_i64:
+				dest = encoding::put(dest,field.value.i64);
+				break;
+			case Message::Field::t_u64:
+			case Message::Field::t_array:
+				dest = encoding::put(dest,field.value.u64);
+				break;
+			}
+			break;
+		}
+	}
+	memcpy(dest,",\"deltaSeq\":",12);
+	dest = encoding::putInteger(dest + 12,uint64_t(encoding.seq));
+	dataSize = deltaSize(state,message);
+	memcpy(dest,",\"dataSize\":",12);
+	dest = encoding::putInteger(dest + 12,uint64_t(dataSize));
+	*dest++ = '}';
+	auto json = dest;
+	
+	// The binary data.
+	auto slots = (const Slot*)(state.data + slotOffset(state.keyLength));
+	auto mask = dest;
+	memset(mask,0,(message.length + 7)/8);
+	dest += (message.length + 7)/8;
+	for(size_t i = 0;i < message.length;++i) {
+		auto &field = message.fieldArray[i];
+		if(!changed(state,slots[i],field)) continue;
+		mask[i/8] |= char(1 << (i%8));
+		switch(field.type) {
+		case Message::Field::t_boolean:
+			break;
+		case Message::Field::t_f64:
+			dest = encoding::putLittleEndian(dest,&field.value.f64,1,8);
+			break;
+		case Message::Field::t_cstr: {
+			auto length = strlen(field.value.cstr);
+			dest = putVarint(dest,length);
+			memcpy(dest,field.value.cstr,length);
+			dest += length;
+			break;
+		}
+		case Message::Field::t_ptr: {
+			char str[encoding::kMaxNumberLength];
+			auto length = size_t(snprintf(str,sizeof(str),"%p",
+				field.value.ptr));
+			dest = putVarint(dest,length);
+			memcpy(dest,str,length);
+			dest += length;
+			break;
+		}
+		default:
+			dest = putVarint(dest,zigZag(bits(field) - slots[i].bits));
+			break;
+		}
+	}
+	assert(size_t(dest - json) == dataSize);
+	return json;
+}
+
+/** Remembers the values of the sent message and unlocks the encoder */
+void DeltaEncoder::end(const Encoding &encoding,const Message &message) {
+	auto &state = *(State*)encoding.state;
+	if(encoding.keyframe) {
+		state.keyframe = encoding.frame;
+		state.epoch = epoch;
+	}
+	auto offset = slotOffset(state.keyLength);
+	auto size = offset + sizeof(Slot)*message.length;
+	for(size_t i = 0;i < message.length;++i) {
+		auto &field = message.fieldArray[i];
+		size += strlen(field.id);
+		if(field.type == Message::Field::t_cstr) 
+			size += strlen(field.value.cstr);
+	}
+	if(size > state.capacity) {
+		auto data = (uint8_t*)allocator->allocate(size);
+		memcpy(data,state.data,state.keyLength);
+		allocator->deallocate(state.data);
+		state.data = data;
+		state.capacity = uint32_t(size);
+	}
+	state.fieldCount = uint32_t(message.length);
+	auto slots = (Slot*)(state.data + offset);
+	auto strings = offset + sizeof(Slot)*message.length;
+	for(size_t i = 0;i < message.length;++i) {
+		auto &field = message.fieldArray[i];
+		auto idLength = strlen(field.id);
+		memcpy(state.data + strings,field.id,idLength);
+		slots[i].id = uint32_t(strings);
+		slots[i].idLength = uint32_t(idLength);
+		slots[i].type = uint32_t(field.type);
+		strings += idLength;
+		if(field.type == Message::Field::t_cstr) {
+			auto length = strlen(field.value.cstr);
+			memcpy(state.data + strings,field.value.cstr,length);
+			slots[i].length = uint32_t(length);
+			slots[i].bits = strings;
+			strings += length;
+		} else {
+			slots[i].length = 0;
+			slots[i].bits = bits(field);
+		}
+	}
+	lock.clear(std::memory_order_release);
+}
+
+/** Makes each key send a keyframe with its next message */
+void DeltaEncoder::resync() {
+	while(lock.test_and_set(std::memory_order_acquire)) ;
+	++epoch;
+	lock.clear(std::memory_order_release);
+}
+size_t DeltaEncoder::memoryUsage() const {
+	auto size = sizeof(State)*stateCapacity;
+	for(size_t i = 0;i < stateCapacity;++i) {
+		if(states[i].hash) size += states[i].capacity;
+	}
+	return size;
+}
+
+} // gamedevwebtools
+
+/*----------------------------------------------------------------------
+ * Actual tooling service. 
+ */
+namespace gamedevwebtools {
+
+Message::Message(const char *type,const Field *fields,size_t count) {
+	this->name = type;this->fieldArray = fields;this->length = count;
+	this->priorityClass = Normal;
+}
+Message::Message(const char *type) {
+	this->name = type;this->fieldArray = nullptr;this->length = 0;
+	this->priorityClass = Normal;
+}
+Message::Message(const char *type,const Field &a) {
+	this->name = type;this->fieldArray = inlineStorage;this->length = 1;
+	this->priorityClass = Normal;
+	inlineStorage[0] = a;
+}
+Message::Message(const char *type,const Field &a,const Field &b) {
+	this->name = type;this->fieldArray = inlineStorage;this->length = 2;
+	this->priorityClass = Normal;
+	inlineStorage[0] = a;inlineStorage[1] = b;
+}
+Message::Message(const char *type,const Field &a,const Field &b,
+	const Field &c) {
+	this->name = type;this->fieldArray = inlineStorage;this->length = 3;
+	this->priorityClass = Normal;
+	inlineStorage[0] = a;inlineStorage[1] = b;inlineStorage[2] = c;
+}
+
+/**
+ * The messaging service uses double buffering to send messages.
+ */
+Service::Service() {
+	threadMessageBackBuffers = threadMessageBuffers = nullptr;
+	threadMessageBackStamps = threadMessageStamps = nullptr;
+	nextStamp = 0;
+	orderedMessages = nullptr;
+	mergeHeads = nullptr;
+	transport = nullptr;
+	ownsTransport = false;
+	clients = nullptr;
+	clientCount = 0;
+	activeClientCount = 0;
+	pooledClientCount = 0;
+	threadCount = 0;
+	active_ = false;
+	memusage = 0;
+	currentFrameId = 0;
+	currentFrameTime = 0.0;
+	previousFrameTime = 0.0;
+	captureFile = nullptr;
+	captureOffset = 0;
+	captureIndex = nullptr;
+	flightRecorder = nullptr;
+	snapshot = nullptr;
+	formatCount = 0;
+	formats = nullptr;
+	categories = nullptr;
+	logDuplicateLimit = std::numeric_limits<uint32_t>::max();
+	selfProfiling = false;
+	threadProfiles = nullptr;
+	memset(&updateProfile,0,sizeof(updateProfile));
+	frameStartClock = 0;
+	droppedCount = 0;
+	growCount = 0;
+	typeStatistics = nullptr;
+	taskBatch = nullptr;
+	deltas = nullptr;
+	inboundQueue = nullptr;
+	inboundDrops = 0;
+	dispatchTable = nullptr;
+	dispatchSeed = 0;
+	dispatchShift = 0;
+	dispatchTableSize = 0;
+	dispatchDepth = 0;
+	refreezeHandlers = false;
+	typeStatisticsReportTime = 0.0;
+	budget = nullptr;
+	warmedUp = false;
+	assertOnAllocation = false;
+	allocationCount = 0;
+	reportedAllocationCount = 0;
+	overflowCount = 0;
+	bufferCount = 0;
+	threadMessageBufferLimit = 0;
+	overflowPolicy = DropNewest;
+	for(size_t i = 0;i < Message::kPriorityCount;++i) 
+		priorityWeights[i] = 1;
+	threadOverflows = nullptr;
+	spillBuffers = nullptr;
+	captureLock.clear();
+	sampledTypeCount = 0;
+	pingInterval = 0;
+	pingTimeout = 0;
+	nextPing = 0;
+	frameClock = 0;
+	receivingClient = 0;
+	maxClientLag = 0.0;
+	clientReportTime = 0.0;
+	clientIds = nullptr;
+	unwrittenTails = nullptr;
+	nextClientId = 1;
+	pendingRequestCount = 0;
+	requestTimeout = 0;
+	responses = nullptr;
+	requestLock.clear();
+}
+
+void Service::init(
+	const ApplicationInformation &appInfo,
+	const NetworkOptions &netOptions,
+	size_t threadCount) 
+{
+	if(threadCount < 1){
+		assert(false && "Thread count must be at least 1!");
+		threadCount = 1;
+	}
+	this->threadCount = threadCount;
+	
+	// Place the budget allocator at the start of the budget.
+	assertOnAllocation = netOptions.assertOnAllocation;
+	if(netOptions.memoryBudget && 
+		netOptions.memoryBudgetSize > sizeof(core::memory::Budget)) 
+	{
+		budget = new(netOptions.memoryBudget) core::memory::Budget(
+			(uint8_t*)netOptions.memoryBudget + sizeof(core::memory::Budget),
+			netOptions.memoryBudgetSize - sizeof(core::memory::Budget));
+	}
+	
+	//Get the thread message buffers - one for each priority class.
+	
+	bufferCount = threadCount*Message::kPriorityCount;
+	threadMessageBuffers = (core::memory::Arena*)
+		allocate(sizeof(core::memory::Arena)*bufferCount);
+	threadMessageBackBuffers = (core::memory::Arena*)
+		allocate(sizeof(core::memory::Arena)*bufferCount);
+	auto initialSize = netOptions.threadMessageBufferInitialSize;
+	assert(initialSize > 0);
+	for(size_t i = 0;i <  bufferCount;++i) {
+		new(threadMessageBuffers + i) 
+			core::memory::Arena(this,initialSize);
+		new(threadMessageBackBuffers + i) 
+			core::memory::Arena(this,initialSize);
+	}
+	if(netOptions.orderedThreadMessages) {
+		threadMessageStamps = (core::memory::Arena*)
+			allocate(sizeof(core::memory::Arena)*bufferCount);
+		threadMessageBackStamps = (core::memory::Arena*)
+			allocate(sizeof(core::memory::Arena)*bufferCount);
+		for(size_t i = 0;i <  bufferCount;++i) {
+			new(threadMessageStamps + i) core::memory::Arena(this);
+			new(threadMessageBackStamps + i) core::memory::Arena(this);
+		}
+		orderedMessages = new(allocate(sizeof(core::memory::Arena)))
+			core::memory::Arena(this);
+		mergeHeads = (MergeHead*)allocate(sizeof(MergeHead)*threadCount);
+	}
+	threadMessageBufferLimit = netOptions.threadMessageBufferLimit;
+	overflowPolicy = netOptions.overflowPolicy;
+	for(size_t i = 0;i < Message::kPriorityCount;++i) {
+		auto weight = netOptions.priorityWeights[i];
+		priorityWeights[i] = weight? weight : 1;
+	}
+	threadOverflows = (ThreadOverflow*)
+		allocate(sizeof(ThreadOverflow)*threadCount);
+	memset(threadOverflows,0,sizeof(ThreadOverflow)*threadCount);
+	if(overflowPolicy == SpillToCapture) {
+		spillBuffers = (core::memory::Arena*)
+			allocate(sizeof(core::memory::Arena)*threadCount);
+		for(size_t i = 0;i < threadCount;++i)
+			new(spillBuffers + i) core::memory::Arena(this,initialSize);
+	}
+	
+	selfProfiling = netOptions.selfProfiling;
+	if(selfProfiling) {
+		threadProfiles = (ThreadProfile*)
+			allocate(sizeof(ThreadProfile)*threadCount);
+		memset(threadProfiles,0,sizeof(ThreadProfile)*threadCount);
+	}
+	
+	messageTypeMapping =
+		new(allocate(sizeof(core::HashTable))) core::HashTable(this);
+	messageHandlers =
+		new(allocate(sizeof(core::memory::Arena))) core::memory::Arena(this,4096);
+	messagePrefixes =
+		new(allocate(sizeof(core::memory::Arena))) core::memory::Arena(this);
+	if(netOptions.inboundQueueSize) {
+		inboundQueue = new(allocate(sizeof(InboundQueue))) 
+			InboundQueue(this,netOptions.inboundQueueSize);
+	}
+	
+	assert(netOptions.maxConnectedClients > 0);
+	
+	netInit = netOptions.initializeSystemLibraries;
+	if(netInit)
+		network::init();
+	
+	// Create a transport - TCP sockets by default.
+	transport = netOptions.transport;
+	ownsTransport = !transport;
+	if(!transport) {
+#ifndef GAMEDEVWEBTOOLS_NO_TCP
+		transport = new(allocate(sizeof(network::TcpTransport)))
+			network::TcpTransport(this,netOptions.ipv6? network::IPv6 : 
+				network::IPvDefault);
+#else
+		assert(false && "NetworkOptions::transport is required!");
+#endif
+	}
+		
 	// Allocate networking clients.
 	clientCount = netOptions.maxConnectedClients;
 	activeClientCount = 0;
-	clients = (network::Listener*)onMalloc(
-		sizeof(network::Listener)*clientCount);
+	clients = (network::Connection**)allocate(
+		sizeof(network::Connection*)*clientCount);
+	clientIds = (uint32_t*)allocate(sizeof(uint32_t)*clientCount);
+#ifndef GAMEDEVWEBTOOLS_NO_WEBSOCKETS
+	wsclients = (network::websocket::Server*)allocate(
+		sizeof(network::websocket::Server)*clientCount);
+#else
+	unwrittenTails = (core::memory::Arena*)allocate(
+		sizeof(core::memory::Arena)*clientCount);
+	for(size_t i = 0;i < clientCount;++i)
+		new(unwrittenTails + i) core::memory::Arena(this);
+#endif
+	
+	info = appInfo;
+	
+	// Map the flight recorder.
+	if(netOptions.flightRecorderFile) {
+		flightRecorder = new(allocate(sizeof(capture::FlightRecorder)))
+			capture::FlightRecorder();
+		if(!flightRecorder->open(netOptions.flightRecorderFile,threadCount,
+			netOptions.flightRecorderThreadSize)) {
+			core::Buffer str;
+			str.put("Failed to create the flight recorder file '");
+			str.put(netOptions.flightRecorderFile);
+			str.put("'");
+			onError(str.cString());
+			flightRecorder->~FlightRecorder();
+			deallocate(flightRecorder);
+			flightRecorder = nullptr;
+		}
+	}
+	
+	// Create the late joiner snapshot.
+	if(netOptions.lateJoinerMaxValues || netOptions.lateJoinerHistorySize) {
+		snapshot = new(allocate(sizeof(Snapshot))) Snapshot(this,
+			threadCount,netOptions.lateJoinerMaxValues,
+			netOptions.lateJoinerHistorySize);
+		snapshotLastValue("monitoring.memory","name");
+		snapshotLastValue("profiling.timer","name");
+		snapshotLastValue("profiling.result","name");
+		snapshotLastValue("monitoring.messages","type");
+		snapshotHistory("logging.msg");
+		snapshotHistory("logging.fmsg");
+	}
+	
+	if(netOptions.messageStatistics) {
+		typeStatistics = new(allocate(sizeof(TypeStatistics))) 
+			TypeStatistics(this,threadCount);
+	}
+	taskBatch = new(allocate(sizeof(TaskBatch))) TaskBatch(this,threadCount);
+	deltas = new(allocate(sizeof(DeltaEncoder))) 
+		DeltaEncoder(this,netOptions.deltaKeyframeInterval);
+	
+	pingInterval = netOptions.pingInterval > 0.0? 
+		uint64_t(netOptions.pingInterval*1e9) : 0;
+	pingTimeout = netOptions.pingTimeout > 0.0? 
+		uint64_t(netOptions.pingTimeout*1e9) : 0;
+	connect("network.pong",*this,&Service::clockPong);
+	requestTimeout = netOptions.requestTimeout > 0.0?
+		uint64_t(netOptions.requestTimeout*1e9) : 0;
+	responses = 
+		new(allocate(sizeof(core::memory::Arena))) core::memory::Arena(this);
+	maxClientLag = netOptions.maxClientLag;
+	sampleAdaptively("profiling.task");
+	sampleAdaptively("profiling.tasks");
+	sampleAdaptively("profiling.timer");
+	sampleAdaptively("monitoring.service");
+	
+	// Start listening.
+	auto port = netOptions.port;
+	auto result = transport->listen(port);
+	if(result != 0) {
+		core::Buffer str;
+		str.put("The network server failed to listen on port ");
+		str.fmt("%d",port);
+		str.put(" - error code: ");
+		str.fmt("%d",result);
+#ifndef GAMEDEVWEBTOOLS_NO_TCP
+		str.put(", OS error code: ");
+		str.fmt("%d",network::osErrorCode());
+#endif
+		onError(str.cString());
+		active_ = false;
+	} else active_ = true;
+	
+	// Block until the first client connects.
+	if(active_ && netOptions.blockUntilFirstClient) {
+		while(!checkForNewClient()) ;//Wait.
+	}
+}
+
+Service::~Service() {
+	assert(threadCount > 0 && "gamedevwebtools::Service wasn't initialized!");
+	
+	stopCapture();
+	for(size_t i = 0;i < activeClientCount;++i)
+		transport->close(clients[i]);
+#ifndef GAMEDEVWEBTOOLS_NO_WEBSOCKETS
+	for(size_t i = 0;i < pooledClientCount;++i)
+		wsclients[i].~Server();
+#endif
+	if(ownsTransport) {
+		transport->~Transport();
+		deallocate(transport);
+	}
+	
+	for(size_t i = 0;i < bufferCount;++i) {
+		threadMessageBackBuffers[i].~Arena();
+		threadMessageBuffers[i].~Arena();
+	}
+	if(threadMessageStamps) {
+		for(size_t i = 0;i < bufferCount;++i) {
+			threadMessageBackStamps[i].~Arena();
+			threadMessageStamps[i].~Arena();
+		}
+		deallocate(threadMessageBackStamps);
+		deallocate(threadMessageStamps);
+		orderedMessages->~Arena();
+		deallocate(orderedMessages);
+		deallocate(mergeHeads);
+	}
+	
+	if(snapshot) {
+		snapshot->~Snapshot();
+		deallocate(snapshot);
+	}
+	// Marks the flight recording as a clean shutdown.
+	if(flightRecorder) {
+		flightRecorder->~FlightRecorder();
+		deallocate(flightRecorder);
+	}
+	if(typeStatistics) {
+		typeStatistics->~TypeStatistics();
+		deallocate(typeStatistics);
+	}
+	if(taskBatch) {
+		taskBatch->~TaskBatch();
+		deallocate(taskBatch);
+	}
+	if(deltas) {
+		deltas->~DeltaEncoder();
+		deallocate(deltas);
+	}
+	
+	messageTypeMapping->~HashTable();
+	messageHandlers->~Arena();
+	messagePrefixes->~Arena();
+	deallocate(messageTypeMapping);
+	deallocate(messageHandlers);
+	deallocate(messagePrefixes);
+	if(dispatchTable) deallocate(dispatchTable);
+	if(inboundQueue) {
+		inboundQueue->~InboundQueue();
+		deallocate(inboundQueue);
+	}
+	
+	activeClientCount = 0;
 #ifndef GAMEDEVWEBTOOLS_NO_WEBSOCKETS
-	wsclients = (network::websocket::Server*)onMalloc(
-		sizeof(network::websocket::Server)*clientCount);
+	deallocate(wsclients);
+#else
+	for(size_t i = 0;i < clientCount;++i) unwrittenTails[i].~Arena();
+	deallocate(unwrittenTails);
 #endif
+	deallocate(clients);
+	deallocate(clientIds);
+	responses->~Arena();
+	deallocate(responses);
+	deallocate(threadMessageBackBuffers);
+	deallocate(threadMessageBuffers);
+	deallocate(threadOverflows);
+	if(spillBuffers) {
+		for(size_t i = 0;i < threadCount;++i) spillBuffers[i].~Arena();
+		deallocate(spillBuffers);
+	}
+	if(threadProfiles) deallocate(threadProfiles);
 	
-	info = appInfo;
+	if(netInit)
+		network::shutdown();
+	if(budget) budget->~Budget();
+}
+
+/** Checks for new incoming connections and accepts the new client */
+bool Service::checkForNewClient() {
+	if(activeClientCount < clientCount){
+		//Check for new connections.
+		bool error = false;
+		auto connection = transport->accept(error);
+		if(connection){
+			clients[activeClientCount] = connection;
+			clientIds[activeClientCount] = nextClientId++;
+#ifndef GAMEDEVWEBTOOLS_NO_WEBSOCKETS
+			if(activeClientCount < pooledClientCount)
+				wsclients[activeClientCount].reset(connection);
+			else {
+				new(wsclients + activeClientCount) 
+					network::websocket::Server(this,transport,connection,
+					priorityWeights);
+				pooledClientCount++;
+			}
+#endif
+			activeClientCount++;
+			send(Message("application.information",
+				Message::Field("name",info.name),
+				Message::Field("threadCount",threadCount))
+				.setPriority(Message::High));
+			// The new client needs the logging formats before the logs
+			// in the snapshot and the other messages.
+			for(auto format = formats.load();format;format = format->next)
+				sendFormat(*format,activeClientCount - 1);
+			if(snapshot) sendSnapshot(activeClientCount - 1);
+			// The new client needs the keyframes of the delta messages.
+			// The messages are encoded once for all the clients, so each
+			// client gets the keyframes.
+			deltas->resync();
+			onNewClient();
+			return true;
+		} else if(error) {
+			onError("The network server failed to accept a new "
+				"connection");
+		}
+	}
+	return false;	
+}
+
+/** 
+ * Removes a client from the client array and releases the networking 
+ * resources for that client. The websocket server is kept after the 
+ * active clients, so that its buffers are reused by the next client.
+ */
+void Service::removeClient(size_t i) {
+	assert(i < activeClientCount);
+
+	// The client's requests can't be answered anymore.
+	while(requestLock.test_and_set(std::memory_order_acquire)) ;
+	for(size_t j = 0;j < pendingRequestCount;) {
+		if(pendingRequests[j].client == clientIds[i]) 
+			pendingRequests[j] = pendingRequests[--pendingRequestCount];
+		else ++j;
+	}
+	requestLock.clear(std::memory_order_release);
 	
-	// Start listening.
-	auto port = netOptions.port;
-	auto result = server->listen(port);
-	if(result != network::Server::ErrorNone) {
+	transport->close(clients[i]);
+#ifndef GAMEDEVWEBTOOLS_NO_WEBSOCKETS
+	uint8_t removed[sizeof(network::websocket::Server)];
+	memcpy(removed,&wsclients[i],sizeof(network::websocket::Server));
+#endif
+	
+	// Move the array elements.
+	for(auto j = i+1;j<activeClientCount;++j){
+#ifndef GAMEDEVWEBTOOLS_NO_WEBSOCKETS
+		memcpy(&wsclients[j-1],&wsclients[j],
+			sizeof(network::websocket::Server));
+#endif
+		clients[j-1] = clients[j];
+		clientIds[j-1] = clientIds[j];
+#ifdef GAMEDEVWEBTOOLS_NO_WEBSOCKETS
+		unwrittenTails[j-1].swap(unwrittenTails[j]);
+#endif
+	}
+	activeClientCount--;
+#ifndef GAMEDEVWEBTOOLS_NO_WEBSOCKETS
+	memcpy(&wsclients[activeClientCount],removed,
+		sizeof(network::websocket::Server));
+#else
+	unwrittenTails[activeClientCount].reset();
+#endif
+}
+
+size_t Service::computeMemoryUsage() {
+	size_t size =
+		sizeof(core::memory::Arena)*bufferCount*2 +
+		sizeof(ThreadOverflow)*threadCount +
+		(sizeof(network::Connection*) + sizeof(uint32_t))*clientCount + 
+#ifndef GAMEDEVWEBTOOLS_NO_WEBSOCKETS
+		sizeof(network::websocket::Server)*clientCount;
+#else
+		sizeof(core::memory::Arena)*clientCount;
+	for(size_t i = 0;i < clientCount;++i) 
+		size += unwrittenTails[i].capacity();
+#endif
+	for(size_t i = 0;i < bufferCount;++i) {
+		size += threadMessageBuffers[i].capacity();
+		size += threadMessageBackBuffers[i].capacity();
+	}
+	if(threadMessageStamps) {
+		for(size_t i = 0;i < bufferCount;++i) {
+			size += threadMessageStamps[i].capacity();
+			size += threadMessageBackStamps[i].capacity();
+		}
+		size += orderedMessages->capacity() + sizeof(MergeHead)*threadCount;
+	}
+	size += messageTypeMapping->memoryUsage();
+	size += messageHandlers->capacity();
+	size += messagePrefixes->capacity();
+	size += dispatchTableSize;
+	if(inboundQueue) size += inboundQueue->memoryUsage();
+	size += responses->capacity();
+	if(captureIndex) size += captureIndex->capacity();
+	if(spillBuffers) {
+		size += sizeof(core::memory::Arena)*threadCount;
+		for(size_t i = 0;i < threadCount;++i) 
+			size += spillBuffers[i].capacity();
+	}
+	if(snapshot) size += snapshot->memoryUsage();
+	if(typeStatistics) size += typeStatistics->memoryUsage();
+	if(taskBatch) size += taskBatch->memoryUsage();
+	if(deltas) size += deltas->memoryUsage();
+#ifndef GAMEDEVWEBTOOLS_NO_WEBSOCKETS
+	for(size_t i = 0;i < pooledClientCount;++i) 
+		size += wsclients[i].memoryUsage();
+#endif
+	return size;
+}
+
+size_t Service::queuedBytes() const {
+	size_t size = 0;
+	for(size_t i = 0;i < bufferCount;++i) {
+		size += threadMessageBuffers[i].size();
+		size += threadMessageBackBuffers[i].size();
+	}
+	return size;
+}
+
+void Service::frameStart(double frameTime) {
+	if(!active_) return;
+	
+	//Swap the buffers.
+	auto back = threadMessageBackBuffers;
+	threadMessageBackBuffers = threadMessageBuffers;
+	threadMessageBuffers = back;
+	auto backStamps = threadMessageBackStamps;
+	threadMessageBackStamps = threadMessageStamps;
+	threadMessageStamps = backStamps;
+	if(snapshot) snapshot->swap();
+	
+	auto dt = currentFrameId? frameTime - currentFrameTime : 0.0;
+	++currentFrameId;
+	previousFrameTime = currentFrameTime;
+	currentFrameTime = frameTime;
+	if(pingInterval) frameClock = transport->clock();
+	updateLogLimits(dt > 0.0? dt : 0.0);
+	if(flightRecorder) flightRecorder->frame(currentFrameId,frameTime);
+	sendOverflowStatistics();
+	if(selfProfiling) sendSelfProfile();
+	taskBatch->send(this,currentFrameId - 1);
+	auto allocations = allocationCount.load(std::memory_order_relaxed);
+	if(allocations != reportedAllocationCount) {
 		core::Buffer str;
-		str.put("The network server failed to listen on port ");
-		str.fmt("%d",port);
-		str.put(" - error code: ");
-		str.fmt("%d",int(result));
-		str.put(", OS error code: ");
-		str.fmt("%d",network::osErrorCode());
+		str.put("The service has allocated memory after the warmup - ");
+		str.fmt(uint64_t(allocations - reportedAllocationCount));
+		str.put(" allocation(s) in the last frame");
 		onError(str.cString());
-		active_ = false;
-	} else active_ = true;
+		reportedAllocationCount = allocations;
+	}
+	if(auto drops = inboundDrops.exchange(0,std::memory_order_relaxed)) {
+		core::Buffer str;
+		str.put("The inbound message queue is full - ");
+		str.fmt(uint64_t(drops));
+		str.put(" received message(s) were dropped in the last frame");
+		onError(str.cString());
+	}
+	if(typeStatistics) {
+		typeStatistics->merge();
+		if(frameTime >= typeStatisticsReportTime) {
+			typeStatisticsReportTime = frameTime + 1.0;
+			sendMessageStatistics();
+		}
+	}
+	if(pingInterval && activeClientCount && 
+		frameTime >= clientReportTime) {
+		clientReportTime = frameTime + 1.0;
+		sendClientStatistics();
+	}
+	
+	auto memoryUsage = computeMemoryUsage();
+	if(memusage != memoryUsage) {
+		memusage = memoryUsage;
+		send(Message("monitoring.memory",
+			Message::Field("name","gamedevwebtools"),
+			Message::Field("t",frameTime),
+			Message::Field("size",memusage)));
+	}
+}
+
+/** 
+ * Returns the size of an encoded message. The service writes the 
+ * dataSize as the last field of the JSON header.
+ */
+static size_t encodedSize(const uint8_t *message) {
+	auto jsonSize = size_t(message[0]) + size_t(message[1])*256;
+	auto json = (const char*)message + 2;
+	if(jsonSize < 2 || json[jsonSize - 1] != '}') return 2 + jsonSize;
+	auto end = jsonSize - 1,begin = end;
+	while(begin > 0 && isdigit(json[begin - 1])) --begin;
+	static const char field[] = "\"dataSize\":";
+	auto fieldLength = sizeof(field) - 1;
+	if(begin == end || begin < fieldLength || 
+		memcmp(json + begin - fieldLength,field,fieldLength)) 
+		return 2 + jsonSize;
+	size_t dataSize = 0;
+	for(auto i = begin;i < end;++i) 
+		dataSize = dataSize*10 + size_t(json[i] - '0');
+	return 2 + jsonSize + dataSize;
+}
+
+/** 
+ * Returns the end of the next frame written to the clients. The large
+ * buffers are split at the message boundaries, so that the frames of 
+ * the higher priority classes can be sent in between.
+ */
+static const uint8_t *frameEnd(const uint8_t *begin,const uint8_t *end) {
+	enum { kMaxFrameSize = 64*1024 };
+	if(size_t(end - begin) <= kMaxFrameSize) return end;
+	auto p = begin + encodedSize(begin);
+	while(p < end) {
+		auto next = p + encodedSize(p);
+		if(size_t(next - begin) > kMaxFrameSize) break;
+		p = next;
+	}
+	return p < end? p : end;
+}
+
+/** 
+ * Returns the index of the k-th buffer in the order in which the 
+ * buffers are written - the higher priority classes first.
+ */
+static size_t bufferIndex(size_t k,size_t threadCount) {
+	auto priority = Message::kPriorityCount - 1 - k/threadCount;
+	return (k%threadCount)*Message::kPriorityCount + priority;
+}
+
+/**
+ * Merges the messages of each priority class from the threads' back 
+ * buffers in the order in which they were sent. It's a k-way merge 
+ * which copies the runs of the consecutive messages from a thread. 
+ * The merged messages are copied back over the first thread's messages,
+ * so that they are written to the clients and the capture file as usual.
+ */
+void Service::mergeThreadMessages() {
+	for(size_t priority = 0;priority < Message::kPriorityCount;++priority) {
+		size_t total = 0,buffers = 0;
+		for(size_t t = 0;t < threadCount;++t) {
+			auto i = t*Message::kPriorityCount + priority;
+			auto &head = mergeHeads[t];
+			head.message = (const uint8_t*)threadMessageBackBuffers[i].base();
+			head.stamp = (const MessageStamp*)
+				threadMessageBackStamps[i].base();
+			head.stampEnd = head.stamp + 
+				threadMessageBackStamps[i].size()/sizeof(MessageStamp);
+			total += threadMessageBackBuffers[i].size();
+			buffers += head.stamp < head.stampEnd? 1 : 0;
+		}
+		// The messages of a single thread are already in order.
+		if(buffers < 2) continue;
+		
+		orderedMessages->reset();
+		auto dest = (uint8_t*)orderedMessages->tryAllocate(total);
+		if(!dest) continue;
+		for(;;) {
+			// The oldest message, and the oldest of the other threads.
+			auto first = threadCount;
+			auto stamp = std::numeric_limits<uint64_t>::max();
+			auto next = stamp;
+			for(size_t t = 0;t < threadCount;++t) {
+				auto &head = mergeHeads[t];
+				if(head.stamp == head.stampEnd) continue;
+				if(head.stamp->sequence < stamp) {
+					next = stamp;
+					stamp = head.stamp->sequence;
+					first = t;
+				} else if(head.stamp->sequence < next) 
+					next = head.stamp->sequence;
+			}
+			if(first == threadCount) break;
+			auto &head = mergeHeads[first];
+			auto begin = head.message;
+			do {
+				head.message += head.stamp->size;
+				head.stamp++;
+			} while(head.stamp < head.stampEnd && head.stamp->sequence < next);
+			memcpy(dest,begin,size_t(head.message - begin));
+			dest += head.message - begin;
+		}
+		assert(dest == (uint8_t*)orderedMessages->base() + total);
+		// The first thread's buffers have room for all the messages of
+		// the priority class after the warmup.
+		auto &buffer = threadMessageBackBuffers[priority];
+		buffer.reset();
+		memcpy(buffer.allocate(total),orderedMessages->base(),total);
+		for(size_t t = 1;t < threadCount;++t) 
+			threadMessageBackBuffers[t*Message::kPriorityCount + priority]
+				.reset();
+	}
+	for(size_t i = 0;i < bufferCount;++i) threadMessageBackStamps[i].reset();
+}
+
+/** Adds the time since the start of the phase to the total */
+static void lap(uint64_t &total,uint64_t &phase) {
+	auto time = core::clock();
+	total += time - phase;
+	phase = time;
+}
+
+void Service::update() {
+	uint64_t phase = 0;
+	if(selfProfiling) {
+		phase = core::clock();
+		if(!updateProfile.start) {
+			updateProfile.start = phase;
+			updateProfile.threadId = currentThreadId();
+		}
+	}
+	checkForNewClient();
+	if(threadMessageStamps) mergeThreadMessages();
+	if(captureFile) writeCapture();
+#ifndef GAMEDEVWEBTOOLS_NO_WEBSOCKETS
+	if(pingInterval) {
+		auto time = transport->clock();
+		if(time >= nextPing) {
+			// The clients couldn't answer while the service wasn't updated,
+			// so a stall doesn't count towards the ping timeout.
+			auto stall = nextPing && time - nextPing > pingInterval?
+				time - nextPing : 0;
+			nextPing = time + pingInterval;
+			updateClients(time,stall);
+		}
+	}
+#endif
+	if(selfProfiling) lap(updateProfile.accept,phase);
+	
+	// Write the thread message buffers - the higher priority first.
+	for(size_t k = 0;k < bufferCount;++k) {
+		auto i = bufferIndex(k,threadCount);
+		auto begin = (const uint8_t*)threadMessageBackBuffers[i].base();
+		auto size  = threadMessageBackBuffers[i].size();
+		if(!size) continue;
+		
+#ifndef GAMEDEVWEBTOOLS_NO_WEBSOCKETS
+		auto priority = Message::Priority(i%Message::kPriorityCount);
+		for(auto end = begin + size;begin < end;) {
+			auto frame = frameEnd(begin,end);
+			for(size_t j = 0;j < activeClientCount;++j) {
+				// The lagging clients get the sampled messages less often.
+				auto level = wsclients[j].statistics.samplingLevel;
+				if(level && (currentFrameId & ((uint64_t(1) << level) - 1)))
+					writeSampled(j,begin,frame,priority);
+				else 
+					wsclients[j].write(begin,size_t(frame - begin),priority);
+			}
+			begin = frame;
+		}
+#else
+		// Transport messages over TCP.
+		for(size_t j = 0;j < activeClientCount;++j)
+			writeToClient(j,begin,size);
+#endif
+		threadMessageBackBuffers[i].reset();
+	}
+	if(snapshot) snapshot->merge();
+	updateRequests(transport->clock());
+	
+#ifdef GAMEDEVWEBTOOLS_NO_WEBSOCKETS
+	for(size_t i = 0; i < activeClientCount;) {
+		if(flushClient(i)) ++i;
+		else removeClient(i);
+	}
+#else
+	// Transport messages over Websockets.
+	for(size_t i = 0; i < activeClientCount; ++i)
+		wsclients[i].send();
+	if(selfProfiling) lap(updateProfile.write,phase);
+	for(size_t i = 0; i < activeClientCount; ++i) {
+		wsclients[i].update();
+		if(selfProfiling) lap(updateProfile.read,phase);
+		if(wsclients[i].hasErrors()){
+			core::Buffer str;
+			str.put("A websocket connection has "
+				"encountered a protocol error and has to be shutdown");
+			onError(str.cString());
+			wsclients[i].close();
+		} else {
+			auto msg = wsclients[i].messages();
+			receivingClient = i;
+			recieve(msg.first,msg.second);
+			// The parsing and the dispatching are measured by parse.
+			if(selfProfiling) phase = core::clock();
+		}
+	}
+	for(size_t i = 0; i < activeClientCount; ++i){
+		if(wsclients[i].isClosed()) {
+			removeClient(i);
+			break;
+		}
+	}
+#endif
+}
+
+/** 
+ * Allocates the memory for the service - from the budget when it's set,
+ * otherwise from onMalloc.
+ */
+void *Service::allocate(size_t size) {
+	if(budget) {
+		auto result = budget->allocate(size);
+		if(result) return result;
+	}
+	if(warmedUp) {
+		allocationCount.fetch_add(1,std::memory_order_relaxed);
+		assert(!assertOnAllocation && 
+			"gamedevwebtools: An allocation after the warmup!");
+	}
+	return onMalloc(size);
+}
+void Service::deallocate(void *ptr) {
+	if(budget && budget->owns(ptr)) budget->free(ptr);
+	else onFree(ptr);
+}
+
+/** 
+ * Limits a front and a back arena to the larger capacity of the two, and
+ * grows the smaller one to it, as they are swapped every frame.
+ */
+static void limitSwapped(core::memory::Arena &front,
+	core::memory::Arena &back) 
+{
+	auto capacity = front.capacity() > back.capacity()? 
+		front.capacity() : back.capacity();
+	if(front.capacity() < capacity) front.grow(capacity - front.capacity());
+	if(back.capacity() < capacity) back.grow(capacity - back.capacity());
+	front.setLimit(capacity);
+	back.setLimit(capacity);
+}
+
+void Service::warmupComplete() {
+	for(size_t i = 0;i < bufferCount;++i) {
+		limitSwapped(threadMessageBuffers[i],threadMessageBackBuffers[i]);
+		if(threadMessageStamps) 
+			limitSwapped(threadMessageStamps[i],threadMessageBackStamps[i]);
+	}
+	if(orderedMessages) {
+		// The merged messages of a priority class are copied back to the
+		// first thread's buffers, so their capacity grows past their limits.
+		size_t largest = 0;
+		for(size_t priority = 0;priority < Message::kPriorityCount;
+			++priority) 
+		{
+			size_t total = 0;
+			for(size_t t = 0;t < threadCount;++t) {
+				total += threadMessageBuffers[t*Message::kPriorityCount + 
+					priority].capacity();
+			}
+			auto &front = threadMessageBuffers[priority];
+			if(front.capacity() <= total) 
+				front.grow(total - front.capacity());
+			auto &back = threadMessageBackBuffers[priority];
+			if(back.capacity() <= total) 
+				back.grow(total - back.capacity());
+			if(total > largest) largest = total;
+		}
+		if(orderedMessages->capacity() < largest)
+			orderedMessages->grow(largest - orderedMessages->capacity());
+		orderedMessages->setLimit(largest);
+	}
+	if(spillBuffers) {
+		for(size_t i = 0;i < threadCount;++i) 
+			spillBuffers[i].setLimit(spillBuffers[i].capacity());
+	}
+	if(snapshot) snapshot->setLimits();
+	taskBatch->setLimits();
+	// The buffers are grown for the merged messages before this.
+	warmedUp = true;
+}
+
+void *Service::onMalloc(size_t size) {
+	return ::malloc(size);
+}
+void Service::onFree(void *ptr) {
+	::free(ptr);
+}
+
+/** 
+ * Encodes the message's fields and the size of its binary data, and 
+ * closes the JSON object. The binary values of the fields follow the
+ * binary data (see putBinaryFields).
+ */
+void Service::encodeFields(core::Buffer &dest,const Message &message,
+	size_t dataSize)
+{
+	auto offset = dataSize;
+	for(size_t i = 0;i<message.length;++i) {
+		auto field = message.fieldArray[i];
+		dest.put(",\"");
+		dest.putEscaped(field.id);
+		dest.put("\":");
+		switch(field.type) {
+		case Message::Field::t_boolean:
+			dest.put(field.value.boolean? "true": "false");
+			break;
+		case Message::Field::t_i32:
+			dest.fmt("%d",field.value.i32);
+			break;
+		case Message::Field::t_isz:
+			dest.fmt(uint64_t(field.value.isz));
+			break;
+		case Message::Field::t_f64:
+			dest.fmt("%g",field.value.f64);
+			break;
+		case Message::Field::t_cstr:
+			dest.put('"');
+			dest.putEscaped(field.value.cstr);
+			dest.put('"');
+			break;
+		case Message::Field::t_ptr:
+			dest.put('"');
+			dest.fmt("%p",field.value.ptr);
+			dest.put('"');
+			break;
+		case Message::Field::t_i64:
+		case Message::Field::t_u64:
+		case Message::Field::t_array: {
+			char descriptor[encoding::kMaxBinaryFieldLength];
+			auto end = putBinaryField(descriptor,field,offset);
+			dest.put(descriptor,size_t(end - descriptor));
+			break;
+		}
+		}
+	}
+	if(offset) {
+		 dest.put(",\"dataSize\":");
+		 dest.fmt(uint64_t(offset));
+	}
+	dest.put('}');
+}
+/** 
+ * Writes the descriptor of a binary field, the field's data is at the
+ * offset after the JSON header. 
+ */
+char *Service::putBinaryField(char *dest,const Message::Field &field,
+	size_t &offset) 
+{
+	if(field.type == Message::Field::t_array) {
+		auto type = encoding::BinaryType(field.value.array.elementType);
+		dest = encoding::putBinaryField(dest,type,field.value.array.count,
+			false,offset);
+		offset += size_t(field.value.array.count)*
+			encoding::binaryTypeSize(type);
+		return dest;
+	}
+	dest = encoding::putBinaryField(dest,field.type == 
+		Message::Field::t_i64? encoding::b_i64 : encoding::b_u64,1,true,
+		offset);
+	offset += 8;
+	return dest;
+}
+/** Returns the size of the binary values of the message's fields */
+size_t Service::binaryFieldsSize(const Message &message) {
+	size_t size = 0;
+	for(size_t i = 0;i < message.length;++i) {
+		auto &field = message.fieldArray[i];
+		if(field.type == Message::Field::t_i64 || 
+			field.type == Message::Field::t_u64) size += 8;
+		else if(field.type == Message::Field::t_array) {
+			size += size_t(field.value.array.count)*encoding::binaryTypeSize(
+				encoding::BinaryType(field.value.array.elementType));
+		}
+	}
+	return size;
+}
+/** Writes the binary values of the message's fields */
+char *Service::putBinaryFields(char *dest,const Message &message) {
+	for(size_t i = 0;i < message.length;++i) {
+		auto &field = message.fieldArray[i];
+		if(field.type == Message::Field::t_i64 || 
+			field.type == Message::Field::t_u64) 
+			dest = encoding::putLittleEndian(dest,&field.value.i64,1,8);
+		else if(field.type == Message::Field::t_array) {
+			auto &array = field.value.array;
+			dest = encoding::putLittleEndian(dest,array.data,array.count,
+				encoding::binaryTypeSize(
+				encoding::BinaryType(array.elementType)));
+		}
+	}
+	return dest;
+}
+
+/* Send a message. */
+void Service::send(const Message &message) {
+	send(message,nullptr,0);
+}
+void Service::send(const Message &message,const void *data,const size_t
+	dataSize) 
+{
+	if(!active_) return;
+	// The upper bound of the encoded size, like in sendFields.
+	auto typeLength = strlen(message.name);
+	auto size = 11 + encoding::escapedLength(message.name,typeLength) + 
+		(dataSize? 12 + encoding::kMaxNumberLength : 0);
+	for(size_t i = 0;i < message.length;++i) {
+		auto &field = message.fieldArray[i];
+		size += 4 + encoding::escapedLength(field.id,strlen(field.id));
+		switch(field.type) {
+		case Message::Field::t_cstr:
+			size += encoding::size(field.value.cstr);
+			break;
+		case Message::Field::t_i64:
+		case Message::Field::t_u64:
+		case Message::Field::t_array:
+			size += encoding::kMaxBinaryFieldLength;
+			break;
+		default:
+			size += encoding::kMaxNumberLength;
+			break;
+		}
+	}
+	// The binary values follow the binary data.
+	auto binarySize = binaryFieldsSize(message);
+	if(binarySize && !dataSize) size += 12 + encoding::kMaxNumberLength;
+	auto deltaType = dataSize? size_t(DeltaEncoder::kNone) : 
+		deltas->find(message.name);
+	if(deltaType != DeltaEncoder::kNone) 
+		size += deltas->maxSize(deltaType,message);
+	Reservation reservation;
+	if(!beginSend(reservation,message.priorityClass,
+		size + dataSize + binarySize)) return;
 	
-	// Block until the first client connects.
-	if(active_ && netOptions.blockUntilFirstClient) {
-		while(!checkForNewClient()) ;//Wait.
+	auto dest = reservation.json;
+	memcpy(dest,"{\"type\":\"",9);
+	dest = encoding::putEscaped(dest + 9,message.name,typeLength);
+	*dest++ = '"';
+	DeltaEncoder::Encoding delta;
+	if(deltaType != DeltaEncoder::kNone && 
+		!deltas->begin(delta,deltaType,message,currentFrameId)) 
+		deltaType = DeltaEncoder::kNone;
+	if(deltaType != DeltaEncoder::kNone && !delta.keyframe) {
+		size_t deltaSize;
+		dest = deltas->putDelta(dest,delta,message,deltaSize);
+		deltas->end(delta,message);
+		// The deltas aren't a part of the snapshot.
+		endSend(reservation,message.priorityClass,message.name,
+			size_t(dest - reservation.json),dest,deltaSize,nullptr,0,false);
+		return;
+	}
+	const void *key = nullptr;
+	size_t keyLength = 0;
+	auto keyField = snapshotKeyField(message.name);
+	auto offset = dataSize;
+	for(size_t i = 0;i < message.length;++i) {
+		auto &field = message.fieldArray[i];
+		dest[0] = ',';dest[1] = '"';
+		dest = encoding::putEscaped(dest + 2,field.id,strlen(field.id));
+		dest[0] = '"';dest[1] = ':';
+		dest += 2;
+		switch(field.type) {
+		case Message::Field::t_boolean:
+			dest = encoding::put(dest,field.value.boolean);
+			break;
+		case Message::Field::t_i32:
+			dest = encoding::put(dest,field.value.i32);
+			break;
+		case Message::Field::t_isz:
+			dest = encoding::put(dest,field.value.isz);
+			break;
+		case Message::Field::t_f64:
+			dest = encoding::put(dest,field.value.f64);
+			break;
+		case Message::Field::t_cstr:
+			dest = encoding::put(dest,field.value.cstr);
+			break;
+		case Message::Field::t_ptr:
+			*dest++ = '"';
+			dest += snprintf(dest,encoding::kMaxNumberLength - 2,"%p",
+				field.value.ptr);
+			*dest++ = '"';
+			break;
+		case Message::Field::t_i64:
+		case Message::Field::t_u64:
+		case Message::Field::t_array:
+			dest = putBinaryField(dest,field,offset);
+			break;
+		}
+		if(keyField && !key && !strcmp(field.id,keyField)) 
+			key = Snapshot::key(field,keyLength);
+	}
+	if(deltaType != DeltaEncoder::kNone) {
+		dest = deltas->putKeyframe(dest,delta,message);
+		deltas->end(delta,message);
 	}
+	if(offset) {
+		memcpy(dest,",\"dataSize\":",12);
+		dest = encoding::putInteger(dest + 12,uint64_t(offset));
+	}
+	*dest++ = '}';
+	auto jsonSize = size_t(dest - reservation.json);
+	if(dataSize) memcpy(dest,data,dataSize);
+	putBinaryFields(dest + dataSize,message);
+	endSend(reservation,message.priorityClass,message.name,jsonSize,dest,
+		offset,key,keyLength);
 }
 
-Service::~Service() {
-	assert(threadCount > 0 && "gamedevwebtools::Service wasn't initialized!");
+/**
+ * Reserves the space for a message of up to size bytes (without the 
+ * 2 byte header) in the current thread's buffer. When the message doesn't
+ * fit, it's encoded into the thread's spill buffer and spilled by endSend,
+ * or it's dropped and beginSend returns false.
+ */
+bool Service::beginSend(Reservation &reservation,
+	Message::Priority priority,size_t size) 
+{
+	reservation.start = selfProfiling || typeStatistics? core::clock() : 0;
+	reservation.spilled = false;
+	auto threadId = currentThreadId();
+	assert(threadId < threadCount); //Enforce the threadId contract.
+	uint8_t *dest = nullptr;
+	auto buffer = threadId*Message::kPriorityCount + priority;
+	if(!threadMessageBufferLimit || makeRoom(threadId,priority,2 + size)) {
+		dest = (uint8_t*)threadMessageBuffers[buffer].tryAllocate(2 + size);
+	}
+	if(dest && threadMessageStamps) {
+		auto stamp = stampMessages(buffer,1);
+		if(stamp) stamp->size = 2 + size;
+		else {
+			threadMessageBuffers[buffer].reset(size_t(dest - 
+				(uint8_t*)threadMessageBuffers[buffer].base()));
+			dest = nullptr;
+		}
+	}
+	if(!dest && spillBuffers) {
+		auto &scratch = spillBuffers[threadId];
+		scratch.reset();
+		dest = (uint8_t*)scratch.tryAllocate(2 + size);
+		reservation.spilled = dest != nullptr;
+	}
+	if(!dest) {
+		overflow(threadId,priority,nullptr,0,nullptr,2 + size,nullptr,0);
+		return false;
+	}
+	reservation.json = (char*)dest + 2;
+	return true;
+}
+/** 
+ * Writes the header and the binary data of a message encoded in place,
+ * and returns the unused part of the reservation to the buffer. The 
+ * message is recorded by the snapshot unless record is false.
+ */
+void Service::endSend(const Reservation &reservation,
+	Message::Priority priority,const char *type,size_t jsonSize,
+	const void *data,size_t dataSize,const void *key,size_t keyLength,
+	bool record) 
+{
+	assert(jsonSize <= 0xFFFF);
+	auto threadId = currentThreadId();
+	auto json = reservation.json;
+	if(typeStatistics) {
+		typeStatistics->count(threadId,type,jsonSize + 2,dataSize,
+			core::clock() - reservation.start);
+	}
+	// Header - little endian.
+	uint8_t header[2] = { 
+		uint8_t(jsonSize&0xFF), uint8_t((jsonSize/256)&0xFF) 
+	};
+	if(reservation.spilled) 
+		overflow(threadId,priority,header,2,json,jsonSize,data,dataSize);
+	else {
+		auto dest = (uint8_t*)json - 2;
+		memcpy(dest,header,2);
+		// The data can be already encoded after the JSON.
+		if(dataSize && data != json + jsonSize) 
+			memcpy(json + jsonSize,data,dataSize);
+		auto &buffer = threadMessageBuffers[threadId*
+			Message::kPriorityCount + priority];
+		auto size = 2 + jsonSize + dataSize;
+		buffer.reset(size_t(dest - (uint8_t*)buffer.base()) + size);
+		if(threadMessageStamps) {
+			auto &stamps = threadMessageStamps[threadId*
+				Message::kPriorityCount + priority];
+			((MessageStamp*)stamps.top() - 1)->size = size;
+		}
+		if(flightRecorder) flightRecorder->record(threadId,dest,size);
+		if(selfProfiling) {
+			threadProfiles[threadId].messages++;
+			threadProfiles[threadId].bytes += size;
+		}
+	}
+	if(snapshot && record) {
+		snapshot->record(threadId,type,key,keyLength,json,jsonSize,
+			data,dataSize);
+	}
+	if(selfProfiling) {
+		auto &profile = threadProfiles[threadId];
+		if(!profile.first) profile.first = reservation.start;
+		profile.time += core::clock() - reservation.start;
+	}
+}
+/** Returns the snapshot's key field of a message type, if it has one */
+const char *Service::snapshotKeyField(const char *type) const {
+	return snapshot? snapshot->keyField(type) : nullptr;
+}
+
+void Service::sendEncoded(const void *messages,size_t size) {
+	if(!active_ || !size) return;
 	
-	for(size_t i = 0;i < activeClientCount;++i) {
-#ifndef GAMEDEVWEBTOOLS_NO_WEBSOCKETS
-		wsclients[i].~Server();
-#endif
-		clients[i].~Listener();
+	auto threadId = currentThreadId();
+	assert(threadId < threadCount); //Enforce the threadId contract.
+	void *dest = nullptr;
+	auto buffer = threadId*Message::kPriorityCount + Message::Normal;
+	if(!threadMessageBufferLimit || 
+		makeRoom(threadId,Message::Normal,size)) 
+	{
+		dest = threadMessageBuffers[buffer].tryAllocate(size);
 	}
-	server->~Server();
+	if(dest && threadMessageStamps) {
+		size_t count = 0;
+		auto begin = (const uint8_t*)messages,end = begin + size;
+		for(auto p = begin;p < end;p += encodedSize(p)) ++count;
+		auto stamps = stampMessages(buffer,count);
+		if(stamps) {
+			// The last message takes the rest when the sizes don't add up.
+			auto p = begin;
+			for(size_t i = 0;i < count;++i) {
+				auto next = i + 1 < count? p + encodedSize(p) : end;
+				stamps[i].size = size_t(next - p);
+				p = next;
+			}
+		} else {
+			threadMessageBuffers[buffer].reset(size_t((uint8_t*)dest - 
+				(uint8_t*)threadMessageBuffers[buffer].base()));
+			dest = nullptr;
+		}
+	}
+	if(!dest) {
+		overflow(threadId,Message::Normal,nullptr,0,messages,size,
+			nullptr,0);
+		return;
+	}
+	memcpy(dest,messages,size);
+	if(flightRecorder) flightRecorder->record(threadId,messages,size);
+	if(selfProfiling) threadProfiles[threadId].bytes += size;
+}
+size_t Service::currentThreadId() const {
+	return 0;
+}
+/** 
+ * Stamps the messages which were just added to a thread buffer with the
+ * next sequence numbers. Returns the stamps, whose sizes are set by the
+ * caller, or nullptr when the stamps can't grow.
+ */
+Service::MessageStamp *Service::stampMessages(size_t buffer,size_t count) {
+	auto stamps = (MessageStamp*)threadMessageStamps[buffer].tryAllocate(
+		sizeof(MessageStamp)*count);
+	if(!stamps) return nullptr;
+	auto stamp = nextStamp.fetch_add(count,std::memory_order_relaxed);
+	for(size_t i = 0;i < count;++i) stamps[i].sequence = stamp + i;
+	return stamps;
+}
+
+/* Overflow */
+
+/** 
+ * Checks whether a message fits into the thread's buffer limit, and 
+ * drops the oldest lower priority messages when the policy allows it.
+ */
+bool Service::makeRoom(size_t threadId,Message::Priority priority,
+	size_t size) 
+{
+	auto buffers = threadMessageBuffers + threadId*Message::kPriorityCount;
+	size_t used = 0;
+	for(size_t i = 0;i < Message::kPriorityCount;++i) 
+		used += buffers[i].size();
+	if(used + size <= threadMessageBufferLimit) return true;
+	if(overflowPolicy != DropOldest || size > threadMessageBufferLimit) 
+		return false;
 	
+	auto &counters = threadOverflows[threadId];
+	for(size_t i = 0;i <= size_t(priority) && 
+		used + size > threadMessageBufferLimit;++i) 
+	{
+		// Drop the oldest messages until there's enough room.
+		auto &buffer = buffers[i];
+		auto begin = (uint8_t*)buffer.base();
+		auto end = begin + buffer.size();
+		auto required = used + size - threadMessageBufferLimit;
+		auto p = begin;
+		uint64_t count = 0;
+		auto stamps = threadMessageStamps? 
+			threadMessageStamps + threadId*Message::kPriorityCount + i :
+			nullptr;
+		for(;p < end && size_t(p - begin) < required;++count) {
+			p += stamps? ((const MessageStamp*)stamps->base())[count].size :
+				encodedSize(p);
+		}
+		if(p > end) p = end;
+		memmove(begin,p,size_t(end - p));
+		buffer.reset(size_t(end - p));
+		if(stamps) {
+			auto remaining = stamps->size() - count*sizeof(MessageStamp);
+			memmove(stamps->base(),(uint8_t*)stamps->base() + 
+				count*sizeof(MessageStamp),remaining);
+			stamps->reset(remaining);
+		}
+		used -= size_t(p - begin);
+		counters.dropped[i] += count;
+		counters.droppedBytes += size_t(p - begin);
+		overflowCount.fetch_add(size_t(count),std::memory_order_relaxed);
+	}
+	return used + size <= threadMessageBufferLimit;
+}
+
+/** Handles a message which doesn't fit into the thread's buffers */
+void Service::overflow(size_t threadId,Message::Priority priority,
+	const void *prefix,size_t prefixSize,const void *data,size_t size,
+	const void *binaryData,size_t binaryDataSize) 
+{
+	auto &counters = threadOverflows[threadId];
+	if(overflowPolicy == SpillToCapture && 
+		spill(prefix,prefixSize,data,size,binaryData,binaryDataSize)) 
+	{
+		counters.spilled++;
+		return;
+	}
+	counters.dropped[priority]++;
+	counters.droppedBytes += prefixSize + size + binaryDataSize;
+	overflowCount.fetch_add(1,std::memory_order_relaxed);
+}
+
+/** 
+ * Writes a message to the capture file as a frame of its own.
+ * Returns false when the service isn't capturing, or when the index 
+ * has no room left for it.
+ */
+bool Service::spill(const void *prefix,size_t prefixSize,const void *data,
+	size_t size,const void *binaryData,size_t binaryDataSize) 
+{
+	while(captureLock.test_and_set(std::memory_order_acquire)) ;
+	// The index is grown only by the update thread.
+	bool ok = captureFile != nullptr && 
+		captureIndex->remaining() > sizeof(capture::IndexEntry);
+	if(ok) {
+		capture::FrameHeader header;
+		header.magic = capture::kFrameMagic;
+		header.reserved = 0;
+		header.size = uint32_t(prefixSize + size + binaryDataSize);
+		header.frameId = currentFrameId;
+		header.time = currentFrameTime;
+		auto file = (FILE*)captureFile;
+		ok = fwrite(&header,sizeof(header),1,file) == 1;
+		if(ok && prefixSize) ok = fwrite(prefix,prefixSize,1,file) == 1;
+		if(ok) ok = fwrite(data,size,1,file) == 1;
+		if(ok && binaryDataSize) 
+			ok = fwrite(binaryData,binaryDataSize,1,file) == 1;
+		if(ok) {
+			auto entry = (capture::IndexEntry*)
+				captureIndex->allocate(sizeof(capture::IndexEntry));
+			entry->frameId = header.frameId;
+			entry->time = header.time;
+			entry->offset = captureOffset;
+			captureOffset += sizeof(header) + header.size;
+		}
+	}
+	captureLock.clear(std::memory_order_release);
+	return ok;
+}
+
+/** Reports the messages which didn't fit into the buffers */
+void Service::sendOverflowStatistics() {
+	ThreadOverflow total;
+	memset(&total,0,sizeof(total));
 	for(size_t i = 0;i < threadCount;++i) {
-		threadMessageBackBuffers[i].~Arena();
-		threadMessageBuffers[i].~Arena();
+		auto &counters = threadOverflows[i];
+		for(size_t j = 0;j < Message::kPriorityCount;++j)
+			total.dropped[j] += counters.dropped[j];
+		total.droppedBytes += counters.droppedBytes;
+		total.spilled += counters.spilled;
 	}
-	
-	messageTypeMapping->~HashTable();
-	messageHandlers->~Arena();
-	onFree(messageTypeMapping);
-	onFree(messageHandlers);
-	
-	activeClientCount = 0;
-#ifndef GAMEDEVWEBTOOLS_NO_WEBSOCKETS
-	onFree(wsclients);
-#endif
-	onFree(clients);
-	onFree(server);
-	onFree(threadMessageBackBuffers);
-	onFree(threadMessageBuffers);
-	
-	if(netInit)
-		network::shutdown();
+	memset(threadOverflows,0,sizeof(ThreadOverflow)*threadCount);
+	auto dropped = total.dropped[Message::Low] + 
+		total.dropped[Message::Normal] + total.dropped[Message::High];
+	if(!dropped && !total.spilled) return;
+	Message::Field fields[] = {
+		Message::Field("t",currentFrameTime),
+		Message::Field("dropped",size_t(dropped)),
+		Message::Field("low",size_t(total.dropped[Message::Low])),
+		Message::Field("normal",size_t(total.dropped[Message::Normal])),
+		Message::Field("high",size_t(total.dropped[Message::High])),
+		Message::Field("bytes",size_t(total.droppedBytes)),
+		Message::Field("spilled",size_t(total.spilled))
+	};
+	send(Message("monitoring.overflow",fields,
+		sizeof(fields)/sizeof(fields[0])).setPriority(Message::High));
 }
 
-/** Checks for new incoming connections and accepts the new client */
-bool Service::checkForNewClient() {
-	if(activeClientCount < clientCount){
-		//Check for new connections.
-		new(clients+activeClientCount) network::Listener();
-		auto result = server->accept(clients[activeClientCount]);
-		if(result == network::Server::ErrorNone){
+/* Late joiner snapshot */
+
+void Service::snapshotLastValue(const char *messageType,
+	const char *keyField) 
+{
+	if(snapshot) snapshot->add(messageType,keyField,false);
+}
+void Service::snapshotHistory(const char *messageType) {
+	if(snapshot) snapshot->add(messageType,nullptr,true);
+}
+void Service::encodeDeltas(const char *messageType,const char *keyField) {
+	if(deltas) deltas->add(messageType,keyField);
+}
+/** Writes the snapshot to the new client before the other messages */
+void Service::sendSnapshot(size_t client) {
+	auto size = snapshot->size();
+	if(!size) return;
 #ifndef GAMEDEVWEBTOOLS_NO_WEBSOCKETS
-			new(wsclients + activeClientCount) 
-				network::websocket::Server(this,
-					clients + activeClientCount);
+	snapshot->copy(wsclients[client].beginWrite(size,Message::High));
+#else
+	auto dest = (uint8_t*)allocate(size);
+	snapshot->copy(dest);
+	writeToClient(client,dest,size);
+	deallocate(dest);
 #endif
-			activeClientCount++;
-			send(Message("application.information",
-				Message::Field("name",info.name),
-				Message::Field("threadCount",threadCount)));
-			onNewClient();
-			return true;
-		} else {
-			clients[activeClientCount].~Listener();
-			if(result != network::Server::ErrorNoConnections){
-				onError("The network server failed to accept a new"
-					"connection");
+}
+
+/* Self profiling */
+
+void Service::profileTask(const char *name,size_t thread,int32_t depth,
+	double t,double dt) 
+{
+	if(!active_) return;
+	taskBatch->add(currentThreadId(),name,uint32_t(thread),depth,t,dt);
+}
+
+/** 
+ * Reports the cost of the service during the last frame.
+ * The time spent in update is reported as a task with the subtasks
+ * for each phase, which are shown one after another even though the
+ * reading, parsing and dispatching are interleaved for each client.
+ * The time spent in send is reported as a task for each thread which
+ * starts with the first send in that frame.
+ */
+void Service::sendSelfProfile() {
+	auto now = core::clock();
+	if(frameStartClock) {
+		auto seconds = [](uint64_t ns) { return double(ns)*1e-9; };
+		
+		auto &update = updateProfile;
+		uint64_t updateTime = update.accept + update.write + update.read +
+			update.parse + update.dispatch;
+		if(update.start) {
+			auto t = update.start > frameStartClock? 
+				seconds(update.start - frameStartClock) : 0.0;
+			profileTask("gamedevwebtools.update",update.threadId,0,t,
+				seconds(updateTime));
+			const char *names[] = { "accept", "write", "read", "parse",
+				"dispatch" };
+			uint64_t times[] = { update.accept, update.write, update.read,
+				update.parse, update.dispatch };
+			for(size_t i = 0;i < 5;++i) {
+				profileTask(names[i],update.threadId,1,t,seconds(times[i]));
+				t += seconds(times[i]);
+			}
+		}
+		uint64_t sendTime = 0,messages = 0,bytes = 0;
+		for(size_t i = 0;i < threadCount;++i) {
+			auto &profile = threadProfiles[i];
+			if(profile.first) {
+				auto t = profile.first > frameStartClock? 
+					seconds(profile.first - frameStartClock) : 0.0;
+				profileTask("gamedevwebtools.send",i,0,t,
+					seconds(profile.time));
 			}
+			sendTime += profile.time;
+			messages += profile.messages;
+			bytes += profile.bytes;
 		}
+		
+		size_t queue = 0,clientQueue = 0;
+		for(size_t i = 0;i < bufferCount;++i) 
+			queue += threadMessageBackBuffers[i].size();
+#ifndef GAMEDEVWEBTOOLS_NO_WEBSOCKETS
+		for(size_t i = 0;i < activeClientCount;++i)
+			clientQueue += wsclients[i].queuedBytes();
+#endif
+		Message::Field fields[] = {
+			Message::Field("t",currentFrameTime),
+			Message::Field("messages",size_t(messages)),
+			Message::Field("bytes",size_t(bytes)),
+			Message::Field("send",seconds(sendTime)),
+			Message::Field("update",seconds(updateTime)),
+			Message::Field("queue",queue),
+			Message::Field("clientQueue",clientQueue),
+			Message::Field("dropped",size_t(droppedCount)),
+			Message::Field("grows",size_t(growCount.exchange(0))),
+			Message::Field("allocations",allocationsAfterWarmup()),
+			Message::Field("overflows",overflowedMessages())
+		};
+		send(Message("monitoring.service",fields,
+			sizeof(fields)/sizeof(fields[0])));
 	}
-	return false;	
+	memset(threadProfiles,0,sizeof(ThreadProfile)*threadCount);
+	memset(&updateProfile,0,sizeof(updateProfile));
+	droppedCount = 0;
+	frameStartClock = now;
 }
 
-/** 
- * Removes a client from the client array 
- * and releases the networking resources for that client */
-void Service::removeClient(size_t i) {
-	assert(i < activeClientCount);
+/* Message type statistics */
+
+size_t Service::messageStatistics(MessageStatistics *statistics,
+	size_t max) const 
+{
+	if(!typeStatistics) return 0;
+	auto count = typeStatistics->size();
+	for(size_t i = 0;i < count && i < max;++i)
+		typeStatistics->get(i,statistics[i]);
+	return count;
+}
+bool Service::messageStatistics(const char *messageType,
+	MessageStatistics &statistics) const 
+{
+	if(!typeStatistics) return false;
+	auto i = typeStatistics->find(messageType);
+	if(i == typeStatistics->size()) return false;
+	typeStatistics->get(i,statistics);
+	return true;
+}
+void Service::resetMessageStatistics() {
+	if(typeStatistics) typeStatistics->reset();
+}
+/** Reports the totals for each message type to the clients */
+void Service::sendMessageStatistics() {
+	for(size_t i = 0;i < typeStatistics->size();++i) {
+		MessageStatistics statistics;
+		typeStatistics->get(i,statistics);
+		Message::Field fields[] = {
+			Message::Field("type",statistics.type),
+			Message::Field("t",currentFrameTime),
+			Message::Field("messages",size_t(statistics.messages)),
+			Message::Field("headerBytes",size_t(statistics.headerBytes)),
+			Message::Field("dataBytes",size_t(statistics.dataBytes)),
+			Message::Field("encodeTime",statistics.encodeTime)
+		};
+		send(Message("monitoring.messages",fields,
+			sizeof(fields)/sizeof(fields[0]))
+			.setPriority(Message::Low));
+	}
+}
+
+/* Adaptive sampling */
 
+void Service::sampleAdaptively(const char *messageType) {
+	for(size_t i = 0;i < sampledTypeCount;++i) {
+		if(!strcmp(sampledTypes[i].name,messageType)) return;
+	}
+	if(sampledTypeCount >= kMaxSampledTypes) {
+		assert(false && "Too many adaptively sampled message types!");
+		return;
+	}
+	sampledTypes[sampledTypeCount].name = messageType;
+	sampledTypes[sampledTypeCount].length = strlen(messageType);
+	sampledTypeCount++;
+}
+bool Service::clientStatistics(size_t client,
+	ClientStatistics &statistics) const 
+{
+	if(client >= activeClientCount) return false;
 #ifndef GAMEDEVWEBTOOLS_NO_WEBSOCKETS
-	wsclients[i].~Server();
+	auto &ws = wsclients[client];
+	statistics.rtt = double(ws.statistics.rtt)*1e-9;
+	statistics.rttMin = double(ws.statistics.rttMin)*1e-9;
+	statistics.rttMax = double(ws.statistics.rttMax)*1e-9;
+	statistics.rttDeviation = double(ws.statistics.rttDeviation)*1e-9;
+	statistics.clockOffset = ws.statistics.clock.offset;
+	statistics.clockDelay = ws.statistics.clock.delay;
+	statistics.clockSamples = ws.statistics.clockSampleCount;
+	statistics.throughput = ws.statistics.throughput;
+	statistics.queuedBytes = ws.queuedBytes() + ws.net->queuedBytes();
+	statistics.samplingInterval = 1u << ws.statistics.samplingLevel;
+#else
+	memset(&statistics,0,sizeof(statistics));
+	statistics.queuedBytes = clients[client]->queuedBytes();
+	statistics.samplingInterval = 1;
 #endif
-	clients[i].~Listener();
-	
-	// Move the array elements.
-	for(auto j = i+1;j<activeClientCount;++j){
+	return true;
+}
+
 #ifndef GAMEDEVWEBTOOLS_NO_WEBSOCKETS
-		memcpy(&wsclients[j-1],&wsclients[j],
-			sizeof(network::websocket::Server));
-		// NB: Patch the listener pointer.
-		wsclients[j-1].net = &clients[j-1];
-#endif
-		memcpy(&clients[j-1],&clients[j],sizeof(network::Listener));
+/** Writes a message to a single client at the high priority */
+static void writeMessage(network::websocket::Server &client,
+	core::Buffer &json) 
+{
+	auto dest = client.beginWrite(2 + json.length(),Message::High);
+	dest[0] = uint8_t(json.length() & 0xFF);
+	dest[1] = uint8_t(json.length() >> 8);
+	memcpy(dest + 2,json.base(),json.length());
+}
+
+/** 
+ * Pings the clients, and estimates how far behind each client is - the 
+ * time it takes to deliver the queued bytes at the measured throughput
+ * plus half of the round trip time. The sampling is halved when the lag 
+ * is too large, and it's doubled when the client has caught up.
+ * The clients which haven't sent anything for the timeout are closed,
+ * without counting the stall - the time when the service wasn't updated.
+ */
+void Service::updateClients(uint64_t time,uint64_t stall) {
+	for(size_t i = 0;i < activeClientCount;++i) {
+		auto &ws = wsclients[i];
+		auto &statistics = ws.statistics;
+		if(ws.isClosed()) continue;
+		statistics.lastActivity += stall;
+		if(pingTimeout && time > statistics.lastActivity &&
+			time - statistics.lastActivity > pingTimeout) {
+			onError("A client hasn't responded to the pings and "
+				"was disconnected");
+			ws.close();
+			continue;
+		}
+		
+		auto measured = statistics.lastTime != 0;
+		if(measured) {
+			auto dt = double(time - statistics.lastTime)*1e-9;
+			auto rate = double(statistics.written - statistics.lastWritten)/dt;
+			statistics.throughput = statistics.throughput > 0.0? 
+				statistics.throughput*0.75 + rate*0.25 : rate;
+		}
+		statistics.lastTime = time;
+		statistics.lastWritten = statistics.written;
+		if(measured && maxClientLag > 0.0 && sampledTypeCount) {
+			auto queued = double(ws.queuedBytes() + ws.net->queuedBytes());
+			auto lag = double(statistics.rtt)*0.5e-9;
+			if(queued > 0.0) {
+				lag += statistics.throughput > 0.0? 
+					queued/statistics.throughput : maxClientLag*2.0;
+			}
+			if(lag > maxClientLag) {
+				if(statistics.samplingLevel < kMaxSamplingLevel)
+					statistics.samplingLevel++;
+			} else if(lag < maxClientLag*0.25 && statistics.samplingLevel)
+				statistics.samplingLevel--;
+		}
+		
+		if(!ws.ping(time)) continue;
+		// The application level ping for the clock synchronisation.
+		statistics.pingId = (statistics.pingId + 1) & 0x7FFFFFFF;
+		statistics.pingTimes[statistics.pingId % 
+			network::websocket::Server::kClockSamples] = serverTime(time);
+		core::Buffer json;
+		json.put("{\"type\":\"network.ping\",\"id\":");
+		json.fmt("%d",int32_t(statistics.pingId));
+		json.put('}');
+		writeMessage(ws,json);
 	}
-	activeClientCount--;
 }
+#endif
 
-size_t Service::computeMemoryUsage() {
-	size_t size =
-		sizeof(core::memory::Arena)*threadCount*2 +
-		sizeof(network::Listener)*clientCount + 
-		sizeof(network::Server) +
+/** 
+ * Returns the frame time which corresponds to the given clock, assuming 
+ * that the frame time advances in seconds.
+ */
+double Service::serverTime(uint64_t time) const {
+	if(!frameClock) return double(time)*1e-9;
+	return currentFrameTime + (double(time) - double(frameClock))*1e-9;
+}
+/** 
+ * Adds a clock sample when a client answers network.ping with the times
+ * when it has recieved the ping (t1) and sent the answer (t2).
+ */
+void Service::clockPong(const Message &message) {
 #ifndef GAMEDEVWEBTOOLS_NO_WEBSOCKETS
-		sizeof(network::websocket::Server)*clientCount;
+	if(receivingClient >= activeClientCount) return;
+	auto t3 = serverTime(transport->clock());
+	auto &ws = wsclients[receivingClient];
+	auto &statistics = ws.statistics;
+	int32_t id = -1;
+	double t1 = 0.0,t2 = 0.0;
+	for(size_t i = 0;i < message.fieldCount();++i) {
+		auto &field = message.fields()[i];
+		if(!strcmp(field.name(),"id")) id = field.asInteger();
+		else if(!strcmp(field.name(),"t1")) t1 = field.asReal();
+		else if(!strcmp(field.name(),"t2")) t2 = field.asReal();
+	}
+	// Only the answers to the recent pings are used.
+	auto count = network::websocket::Server::kClockSamples;
+	if(id < 0 || ((statistics.pingId - uint32_t(id)) & 0x7FFFFFFF) >= 
+		uint32_t(count)) return;
+	auto t0 = statistics.pingTimes[uint32_t(id) % count];
+	network::websocket::Server::ClockSample sample;
+	sample.offset = ((t1 - t0) + (t2 - t3))*0.5;
+	sample.delay = (t3 - t0) - (t2 - t1);
+	if(sample.delay < 0.0) sample.delay = 0.0;
+	
+	// The sample with the lowest delay is the most accurate.
+	statistics.clockSamples[statistics.clockSampleCount%count] = sample;
+	statistics.clockSampleCount++;
+	auto samples = statistics.clockSampleCount < size_t(count)? 
+		statistics.clockSampleCount : size_t(count);
+	statistics.clock = statistics.clockSamples[0];
+	for(size_t i = 1;i < samples;++i) {
+		if(statistics.clockSamples[i].delay < statistics.clock.delay)
+			statistics.clock = statistics.clockSamples[i];
+	}
+	
+	// Tell the client its offset.
+	core::Buffer json;
+	json.put("{\"type\":\"network.clock\",\"offset\":");
+	json.fmt("%.9f",statistics.clock.offset);
+	json.put(",\"delay\":");
+	json.fmt("%.9f",statistics.clock.delay);
+	json.put('}');
+	writeMessage(ws,json);
 #else
-		0;
+	(void)message;
 #endif
-	for(size_t i = 0;i < threadCount;++i) {
-		size += threadMessageBuffers[i].capacity();
-		size += threadMessageBackBuffers[i].capacity();
+}
+
+/** Reports the connection of each client */
+void Service::sendClientStatistics() {
+	for(size_t i = 0;i < activeClientCount;++i) {
+		ClientStatistics statistics;
+		clientStatistics(i,statistics);
+		Message::Field fields[] = {
+			Message::Field("client",i),
+			Message::Field("t",currentFrameTime),
+			Message::Field("rtt",statistics.rtt),
+			Message::Field("rttMin",statistics.rttMin),
+			Message::Field("rttMax",statistics.rttMax),
+			Message::Field("jitter",statistics.rttDeviation),
+			Message::Field("clockOffset",statistics.clockOffset),
+			Message::Field("throughput",statistics.throughput),
+			Message::Field("queue",statistics.queuedBytes),
+			Message::Field("sampling",int32_t(statistics.samplingInterval))
+		};
+		send(Message("monitoring.client",fields,
+			sizeof(fields)/sizeof(fields[0])));
 	}
-	size += messageTypeMapping->memoryUsage();
-	size += messageHandlers->capacity();
-	for(size_t i = 0;i < activeClientCount;++i) 
-		size += wsclients[i].memoryUsage();
-	return size;
 }
 
-void Service::frameStart(double frameTime) {
-	if(!active_) return;
-	
-	//Swap the buffers.
-	auto back = threadMessageBackBuffers;
-	threadMessageBackBuffers = threadMessageBuffers;
-	threadMessageBuffers = back;
-	
-	auto memoryUsage = computeMemoryUsage();
-	if(memusage != memoryUsage) {
-		memusage = memoryUsage;
-		send(Message("monitoring.memory",
-			Message::Field("name","gamedevwebtools"),
-			Message::Field("t",frameTime),
-			Message::Field("size",memusage)));
+/** Returns true if the message's type is sampled adaptively */
+bool Service::isSampled(const uint8_t *message) const {
+	static const char prefix[] = "{\"type\":\"";
+	auto prefixLength = sizeof(prefix) - 1;
+	auto jsonSize = size_t(message[0]) + size_t(message[1])*256;
+	auto json = (const char*)message + 2;
+	if(jsonSize <= prefixLength) return false;
+	auto name = json + prefixLength;
+	auto nameLength = jsonSize - prefixLength;
+	for(size_t i = 0;i < sampledTypeCount;++i) {
+		auto length = sampledTypes[i].length;
+		if(length < nameLength && name[length] == '"' &&
+			!memcmp(name,sampledTypes[i].name,length)) return true;
+	}
+	return false;
+}
+
+#ifndef GAMEDEVWEBTOOLS_NO_WEBSOCKETS
+/** Writes the messages to a client without the sampled messages */
+void Service::writeSampled(size_t client,const uint8_t *begin,
+	const uint8_t *end,Message::Priority priority) 
+{
+	size_t size = 0;
+	for(auto p = begin;p < end;) {
+		auto next = p + encodedSize(p);
+		if(!isSampled(p)) size += size_t(next - p);
+		p = next;
+	}
+	if(!size) return;
+	auto dest = wsclients[client].beginWrite(size,priority);
+	for(auto p = begin;p < end;) {
+		auto next = p + encodedSize(p);
+		if(!isSampled(p)) {
+			memcpy(dest,p,size_t(next - p));
+			dest += next - p;
+		}
+		p = next;
 	}
 }
-
-void Service::update() {
-	checkForNewClient();
-	
-	// Write the thread message buffers.
-	for(size_t i = 0;i < threadCount;++i) {
-		auto begin = threadMessageBackBuffers[i].base();
-		auto size  = threadMessageBackBuffers[i].size();
-		
-		for(size_t j = 0;j < activeClientCount;++j) {
-#ifndef GAMEDEVWEBTOOLS_NO_WEBSOCKETS
-			wsclients[j].write(begin,size);
 #else
-			// Transport messages over TCP.
-			clients[j].write(begin,size);
-#endif
-		}
-		threadMessageBackBuffers[i].reset();
+/** 
+ * Writes the messages to a client. The bytes which the connection
+ * doesn't accept are kept, and written before the next messages.
+ */
+void Service::writeToClient(size_t client,const void *data,size_t size) {
+	auto &tail = unwrittenTails[client];
+	size_t n = 0;
+	if(!tail.size()) {
+		n = clients[client]->write(data,size);
+		// The failure is found by the flush.
+		if(n == Connection::kError) n = 0;
+	}
+	if(n < size) 
+		memcpy(tail.allocate(size - n),(const uint8_t*)data + n,size - n);
+}
+/** Writes the unwritten bytes. Returns false if the connection failed. */
+bool Service::flushClient(size_t client) {
+	auto &tail = unwrittenTails[client];
+	auto size = tail.size();
+	if(!size) return true;
+	auto n = clients[client]->write(tail.base(),size);
+	if(n == Connection::kError) return false;
+	if(n == size) tail.reset();
+	else if(n) {
+		auto base = (uint8_t*)tail.base();
+		memmove(base,base + n,size - n);
+		tail.reset(size - n);
 	}
+	return true;
+}
+#endif
+
+/* Deferred logging */
+
+/** Returns the format id, or 0 if the message is dropped by the limits */
+uint32_t Service::acceptLog(logging::Format &format) {
+	auto id = format.id.load(std::memory_order_acquire);
+	if(!id) id = registerFormat(format);
 	
-#ifndef GAMEDEVWEBTOOLS_NO_WEBSOCKETS
-	// Transport messages over Websockets.
-	for(size_t i = 0; i < activeClientCount; ++i) {
-		wsclients[i].update();
-		if(wsclients[i].hasErrors()){
-			core::Buffer str;
-			str.put("A websocket connection has "
-				"encountered a protocol error and has to be shutdown");
-			onError(str.cString());
-			wsclients[i].close();
-		} else {
-			auto msg = wsclients[i].messages();
-			recieve(msg.first,msg.second);
+	// Collapse the duplicate messages.
+	if(logDuplicateLimit != std::numeric_limits<uint32_t>::max() &&
+		format.frameCount.fetch_add(1,std::memory_order_relaxed) >= 
+		logDuplicateLimit) return 0;
+	
+	if(!logLevelLimits[format.level].consume()) return 0;
+	auto category = format.category;
+	if(category) {
+		if(!category->registered.load(std::memory_order_relaxed) &&
+			!category->registered.exchange(true)) {
+			auto head = categories.load();
+			do {
+				category->next = head;
+			} while(!categories.compare_exchange_weak(head,category));
 		}
+		if(!category->limit.consume()) return 0;
 	}
-	for(size_t i = 0; i < activeClientCount; ++i){
-		if(wsclients[i].isClosed()) {
-			removeClient(i);
-			break;
-		}
+	return id;
+}
+uint32_t Service::registerFormat(logging::Format &format) {
+	auto id = formatCount.fetch_add(1) + 1;
+	uint32_t registered = 0;
+	// Another thread might have registered this format first.
+	if(!format.id.compare_exchange_strong(registered,id)) 
+		return registered;
+	auto head = formats.load();
+	do {
+		format.next = head;
+	} while(!formats.compare_exchange_weak(head,&format));
+	sendFormat(format);
+	return id;
+}
+void Service::sendFormat(const logging::Format &format,size_t client) {
+	Message::Field fields[] = {
+		Message::Field("id",int32_t(format.id.load())),
+		Message::Field("lvl",int32_t(format.level)),
+		Message::Field("fmt",format.format),
+		Message::Field("file",format.file),
+		Message::Field("line",int32_t(format.line)),
+		Message::Field("category",format.category? 
+			format.category->name : "")
+	};
+	Message message("logging.format",fields,sizeof(fields)/sizeof(fields[0]));
+	message.setPriority(Message::High);
+	if(client == ~size_t(0)) {
+		send(message);
+		return;
 	}
+	core::Buffer json;
+	json.put("{\"type\":\"logging.format\"");
+	encodeFields(json,message,0);
+	assert(json.length() <= 0xFFFF);
+	uint8_t header[2] = { uint8_t(json.length() & 0xFF),
+		uint8_t(json.length() >> 8) };
+#ifndef GAMEDEVWEBTOOLS_NO_WEBSOCKETS
+	auto dest = wsclients[client].beginWrite(2 + json.length(),Message::High);
+	memcpy(dest,header,2);
+	memcpy(dest + 2,json.base(),json.length());
+#else
+	writeToClient(client,header,2);
+	writeToClient(client,json.base(),json.length());
 #endif
 }
+/** The errors are sent at the high priority */
+void Service::sendLog(uint32_t formatId,logging::Level level,
+	const logging::Arguments &arguments) 
+{
+	send(Message("logging.fmsg",Message::Field("id",int32_t(formatId)))
+		.setPriority(level >= logging::Error? Message::High : 
+		Message::Normal),arguments.data(),arguments.size());
+}
 
-void *Service::onMalloc(size_t size) {
-	return ::malloc(size);
+void Service::setLogDuplicateLimit(uint32_t messagesPerFrame) {
+	logDuplicateLimit = messagesPerFrame;
 }
-void Service::onFree(void *ptr) {
-	::free(ptr);
+void Service::setLogRateLimit(logging::Level level,
+	double messagesPerSecond,double burst) 
+{
+	assert(level >= logging::Trace && level <= logging::Fatal);
+	auto &limit = logLevelLimits[level];
+	limit.rate = messagesPerSecond;
+	limit.burst = burst;
+	limit.tokens = int64_t(burst*logging::TokenBucket::kScale);
 }
 
-/* Send a message. */
-void Service::send(const Message &message) {
-	send(message,nullptr,0);
+static void refill(logging::TokenBucket &bucket,double dt) {
+	if(bucket.rate <= 0.0) return;
+	auto max = int64_t(bucket.burst*logging::TokenBucket::kScale);
+	auto tokens = bucket.tokens.load(std::memory_order_relaxed) + 
+		int64_t(bucket.rate*dt*logging::TokenBucket::kScale);
+	bucket.tokens.store(tokens < max? tokens : max,
+		std::memory_order_relaxed);
 }
-void Service::send(const Message &message,const void *data,const size_t
-	dataSize) 
-{
-	if(!active_) return;
-	
-	core::Buffer dest;
-    dest.put("{\"type\":\"");
-    dest.putEscaped(message.name);
-    dest.put('"');
-    for(size_t i = 0;i<message.length;++i) {
-		auto field = message.fieldArray[i];
-		dest.put(",\"");
-		dest.putEscaped(field.id);
-		dest.put("\":");
-		switch(field.type) {
-		case Message::Field::t_boolean:
-			dest.put(field.value.boolean? "true": "false");
-			break;
-		case Message::Field::t_i32:
-			dest.fmt("%d",field.value.i32);
-			break;
-		case Message::Field::t_isz:
-			dest.fmt(uint64_t(field.value.isz));
-			break;
-		case Message::Field::t_f64:
-			dest.fmt("%g",field.value.f64);
-			break;
-		case Message::Field::t_cstr:
-			dest.put('"');
-			dest.putEscaped(field.value.cstr);
-			dest.put('"');
-			break;
-		case Message::Field::t_ptr:
-			dest.put('"');
-			dest.fmt("%p",field.value.ptr);
-			dest.put('"');
-			break;
+
+/** 
+ * Reports the collapsed and the dropped logging messages from the last 
+ * frame and refills the rate limits.
+ */
+void Service::updateLogLimits(double dt) {
+	if(logDuplicateLimit != std::numeric_limits<uint32_t>::max()) {
+		for(auto format = formats.load();format;format = format->next) {
+			auto count = format->frameCount.exchange(0,
+				std::memory_order_relaxed);
+			if(count <= logDuplicateLimit) continue;
+			droppedCount += count - logDuplicateLimit;
+			send(Message("logging.repeat",
+				Message::Field("id",int32_t(format->id.load())),
+				Message::Field("count",size_t(count - logDuplicateLimit))));
 		}
 	}
-	if(dataSize) {
-		 dest.put(",\"dataSize\":");
-		 dest.fmt(uint64_t(dataSize));
+	for(int32_t i = logging::Trace;i <= logging::Fatal;++i) {
+		auto &limit = logLevelLimits[i];
+		refill(limit,dt);
+		auto dropped = limit.dropped.exchange(0,std::memory_order_relaxed);
+		droppedCount += dropped;
+		if(dropped) {
+			send(Message("logging.dropped",
+				Message::Field("lvl",i),
+				Message::Field("count",size_t(dropped))));
+		}
 	}
-	dest.put('}');
-	send((const uint8_t*)dest.base(),dest.length(),dataSize,data);		
+	for(auto category = categories.load();category;
+		category = category->next) {
+		refill(category->limit,dt);
+		auto dropped = category->limit.dropped.exchange(0,
+			std::memory_order_relaxed);
+		droppedCount += dropped;
+		if(dropped) {
+			send(Message("logging.dropped",
+				Message::Field("category",category->name),
+				Message::Field("count",size_t(dropped))));
+		}
+	}
+}
+
+/* Capture */
+bool Service::startCapture(const char *filename) {
+	assert(threadCount > 0 && "gamedevwebtools::Service wasn't initialized!");
+	stopCapture();
+	
+	auto file = fopen(filename,"wb");
+	if(!file) {
+		core::Buffer str;
+		str.put("Failed to open the capture file '");
+		str.put(filename);
+		str.put("'");
+		onError(str.cString());
+		return false;
+	}
+	capture::FileHeader header;
+	header.magic = capture::kFileMagic;
+	header.version = capture::kVersion;
+	header.indexOffset = 0;
+	header.threadCount = uint32_t(threadCount);
+	header.reserved = 0;
+	if(fwrite(&header,sizeof(header),1,file) != 1) {
+		fclose(file);
+		onError("Failed to write the capture file header");
+		return false;
+	}
+	auto index = new(allocate(sizeof(core::memory::Arena))) 
+		core::memory::Arena(this,kSpillIndexReserve*2*
+			sizeof(capture::IndexEntry));
+	while(captureLock.test_and_set(std::memory_order_acquire)) ;
+	captureFile = file;
+	captureOffset = sizeof(header);
+	captureIndex = index;
+	captureLock.clear(std::memory_order_release);
+	return true;
 }
 
-void Service::send(const uint8_t *data,size_t size,size_t binaryDataSize,
-	const void *binaryData) 
-{	
-	assert(size <= 0xFFFF);
+void Service::stopCapture() {
+	if(!captureFile) return;
+	while(captureLock.test_and_set(std::memory_order_acquire)) ;
+	auto file = (FILE*)captureFile;
 	
-	// Compute total size.
-	auto totalSize = size + 2;
+	// Write the index and patch the file header to point to it.
+	capture::IndexHeader index;
+	index.magic = capture::kIndexMagic;
+	index.reserved = 0;
+	index.count = captureIndex->size()/sizeof(capture::IndexEntry);
+	auto indexOffset = captureOffset;
+	bool ok = fwrite(&index,sizeof(index),1,file) == 1;
+	if(ok && index.count) {
+		ok = fwrite(captureIndex->base(),captureIndex->size(),1,file) == 1;
+	}
+	if(ok) ok = fseek(file,offsetof(capture::FileHeader,indexOffset),
+		SEEK_SET) == 0;
+	if(ok) ok = fwrite(&indexOffset,sizeof(indexOffset),1,file) == 1;
+	if(fclose(file) != 0) ok = false;
 	
-	// Allocate the memory for the message.
-	auto threadId = currentThreadId();
-	assert(threadId < threadCount); //Enforce the threadId contract.
-	auto dest = 
-		(uint8_t*)threadMessageBuffers[threadId].allocate(totalSize+binaryDataSize);
+	auto indexArena = captureIndex;
+	captureIndex = nullptr;
+	captureFile = nullptr;
+	captureLock.clear(std::memory_order_release);
+	if(!ok) onError("Failed to write the capture index");
 	
-	// Header - little endian.
-	dest[0] = uint8_t(size&0xFF);
-	dest[1] = uint8_t((size/256)&0xFF);
-	// Write the message.
-	memcpy(dest+2,data,size);
-	if(binaryDataSize)
-		memcpy(dest+2+size,binaryData,binaryDataSize);
+	indexArena->~Arena();
+	deallocate(indexArena);
 }
-size_t Service::currentThreadId() const {
-	return 0;
+
+/** Writes the messages from the thread back buffers to the capture file */
+void Service::writeCapture() {
+	capture::FrameHeader header;
+	header.size = 0;
+	for(size_t i = 0;i < bufferCount;++i)
+		header.size += threadMessageBackBuffers[i].size();
+	if(!header.size) return;
+	header.magic = capture::kFrameMagic;
+	header.reserved = 0;
+	// The back buffers hold the messages of the previous frame.
+	header.frameId = currentFrameId? currentFrameId - 1 : 0;
+	header.time = previousFrameTime;
+	
+	// The sending threads can spill the messages into the file.
+	while(captureLock.test_and_set(std::memory_order_acquire)) ;
+	auto file = (FILE*)captureFile;
+	bool ok = fwrite(&header,sizeof(header),1,file) == 1;
+	for(size_t k = 0;ok && k < bufferCount;++k) {
+		auto i = bufferIndex(k,threadCount);
+		auto size = threadMessageBackBuffers[i].size();
+		if(size) 
+			ok = fwrite(threadMessageBackBuffers[i].base(),size,1,file) == 1;
+	}
+	if(ok) {
+		auto entry = (capture::IndexEntry*)
+			captureIndex->allocate(sizeof(capture::IndexEntry));
+		entry->frameId = header.frameId;
+		entry->time = header.time;
+		entry->offset = captureOffset;
+		captureOffset += sizeof(header) + header.size;
+		auto reserve = kSpillIndexReserve*sizeof(capture::IndexEntry);
+		if(captureIndex->remaining() < reserve) captureIndex->grow(reserve);
+	}
+	captureLock.clear(std::memory_order_release);
+	if(!ok) {
+		onError("Failed to write to the capture file - "
+			"the capture was stopped");
+		stopCapture();
+	}
 }
 
 /* Recieve a message */
@@ -2461,21 +6459,256 @@ size_t Service::parse(char *message,size_t size) {
 	result.type = nullptr;
 	result.fields = fields;
 	result.binaryDataSize = 0;
+	auto start = selfProfiling? core::clock() : 0;
 	parseJSON(this, result, message, size);
+	uint64_t parsed = 0;
+	if(selfProfiling) {
+		parsed = core::clock();
+		updateProfile.parse += parsed - start;
+	}
 	if(!result.type) return result.binaryDataSize;
-		
-	Message resultMsg(result.type,result.fields,result.count);
 	
-	auto handler = messageTypeMapping->find(result.type);
-	if(handler != core::HashTable::kInvalidValue) {
-		auto base = (uint8_t*)messageHandlers->base();
-		(*((BindingDispatchFunction*)(base+handler))) (
-			base + handler + sizeof(BindingDispatchFunction),resultMsg);
+	// The service's own messages are always handled by update.
+	auto client = clientIds[receivingClient];
+	if(inboundQueue && strncmp(result.type,"network.",8)) {
+		if(!inboundQueue->push(client,result.type,result.fields,
+			result.count,message,size)) 
+			inboundDrops.fetch_add(1,std::memory_order_relaxed);
+	} else dispatch(Message(result.type,result.fields,result.count),client);
+	if(selfProfiling) updateProfile.dispatch += core::clock() - parsed;
+	return result.binaryDataSize;
+}
+
+/**
+ * The handlers connected to a message type form a chain in the handler
+ * arena, so that they are called in the order in which they were 
+ * connected. The arena can move, so the chain is linked by offsets.
+ */
+typedef void (*RequestDispatchFunction)(const void *,
+	const Service::Request &,const Message &);
+struct HandlerRecord {
+	union {
+		BindingDispatchFunction function;
+		RequestDispatchFunction requestFunction; // When isRequest is set.
+	};
+	uint32_t next; // The offset of the next handler for the same type.
+	uint32_t isRequest;
+};
+/**
+ * The prefix subscriptions (e.g. 'input.*') are stored in a character 
+ * trie, with the root node matching any type.
+ */
+struct PrefixNode {
+	char c;
+	uint32_t child;    // The first child node.
+	uint32_t sibling;  // The next node with the same parent.
+	uint32_t handlers; // The chain of the handlers for this prefix.
+};
+
+/** Calls the chain of handlers which starts at the given offset */
+bool Service::dispatchChain(uint32_t offset,const Message &message,
+	uint32_t client) 
+{
+	if(offset == core::HashTable::kInvalidValue) return false;
+	while(offset != core::HashTable::kInvalidValue) {
+		// A handler can connect another handler, which moves the arena,
+		// so the record isn't used after the call.
+		auto record = (const HandlerRecord*)
+			((const uint8_t*)messageHandlers->base() + offset);
+		offset = record->next;
+		if(record->isRequest) {
+			Request request;
+			if(beginRequest(message,client,request)) {
+				record->requestFunction(record + 1,request,message);
+			}
+		} else record->function(record + 1,message);
+	}
+	return true;
+}
+
+/** 
+ * Calls f(handlers) for the handler chain of each prefix of the type 
+ * which has handlers, from the shortest prefix.
+ */
+template<typename F>
+static void forEachPrefix(const core::memory::Arena *prefixes,
+	const char *type,F f)
+{
+	if(!prefixes->size()) return;
+	uint32_t node = 0;
+	for(auto c = type;;++c) {
+		// f can connect a prefix handler, which moves the nodes.
+		auto handlers = ((const PrefixNode*)prefixes->base())[node].handlers;
+		if(handlers != core::HashTable::kInvalidValue) f(handlers);
+		if(!*c) break;
+		auto nodes = (const PrefixNode*)prefixes->base();
+		auto child = nodes[node].child;
+		while(child != core::HashTable::kInvalidValue && 
+			nodes[child].c != *c) child = nodes[child].sibling;
+		if(child == core::HashTable::kInvalidValue) break;
+		node = child;
+	}
+}
+
+struct Service::DispatchEntry {
+	uint32_t hash;     // 0 marks an empty slot, MessageType is never 0.
+	uint32_t handlers; // The chain of the type's handlers.
+	const char *type;
+	/// The index of the type's list of the prefix handler chains, which
+	/// follows the slots and ends with kInvalidValue.
+	uint32_t prefixes;
+};
+
+static inline uint32_t dispatchSlot(uint32_t hash,uint32_t seed,
+	uint32_t shift) 
+{
+	return ((hash ^ seed)*0x9E3779B1u) >> shift;
+}
+
+/** 
+ * Calls the handlers of the message. A handler can connect the handlers,
+ * and the dispatch table is rebuilt after the outermost dispatch.
+ */
+void Service::dispatch(const Message &message,uint32_t client) {
+	dispatchDepth.fetch_add(1,std::memory_order_relaxed);
+	dispatchHandlers(message,client);
+	if(dispatchDepth.fetch_sub(1,std::memory_order_relaxed) == 1 &&
+		refreezeHandlers) 
+	{
+		refreezeHandlers = false;
+		freezeHandlers();
+	}
+}
+void Service::dispatchHandlers(const Message &message,uint32_t client) {
+	auto type = message.type();
+	auto handled = false;
+	if(dispatchTable) {
+		auto hash = MessageType(type).hash;
+		auto &entry = dispatchTable[dispatchSlot(hash,dispatchSeed,
+			dispatchShift)];
+		if(entry.hash == hash && !strcmp(entry.type,type)) {
+			auto prefixes = (const uint32_t*)(dispatchTable + 
+				(size_t(1) << (32 - dispatchShift))) + entry.prefixes;
+			dispatchChain(entry.handlers,message,client);
+			for(;*prefixes != core::HashTable::kInvalidValue;++prefixes)
+				dispatchChain(*prefixes,message,client);
+			return;
+		}
+		// Only the prefix handlers can match an unknown type.
 	} else {
+		handled = dispatchChain(messageTypeMapping->find(type),message,
+			client);
+	}
+	forEachPrefix(messagePrefixes,type,[&](uint32_t handlers) {
+		dispatchChain(handlers,message,client);
+		handled = true;
+	});
+	if(!handled) {
 		send(Message("gamedevwebtools.unhandled",
-			Message::Field("msgtype",result.type)));
+			Message::Field("msgtype",type)));
 	}
-	return result.binaryDataSize;
+}
+
+/**
+ * Fills the dispatch table with the given number of slots, returns false
+ * when two types map to the same slot.
+ */
+bool Service::fillDispatchTable(DispatchEntry *table,uint32_t slots,
+	uint32_t seed)
+{
+	uint32_t shift = 32;
+	for(auto i = slots;i > 1;i >>= 1) --shift;
+	auto collision = false;
+	messageTypeMapping->forEach([&](const char *type,uint32_t handlers) {
+		auto hash = MessageType(type).hash;
+		auto &entry = table[dispatchSlot(hash,seed,shift)];
+		if(entry.hash) collision = true;
+		entry.hash = hash;
+		entry.handlers = handlers;
+		entry.type = type;
+	});
+	if(collision) return false;
+	
+	// Resolve the prefix handlers of each type.
+	auto prefixes = (uint32_t*)(table + slots);
+	uint32_t count = 0;
+	for(uint32_t i = 0;i < slots;++i) {
+		if(!table[i].hash) continue;
+		table[i].prefixes = count;
+		forEachPrefix(messagePrefixes,table[i].type,[&](uint32_t handlers) {
+			prefixes[count++] = handlers;
+		});
+		prefixes[count++] = core::HashTable::kInvalidValue;
+	}
+	dispatchSeed = seed;
+	dispatchShift = shift;
+	return true;
+}
+
+void Service::freezeHandlers() {
+	if(dispatchDepth.load(std::memory_order_relaxed)) {
+		refreezeHandlers = true;
+		return;
+	}
+	if(dispatchTable) deallocate(dispatchTable);
+	dispatchTable = nullptr;
+	dispatchTableSize = 0;
+	
+	uint32_t count = 0;
+	size_t prefixCount = 0;
+	messageTypeMapping->forEach([&](const char *type,uint32_t) {
+		++count;
+		forEachPrefix(messagePrefixes,type,[&](uint32_t) { ++prefixCount; });
+		++prefixCount;
+	});
+	
+	// No seed maps the types with the same hash to distinct slots, their
+	// handlers are found with the hash table instead.
+	if(count > 1) {
+		auto hashes = (uint32_t*)allocate(sizeof(uint32_t)*count);
+		uint32_t i = 0;
+		messageTypeMapping->forEach([&](const char *type,uint32_t) {
+			hashes[i++] = MessageType(type).hash;
+		});
+		std::sort(hashes,hashes + count);
+		auto duplicate = std::adjacent_find(hashes,hashes + count) != 
+			hashes + count;
+		deallocate(hashes);
+		if(duplicate) return;
+	}
+	
+	// Look for a seed which maps the types to distinct slots, and double
+	// the table when there isn't one, up to a limit.
+	enum { kMaxSeeds = 64, kMaxSlots = 64*1024 };
+	uint32_t slots = 2;
+	while(slots < count) slots *= 2;
+	for(;slots <= kMaxSlots;slots *= 2) {
+		auto size = sizeof(DispatchEntry)*slots + sizeof(uint32_t)*prefixCount;
+		auto table = (DispatchEntry*)allocate(size);
+		for(uint32_t seed = 0;seed < kMaxSeeds;++seed) {
+			memset(table,0,sizeof(DispatchEntry)*slots);
+			if(fillDispatchTable(table,slots,seed*0x9E3779B9u)) {
+				dispatchTable = table;
+				dispatchTableSize = size;
+				return;
+			}
+		}
+		deallocate(table);
+	}
+}
+
+size_t Service::dispatchMessages(double timeBudget) {
+	if(!inboundQueue) return 0;
+	auto deadline = timeBudget > 0.0? 
+		core::clock() + uint64_t(timeBudget*1e9) : 0;
+	size_t count = 0;
+	while(auto entry = inboundQueue->front()) {
+		dispatch(entry->message(),entry->client);
+		inboundQueue->pop(entry);
+		++count;
+		if(deadline && core::clock() >= deadline) break;
+	}
+	return count;
 }
 
 void Service::recieve(uint8_t *data,size_t size) {
@@ -2528,73 +6761,315 @@ static uint32_t handlerOffset(const core::memory::Arena *arena) {
 	return uint32_t(offset);
 }
 
-void Service::safeInsert(core::HashTable *hash,const char *key){
-	auto value = handlerOffset(messageHandlers);
-	if(hash->find(key) == core::HashTable::kInvalidValue) {
-		hash->insert(key, value);
-		return;
+/** Appends the handler to the chain which starts at the given offset */
+static void appendHandler(core::memory::Arena *handlers,uint32_t first,
+	uint32_t handler)
+{
+	auto base = (uint8_t*)handlers->base();
+	auto record = (HandlerRecord*)(base + first);
+	while(record->next != core::HashTable::kInvalidValue)
+		record = (HandlerRecord*)(base + record->next);
+	record->next = handler;
+}
+
+/** 
+ * Returns the node of the given prefix in the prefix trie, creating the 
+ * nodes along the way.
+ */
+static PrefixNode *prefixNode(core::memory::Arena *prefixes,
+	const char *prefix,size_t length)
+{
+	if(!prefixes->size()) {
+		auto root = (PrefixNode*)prefixes->allocate(sizeof(PrefixNode));
+		root->c = '\0';
+		root->child = root->sibling = root->handlers = 
+			core::HashTable::kInvalidValue;
 	}
-	core::Buffer buffer;
-	buffer.put("Can't connect to '");
-	buffer.put(key);
-	buffer.put("' - this message type is already taken.");
-	onError(buffer.cString());
+	uint32_t node = 0;
+	for(size_t i = 0;i < length;++i) {
+		auto nodes = (PrefixNode*)prefixes->base();
+		auto child = nodes[node].child;
+		while(child != core::HashTable::kInvalidValue && 
+			nodes[child].c != prefix[i]) child = nodes[child].sibling;
+		if(child == core::HashTable::kInvalidValue) {
+			child = uint32_t(prefixes->size()/sizeof(PrefixNode));
+			auto added = (PrefixNode*)prefixes->allocate(sizeof(PrefixNode));
+			nodes = (PrefixNode*)prefixes->base();
+			added->c = prefix[i];
+			added->child = added->handlers = core::HashTable::kInvalidValue;
+			added->sibling = nodes[node].child;
+			nodes[node].child = child;
+		}
+		node = child;
+	}
+	return (PrefixNode*)prefixes->base() + node;
+}
+
+void Service::route(MessageType messageType,uint32_t handler) {
+	auto length = strlen(messageType.name);
+	if(length && messageType.name[length - 1] == '*') {
+		auto node = prefixNode(messagePrefixes,messageType.name,length - 1);
+		if(node->handlers == core::HashTable::kInvalidValue) 
+			node->handlers = handler;
+		else appendHandler(messageHandlers,node->handlers,handler);
+	} else {
+		auto first = messageTypeMapping->find(messageType.name,
+			messageType.hash);
+		if(first == core::HashTable::kInvalidValue) {
+			messageTypeMapping->insert(messageType.name,messageType.hash,
+				handler);
+		} else appendHandler(messageHandlers,first,handler);
+	}
+	if(dispatchTable) freezeHandlers();
 }
 
-void Service::connect(const char *messageType, 
+void Service::connect(MessageType messageType, 
 	void (*function)()) 
 {
-	safeInsert(messageTypeMapping,messageType);
-	auto f = (BindingDispatchFunction*)
-		messageHandlers->allocate(sizeof(BindingDispatchFunction));
-	auto args = (FunctionCallback*)
-		messageHandlers->allocate(sizeof(FunctionCallback));
-	*f = &dispatchFunction;
-	args->function = function;
+	FunctionCallback callback = { function };
+	methodConnect(messageType,&dispatchFunction,&callback,sizeof(callback));
 }
-void Service::connect(const char *messageType, 
+void Service::connect(MessageType messageType, 
 	void (*function)(void *userData), void *data) 
 {
-	safeInsert(messageTypeMapping,messageType);
-	auto f = (BindingDispatchFunction*)
-		messageHandlers->allocate(sizeof(BindingDispatchFunction));
-	auto args = (FunctionDataCallback*)
-		messageHandlers->allocate(sizeof(FunctionDataCallback));
-	*f = &dispatchFunctionData;
-	args->function = function;
-	args->data = data;
+	FunctionDataCallback callback = { function, data };
+	methodConnect(messageType,&dispatchFunctionData,&callback,
+		sizeof(callback));
 }
-void Service::connect(const char *messageType, 
+void Service::connect(MessageType messageType, 
 	void (*function)(const Message &message))
 {
-	safeInsert(messageTypeMapping,messageType);
-	auto f = (BindingDispatchFunction*)
-		messageHandlers->allocate(sizeof(BindingDispatchFunction));
-	auto args = (FunctionMsgCallback*)
-		messageHandlers->allocate(sizeof(FunctionMsgCallback));
-	*f = &dispatchFunctionMsg;
-	args->function = function;	
+	FunctionMsgCallback callback = { function };
+	methodConnect(messageType,&dispatchFunctionMsg,&callback,
+		sizeof(callback));
 }
-void Service::connect(const char *messageType, 
+void Service::connect(MessageType messageType, 
 	void (*function)(void *userData, const Message &message), void *data)
 {
-	safeInsert(messageTypeMapping,messageType);
-	auto f = (BindingDispatchFunction*)
-		messageHandlers->allocate(sizeof(BindingDispatchFunction));
-	auto args = (FunctionDataMsgCallback*)
-		messageHandlers->allocate(sizeof(FunctionDataMsgCallback));
-	*f = &dispatchFunctionDataMsg;
-	args->function = function;
-	args->data = data;	
+	FunctionDataMsgCallback callback = { function, data };
+	methodConnect(messageType,&dispatchFunctionDataMsg,&callback,
+		sizeof(callback));
+}
+void Service::methodConnect(MessageType messageType,
+	void (*dispatch)(const void *,const Message &),
+	const void *callback,size_t callbackSize) 
+{
+	auto offset = handlerOffset(messageHandlers);
+	auto record = (HandlerRecord*)
+		messageHandlers->allocate(sizeof(HandlerRecord));
+	record->function = dispatch;
+	record->next = core::HashTable::kInvalidValue;
+	record->isRequest = 0;
+	// Keep the next record aligned.
+	auto args = messageHandlers->allocate((callbackSize + 7) & ~size_t(7));
+	memcpy(args,callback,callbackSize);
+	route(messageType,offset);
 }
-void Service::methodConnect(void (*dispatch)(const void *,const Message &),
+void Service::requestConnect(MessageType messageType,
+	void (*dispatch)(const void *,const Request &,const Message &),
 	const void *callback,size_t callbackSize) 
 {
-	auto f = (BindingDispatchFunction*)
-		messageHandlers->allocate(sizeof(BindingDispatchFunction));
-	auto args = messageHandlers->allocate(callbackSize);
-	*f = dispatch;
+	auto offset = handlerOffset(messageHandlers);
+	auto record = (HandlerRecord*)
+		messageHandlers->allocate(sizeof(HandlerRecord));
+	record->requestFunction = dispatch;
+	record->next = core::HashTable::kInvalidValue;
+	record->isRequest = 1;
+	auto args = messageHandlers->allocate((callbackSize + 7) & ~size_t(7));
 	memcpy(args,callback,callbackSize);
+	route(messageType,offset);
+}
+
+struct FunctionRequestCallback {
+	void (*function)(void *,const Service::Request &,const Message &);
+	void *data;
+};
+static void dispatchFunctionRequest(const void *data,
+	const Service::Request &request,const Message &msg) 
+{
+	auto self = ((const FunctionRequestCallback*)data);
+	self->function (self->data,request,msg);
+}
+void Service::connectRequest(MessageType method,
+	void (*handler)(void *userData,const Request &request,
+	const Message &message),void *data)
+{
+	FunctionRequestCallback callback = { handler, data };
+	requestConnect(method,&dispatchFunctionRequest,&callback,
+		sizeof(callback));
+}
+
+/**
+ * Registers a pending request, returns false when the handler shouldn't
+ * be called because too many requests are pending.
+ */
+bool Service::beginRequest(const Message &message,uint32_t client,
+	Request &request)
+{
+	request.id = 0;
+	request.client = client;
+	for(size_t i = 0;i < message.fieldCount();++i) {
+		auto &field = message.fields()[i];
+		if(field.isInteger() && !strcmp(field.name(),"requestId")) {
+			request.id = uint32_t(field.asInteger());
+			break;
+		}
+	}
+	if(!request.id) return true;
+	
+	while(requestLock.test_and_set(std::memory_order_acquire)) ;
+	auto accepted = pendingRequestCount < kMaxPendingRequests;
+	if(accepted) {
+		auto &pending = pendingRequests[pendingRequestCount++];
+		pending.id = request.id;
+		pending.client = client;
+		pending.deadline = requestTimeout? 
+			transport->clock() + requestTimeout : 0;
+	} else {
+		// The request isn't pending, so respond would drop the error.
+		core::Buffer json;
+		json.put("{\"type\":\"rpc.error\",\"requestId\":");
+		json.fmt("%u",unsigned(request.id));
+		json.put(",\"error\":\"Too many pending requests\"}");
+		queueResponse(client,json,nullptr,0,Message::High);
+	}
+	requestLock.clear(std::memory_order_release);
+	return accepted;
+}
+
+bool Service::respond(const Request &request,const Message &response,
+	const void *data,size_t dataSize)
+{
+	if(!request.id) return false;
+	core::Buffer json;
+	json.put("{\"type\":\"");
+	json.putEscaped(response.name);
+	json.put("\",\"requestId\":");
+	json.fmt("%u",unsigned(request.id));
+	encodeFields(json,response,dataSize);
+	
+	// Remove the request from the pending requests.
+	while(requestLock.test_and_set(std::memory_order_acquire)) ;
+	auto pending = false;
+	for(size_t i = 0;i < pendingRequestCount;++i) {
+		if(pendingRequests[i].id == request.id && 
+			pendingRequests[i].client == request.client) 
+		{
+			pendingRequests[i] = pendingRequests[--pendingRequestCount];
+			pending = true;
+			break;
+		}
+	}
+	if(pending) {
+		queueResponse(request.client,json,data,dataSize,
+			response.priorityClass,&response);
+	}
+	requestLock.clear(std::memory_order_release);
+	return pending;
+}
+bool Service::fail(const Request &request,const char *error) {
+	return respond(request,Message("rpc.error",
+		Message::Field("error",error)).setPriority(Message::High));
+}
+
+/** 
+ * Queues a message for a single client, the requestLock must be held.
+ * The record is the client id, the priority and the size followed by
+ * the message in the network format.
+ */
+void Service::queueResponse(uint32_t client,core::Buffer &json,
+	const void *data,size_t dataSize,Message::Priority priority,
+	const Message *binaryFields)
+{
+	auto binarySize = binaryFields? binaryFieldsSize(*binaryFields) : 0;
+	auto size = 2 + json.length() + dataSize + binarySize;
+	assert(json.length() <= 0xFFFF);
+	auto dest = queueRecord(client,priority,size);
+	dest[0] = uint8_t(json.length() & 0xFF);
+	dest[1] = uint8_t(json.length() >> 8);
+	memcpy(dest + 2,json.base(),json.length());
+	if(dataSize) memcpy(dest + 2 + json.length(),data,dataSize);
+	if(binarySize) {
+		putBinaryFields((char*)dest + 2 + json.length() + dataSize,
+			*binaryFields);
+	}
+}
+
+/** 
+ * Allocates a record for the messages of a single client, the 
+ * requestLock must be held. Returns the space for the messages.
+ */
+uint8_t *Service::queueRecord(uint32_t client,Message::Priority priority,
+	size_t size)
+{
+	auto record = (uint32_t*)responses->allocate(
+		(3*sizeof(uint32_t) + size + 3) & ~size_t(3));
+	record[0] = client;
+	record[1] = uint32_t(priority);
+	record[2] = uint32_t(size);
+	return (uint8_t*)(record + 3);
+}
+
+void Service::sendTo(uint32_t client,const Message &message,
+	const void *data,size_t dataSize)
+{
+	if(!active_) return;
+	core::Buffer json;
+	json.put("{\"type\":\"");
+	json.putEscaped(message.name);
+	json.put('"');
+	encodeFields(json,message,dataSize);
+	while(requestLock.test_and_set(std::memory_order_acquire)) ;
+	queueResponse(client,json,data,dataSize,message.priorityClass,&message);
+	requestLock.clear(std::memory_order_release);
+}
+void Service::sendEncodedTo(uint32_t client,const void *messages,
+	size_t size)
+{
+	if(!active_ || !size) return;
+	while(requestLock.test_and_set(std::memory_order_acquire)) ;
+	memcpy(queueRecord(client,Message::Normal,size),messages,size);
+	requestLock.clear(std::memory_order_release);
+}
+
+/** 
+ * Fails the requests which have timed out, and writes the queued 
+ * responses to their clients.
+ */
+void Service::updateRequests(uint64_t time) {
+	while(requestLock.test_and_set(std::memory_order_acquire)) ;
+	for(size_t i = 0;i < pendingRequestCount;) {
+		auto pending = pendingRequests[i];
+		if(!pending.deadline || time < pending.deadline) {
+			++i;
+			continue;
+		}
+		pendingRequests[i] = pendingRequests[--pendingRequestCount];
+		core::Buffer json;
+		json.put("{\"type\":\"rpc.error\",\"requestId\":");
+		json.fmt("%u",unsigned(pending.id));
+		json.put(",\"error\":\"The request has timed out\"}");
+		queueResponse(pending.client,json,nullptr,0,Message::High);
+	}
+	
+	auto begin = (const uint8_t*)responses->base();
+	for(auto end = begin + responses->size();begin < end;) {
+		auto record = (const uint32_t*)begin;
+		auto message = (const uint8_t*)(record + 3);
+		size_t size = record[2];
+		for(size_t i = 0;i < activeClientCount;++i) {
+			if(clientIds[i] != record[0]) continue;
+#ifndef GAMEDEVWEBTOOLS_NO_WEBSOCKETS
+			memcpy(wsclients[i].beginWrite(size,
+				Message::Priority(record[1])),message,size);
+#else
+			writeToClient(i,message,size);
+#endif
+		}
+		begin += (3*sizeof(uint32_t) + size + 3) & ~size_t(3);
+	}
+	responses->reset();
+	requestLock.clear(std::memory_order_release);
 }
 
 /* Default handlers */
@@ -20,7 +20,10 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 #include <utility>
+#include <type_traits>
+#include <atomic>
 
 #ifndef GAMEDEVWEBTOOLS_CONSTEXPR
 	#ifdef _MSC_VER
@@ -45,28 +48,490 @@ namespace logging {
 		Critical,
 		Fatal,	
 	};
+	
+	/**
+	 * A token bucket which limits the rate of the logging messages.
+	 * The tokens are refilled by the service at the start of each frame.
+	 */
+	struct TokenBucket {
+		enum { kScale = 1024 }; // One token.
+		
+		/// The number of messages per second, 0 means unlimited.
+		double rate;
+		/// The maximum number of messages which can be sent at once.
+		double burst;
+		
+		// Used by the service.
+		std::atomic<int64_t> tokens;
+		std::atomic<uint32_t> dropped;
+		
+		GAMEDEVWEBTOOLS_CONSTEXPR TokenBucket(double messagesPerSecond = 0.0,
+			double maxBurst = 0.0) : rate(messagesPerSecond),burst(maxBurst),
+			tokens(int64_t(maxBurst*kScale)),dropped(0) {}
+		
+		/** Takes a token, returns false if the message should be dropped */
+		inline bool consume() {
+			if(rate <= 0.0) return true;
+			if(tokens.fetch_sub(kScale,std::memory_order_relaxed) >= kScale)
+				return true;
+			tokens.fetch_add(kScale,std::memory_order_relaxed);
+			dropped.fetch_add(1,std::memory_order_relaxed);
+			return false;
+		}
+	};
+	
+	/**
+	 * A logging category with its own rate limit, e.g.
+	 *   static logging::Category physicsLog("physics",100.0,200.0);
+	 * NB: The category must remain valid while the service is running.
+	 */
+	struct Category {
+		const char *name;
+		TokenBucket limit;
+		
+		// Used by the service.
+		std::atomic<bool> registered;
+		Category *next;
+		
+		GAMEDEVWEBTOOLS_CONSTEXPR Category(const char *categoryName,
+			double messagesPerSecond = 0.0,double maxBurst = 0.0) :
+			name(categoryName),limit(messagesPerSecond,maxBurst),
+			registered(false),next(nullptr) {}
+	};
+	
+	/**
+	 * A static description of a logging call site - the printf style
+	 * format string and the importance level.
+	 * The format is sent to each client only once, and the logging
+	 * calls send only the raw binary arguments, which are then formatted 
+	 * by the web client. This way the application doesn't have to 
+	 * format the logging messages.
+	 * 
+	 * NB: The format must remain valid while the service is running,
+	 * use the GAMEDEVWEBTOOLS_LOG macro to create a static format at
+	 * the call site.
+	 */
+	struct Format {
+		const char *format;
+		Level level;
+		const char *file;
+		int line;
+		Category *category;
+		
+		// Used by the service.
+		std::atomic<uint32_t> id;
+		std::atomic<uint32_t> frameCount;
+		Format *next;
+		
+		GAMEDEVWEBTOOLS_CONSTEXPR Format(const char *fmt,Level lvl,
+			const char *fileName = "",int lineNumber = 0,
+			Category *logCategory = nullptr) :
+			format(fmt),level(lvl),file(fileName),line(lineNumber),
+			category(logCategory),id(0),frameCount(0),next(nullptr) {}
+	};
+	
+	/**
+	 * The binary encoding of the logging arguments.
+	 * Each argument is encoded as a one byte type tag followed by 
+	 * the value in little endian:
+	 *   'b' - bool(1 byte), 'i'/'u' - int32/uint32, 'I'/'U' - int64/uint64,
+	 *   'd' - double, 'p' - pointer(8 bytes),
+	 *   's' - string(2 byte length followed by the characters).
+	 * The strings are truncated when the arguments don't fit into
+	 * kMaxSize bytes.
+	 */
+	class Arguments {
+	public:
+		enum { kMaxSize = 1024 };
+		
+		inline Arguments() : length(0) {}
+		
+		inline void put() {}
+		template<typename T,typename... Rest>
+		inline void put(const T &value,const Rest &... rest) {
+			encode(value);
+			put(rest...);
+		}
+		
+		inline const uint8_t *data() const { return storage; }
+		inline size_t size() const { return length; }
+	private:
+		inline void encode(char tag,const void *value,size_t size) {
+			if(length + 1 + size > kMaxSize) return;
+			storage[length] = uint8_t(tag);
+			memcpy(storage + length + 1,value,size);
+			length += 1 + size;
+		}
+		inline void encode(bool x) { encode('b',&x,1); }
+		inline void encode(char x) { encode(int32_t(x)); }
+		inline void encode(signed char x) { encode(int32_t(x)); }
+		inline void encode(unsigned char x) { encode(uint32_t(x)); }
+		inline void encode(short x) { encode(int32_t(x)); }
+		inline void encode(unsigned short x) { encode(uint32_t(x)); }
+		inline void encode(int x) { 
+			int32_t v = x; encode('i',&v,4); 
+		}
+		inline void encode(unsigned int x) { 
+			uint32_t v = x; encode('u',&v,4); 
+		}
+		inline void encode(long x) { encode((long long)x); }
+		inline void encode(unsigned long x) { 
+			encode((unsigned long long)x); 
+		}
+		inline void encode(long long x) { 
+			int64_t v = x; encode('I',&v,8); 
+		}
+		inline void encode(unsigned long long x) { 
+			uint64_t v = x; encode('U',&v,8); 
+		}
+		inline void encode(float x) { encode(double(x)); }
+		inline void encode(double x) { encode('d',&x,8); }
+		inline void encode(const char *str) {
+			if(!str) str = "(null)";
+			if(length + 3 > kMaxSize) return;
+			auto size = strlen(str);
+			if(size > kMaxSize - length - 3) size = kMaxSize - length - 3;
+			uint16_t l = uint16_t(size);
+			storage[length] = 's';
+			memcpy(storage + length + 1,&l,2);
+			memcpy(storage + length + 3,str,size);
+			length += 3 + size;
+		}
+		inline void encode(char *str) { encode((const char*)str); }
+		template<typename T>
+		inline void encode(T *ptr) { 
+			uint64_t v = uint64_t(uintptr_t(ptr)); encode('p',&v,8); 
+		}
+		
+		size_t length;
+		uint8_t storage[kMaxSize];
+	};
 };
+
+/**
+ * Sends a logging message with a printf style format using the 
+ * deferred formatting(see logging::Format), e.g.
+ *   GAMEDEVWEBTOOLS_LOG(service,logging::Warning,"Low fps: %f",fps);
+ */
+#define GAMEDEVWEBTOOLS_LOG(service,level,format,...) \
+	do { \
+		static ::gamedevwebtools::logging::Format gamedevwebtoolsFormat( \
+			format,level,__FILE__,__LINE__); \
+		(service).log(gamedevwebtoolsFormat, ## __VA_ARGS__); \
+	} while(0)
+
+/**
+ * Sends a logging message which belongs to a logging::Category.
+ */
+#define GAMEDEVWEBTOOLS_LOG_CATEGORY(service,category,level,format,...) \
+	do { \
+		static ::gamedevwebtools::logging::Format gamedevwebtoolsFormat( \
+			format,level,__FILE__,__LINE__,&(category)); \
+		(service).log(gamedevwebtoolsFormat, ## __VA_ARGS__); \
+	} while(0)
 	
 namespace core {
 	
+struct Buffer;
 class HashTable;
 
 namespace memory {
 
 class Arena;
+class Budget;
 
 } }// core::memory
 
+class Service;
+
 namespace network {
 	
 class Server;
 class Listener;
+class TcpTransport;
+
+/**
+ * A connection to a single client.
+ * Both read and write mustn't block.
+ */
+class Connection {
+public:
+	enum { kError = ~size_t(0) };
+	
+	virtual ~Connection() {}
+	/** 
+	 * Writes up to size bytes. Returns the amount of bytes written, 
+	 * which can be less than size, or kError if the connection failed.
+	 */
+	virtual size_t write(const void *data,size_t size) = 0;
+	/** Reads up to size bytes. Returns the amount of bytes read. */
+	virtual size_t read(void *data,size_t size) = 0;
+	/** 
+	 * Returns the amount of the written bytes which weren't delivered 
+	 * to the peer yet, e.g. the socket's send queue, or 0 if unknown.
+	 */
+	virtual size_t queuedBytes() const { return 0; }
+};
+
+/**
+ * The transport which is used by the service to accept the clients.
+ * The default transport uses nonblocking TCP sockets, another transport 
+ * can be given to the service using NetworkOptions::transport.
+ */
+class Transport {
+public:
+	virtual ~Transport() {}
+	/** 
+	 * Starts accepting the connections. Returns 0 on success, or a 
+	 * transport specific error code.
+	 */
+	virtual int listen(int port) = 0;
+	/**
+	 * Returns a new connection, or nullptr if there are no new connections.
+	 * Sets error to true when the transport has failed to accept one.
+	 */
+	virtual Connection *accept(bool &error) = 0;
+	/** Closes a connection which was returned by accept. */
+	virtual void close(Connection *connection) = 0;
+	/** 
+	 * Returns the time in ns which is used for the pings and the request
+	 * timeouts. The default is core::clock.
+	 */
+	virtual uint64_t clock() const;
+};
+
+class MemoryConnection;
+
+/**
+ * An in-process transport for the deterministic tests and benchmarks.
+ * A client is connected by calling connect, which returns the client's 
+ * end of the connection. The time used to simulate the bandwidth and the
+ * latency is advanced explicitly by calling setTime.
+ * NB: The transport must outlive the services which use it. It uses
+ * malloc to allocate the memory, as it isn't owned by a service.
+ */
+class MemoryTransport : public Transport {
+public:
+	struct Options {
+		/// Bytes per second in each direction, 0 is unlimited.
+		double bandwidth;
+		/// The time after which the written bytes can be read in seconds.
+		double latency;
+		/// The maximum amount of bytes accepted by a single write, 
+		/// 0 is unlimited. Used to simulate the partial writes.
+		size_t maxWriteSize;
+		/// The amount of bytes which can be written but not read yet.
+		/// A write that doesn't fit is partial.
+		size_t bufferSize;
+		
+		GAMEDEVWEBTOOLS_CONSTEXPR Options() :
+			bandwidth(0.0),latency(0.0),maxWriteSize(0),
+			bufferSize(4*1024*1024) {}
+	};
+	
+	MemoryTransport(const Options &options = Options());
+	~MemoryTransport();
+	
+	/** 
+	 * Creates a new connection, which is returned by the next accept.
+	 * Returns the client's end, which has to be closed by calling close.
+	 */
+	Connection *connect();
+	/** Sets the current time in seconds. */
+	void setTime(double seconds);
+	
+	int listen(int port);
+	Connection *accept(bool &error);
+	void close(Connection *connection);
+	/** Returns the time which was set by setTime. */
+	uint64_t clock() const;
+	
+private:
+	Options options;
+	double time;
+	MemoryConnection *pending; // The connections which weren't accepted.
+	friend class MemoryConnection;
+};
 
 namespace websocket {
 	
 class Server;
 
 } } // network::websocket
+
+class Snapshot;
+class TypeStatistics;
+class TaskBatch;
+class DeltaEncoder;
+class InboundQueue;
+
+/**
+ * The capture file format.
+ * 
+ * A capture file stores the messages sent by the service so that they
+ * can be replayed to the web client later. It consists of a FileHeader,
+ * followed by a sequence of frames - a FrameHeader followed by the
+ * messages sent during that frame, exactly as they are sent over the
+ * network. When the capture is finished properly, an IndexHeader and
+ * an array of IndexEntry is appended to the file, and the indexOffset 
+ * in the FileHeader is updated to point to the IndexHeader.
+ * 
+ * NB: All the values are stored in little endian.
+ */
+namespace capture {
+	enum {
+		kFileMagic  = 0x54574447, // GDWT
+		kFrameMagic = 0x4D415246, // FRAM
+		kIndexMagic = 0x58444E49, // INDX
+		kFlightRecorderMagic = 0x52464447, // GDFR
+		kVersion = 1
+	};
+	
+	struct FileHeader {
+		uint32_t magic;
+		uint32_t version;
+		/// The offset of the index from the start of the file.
+		/// 0 when the capture wasn't finished properly.
+		uint64_t indexOffset;
+		uint32_t threadCount;
+		uint32_t reserved;
+	};
+	
+	struct FrameHeader {
+		uint32_t magic;
+		uint32_t reserved;
+		uint64_t frameId;
+		/// The frame time passed to frameStart.
+		double   time;
+		/// The size of the messages which follow this header.
+		uint64_t size;
+	};
+	
+	struct IndexHeader {
+		uint32_t magic;
+		uint32_t reserved;
+		/// The number of index entries which follow this header.
+		uint64_t count;
+	};
+	
+	struct IndexEntry {
+		uint64_t frameId;
+		double   time;
+		/// The offset of the FrameHeader from the start of the file.
+		uint64_t offset;
+	};
+	
+	/**
+	 * The flight recorder file - the messages sent by each thread are
+	 * mirrored into a ring buffer in a memory mapped file, so that the 
+	 * last messages survive a crash of the application. The file starts
+	 * with a FlightRecorderHeader, followed by a FlightRecorderRing for
+	 * each thread and the ring data. Each ring consists of records -
+	 * a FlightRecorderRecord followed by the messages.
+	 * The replay server can convert a flight recorder file to a capture.
+	 */
+	class FlightRecorder;
+	
+	enum {
+		/// The record marks the unused space at the end of the ring.
+		kPaddingRecord = 1
+	};
+	
+	struct FlightRecorderHeader {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t threadCount;
+		/// 1 while the application is running, 0 after a clean shutdown.
+		uint32_t running;
+		/// The size of each ring in bytes.
+		uint64_t ringSize;
+		/// The last frame id and time passed to frameStart.
+		uint64_t frameId;
+		double   frameTime;
+	};
+	
+	/** Each ring is placed on its own cache line */
+	struct FlightRecorderRing {
+		/// The offset of the ring data from the start of the file.
+		uint64_t offset;
+		/// The total amount of bytes written to the ring.
+		uint64_t head;
+		/// The position of the oldest record in the ring,
+		/// the records from tail to head are valid.
+		uint64_t tail;
+		/// The number of the records which were larger than half of the
+		/// ring, and weren't recorded.
+		uint64_t dropped;
+		uint64_t reserved[4];
+	};
+	
+	struct FlightRecorderRecord {
+		/// The size of the messages which follow the record.
+		uint32_t size;
+		uint32_t flags;
+		uint64_t frameId;
+		double   time;
+	};
+	
+	/**
+	 * Reads the records of a ring - ring points to the ring's data.
+	 * Returns the record at the position, which starts at the ring's 
+	 * tail, and moves the position past it. Returns nullptr when the 
+	 * head is reached or when the record is corrupted.
+	 */
+	const FlightRecorderRecord *readRecord(const uint8_t *ring,
+		uint64_t ringSize,uint64_t &position,uint64_t head);
+} // capture
+	
+/**
+ * 64 bit integers which are sent as raw binary data, so that the web
+ * client gets all their bits (the JSON numbers are doubles).
+ */
+struct Int64 {
+	int64_t value;
+	GAMEDEVWEBTOOLS_CONSTEXPR explicit Int64(int64_t x) : value(x) {}
+};
+struct Uint64 {
+	uint64_t value;
+	GAMEDEVWEBTOOLS_CONSTEXPR explicit Uint64(uint64_t x) : value(x) {}
+};
+
+/**
+ * An array of values which is sent as raw little endian binary data 
+ * after the message's JSON header, e.g. a float4, a matrix, a histogram
+ * or bone transforms. The supported elements are uint8_t, int32_t, 
+ * uint32_t, float, double, int64_t and uint64_t.
+ * The elements must remain valid until the message is sent.
+ */
+template<typename T>
+struct ArrayView {
+	const T *data;
+	size_t count;
+	
+	GAMEDEVWEBTOOLS_CONSTEXPR ArrayView(const T *elements,size_t n) : 
+		data(elements),count(n) {}
+	template<size_t N>
+	GAMEDEVWEBTOOLS_CONSTEXPR ArrayView(const T (&elements)[N]) : 
+		data(elements),count(N) {}
+};
+
+namespace encoding {
+	/** 
+	 * The types of the binary values, the client gets their names 
+	 * (see binaryTypeName).
+	 */
+	enum BinaryType {
+		b_u8, b_i32, b_u32, b_f32, b_f64, b_i64, b_u64
+	};
+	template<typename T> struct BinaryElement;
+	template<> struct BinaryElement<uint8_t> { enum { type = b_u8 }; };
+	template<> struct BinaryElement<int32_t> { enum { type = b_i32 }; };
+	template<> struct BinaryElement<uint32_t> { enum { type = b_u32 }; };
+	template<> struct BinaryElement<float> { enum { type = b_f32 }; };
+	template<> struct BinaryElement<double> { enum { type = b_f64 }; };
+	template<> struct BinaryElement<int64_t> { enum { type = b_i64 }; };
+	template<> struct BinaryElement<uint64_t> { enum { type = b_u64 }; };
+} // encoding
 	
 /**
  * A message to send to the web client.
@@ -83,6 +548,18 @@ public:
 			double f64;
 			const char *cstr;
 			const void *ptr;
+			int64_t i64;
+			uint64_t u64;
+			/// The elements of an ArrayView.
+			struct Array {
+				const void *data;
+				uint32_t count;
+				uint32_t elementType;
+				
+				GAMEDEVWEBTOOLS_CONSTEXPR Array(const void *elements,
+					uint32_t n,uint32_t type) : 
+					data(elements),count(n),elementType(type) {}
+			} array;
 			
 			GAMEDEVWEBTOOLS_CONSTEXPR Value(bool x) : boolean(x) {}
 			GAMEDEVWEBTOOLS_CONSTEXPR Value(int32_t x) : i32(x) {}
@@ -90,10 +567,15 @@ public:
 			GAMEDEVWEBTOOLS_CONSTEXPR Value(double x) : f64(x) {}
 			GAMEDEVWEBTOOLS_CONSTEXPR Value(const char *str) : cstr(str) {}
 			GAMEDEVWEBTOOLS_CONSTEXPR Value(const void *p) : ptr(p) {}
+			GAMEDEVWEBTOOLS_CONSTEXPR Value(Int64 x) : i64(x.value) {}
+			GAMEDEVWEBTOOLS_CONSTEXPR Value(Uint64 x) : u64(x.value) {}
+			GAMEDEVWEBTOOLS_CONSTEXPR Value(const Array &x) : array(x) {}
 			Value() {}
 		};
+		/// The 64 bit integers and the arrays are sent as binary data.
 		enum Type {
-			t_boolean, t_i32, t_isz, t_f64, t_cstr, t_ptr
+			t_boolean, t_i32, t_isz, t_f64, t_cstr, t_ptr, t_i64, t_u64, 
+			t_array
 		};
 		
 	protected:
@@ -116,6 +598,15 @@ public:
 			id(name),type(t_cstr),value(str) {}
 		GAMEDEVWEBTOOLS_CONSTEXPR Field(const char *name,void *ptr) : 
 			id(name),type(t_ptr),value(ptr) {}
+		GAMEDEVWEBTOOLS_CONSTEXPR Field(const char *name,Int64 x) : 
+			id(name),type(t_i64),value(x) {}
+		GAMEDEVWEBTOOLS_CONSTEXPR Field(const char *name,Uint64 x) : 
+			id(name),type(t_u64),value(x) {}
+		template<typename T>
+		GAMEDEVWEBTOOLS_CONSTEXPR Field(const char *name,
+			const ArrayView<T> &x) : id(name),type(t_array),
+			value(Value::Array(x.data,uint32_t(x.count),
+			encoding::BinaryElement<T>::type)) {}
 			
 		/** 
 		 * The is and as methods are used when recieving the messages.
@@ -148,6 +639,9 @@ public:
 		Field() {}
 		friend class Message;
 		friend class Service;
+		friend class Snapshot;
+		friend class InboundQueue;
+		friend class DeltaEncoder;
 	};
 	
 	Message(const char *type,const Field *fields,size_t count);
@@ -156,17 +650,32 @@ public:
 	Message(const char *type,const Field &a,const Field &b);
 	Message(const char *type,const Field &a,const Field &b,
 		const Field &c);
+	
+	/** 
+	 * The priority class of a message. Each class has its own buffers,
+	 * and when a thread's buffers are full the lower priority messages
+	 * are dropped first (see NetworkOptions::overflowPolicy).
+	 */
+	enum Priority {
+		Low, Normal, High, 
+		kPriorityCount
+	};
 		
 	inline const char *type() const;
 	inline size_t fieldCount() const;
 	inline const Field *fields() const;
+	inline Priority priority() const;
+	/** Sets the priority class, which is Normal by default */
+	inline Message &setPriority(Priority priority);
 
 protected:
 	const char *name;
 	const Field *fieldArray;
 	size_t length;
+	Priority priorityClass;
 	
 	friend class Service;
+	friend class DeltaEncoder;
 private:
 	enum { kMaxInlineFields = 3 };
 	Field inlineStorage[kMaxInlineFields];
@@ -178,6 +687,426 @@ inline const char *Message::type() const { return name; }
 inline size_t Message::fieldCount() const { return length; }
 /** Returns the message's fields */
 inline const Message::Field *Message::fields() const { return fieldArray; }
+/** Returns the message's priority class */
+inline Message::Priority Message::priority() const { return priorityClass; }
+inline Message &Message::setPriority(Priority priority) {
+	priorityClass = priority;
+	return *this;
+}
+
+/**
+ * The type of a received message, which is used to connect a handler. 
+ * The type's hash (FNV-1a) is computed at compile time for the string 
+ * literals, so connecting a handler doesn't have to hash the type.
+ * The name must remain valid while the service is running.
+ */
+class MessageType {
+public:
+	GAMEDEVWEBTOOLS_CONSTEXPR MessageType(const char *name) 
+		: name(name), hash(finish(fnv1a(name,0x811C9DC5u))) {}
+	
+	const char *name;
+	uint32_t hash;
+private:
+	static GAMEDEVWEBTOOLS_CONSTEXPR uint32_t fnv1a(const char *str,
+		uint32_t hash) 
+	{
+		return *str? fnv1a(str + 1,(hash ^ uint8_t(*str))*0x01000193u) : 
+			hash;
+	}
+	/// The hash is never 0 and its MSB is clear, like in core::HashTable.
+	static GAMEDEVWEBTOOLS_CONSTEXPR uint32_t finish(uint32_t hash) {
+		return (hash & 0x7FFFFFFF) | ((hash & 0x7FFFFFFF) == 0? 1 : 0);
+	}
+};
+
+/**
+ * A string with an explicit length, which doesn't have to be zero 
+ * terminated, e.g. a token inside of a larger string.
+ */
+struct StringView {
+	const char *data;
+	size_t length;
+	
+	GAMEDEVWEBTOOLS_CONSTEXPR StringView(const char *str,size_t size) : 
+		data(str),length(size) {}
+	inline StringView(const char *str) : data(str),length(strlen(str)) {}
+};
+
+/** 
+ * A typed field of a message sent by Service::sendFields, which is 
+ * created by field.
+ */
+template<typename T>
+struct TypedField {
+	const char *name;
+	size_t nameLength;
+	T value;
+};
+
+/**
+ * Returns a typed field. The name is a string literal, so its length is
+ * known at compile time. The name isn't escaped, so it must not contain
+ * the characters which have to be escaped in JSON.
+ * The value can be a bool, an integer, a float, a double, a string or
+ * a StringView.
+ */
+template<size_t N,typename T>
+GAMEDEVWEBTOOLS_CONSTEXPR TypedField<T> field(const char (&name)[N],
+	T value) 
+{
+	return TypedField<T>{ name, N - 1, value };
+}
+
+/**
+ * The JSON encoding of the typed fields, which is used by 
+ * Service::sendFields. size returns the upper bound of the encoded size
+ * of a value (the exact size for the strings), and put writes the value
+ * and returns the end of the written value.
+ */
+namespace encoding {
+	enum { kMaxNumberLength = 24, kMaxBinaryFieldLength = 80 };
+	
+	size_t escapedLength(const char *str,size_t length);
+	char *putEscaped(char *dest,const char *str,size_t length);
+	char *putInteger(char *dest,int64_t x);
+	char *putInteger(char *dest,uint64_t x);
+	char *putReal(char *dest,double x);
+	const char *binaryTypeName(BinaryType type);
+	size_t binaryTypeSize(BinaryType type);
+	char *putBinaryField(char *dest,BinaryType type,size_t count,
+		bool scalar,size_t offset);
+	char *putLittleEndian(char *dest,const void *data,size_t count,
+		size_t elementSize);
+	
+	inline size_t size(bool) { return 5; }
+	template<typename T>
+	inline typename std::enable_if<std::is_arithmetic<T>::value,size_t>::type
+		size(T) { return kMaxNumberLength; }
+	inline size_t size(const char *str) { 
+		return 2 + escapedLength(str,strlen(str)); 
+	}
+	inline size_t size(const StringView &str) { 
+		return 2 + escapedLength(str.data,str.length); 
+	}
+	inline size_t size(Int64) { return kMaxBinaryFieldLength; }
+	inline size_t size(Uint64) { return kMaxBinaryFieldLength; }
+	template<typename T>
+	inline size_t size(const ArrayView<T> &) { 
+		return kMaxBinaryFieldLength; 
+	}
+	
+	inline char *put(char *dest,bool x) {
+		auto str = x? "true" : "false";
+		auto length = x? 4 : 5;
+		memcpy(dest,str,length);
+		return dest + length;
+	}
+	template<typename T>
+	inline typename std::enable_if<std::is_integral<T>::value && 
+		std::is_signed<T>::value,char*>::type put(char *dest,T x) { 
+		return putInteger(dest,int64_t(x)); 
+	}
+	template<typename T>
+	inline typename std::enable_if<std::is_integral<T>::value && 
+		!std::is_signed<T>::value,char*>::type put(char *dest,T x) { 
+		return putInteger(dest,uint64_t(x)); 
+	}
+	template<typename T>
+	inline typename std::enable_if<std::is_floating_point<T>::value,
+		char*>::type put(char *dest,T x) { 
+		return putReal(dest,double(x)); 
+	}
+	inline char *put(char *dest,const StringView &str) {
+		*dest = '"';
+		dest = putEscaped(dest + 1,str.data,str.length);
+		*dest = '"';
+		return dest + 1;
+	}
+	inline char *put(char *dest,const char *str) {
+		return put(dest,StringView(str));
+	}
+	
+	/**
+	 * The binary values are written as a descriptor with the type, the
+	 * count and the offset of their data, which follows the JSON header.
+	 * put advances the offset by binarySize, and putBinary writes the
+	 * data after the header.
+	 */
+	template<typename T> 
+	inline size_t binarySize(const T &) { return 0; }
+	inline size_t binarySize(Int64) { return sizeof(int64_t); }
+	inline size_t binarySize(Uint64) { return sizeof(uint64_t); }
+	template<typename T>
+	inline size_t binarySize(const ArrayView<T> &x) { 
+		return x.count*sizeof(T); 
+	}
+	
+	template<typename T>
+	inline char *put(char *dest,const T &value,size_t &) { 
+		return put(dest,value); 
+	}
+	inline char *put(char *dest,Int64,size_t &offset) {
+		dest = putBinaryField(dest,b_i64,1,true,offset);
+		offset += sizeof(int64_t);
+		return dest;
+	}
+	inline char *put(char *dest,Uint64,size_t &offset) {
+		dest = putBinaryField(dest,b_u64,1,true,offset);
+		offset += sizeof(uint64_t);
+		return dest;
+	}
+	template<typename T>
+	inline char *put(char *dest,const ArrayView<T> &x,size_t &offset) {
+		dest = putBinaryField(dest,BinaryType(BinaryElement<T>::type),
+			x.count,false,offset);
+		offset += x.count*sizeof(T);
+		return dest;
+	}
+	
+	template<typename T>
+	inline char *putBinary(char *dest,const T &) { return dest; }
+	inline char *putBinary(char *dest,Int64 x) {
+		return putLittleEndian(dest,&x.value,1,sizeof(int64_t));
+	}
+	inline char *putBinary(char *dest,Uint64 x) {
+		return putLittleEndian(dest,&x.value,1,sizeof(uint64_t));
+	}
+	template<typename T>
+	inline char *putBinary(char *dest,const ArrayView<T> &x) {
+		return putLittleEndian(dest,x.data,x.count,sizeof(T));
+	}
+	
+	template<typename T> struct IsBinary { enum { value = 0 }; };
+	template<> struct IsBinary<Int64> { enum { value = 1 }; };
+	template<> struct IsBinary<Uint64> { enum { value = 1 }; };
+	template<typename T> struct IsBinary<ArrayView<T>> { 
+		enum { value = 1 }; 
+	};
+	template<typename... Types> struct AnyBinary { enum { value = 0 }; };
+	template<typename T,typename... Rest> struct AnyBinary<T,Rest...> {
+		enum { value = IsBinary<T>::value || AnyBinary<Rest...>::value };
+	};
+	
+	inline size_t fieldsSize() { return 0; }
+	template<typename T,typename... Rest>
+	inline size_t fieldsSize(const TypedField<T> &f,const Rest &... rest) {
+		// ,"name":value
+		return 4 + f.nameLength + size(f.value) + fieldsSize(rest...);
+	}
+	inline size_t fieldsBinarySize() { return 0; }
+	template<typename T,typename... Rest>
+	inline size_t fieldsBinarySize(const TypedField<T> &f,
+		const Rest &... rest) 
+	{
+		return binarySize(f.value) + fieldsBinarySize(rest...);
+	}
+	inline char *putFields(char *dest,size_t &) { return dest; }
+	template<typename T,typename... Rest>
+	inline char *putFields(char *dest,size_t &offset,const TypedField<T> &f,
+		const Rest &... rest) 
+	{
+		dest[0] = ',';dest[1] = '"';
+		memcpy(dest + 2,f.name,f.nameLength);
+		dest += 2 + f.nameLength;
+		dest[0] = '"';dest[1] = ':';
+		return putFields(put(dest + 2,f.value,offset),offset,rest...);
+	}
+	inline char *putBinaryFields(char *dest) { return dest; }
+	template<typename T,typename... Rest>
+	inline char *putBinaryFields(char *dest,const TypedField<T> &f,
+		const Rest &... rest) 
+	{
+		return putBinaryFields(putBinary(dest,f.value),rest...);
+	}
+	
+	/**
+	 * The bytes which identify the value of a snapshot's key field. 
+	 * The values are stored like in Message::Field, so that the keys
+	 * match the keys of the messages sent with Service::send.
+	 */
+	struct Key {
+		const void *data;
+		size_t length;
+		union {
+			bool boolean;
+			int32_t i32;
+			size_t isz;
+			double f64;
+			int64_t i64;
+			uint64_t u64;
+		} storage;
+		
+		inline Key() : data(nullptr),length(0) {}
+		inline void set(bool x) { 
+			storage.boolean = x; 
+			data = &storage.boolean;length = sizeof(bool);
+		}
+		template<typename T>
+		inline typename std::enable_if<std::is_integral<T>::value>::type 
+			set(T x) 
+		{
+			if(sizeof(T) <= sizeof(int32_t) && std::is_signed<T>::value) {
+				storage.i32 = int32_t(x);
+				data = &storage.i32;length = sizeof(int32_t);
+			} else {
+				storage.isz = size_t(x);
+				data = &storage.isz;length = sizeof(size_t);
+			}
+		}
+		template<typename T>
+		inline typename std::enable_if<std::is_floating_point<T>::value>::type
+			set(T x) 
+		{
+			storage.f64 = double(x);
+			data = &storage.f64;length = sizeof(double);
+		}
+		inline void set(const StringView &str) { 
+			data = str.data;length = str.length; 
+		}
+		inline void set(const char *str) { set(StringView(str)); }
+		inline void set(Int64 x) {
+			storage.i64 = x.value;
+			data = &storage.i64;length = sizeof(int64_t);
+		}
+		inline void set(Uint64 x) {
+			storage.u64 = x.value;
+			data = &storage.u64;length = sizeof(uint64_t);
+		}
+		/// The arrays can't be the keys.
+		template<typename T>
+		inline void set(const ArrayView<T> &) {}
+	};
+	inline void findKey(Key &,const char *) {}
+	template<typename T,typename... Rest>
+	inline void findKey(Key &key,const char *name,const TypedField<T> &f,
+		const Rest &... rest) 
+	{
+		if(!strcmp(f.name,name)) key.set(f.value);
+		else findKey(key,name,rest...);
+	}
+	
+	inline size_t valuesSize() { return 0; }
+	template<typename T,typename... Rest>
+	inline size_t valuesSize(const T &value,const Rest &... rest) {
+		return size(value) + binarySize(value) + valuesSize(rest...);
+	}
+	inline char *putBinaryValues(char *dest) { return dest; }
+	template<typename T,typename... Rest>
+	inline char *putBinaryValues(char *dest,const T &value,
+		const Rest &... rest) 
+	{
+		return putBinaryValues(putBinary(dest,value),rest...);
+	}
+	size_t encodeTemplate(char *dest,size_t capacity,const char *type,
+		const char *const *names,size_t count,bool binary,
+		uint16_t *offsets);
+} // encoding
+
+/**
+ * A message with a fixed shape. The type, the field names and the 
+ * punctuation are encoded once when the template is created, and 
+ * sending it only writes the values between the precomputed parts, e.g.
+ *   static const MessageTemplate<size_t,double,double> frame(
+ *     "monitoring.frame","id","dt","t");
+ *   service.send(frame,frameId,dt,t);
+ * The field types are the ones supported by field, and the names are
+ * string literals. A template whose encoded type and names don't fit
+ * into kMaxTextLength bytes is invalid, and it isn't sent.
+ */
+template<typename... Types>
+class MessageTemplate {
+public:
+	enum { 
+		kFieldCount = sizeof...(Types), kMaxTextLength = 256,
+		kBinary = encoding::AnyBinary<Types...>::value
+	};
+	
+	template<typename... Names>
+	MessageTemplate(const char *type,const Names &... names);
+	
+	inline const char *type() const { return name; }
+	inline Message::Priority priority() const { return priorityClass; }
+	inline bool isValid() const { return length != 0; }
+	/** Sets the priority class, which is Normal by default */
+	inline MessageTemplate &setPriority(Message::Priority priority) {
+		priorityClass = priority;
+		return *this;
+	}
+	
+	/** 
+	 * Returns the upper bound of the encoded size of the message, 
+	 * including the binary values.
+	 */
+	inline size_t size(const Types &... values) const {
+		return length + encoding::valuesSize(values...) + 
+			(kBinary? encoding::kMaxNumberLength + 1 : 0);
+	}
+	/** 
+	 * Encodes the message and returns the end of the encoded JSON, 
+	 * which is followed by binarySize bytes of the binary values.
+	 */
+	inline char *encode(char *dest,size_t &binarySize,
+		const Types &... values) const 
+	{
+		binarySize = 0;
+		dest = put(dest,0,binarySize,values...);
+		if(!kBinary) return dest;
+		// The template ends with the dataSize.
+		dest = encoding::putInteger(dest,uint64_t(binarySize));
+		*dest++ = '}';
+		encoding::putBinaryValues(dest,values...);
+		return dest;
+	}
+	inline void findKey(encoding::Key &key,const char *keyField,
+		const Types &... values) const 
+	{
+		findKey(key,keyField,0,values...);
+	}
+private:
+	inline char *put(char *dest,size_t i,size_t &) const {
+		memcpy(dest,text + offsets[i],length - offsets[i]);
+		return dest + length - offsets[i];
+	}
+	template<typename T,typename... Rest>
+	inline char *put(char *dest,size_t i,size_t &offset,const T &value,
+		const Rest &... rest) const 
+	{
+		auto size = size_t(offsets[i + 1] - offsets[i]);
+		memcpy(dest,text + offsets[i],size);
+		return put(encoding::put(dest + size,value,offset),i + 1,offset,
+			rest...);
+	}
+	inline void findKey(encoding::Key &,const char *,size_t) const {}
+	template<typename T,typename... Rest>
+	inline void findKey(encoding::Key &key,const char *keyField,size_t i,
+		const T &value,const Rest &... rest) const 
+	{
+		if(!strcmp(names[i + 1],keyField)) key.set(value);
+		else findKey(key,keyField,i + 1,rest...);
+	}
+	
+	const char *name;
+	Message::Priority priorityClass;
+	/// The names are preceded by a null, as there may be no fields.
+	const char *names[kFieldCount + 1];
+	/// The constant parts, the value i goes after the part i.
+	uint16_t offsets[kFieldCount + 1];
+	size_t length;
+	char text[kMaxTextLength];
+};
+
+template<typename... Types>
+template<typename... Names>
+MessageTemplate<Types...>::MessageTemplate(const char *type,
+	const Names &... fieldNames) : name(type),priorityClass(Message::Normal),
+	names{ nullptr, fieldNames... } 
+{
+	static_assert(sizeof...(Names) == kFieldCount,
+		"Each field of a message template needs a name");
+	length = encoding::encodeTemplate(text,sizeof(text),type,names + 1,
+		kFieldCount,kBinary != 0,offsets);
+}
 
 class MessageHandler {
 public:
@@ -194,6 +1123,24 @@ public:
 class Service {
 public:
 	
+	/**
+	 * What happens to a message when the sending thread's buffers are 
+	 * full (see NetworkOptions::threadMessageBufferLimit).
+	 */
+	enum OverflowPolicy {
+		/// The message is dropped.
+		DropNewest,
+		/// The oldest messages of the lowest priority classes up to the
+		/// message's class are dropped to make room for it, the message
+		/// is dropped when that isn't enough.
+		DropOldest,
+		/// The message is written to the capture file instead, so that 
+		/// it's available in the replay. Dropped when not capturing, or
+		/// when it doesn't fit into the thread's spill buffer after the
+		/// warmup (see Service::warmupComplete).
+		SpillToCapture
+	};
+	
 	/**
 	 * Network options for the Server.
 	 */
@@ -219,14 +1166,149 @@ public:
 		/// Default: true
 		bool initializeSystemLibraries;
 		
-		/// The inital size of each sent messages buffer for each thread.
+		/// The inital size of each sent messages buffer for each thread
+		/// and priority class.
 		/// Default: 4 KiB
 		size_t threadMessageBufferInitialSize;
 		
+		/// The maximum amount of the sent messages in bytes which can be
+		/// buffered by each thread, e.g. when update isn't called during 
+		/// a long loading screen. 0 means no limit.
+		/// Default: 0
+		size_t threadMessageBufferLimit;
+		
+		/// What happens to the messages which are sent when the buffers
+		/// are full - either because of the threadMessageBufferLimit, or
+		/// because they can't grow after the warmup.
+		/// Default: DropNewest
+		OverflowPolicy overflowPolicy;
+		
+		/// The share of a congested connection that each priority class
+		/// gets, indexed by Message::Priority. The queued messages are 
+		/// written to each client using a weighted round robin, so the
+		/// lower classes are slowed down, but never starved.
+		/// Default: { 1, 4, 16 }
+		uint32_t priorityWeights[Message::kPriorityCount];
+		
+		/// Should the messages of all the threads be written to the 
+		/// clients in the order in which they were sent? Each message is
+		/// stamped with a sequence number by send, and update merges the
+		/// threads' buffers of each priority class, so the clients don't
+		/// have to sort the messages from the different threads. The 
+		/// higher priority classes are still written first.
+		/// Default: false
+		bool orderedThreadMessages;
+		
+		/// The name of the flight recorder file. When it's set, the
+		/// messages sent by each thread are also mirrored into a 
+		/// memory mapped file, which can be recovered after a crash.
+		/// Default: nullptr
+		const char *flightRecorderFile;
+		
+		/// The size of the flight recorder ring for each thread.
+		/// Default: 1 MiB
+		size_t flightRecorderThreadSize;
+		
+		/// The transport used to accept the clients. The service 
+		/// doesn't take the ownership of the transport.
+		/// Default: nullptr - the TCP sockets.
+		network::Transport *transport;
+		
+		/// The maximum number of the last values (see snapshotLastValue)
+		/// which are sent to a new client, e.g. 1024. 0 disables the 
+		/// last values, as the snapshot costs a lookup in each send.
+		/// Default: 0
+		size_t lateJoinerMaxValues;
+		
+		/// The amount of the recent messages (see snapshotHistory) 
+		/// which are sent to a new client, e.g. 64 KiB. 0 disables the
+		/// history.
+		/// Default: 0
+		size_t lateJoinerHistorySize;
+		
+		/// Should the service measure its own cost? The time spent in
+		/// send and update, the amount of the sent messages and bytes,
+		/// the queued bytes, the dropped messages and the buffer grow 
+		/// events are reported to the client each frame.
+		/// Default: false
+		bool selfProfiling;
+		
+		/// Should the service count the sent messages for each message
+		/// type? The totals are reported to the client once a second
+		/// and can be queried with messageStatistics.
+		/// Default: false
+		bool messageStatistics;
+		
+		/// The memory budget - a block of memory supplied by the 
+		/// application, which must remain valid while the service is 
+		/// running. When it's set the service allocates from it 
+		/// instead of onMalloc, and falls back to onMalloc only when
+		/// the budget is exhausted.
+		/// Default: nullptr
+		void *memoryBudget;
+		size_t memoryBudgetSize;
+		
+		/// Should the service assert when it allocates from onMalloc
+		/// after warmupComplete was called?
+		/// Default: false
+		bool assertOnAllocation;
+		
+		/// How often the clients are pinged to measure the round trip
+		/// time in seconds. 0 disables the pings.
+		/// Default: 1
+		double pingInterval;
+		
+		/// A client which hasn't sent anything for this many seconds is
+		/// disconnected, when the pings are enabled. 0 disables it.
+		/// Default: 30
+		double pingTimeout;
+		
+		/// The lag in seconds after which a client is considered to be
+		/// falling behind - the message types given to sampleAdaptively
+		/// are then sent to it less often. The lag is estimated from the
+		/// round trip time, the queued bytes and the client's throughput,
+		/// and it's checked with each ping. 0 disables the sampling.
+		/// Default: 1
+		double maxClientLag;
+		
+		/// The size of the inbound message queue in bytes. When it's
+		/// set the received messages are parsed by update and queued,
+		/// and the handlers are called by dispatchMessages on the 
+		/// thread which calls it. 0 calls the handlers from update.
+		/// Default: 0
+		size_t inboundQueueSize;
+		
+		/// The time in seconds in which a request has to be answered 
+		/// (see connectRequest), the client gets an rpc.error message
+		/// afterwards. 0 disables the timeout.
+		/// Default: 10
+		double requestTimeout;
+		
+		/// How often the delta encoded messages (see encodeDeltas) are 
+		/// sent in full in frames, so that the clients which have missed
+		/// a message can resync. 0 sends the keyframes only when a new
+		/// client connects.
+		/// Default: 60
+		uint32_t deltaKeyframeInterval;
+		
 		GAMEDEVWEBTOOLS_CONSTEXPR NetworkOptions() :
 			maxConnectedClients(8),port(8080),blockUntilFirstClient(false),
 			ipv6(false),initializeSystemLibraries(true),
-			threadMessageBufferInitialSize(4096) {}
+			threadMessageBufferInitialSize(4096),
+			threadMessageBufferLimit(0),overflowPolicy(DropNewest),
+			priorityWeights{ 1, 4, 16 },orderedThreadMessages(false),
+			flightRecorderFile(nullptr),
+			flightRecorderThreadSize(1024*1024),
+			transport(nullptr),
+			lateJoinerMaxValues(0),
+			lateJoinerHistorySize(0),
+			selfProfiling(false),
+			messageStatistics(false),
+			memoryBudget(nullptr),memoryBudgetSize(0),
+			assertOnAllocation(false),
+			pingInterval(1.0),pingTimeout(30.0),maxClientLag(1.0),
+			inboundQueueSize(0),requestTimeout(10.0),
+			deltaKeyframeInterval(60) {}
 	};
 	
 	/**
@@ -288,8 +1370,112 @@ public:
 	virtual void *onMalloc(size_t size);
 	virtual void onFree(void *ptr);
 	
+	/**
+	 * Marks the end of the warmup, after which the service shouldn't 
+	 * allocate any memory. The thread message buffers can't grow
+	 * beyond their current capacity any more - the messages which don't 
+	 * fit are dropped - and the buffers of the disconnected clients are
+	 * reused for the new clients. The service reports each allocation 
+	 * from onMalloc after the warmup using onError once a frame, or 
+	 * asserts when NetworkOptions::assertOnAllocation is set.
+	 * 
+	 * NB: Thread Safety: Must be called when no messages are sent, e.g.
+	 * just before frameStart.
+	 */
+	void warmupComplete();
+	/** Returns the number of the allocations from onMalloc after the warmup */
+	inline size_t allocationsAfterWarmup() const;
+	/** Returns the number of the messages dropped by the full buffers */
+	inline size_t overflowedMessages() const;
+	
 	/** Returns the number of clients connected ATM */
 	inline size_t connectedClients() const;
+	/** 
+	 * Returns the id of the client with the given index, which must be
+	 * less than connectedClients. The ids aren't reused, so a client 
+	 * which has reconnected gets a new id.
+	 * NB: Thread Safety: Must not be called while update is running.
+	 */
+	inline uint32_t clientId(size_t index) const;
+	
+	/** 
+	 * Returns the amount of bytes which were sent by the application, 
+	 * but weren't written to the clients yet.
+	 * NB: Thread Safety: Must not be called while messages are sent.
+	 */
+	size_t queuedBytes() const;
+	
+	/**
+	 * The totals for a single message type.
+	 */
+	struct MessageStatistics {
+		const char *type;
+		uint64_t messages;
+		uint64_t headerBytes; ///< The JSON headers and the length prefixes.
+		uint64_t dataBytes;   ///< The binary data.
+		double encodeTime;    ///< The time spent encoding in seconds.
+	};
+	
+	/**
+	 * Returns the number of the message types which were sent since
+	 * the start or the last reset, and copies the totals for up to 
+	 * max of them into the given array. Requires the messageStatistics
+	 * network option.
+	 * The counters are keyed by the address of the message type 
+	 * string, so the type strings must remain valid while the service
+	 * is running. When a thread sends too many distinct types the 
+	 * remaining ones are counted as the type 'other'.
+	 * 
+	 * NB: Thread Safety: The totals are updated by frameStart, so these
+	 * must be called from the thread which calls frameStart.
+	 */
+	size_t messageStatistics(MessageStatistics *statistics,
+		size_t max) const;
+	/** Returns false when the message type wasn't sent. */
+	bool messageStatistics(const char *messageType,
+		MessageStatistics &statistics) const;
+	void resetMessageStatistics();
+	
+	/**
+	 * Samples the messages of the given type adaptively - when a client
+	 * falls behind (see NetworkOptions::maxClientLag), they are sent to 
+	 * it only every 2nd, 4th, ... frame, and the full detail is restored
+	 * when it catches up. The other clients aren't affected.
+	 * By default profiling.task, profiling.tasks, profiling.timer and 
+	 * monitoring.service are sampled. The message type string must remain valid while the 
+	 * service is running.
+	 * NB: Thread Safety: Must be called after init, before update.
+	 */
+	void sampleAdaptively(const char *messageType);
+	
+	/**
+	 * The connection to a single client. The times are in seconds.
+	 * 
+	 * The clock offset is estimated like in NTP - the client answers the
+	 * network.ping messages with its receive and send times, and the 
+	 * offset of the sample with the lowest delay among the recent ones 
+	 * is used. The server's clock is the frame time passed to 
+	 * frameStart, so a t field maps to t + clockOffset on the client's 
+	 * clock. The client is told its offset by the network.clock message.
+	 */
+	struct ClientStatistics {
+		double rtt;        ///< The smoothed round trip time, 0 if unknown.
+		double rttMin;
+		double rttMax;
+		double rttDeviation; ///< The smoothed mean deviation (jitter).
+		double clockOffset;  ///< The client's clock minus the server's.
+		double clockDelay;   ///< The round trip delay of the offset's sample.
+		size_t clockSamples; ///< 0 when the offset isn't known.
+		double throughput; ///< The bytes written per second.
+		size_t queuedBytes;
+		/// The adaptively sampled messages are sent every nth frame.
+		uint32_t samplingInterval;
+	};
+	/** 
+	 * Returns false when there isn't a client with the given index.
+	 * NB: Thread Safety: Must not be called while update is running.
+	 */
+	bool clientStatistics(size_t client,ClientStatistics &statistics) const;
 	
 	/** 
 	 * Gathers the messages from the threads.
@@ -316,6 +1502,21 @@ public:
 	 */
 	void update();
 	
+	/**
+	 * Calls the handlers of the messages which were received by update,
+	 * when the inbound queue is used (see NetworkOptions::inboundQueueSize).
+	 * The application can call it at a point where its state can be
+	 * modified, e.g. at the start of the simulation. The dispatch stops 
+	 * once the time budget in seconds is spent, the remaining messages
+	 * stay queued until the next call. 0 dispatches all the messages.
+	 * Returns the number of the dispatched messages.
+	 * 
+	 * The service's own messages (network.*) are still handled by update.
+	 * NB: Thread Safety: Can be called from one thread at a time, 
+	 *   concurrently with update.
+	 */
+	size_t dispatchMessages(double timeBudget = 0.0);
+	
 	/**
 	 * Sends a message.
 	 * NB: Thread Safety: Can be called from any thread.
@@ -327,12 +1528,174 @@ public:
 	void send(const Message &message,const void *data,const size_t
 		dataSize);
 	
+	/**
+	 * Sends a message with the typed fields, e.g.
+	 *   service.sendFields("frame",field("id",frameId),field("dt",dt));
+	 * The fields are encoded straight into the thread's message buffer,
+	 * so there's no limit on the amount of fields and the strings aren't
+	 * truncated, only the JSON header has to fit into 64 KiB.
+	 * NB: Thread Safety: Can be called from any thread.
+	 */
+	template<typename... Fields>
+	void sendFields(const char *type,const Fields &... fields);
+	template<typename... Fields>
+	void sendFields(Message::Priority priority,const char *type,
+		const void *data,size_t dataSize,const Fields &... fields);
+	
+	/**
+	 * Sends a message with a fixed shape (see MessageTemplate), which 
+	 * only writes the values into the thread's message buffer.
+	 * NB: Thread Safety: Can be called from any thread.
+	 */
+	template<typename... Types,typename... Values>
+	void send(const MessageTemplate<Types...> &message,
+		const Values &... values);
+	
+	/**
+	 * Sends a block of messages which are already encoded in the 
+	 * network format (e.g. messages which were read from a capture file).
+	 * NB: Thread Safety: Can be called from any thread.
+	 */
+	void sendEncoded(const void *messages,size_t size);
+	
+	/**
+	 * Sends a message only to the client with the given id (see clientId
+	 * and Request::client). The message is written with the responses,
+	 * so it doesn't go to the capture or to the other clients.
+	 * NB: Thread Safety: Can be called from any thread.
+	 */
+	void sendTo(uint32_t client,const Message &message,
+		const void *data = nullptr,size_t dataSize = 0);
+	/**
+	 * Sends a block of messages in the network format only to the client
+	 * with the given id.
+	 * NB: Thread Safety: Can be called from any thread.
+	 */
+	void sendEncodedTo(uint32_t client,const void *messages,size_t size);
+	
+	/**
+	 * Records a profiling task - its name, thread, depth relative to
+	 * the outer task, start time since the frame start and duration in
+	 * seconds. The tasks of a frame are sent at the start of the next 
+	 * frame as a single profiling.tasks message, which has a binary 
+	 * column for each field instead of a message for each task.
+	 * The name must remain valid until the next frameStart.
+	 * NB: Thread Safety: Can be called from any thread.
+	 */
+	void profileTask(const char *name,size_t thread,int32_t depth,
+		double t,double dt);
+	
+	/**
+	 * Sends a logging message using a static format and the given
+	 * arguments, which are formatted by the web client.
+	 * The format is registered and sent to the clients on the first use.
+	 * NB: Thread Safety: Can be called from any thread.
+	 */
+	template<typename... Args>
+	void log(logging::Format &format,const Args &... args);
+	
+	/**
+	 * Limits the number of the deferred logging messages sent from one
+	 * logging call site each frame. The rest of the messages are counted
+	 * and the client is told how many times they were repeated.
+	 * The default is unlimited.
+	 * NB: Thread Safety: Must not be called while logging is taking place.
+	 */
+	void setLogDuplicateLimit(uint32_t messagesPerFrame);
+	
+	/**
+	 * Limits the rate of the deferred logging messages with the given
+	 * level using a token bucket. The number of the dropped messages is
+	 * reported to the client each frame. A rate of 0 removes the limit.
+	 * The rate of the messages in a logging::Category is limited by 
+	 * the category.
+	 * NB: Thread Safety: Must not be called while logging is taking place.
+	 */
+	void setLogRateLimit(logging::Level level,double messagesPerSecond,
+		double burst);
+	
+	/**
+	 * Starts recording all the sent messages into a capture file.
+	 * The capture can be replayed to the web client by the replay
+	 * server located in the folder server/replay.
+	 * Returns false if the capture file couldn't be created.
+	 * 
+	 * NB: Thread Safety: Must not be called while update is running.
+	 */
+	bool startCapture(const char *filename);
+	
+	/** 
+	 * Finishes the capture by writing the capture index and closes
+	 * the capture file.
+	 * NB: Thread Safety: Must not be called while update is running.
+	 */
+	void stopCapture();
+	
+	/** Returns true if the messages are being recorded to a capture file */
+	inline bool isCapturing() const;
+	
+	/**
+	 * A client which connects later receives a snapshot of the state,
+	 * so that it doesn't have to wait until the application sends
+	 * the messages again.
+	 * 
+	 * snapshotLastValue makes the service remember the last message 
+	 * of the given type for each value of the key field, e.g. the last
+	 * monitoring.memory for each name. The keyField can be nullptr to 
+	 * remember just the last message of the given type.
+	 * 
+	 * snapshotHistory makes the service remember the recent messages of
+	 * the given type, e.g. the last logging messages.
+	 * 
+	 * The snapshot is enabled by NetworkOptions::lateJoinerMaxValues 
+	 * and NetworkOptions::lateJoinerHistorySize, otherwise these calls
+	 * have no effect. When it's enabled the service remembers the last
+	 * monitoring.memory, profiling.timer and profiling.result for each
+	 * name, and the recent logging.msg and logging.fmsg messages.
+	 * The message type and the key field strings must remain valid while
+	 * the service is running.
+	 * 
+	 * NB: Thread Safety: Must be called after init, before any messages
+	 * are sent.
+	 */
+	void snapshotLastValue(const char *messageType,const char *keyField);
+	void snapshotHistory(const char *messageType);
+	
+	/**
+	 * encodeDeltas makes the service send the messages of the given type
+	 * as the changes from the previous message with the same value of 
+	 * the key field, e.g. the counters of a subsystem which are sent each
+	 * frame. The integer fields are sent as zig-zag varint deltas and the
+	 * unchanged fields are skipped. The keyField can be nullptr when
+	 * there's just one message of this type per frame.
+	 * 
+	 * A message is sent in full as a keyframe when it's the first one
+	 * for its key, when its fields differ from the previous message, 
+	 * when a new client connects and every 
+	 * NetworkOptions::deltaKeyframeInterval frames. A client which has 
+	 * missed a message ignores the deltas for that key until the next 
+	 * keyframe. Only the messages sent with send(Message) without the
+	 * binary data and the array fields are delta encoded.
+	 * The message type and the key field strings must remain valid while
+	 * the service is running.
+	 * 
+	 * NB: Thread Safety: Must be called after init, before any messages
+	 * are sent.
+	 */
+	void encodeDeltas(const char *messageType,const char *keyField);
+	
 
 	/**
 	 * The set of connect methods enable the user to recieve messages
 	 * using custom handlers.
 	 * 
-	 * The application can only connect one handler for each distinct message type.
+	 * Several handlers can be connected to the same message type, they
+	 * are called in the order in which they were connected. A message 
+	 * type which ends with '*' connects the handler to all the types 
+	 * with the given prefix, e.g. 'input.*' receives 'input.keydown'. 
+	 * The handlers of the exact type are called first, followed by the
+	 * prefix handlers from the shortest prefix. The message type string
+	 * must remain valid while the service is running.
 	 * NB:
 	 * Memory considerations:
 	 *   All the strings and the field array owned by the message are
@@ -343,18 +1706,20 @@ public:
 	 *   The connect methods AREN'T thread safe and MUST be called only
 	 *   from one thread.
 	 * 
-	 *   The functions/methods callbacks are called only from inside update.
+	 *   The functions/methods callbacks are called only from inside update,
+	 *   or from inside dispatchMessages when the inbound queue is used
+	 *   (see NetworkOptions::inboundQueueSize).
 	 */
 	/** 
 	 * The following four methods provide a binding between a message type
 	 * and functions. */
-	void connect(const char *messageType, 
+	void connect(MessageType messageType, 
 		void (*function)());
-	void connect(const char *messageType, 
+	void connect(MessageType messageType, 
 		void (*function)(void *userData), void *data);
-	void connect(const char *messageType, 
+	void connect(MessageType messageType, 
 		void (*function)(const Message &message));
-	void connect(const char *messageType, 
+	void connect(MessageType messageType, 
 		void (*function)(void *userData, const Message &message), void *data);
 		
 	/** 
@@ -363,21 +1728,82 @@ public:
 	 * The address of the object must remain constant.
 	 */
 	template<typename T>
-	void connect(const char *messageType, 
+	void connect(MessageType messageType, 
 		T &object, void (T::* method)());
 		
 	template<typename T>
-	void connect(const char *messageType, 
+	void connect(MessageType messageType, 
 		T &object, void (T::* method)(const Message &message));
 		
 	template<typename T>
-	void connect(const char *messageType, 
+	void connect(MessageType messageType, 
 		const T &object, void (T::* method)() const);
 	
 	template<typename T>
-	void connect(const char *messageType, 
+	void connect(MessageType messageType, 
 		const T &object, void (T::* method)(const Message &message) const);
 	
+	/**
+	 * Builds a collision free (perfect hash) dispatch table for the 
+	 * connected message types once all the handlers are connected, so
+	 * that finding the handlers of a received message is a single 
+	 * indexed load and compare. The prefix handlers which match each
+	 * connected type are resolved too. The table is rebuilt when a 
+	 * handler is connected later - when it's connected by a handler,
+	 * after the received message is dispatched. The handlers are found
+	 * with the hash table as before when there's no such table, e.g. 
+	 * when two connected types have the same hash.
+	 * NB: Thread Safety: Must not be called while update or 
+	 *   dispatchMessages is running, except by a handler.
+	 */
+	void freezeHandlers();
+	
+	/**
+	 * A request received from a client. It's a small value, so the 
+	 * handler can keep it and respond in a later frame.
+	 */
+	struct Request {
+		/// The correlation id chosen by the client, 0 when the message
+		/// didn't have a requestId field and no response is expected.
+		uint32_t id;
+		/// The id of the client's connection.
+		uint32_t client;
+	};
+	
+	/**
+	 * Connects a request handler - a handler of the messages with a
+	 * requestId field, to which the client expects a response. 
+	 * The handler, or the application later on, answers the request
+	 * with respond or fail within NetworkOptions::requestTimeout, 
+	 * otherwise the client gets an rpc.error message. When too many
+	 * requests are pending the handler isn't called and the client gets
+	 * an rpc.error message straight away.
+	 * The request handlers are routed like the other handlers (see
+	 * connect).
+	 */
+	template<typename T>
+	void connectRequest(MessageType method,T &object,
+		void (T::* handler)(const Request &request,const Message &message));
+	void connectRequest(MessageType method,
+		void (*handler)(void *userData,const Request &request,
+		const Message &message),void *data);
+	
+	/**
+	 * Sends the response to a request - a message of any type, to which
+	 * the requestId field is added. Only the requesting client gets it.
+	 * Returns false when the request was already answered, or when
+	 * it has timed out.
+	 * NB: Thread Safety: Can be called from any thread.
+	 */
+	bool respond(const Request &request,const Message &response,
+		const void *data = nullptr,size_t dataSize = 0);
+	
+	/**
+	 * Answers the request with an rpc.error message.
+	 * NB: Thread Safety: Can be called from any thread.
+	 */
+	bool fail(const Request &request,const char *error);
+	
 	/**
 	 * A callback for when a new client connects.
 	 * NB: Timing and Thread Safety: Called only from inside update.
@@ -390,46 +1816,341 @@ public:
 	 */
 	virtual void onError(const char *errorString);
 private:
-	void send(const uint8_t *data,size_t size,size_t binaryDataSize,
-		const void *binaryData);
+	/// The space reserved for a message which is encoded in place.
+	struct Reservation {
+		char *json;
+		uint64_t start;
+		bool spilled;
+	};
+	bool beginSend(Reservation &reservation,Message::Priority priority,
+		size_t size);
+	void endSend(const Reservation &reservation,Message::Priority priority,
+		const char *type,size_t jsonSize,const void *data,size_t dataSize,
+		const void *key,size_t keyLength,bool record = true);
+	const char *snapshotKeyField(const char *type) const;
+	bool makeRoom(size_t threadId,Message::Priority priority,size_t size);
+	void overflow(size_t threadId,Message::Priority priority,
+		const void *prefix,size_t prefixSize,const void *data,size_t size,
+		const void *binaryData,size_t binaryDataSize);
+	bool spill(const void *prefix,size_t prefixSize,const void *data,
+		size_t size,const void *binaryData,size_t binaryDataSize);
+	void sendOverflowStatistics();
+	uint32_t acceptLog(logging::Format &format);
+	uint32_t registerFormat(logging::Format &format);
+	/// Sends to all the clients, or writes to the client at that index.
+	void sendFormat(const logging::Format &format,size_t client = ~size_t(0));
+	void sendLog(uint32_t formatId,logging::Level level,
+		const logging::Arguments &arguments);
+	void updateLogLimits(double dt);
+	void sendSnapshot(size_t client);
+	void sendSelfProfile();
+	void sendMessageStatistics();
+	void updateClients(uint64_t time,uint64_t stall);
+	double serverTime(uint64_t time) const;
+	void clockPong(const Message &message);
+	void sendClientStatistics();
+	bool isSampled(const uint8_t *message) const;
+	void writeSampled(size_t client,const uint8_t *begin,
+		const uint8_t *end,Message::Priority priority);
+	void writeToClient(size_t client,const void *data,size_t size);
+	bool flushClient(size_t client);
+	void *allocate(size_t size);
+	void deallocate(void *ptr);
 	size_t parse(char *message,size_t size);
+	void dispatch(const Message &message,uint32_t client);
+	void dispatchHandlers(const Message &message,uint32_t client);
+	bool dispatchChain(uint32_t handlers,const Message &message,
+		uint32_t client);
+	bool beginRequest(const Message &message,uint32_t client,
+		Request &request);
+	static void encodeFields(core::Buffer &dest,const Message &message,
+		size_t dataSize);
+	static char *putBinaryField(char *dest,const Message::Field &field,
+		size_t &offset);
+	static size_t binaryFieldsSize(const Message &message);
+	static char *putBinaryFields(char *dest,const Message &message);
+	void queueResponse(uint32_t client,core::Buffer &json,
+		const void *data,size_t dataSize,Message::Priority priority,
+		const Message *binaryFields = nullptr);
+	uint8_t *queueRecord(uint32_t client,Message::Priority priority,
+		size_t size);
+	void updateRequests(uint64_t time);
+	struct DispatchEntry;
+	bool fillDispatchTable(DispatchEntry *table,uint32_t slots,
+		uint32_t seed);
 	void recieve(uint8_t *data,size_t size);
 	size_t computeMemoryUsage();
+	void writeCapture();
+	struct MessageStamp;
+	MessageStamp *stampMessages(size_t buffer,size_t count);
+	void mergeThreadMessages();
 	
 	bool checkForNewClient();
 	void removeClient(size_t i);
 	
-	void safeInsert(core::HashTable *hash,const char *key);
-	void methodConnect(void (*dispatch)(const void *,const Message &),
+	void route(MessageType messageType,uint32_t handler);
+	void methodConnect(MessageType messageType,
+		void (*dispatch)(const void *,const Message &),
+		const void *callback,size_t callbackSize);
+	void requestConnect(MessageType messageType,
+		void (*dispatch)(const void *,const Request &,const Message &),
 		const void *callback,size_t callbackSize);
 	
 	bool active_;
+	/// The buffers for each thread and priority class.
 	core::memory::Arena *threadMessageBuffers;
 	core::memory::Arena *threadMessageBackBuffers;
 	size_t threadCount;
+	size_t bufferCount;
+	/// The sequence numbers and the sizes of the messages in each buffer,
+	/// when the messages are ordered (see 
+	/// NetworkOptions::orderedThreadMessages).
+	struct MessageStamp {
+		uint64_t sequence;
+		uint64_t size;
+	};
+	core::memory::Arena *threadMessageStamps;
+	core::memory::Arena *threadMessageBackStamps;
+	std::atomic<uint64_t> nextStamp;
+	/// The merged messages of a priority class.
+	core::memory::Arena *orderedMessages;
+	struct MergeHead {
+		const uint8_t *message;
+		const MessageStamp *stamp,*stampEnd;
+	};
+	MergeHead *mergeHeads;
 	core::HashTable *messageTypeMapping;
 	core::memory::Arena *messageHandlers;
+	core::memory::Arena *messagePrefixes;
+	/// The frozen dispatch table - the slot of a type's hash h is 
+	/// ((h ^ dispatchSeed)*0x9E3779B1) >> dispatchShift.
+	DispatchEntry *dispatchTable;
+	uint32_t dispatchSeed;
+	uint32_t dispatchShift;
+	size_t dispatchTableSize; // In bytes, with the prefix lists.
+	/// The dispatch table is in use while a message is dispatched, so
+	/// freezeHandlers is deferred until the dispatch is done.
+	std::atomic<uint32_t> dispatchDepth;
+	bool refreezeHandlers;
+	InboundQueue *inboundQueue;
+	/// The messages dropped by the full inbound queue, reported once 
+	/// per frame.
+	std::atomic<uint32_t> inboundDrops;
 	
-	network::Server *server;
+	network::Transport *transport;
+	bool ownsTransport;
 	size_t clientCount;
 	size_t activeClientCount;
-	network::Listener *clients;
+	size_t pooledClientCount; // The constructed websocket servers.
+	network::Connection **clients;
+	uint32_t *clientIds; // A unique id for each connection.
+	uint32_t nextClientId;
 	network::websocket::Server *wsclients;
+	/// The bytes which the connections haven't accepted yet, when the
+	/// messages are written without the websockets.
+	core::memory::Arena *unwrittenTails;
 	
 	size_t memusage;
 	ApplicationInformation info;
 	bool netInit;
+	
+	uint64_t currentFrameId;
+	double currentFrameTime;
+	double previousFrameTime; // The frame of the back buffers.
+	void *captureFile;
+	uint64_t captureOffset;
+	/// The index keeps room for the frames spilled by the sending threads.
+	enum { kSpillIndexReserve = 256 };
+	core::memory::Arena *captureIndex;
+	capture::FlightRecorder *flightRecorder;
+	Snapshot *snapshot;
+	
+	std::atomic<uint32_t> formatCount;
+	std::atomic<logging::Format*> formats;
+	std::atomic<logging::Category*> categories;
+	uint32_t logDuplicateLimit;
+	logging::TokenBucket logLevelLimits[logging::Fatal + 1];
+	
+	/// Self profiling - the times are in nanoseconds.
+	struct ThreadProfile {
+		uint64_t time;      // The time spent in send.
+		uint64_t first;     // The time of the first send in this frame.
+		uint64_t messages;
+		uint64_t bytes;
+		uint8_t padding[32];// Avoid the false sharing.
+	};
+	struct UpdateProfile {
+		uint64_t start;
+		uint64_t accept,write,read,parse,dispatch;
+		size_t threadId;
+	};
+	bool selfProfiling;
+	ThreadProfile *threadProfiles;
+	UpdateProfile updateProfile;
+	uint64_t frameStartClock;
+	uint32_t droppedCount;
+	std::atomic<uint32_t> growCount;
+	friend class core::memory::Arena;
+	friend class core::HashTable;
+	friend class network::TcpTransport;
+	friend class Snapshot;
+	friend class TypeStatistics;
+	friend class InboundQueue;
+	friend class TaskBatch;
+	friend class DeltaEncoder;
+	
+	/// The profiling tasks of the current frame.
+	TaskBatch *taskBatch;
+	/// The previous values of the delta encoded messages.
+	DeltaEncoder *deltas;
+	
+	TypeStatistics *typeStatistics;
+	double typeStatisticsReportTime;
+	
+	/// Steady state.
+	core::memory::Budget *budget;
+	bool warmedUp;
+	bool assertOnAllocation;
+	std::atomic<size_t> allocationCount;
+	size_t reportedAllocationCount;
+	std::atomic<size_t> overflowCount;
+	
+	/// Overflow - the counters are written only by their thread.
+	struct ThreadOverflow {
+		uint64_t dropped[Message::kPriorityCount];
+		uint64_t droppedBytes;
+		uint64_t spilled;
+		uint8_t padding[24];// Avoid the false sharing.
+	};
+	size_t threadMessageBufferLimit;
+	OverflowPolicy overflowPolicy;
+	uint32_t priorityWeights[Message::kPriorityCount];
+	ThreadOverflow *threadOverflows;
+	/// The spilled messages are encoded here - one for each thread.
+	core::memory::Arena *spillBuffers;
+	std::atomic_flag captureLock;
+	
+	/// The pings and the adaptive sampling.
+	enum { kMaxSampledTypes = 16, kMaxSamplingLevel = 6 };
+	struct SampledType {
+		const char *name;
+		size_t length;
+	};
+	SampledType sampledTypes[kMaxSampledTypes];
+	size_t sampledTypeCount;
+	uint64_t pingInterval; // ns.
+	uint64_t pingTimeout;  // ns.
+	uint64_t nextPing;
+	uint64_t frameClock; // The clock at the last frameStart.
+	size_t receivingClient;
+	double maxClientLag;
+	double clientReportTime;
+	
+	/// The requests - guarded by the requestLock.
+	enum { kMaxPendingRequests = 64 };
+	struct PendingRequest {
+		uint32_t id;
+		uint32_t client;
+		uint64_t deadline; // ns, 0 for none.
+	};
+	PendingRequest pendingRequests[kMaxPendingRequests];
+	size_t pendingRequestCount;
+	uint64_t requestTimeout; // ns.
+	/// The responses which are written to their clients by update.
+	core::memory::Arena *responses;
+	std::atomic_flag requestLock;
 };
 
 inline size_t Service::connectedClients() const { 
 	return activeClientCount; 
 }
+inline uint32_t Service::clientId(size_t index) const {
+	return clientIds[index];
+}
+inline size_t Service::allocationsAfterWarmup() const {
+	return allocationCount.load(std::memory_order_relaxed);
+}
+inline size_t Service::overflowedMessages() const {
+	return overflowCount.load(std::memory_order_relaxed);
+}
+inline bool Service::isCapturing() const {
+	return captureFile != nullptr;
+}
+
+template<typename... Args>
+void Service::log(logging::Format &format,const Args &... args) {
+	if(!active_) return;
+	auto id = acceptLog(format);
+	// Dropped by the limits.
+	if(!id) return;
+	logging::Arguments arguments;
+	arguments.put(args...);
+	sendLog(id,format.level,arguments);
+}
+
+template<typename... Fields>
+void Service::sendFields(const char *type,const Fields &... fields) {
+	sendFields(Message::Normal,type,nullptr,0,fields...);
+}
+template<typename... Fields>
+void Service::sendFields(Message::Priority priority,const char *type,
+	const void *data,size_t dataSize,const Fields &... fields) 
+{
+	if(!active_) return;
+	auto typeLength = strlen(type);
+	// {"type":"<type>"<fields>,"dataSize":<size>}
+	// The binary values follow the binary data.
+	auto binarySize = encoding::fieldsBinarySize(fields...);
+	auto size = 11 + encoding::escapedLength(type,typeLength) + 
+		encoding::fieldsSize(fields...) + 
+		(dataSize || binarySize? 12 + encoding::kMaxNumberLength : 0);
+	Reservation reservation;
+	if(!beginSend(reservation,priority,size + dataSize + binarySize)) 
+		return;
+	
+	auto dest = reservation.json;
+	memcpy(dest,"{\"type\":\"",9);
+	dest = encoding::putEscaped(dest + 9,type,typeLength);
+	*dest++ = '"';
+	auto offset = dataSize;
+	dest = encoding::putFields(dest,offset,fields...);
+	if(offset) {
+		memcpy(dest,",\"dataSize\":",12);
+		dest = encoding::putInteger(dest + 12,uint64_t(offset));
+	}
+	*dest++ = '}';
+	auto jsonSize = size_t(dest - reservation.json);
+	if(dataSize) memcpy(dest,data,dataSize);
+	encoding::putBinaryFields(dest + dataSize,fields...);
+	
+	encoding::Key key;
+	if(auto keyField = snapshotKeyField(type)) 
+		encoding::findKey(key,keyField,fields...);
+	endSend(reservation,priority,type,jsonSize,dest,offset,key.data,
+		key.length);
+}
+
+template<typename... Types,typename... Values>
+void Service::send(const MessageTemplate<Types...> &message,
+	const Values &... values) 
+{
+	if(!active_ || !message.isValid()) return;
+	Reservation reservation;
+	if(!beginSend(reservation,message.priority(),message.size(values...)))
+		return;
+	size_t binarySize;
+	auto end = message.encode(reservation.json,binarySize,values...);
+	encoding::Key key;
+	if(auto keyField = snapshotKeyField(message.type())) 
+		message.findKey(key,keyField,values...);
+	endSend(reservation,message.priority(),message.type(),
+		size_t(end - reservation.json),end,binarySize,key.data,key.length);
+}
 
 template<typename T>
-void Service::connect(const char *messageType, 
+void Service::connect(MessageType messageType, 
 	T &object, void (T::* method)(const Message &message))
 {
-	safeInsert(messageTypeMapping,messageType);
 	struct Wrapper {
 		void (T::* method)(const Message &);
 		T &object;
@@ -441,33 +2162,31 @@ void Service::connect(const char *messageType,
 		}
 	};
 	Wrapper wrapper(object);wrapper.method = method;
-	methodConnect(&Wrapper::dispatch,&wrapper,sizeof(Wrapper));
+	methodConnect(messageType,&Wrapper::dispatch,&wrapper,sizeof(Wrapper));
 }
 
 template<typename T>
-void Service::connect(const char *messageType, 
+void Service::connect(MessageType messageType, 
 	T &object, void (T::* method)())
 {
-	safeInsert(messageTypeMapping,messageType);
 	struct Wrapper {
 		void (T::* method)();
 		T &object;
 		
 		GAMEDEVWEBTOOLS_CONSTEXPR Wrapper(T &obj) : object(obj) {}
-		static void dispatch(const void *data,const Message &msg){
+		static void dispatch(const void *data,const Message &){
 			auto self = (const Wrapper*)data;
 			(self->object.*(self->method))();
 		}
 	};
 	Wrapper wrapper(object);wrapper.method = method;
-	methodConnect(&Wrapper::dispatch,&wrapper,sizeof(Wrapper));
+	methodConnect(messageType,&Wrapper::dispatch,&wrapper,sizeof(Wrapper));
 }
 
 template<typename T>
-void Service::connect(const char *messageType, 
+void Service::connect(MessageType messageType, 
 	const T &object, void (T::* method)(const Message &message) const)
 {
-	safeInsert(messageTypeMapping,messageType);
 	struct Wrapper {
 		void (T::* method)(const Message &) const;
 		const T &object;
@@ -479,26 +2198,45 @@ void Service::connect(const char *messageType,
 		}
 	};
 	Wrapper wrapper(object);wrapper.method = method;
-	methodConnect(&Wrapper::dispatch,&wrapper,sizeof(Wrapper));
+	methodConnect(messageType,&Wrapper::dispatch,&wrapper,sizeof(Wrapper));
 }
 
 template<typename T>
-void Service::connect(const char *messageType, 
+void Service::connect(MessageType messageType, 
 	const T &object, void (T::* method)() const)
 {
-	safeInsert(messageTypeMapping,messageType);
 	struct Wrapper {
 		void (T::* method)() const;
 		const T &object;
 		
 		GAMEDEVWEBTOOLS_CONSTEXPR Wrapper(const T &obj) : object(obj) {}
-		static void dispatch(const void *data,const Message &msg){
+		static void dispatch(const void *data,const Message &){
 			auto self = (const Wrapper*)data;
 			(self->object.*(self->method))();
 		}
 	};
 	Wrapper wrapper(object);wrapper.method = method;
-	methodConnect(&Wrapper::dispatch,&wrapper,sizeof(Wrapper));
+	methodConnect(messageType,&Wrapper::dispatch,&wrapper,sizeof(Wrapper));
+}
+
+template<typename T>
+void Service::connectRequest(MessageType method,T &object,
+	void (T::* handler)(const Request &request,const Message &message))
+{
+	struct Wrapper {
+		void (T::* method)(const Request &,const Message &);
+		T &object;
+		
+		GAMEDEVWEBTOOLS_CONSTEXPR Wrapper(T &obj) : object(obj) {}
+		static void dispatch(const void *data,const Request &request,
+			const Message &msg)
+		{
+			auto self = (const Wrapper*)data;
+			(self->object.*(self->method))(request,msg);
+		}
+	};
+	Wrapper wrapper(object);wrapper.method = handler;
+	requestConnect(method,&Wrapper::dispatch,&wrapper,sizeof(Wrapper));
 }
 
 } // gamedevwebtools.
@@ -0,0 +1,543 @@
+/**
+	The replay server - serves a recorded capture file to the web client
+	using the same protocol as the gamedevwebtools::Service.
+
+	The capture file is memory mapped and the frames are located using
+	the capture index, so the playback starts instantly even for
+	very long captures. If the capture wasn't finished properly
+	(e.g. the application crashed), the frames are located lazily
+	by following the frame headers.
+
+	The replay server can also recover the last frames from a flight 
+	recorder file(see NetworkOptions::flightRecorderFile) into a capture.
+
+	Build instructions:
+	Linux   - cmake is required to build the replay server.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "../gamedevwebtools.h"
+
+#ifndef _WIN32
+	#include <unistd.h>
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+#else
+	#ifndef NOMINMAX
+		#define NOMINMAX
+	#endif
+	#ifndef WIN32_LEAN_AND_MEAN
+		#define WIN32_LEAN_AND_MEAN
+	#endif
+	#include <windows.h>
+#endif
+
+using namespace gamedevwebtools;
+
+/**
+ * A read only memory mapped file.
+ */
+class MappedFile {
+public:
+	MappedFile() : data(nullptr), size(0) {
+#ifdef _WIN32
+		file = INVALID_HANDLE_VALUE;
+		mapping = NULL;
+#endif
+	}
+	~MappedFile() { close(); }
+
+	bool open(const char *filename);
+	void close();
+
+	const uint8_t *data;
+	size_t size;
+private:
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#endif
+};
+
+bool MappedFile::open(const char *filename) {
+#ifndef _WIN32
+	auto fd = ::open(filename,O_RDONLY);
+	if(fd < 0) return false;
+	struct stat st;
+	if(fstat(fd,&st) != 0 || st.st_size == 0) {
+		::close(fd);
+		return false;
+	}
+	size = size_t(st.st_size);
+	auto p = mmap(nullptr,size,PROT_READ,MAP_PRIVATE,fd,0);
+	::close(fd);
+	if(p == MAP_FAILED) return false;
+	// The playback is sequential.
+	madvise(p,size,MADV_SEQUENTIAL);
+	data = (const uint8_t*)p;
+#else
+	file = CreateFileA(filename,GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE,NULL,
+		OPEN_EXISTING,FILE_FLAG_SEQUENTIAL_SCAN,NULL);
+	if(file == INVALID_HANDLE_VALUE) return false;
+	LARGE_INTEGER fileSize;
+	if(!GetFileSizeEx(file,&fileSize) || fileSize.QuadPart == 0) {
+		close();
+		return false;
+	}
+	size = size_t(fileSize.QuadPart);
+	mapping = CreateFileMappingA(file,NULL,PAGE_READONLY,0,0,NULL);
+	if(!mapping) {
+		close();
+		return false;
+	}
+	data = (const uint8_t*)MapViewOfFile(mapping,FILE_MAP_READ,0,0,0);
+	if(!data) {
+		close();
+		return false;
+	}
+#endif
+	return true;
+}
+
+void MappedFile::close() {
+#ifndef _WIN32
+	if(data) munmap((void*)data,size);
+#else
+	if(data) UnmapViewOfFile(data);
+	if(mapping) CloseHandle(mapping);
+	if(file != INVALID_HANDLE_VALUE) CloseHandle(file);
+	mapping = NULL;
+	file = INVALID_HANDLE_VALUE;
+#endif
+	data = nullptr;
+	size = 0;
+}
+
+/**
+ * A memory mapped capture file.
+ */
+class CaptureFile : public MappedFile {
+public:
+	CaptureFile() : index(nullptr), indexCount(0), scanOffset(0),
+		scanFinished(false) {}
+
+	bool open(const char *filename);
+
+	/** Returns the frame header at the index i or nullptr. */
+	const capture::FrameHeader *frame(size_t i);
+	/** Returns the messages which belong to the given frame */
+	const uint8_t *messages(const capture::FrameHeader *frame) const {
+		return (const uint8_t*)(frame + 1);
+	}
+	/** Returns the index of the first frame with id >= frameId */
+	size_t find(uint64_t frameId);
+private:
+	bool scan(size_t i);
+
+	const capture::IndexEntry *index;
+	size_t indexCount;
+
+	// The lazily built index for captures without an index.
+	std::vector<uint64_t> offsets;
+	size_t scanOffset;
+	bool scanFinished;
+};
+
+bool CaptureFile::open(const char *filename) {
+	if(!MappedFile::open(filename)) return false;
+
+	// Verify the header.
+	if(size < sizeof(capture::FileHeader)) return false;
+	auto header = (const capture::FileHeader*)data;
+	if(header->magic != capture::kFileMagic ||
+		header->version != capture::kVersion) return false;
+
+	// Use the index if it's present.
+	auto indexOffset = header->indexOffset;
+	if(indexOffset && indexOffset + sizeof(capture::IndexHeader) <= size) {
+		auto indexHeader = (const capture::IndexHeader*)(data + indexOffset);
+		auto entries = indexOffset + sizeof(capture::IndexHeader);
+		if(indexHeader->magic == capture::kIndexMagic &&
+			indexHeader->count <= (size - entries)/sizeof(capture::IndexEntry)) {
+			index = (const capture::IndexEntry*)(data + entries);
+			indexCount = size_t(indexHeader->count);
+			return true;
+		}
+		printf("The capture index is corrupted, "
+			"the frames will be located by scanning the file.\n");
+	}
+	scanOffset = sizeof(capture::FileHeader);
+	return true;
+}
+
+/** Locates the frames up to and including the frame i */
+bool CaptureFile::scan(size_t i) {
+	while(offsets.size() <= i) {
+		if(scanFinished) return false;
+		auto frame = (const capture::FrameHeader*)(data + scanOffset);
+		if(scanOffset + sizeof(capture::FrameHeader) > size ||
+			frame->magic != capture::kFrameMagic ||
+			frame->size > size - scanOffset - sizeof(capture::FrameHeader)) {
+			// The end of the capture or a truncated frame.
+			scanFinished = true;
+			return false;
+		}
+		offsets.push_back(scanOffset);
+		scanOffset += sizeof(capture::FrameHeader) + size_t(frame->size);
+	}
+	return true;
+}
+
+const capture::FrameHeader *CaptureFile::frame(size_t i) {
+	uint64_t offset;
+	if(index) {
+		if(i >= indexCount) return nullptr;
+		offset = index[i].offset;
+	} else {
+		if(!scan(i)) return nullptr;
+		offset = offsets[i];
+	}
+	auto frame = (const capture::FrameHeader*)(data + offset);
+	if(offset + sizeof(capture::FrameHeader) > size ||
+		frame->magic != capture::kFrameMagic ||
+		frame->size > size - offset - sizeof(capture::FrameHeader))
+		return nullptr;
+	return frame;
+}
+
+size_t CaptureFile::find(uint64_t frameId) {
+	if(index) {
+		size_t begin = 0, end = indexCount;
+		while(begin < end) {
+			auto middle = begin + (end - begin)/2;
+			if(index[middle].frameId < frameId) begin = middle + 1;
+			else end = middle;
+		}
+		return begin;
+	}
+	// Locate the frames until the required frame is found.
+	size_t i = 0;
+	for(auto f = frame(0);f && f->frameId < frameId;f = frame(++i)) ;
+	return i;
+}
+
+/**
+ * The playback of the capture to a single client. Each client has its 
+ * own position, so a client which connects later starts from the 
+ * beginning without disturbing the others.
+ */
+struct Playback {
+	uint32_t client;
+	bool paused;
+	bool step;
+	double speed;
+	size_t position;
+
+	// Playback timing.
+	std::chrono::steady_clock::time_point wallStart;
+	double captureStart;
+};
+
+/**
+ * The replay service - sends the captured frames to the clients.
+ */
+class ReplayService : public Service {
+public:
+	CaptureFile &capture;
+	bool done;
+	bool loop;
+	double speed;
+	size_t startPosition;
+	std::vector<Playback> playbacks;
+
+	ReplayService(CaptureFile &file) : capture(file), done(false),
+		loop(false), speed(1.0), startPosition(0) {}
+
+	/** Moves the playback to the frame i */
+	void seek(Playback &playback,size_t i) {
+		playback.position = i;
+		auto frame = capture.frame(playback.position);
+		playback.captureStart = frame? frame->time : 0.0;
+		playback.wallStart = std::chrono::steady_clock::now();
+		sendTo(playback.client,Message("replay.position",
+			Message::Field("frame",size_t(frame? frame->frameId : 0)),
+			Message::Field("t",playback.captureStart)));
+	}
+	/** Returns true if the frame should be sent according to the speed */
+	bool isDue(const Playback &playback,
+		const capture::FrameHeader *frame) const 
+	{
+		if(playback.speed <= 0.0) return true;
+		std::chrono::duration<double> elapsed =
+			std::chrono::steady_clock::now() - playback.wallStart;
+		return (frame->time - playback.captureStart) <= 
+			elapsed.count()*playback.speed;
+	}
+	/** Returns the playback of the given client or nullptr */
+	Playback *find(uint32_t client) {
+		for(auto &playback : playbacks) {
+			if(playback.client == client) return &playback;
+		}
+		return nullptr;
+	}
+	/** 
+	 * Starts the playbacks of the new clients and removes the playbacks
+	 * of the clients which have disconnected.
+	 */
+	void updatePlaybacks() {
+		for(size_t i = 0;i < playbacks.size();) {
+			size_t j = 0;
+			while(j < connectedClients() && clientId(j) != playbacks[i].client)
+				++j;
+			if(j == connectedClients()) 
+				playbacks.erase(playbacks.begin() + i);
+			else ++i;
+		}
+		for(size_t i = 0;i < connectedClients();++i) {
+			if(find(clientId(i))) continue;
+			Playback playback = { clientId(i), false, false, speed, 0,
+				std::chrono::steady_clock::now(), 0.0 };
+			playbacks.push_back(playback);
+			seek(playbacks.back(),startPosition);
+		}
+	}
+	/** 
+	 * Sends the due frames to the client, up to maxSize bytes. Returns 
+	 * the amount of the sent bytes and the time of the last frame.
+	 */
+	size_t play(Playback &playback,size_t maxSize,double &time) {
+		size_t sent = 0;
+		while((!playback.paused || playback.step) && sent < maxSize) {
+			auto frame = capture.frame(playback.position);
+			if(!frame) {
+				if(loop) seek(playback,startPosition);
+				break;
+			}
+			if(!playback.step && !isDue(playback,frame)) break;
+			sendEncodedTo(playback.client,capture.messages(frame),
+				size_t(frame->size));
+			sent += size_t(frame->size);
+			time = frame->time;
+			playback.position++;
+			if(playback.step) {
+				playback.step = false;
+				break;
+			}
+		}
+		return sent;
+	}
+
+	void onNewClient() override {
+		printf("A new client has connected\n");
+	}
+	void onQuit() {
+		done = true;
+	}
+	void onPause(const Request &request,const Message &) {
+		auto playback = find(request.client);
+		if(!playback) return;
+		playback->paused = !playback->paused;
+		// Continue from the current frame.
+		if(!playback->paused) seek(*playback,playback->position);
+	}
+	void onStep(const Request &request,const Message &) {
+		auto playback = find(request.client);
+		if(playback) playback->step = true;
+	}
+	void onSeek(const Request &request,const Message &message) {
+		auto playback = find(request.client);
+		if(!playback) return;
+		for(size_t i = 0;i < message.fieldCount();++i) {
+			auto &field = message.fields()[i];
+			if(!strcmp(field.name(),"frame") && field.isInteger() &&
+				field.asInteger() >= 0)
+				seek(*playback,capture.find(uint64_t(field.asInteger())));
+		}
+	}
+	void onSpeed(const Request &request,const Message &message) {
+		auto playback = find(request.client);
+		if(!playback) return;
+		for(size_t i = 0;i < message.fieldCount();++i) {
+			auto &field = message.fields()[i];
+			if(!strcmp(field.name(),"speed") && field.isReal()) {
+				playback->speed = field.asReal();
+				seek(*playback,playback->position);
+			}
+		}
+	}
+};
+
+/**
+ * Converts the records from a flight recorder file into a capture file.
+ */
+struct RecoveredRecord {
+	uint64_t frameId;
+	double time;
+	const uint8_t *messages;
+	size_t size;
+};
+
+static bool recover(const char *flightRecorderFile,const char *captureFile) {
+	using namespace capture;
+
+	MappedFile file;
+	if(!file.open(flightRecorderFile)) {
+		printf("Failed to open the flight recorder file '%s'\n",
+			flightRecorderFile);
+		return false;
+	}
+	auto header = (const FlightRecorderHeader*)file.data;
+	if(file.size < sizeof(FlightRecorderHeader) || 
+		header->magic != kFlightRecorderMagic ||
+		header->version != kVersion || header->ringSize == 0) {
+		printf("'%s' isn't a flight recorder file\n",flightRecorderFile);
+		return false;
+	}
+	printf("The application has %s at the frame %llu\n",
+		header->running? "crashed" : "exited",
+		(unsigned long long)header->frameId);
+	
+	// Gather the valid records from all the rings.
+	std::vector<RecoveredRecord> records;
+	auto ringsOffset = (sizeof(FlightRecorderHeader) + 63) & ~size_t(63);
+	auto rings = (const FlightRecorderRing*)(file.data + ringsOffset);
+	auto ringSize = header->ringSize;
+	for(uint32_t i = 0;i < header->threadCount;++i) {
+		auto &ring = rings[i];
+		if(ring.offset + ringSize > file.size) break;
+		auto base = file.data + ring.offset;
+		auto pos = ring.tail;
+		while(auto rec = readRecord(base,ringSize,pos,ring.head)) {
+			RecoveredRecord r = { rec->frameId, rec->time,
+				(const uint8_t*)(rec + 1), rec->size };
+			records.push_back(r);
+		}
+		if(pos < ring.head) 
+			printf("The ring of the thread %u is corrupted\n",unsigned(i));
+		if(ring.dropped) {
+			printf("The thread %u has dropped %llu records which were too "
+				"large for the ring\n",unsigned(i),
+				(unsigned long long)ring.dropped);
+		}
+	}
+	std::stable_sort(records.begin(),records.end(),
+		[](const RecoveredRecord &a,const RecoveredRecord &b) {
+			return a.frameId < b.frameId;
+		});
+	
+	// Write the capture.
+	auto out = fopen(captureFile,"wb");
+	if(!out) {
+		printf("Failed to create the capture file '%s'\n",captureFile);
+		return false;
+	}
+	FileHeader fileHeader = { kFileMagic, kVersion, 0, 
+		header->threadCount, 0 };
+	bool ok = fwrite(&fileHeader,sizeof(fileHeader),1,out) == 1;
+	size_t frames = 0;
+	for(size_t i = 0;ok && i < records.size();) {
+		FrameHeader frame = { kFrameMagic, 0, records[i].frameId,
+			records[i].time, 0 };
+		auto end = i;
+		for(;end < records.size() && records[end].frameId == frame.frameId;
+			++end) frame.size += records[end].size;
+		ok = fwrite(&frame,sizeof(frame),1,out) == 1;
+		for(;ok && i < end;++i)
+			ok = fwrite(records[i].messages,records[i].size,1,out) == 1;
+		++frames;
+	}
+	if(fclose(out) != 0) ok = false;
+	if(!ok) {
+		printf("Failed to write the capture file '%s'\n",captureFile);
+		return false;
+	}
+	printf("Recovered %llu frames into '%s'\n",(unsigned long long)frames,
+		captureFile);
+	return true;
+}
+
+static void usage() {
+	printf("Usage: replay <capture file> [-port N] [-speed X] [-frame N] [-loop]\n"
+		"       replay -recover <flight recorder file> <capture file>\n");
+}
+
+int main(int argc,char **argv) {
+	if(argc < 2) {
+		usage();
+		return 1;
+	}
+	if(!strcmp(argv[1],"-recover")) {
+		if(argc != 4) {
+			usage();
+			return 1;
+		}
+		return recover(argv[2],argv[3])? 0 : 1;
+	}
+	Service::NetworkOptions netOpts;
+	netOpts.blockUntilFirstClient = true;
+	double speed = 1.0;
+	uint64_t startFrame = 0;
+	bool loop = false;
+	for(int i = 2;i < argc;++i) {
+		if(!strcmp(argv[i],"-port") && i + 1 < argc)
+			netOpts.port = atoi(argv[++i]);
+		else if(!strcmp(argv[i],"-speed") && i + 1 < argc)
+			speed = atof(argv[++i]);
+		else if(!strcmp(argv[i],"-frame") && i + 1 < argc)
+			startFrame = strtoull(argv[++i],nullptr,10);
+		else if(!strcmp(argv[i],"-loop"))
+			loop = true;
+		else {
+			usage();
+			return 1;
+		}
+	}
+
+	CaptureFile file;
+	if(!file.open(argv[1])) {
+		printf("Failed to open the capture file '%s'\n",argv[1]);
+		return 1;
+	}
+
+	Service::ApplicationInformation info;
+	info.name = argv[1];
+	ReplayService service(file);
+	service.speed = speed;
+	printf("Waiting for a client to connect on port %d\n",netOpts.port);
+	service.init(info,netOpts);
+
+	service.connect("application.service.quit",service,&ReplayService::onQuit);
+	service.connectRequest("application.service.activate",service,
+		&ReplayService::onPause);
+	service.connectRequest("application.service.step",service,
+		&ReplayService::onStep);
+	service.connectRequest("replay.pause",service,&ReplayService::onPause);
+	service.connectRequest("replay.seek",service,&ReplayService::onSeek);
+	service.connectRequest("replay.speed",service,&ReplayService::onSpeed);
+
+	service.loop = loop;
+	service.startPosition = file.find(startFrame);
+
+	// Limit the amount of data sent to a client in one update when the 
+	// playback is faster than real-time, so that the clients can keep up.
+	const size_t kMaxUpdateSize = 1024*1024*4;
+
+	while(!service.done) {
+		service.updatePlaybacks();
+		size_t sent = 0;
+		double time = 0.0;
+		for(auto &playback : service.playbacks)
+			sent += service.play(playback,kMaxUpdateSize,time);
+		if(sent) service.frameStart(time);
+		service.update();
+		if(!sent) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return 0;
+}
@@ -121,6 +121,7 @@ int main() {
 	service.connect("allocate",service,&SampleService::allocate);
 	service.connect("input.keydown",service,&SampleService::keydown);
 	service.connect("input.keyup",service,&SampleService::keyup);
+	service.freezeHandlers();
 	
 	auto firstT = now();
 	auto lastT = firstT;
@@ -144,10 +145,14 @@ int main() {
 			
 			skippedFrames = false;
 			
-			// Frame timing information.
-			service.send(Message("monitoring.frame",
-				Message::Field("id",frameId),
-				Message::Field("dt",dt),Message::Field("t",frameT)));
+			// Frame timing information - it's sent at the high priority, 
+			// so that the frame times are shown even when the connection
+			// is congested.
+			// The frames have a fixed shape, so the message is encoded 
+			// from a template.
+			static const auto frame = MessageTemplate<size_t,double,double>(
+				"monitoring.frame","id","dt","t").setPriority(Message::High);
+			service.send(frame,frameId,dt,frameT);
 			
 			// Print something to the log
 			if((frameId % 50) == 0) {
@@ -167,21 +172,15 @@ int main() {
 					Message::Field("lvl",logging::Information),
 					Message::Field("msg","")));	
 			}
+			// The deferred logging - the client formats the message.
+			if((frameId % 50) == 25) {
+				GAMEDEVWEBTOOLS_LOG(service,logging::Debug,
+					"Frame %d took %.2f ms",frameId,dt*1000.0);
+			}
 					
 			// Some dummy task profiling times
-			Message::Field fields[] = {
-				Message::Field("thread",0),
-				Message::Field("depth",0),
-				Message::Field("t",0.0),
-				Message::Field("dt",dt),
-				Message::Field("frame",frameId),
-				Message::Field("name","frame")
-			};
-			service.send(Message("profiling.task",fields,sizeof(fields)/sizeof(fields[0])));
-			fields[1] = Message::Field("depth",1);
-			fields[3] = Message::Field("dt",dt*0.5);
-			fields[5] = Message::Field("name","some task");
-			service.send(Message("profiling.task",fields,sizeof(fields)/sizeof(fields[0])));
+			service.profileTask("frame",0,0,0.0,dt);
+			service.profileTask("some task",0,1,0.0,dt*0.5);
 			
 			// Some memory usage information.
 			if(intsPrevMemUsage != ints.memoryUsage()) {
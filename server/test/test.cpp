@@ -3,6 +3,8 @@
 #include <time.h>
 #include <string>
 #include <map>
+#include <vector>
+#include <thread>
 
 #include "../gamedevwebtools.cpp"
 
@@ -42,6 +44,32 @@ int main() {
 		string.reset();
 		string.putEscaped("A \"string\"");
 		assert(!strcmp(string.cString(),"A \\\"string\\\""));
+		string.reset();
+		string.putEscaped("\\\n\x01");
+		assert(!strcmp(string.cString(),"\\\\\\n\\u0001"));
+	}
+	
+	//Logging arguments
+	{
+		using namespace gamedevwebtools::logging;
+		
+		Arguments args;
+		args.put(42,"Hi",2.5,uint64_t(7));
+		assert(args.size() == 5 + 5 + 9 + 9);
+		auto data = args.data();
+		assert(data[0] == 'i' && data[5] == 's' && data[10] == 'd' &&
+			data[19] == 'U');
+		int32_t i;
+		memcpy(&i,data+1,4);
+		assert(i == 42);
+		assert(data[6] == 2 && data[7] == 0 && !memcmp(data+8,"Hi",2));
+		
+		TokenBucket unlimited;
+		assert(unlimited.consume());
+		TokenBucket bucket(10.0,2.0);
+		assert(bucket.consume() && bucket.consume());
+		assert(!bucket.consume());
+		assert(bucket.dropped == 1);
 	}
 	
 	//memory
@@ -168,6 +196,1769 @@ int main() {
 			assert(reference[str] == table.find(str));
 		}
 	}
+	// Memory transport
+	{
+		using namespace gamedevwebtools;
+		
+		network::MemoryTransport::Options transportOptions;
+		transportOptions.latency = 0.5;
+		transportOptions.maxWriteSize = 16;
+		network::MemoryTransport transport(transportOptions);
+		Service service;
+		Service::NetworkOptions options;
+		options.transport = &transport;
+		// The pings follow the transport's time, and would fill the writes.
+		options.pingInterval = 0.0;
+		service.init(Service::ApplicationInformation(),options);
+		
+		auto client = transport.connect();
+		auto request = "GET / HTTP/1.1\r\nUpgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n";
+		for(size_t i = 0;i < strlen(request);)
+			i += client->write(request + i,strlen(request) - i);
+		
+		// The request arrives after the latency.
+		service.update();
+		assert(service.connectedClients() == 1);
+		char response[4096];
+		assert(client->read(response,sizeof(response)) == 0);
+		transport.setTime(0.5);
+		service.update();
+		assert(client->read(response,sizeof(response)) == 0);
+		
+		// The response is written 16 bytes at a time.
+		service.send(Message("test.memory",Message::Field("x",42)));
+		service.frameStart(0.0);
+		size_t size = 0;
+		double time = 0.5;
+		for(int i = 0;i < 64;++i) {
+			transport.setTime(time += 0.5);
+			auto n = client->read(response + size,sizeof(response) - size);
+			// An update can write the end of the control frames and the
+			// start of the queued messages.
+			assert(n <= 2*16);
+			size += n;
+			service.update();
+		}
+		std::string received(response,size);
+		assert(received.find("HTTP/1.1 101") == 0);
+		assert(received.find("s3pPLMBiTxaQ9kYGzzhZRbK+xOo=") != 
+			std::string::npos);
+		assert(received.find("{\"type\":\"test.memory\",\"x\":42}") != 
+			std::string::npos);
+		transport.close(client);
+	}
+	
+	// Self profiling
+	{
+		using namespace gamedevwebtools;
+		
+		network::MemoryTransport transport;
+		Service service;
+		Service::NetworkOptions options;
+		options.transport = &transport;
+		options.selfProfiling = true;
+		service.init(Service::ApplicationInformation(),options);
+		
+		auto client = transport.connect();
+		auto request = "GET / HTTP/1.1\r\nUpgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n";
+		client->write(request,strlen(request));
+		for(int i = 0;i < 3;++i) {
+			service.frameStart(double(i));
+			service.send(Message("test.profile",Message::Field("i",i)));
+			service.update();
+		}
+		char response[16*1024];
+		auto size = client->read(response,sizeof(response));
+		std::string received(response,size);
+		assert(received.find("\"type\":\"monitoring.service\"") !=
+			std::string::npos);
+		assert(received.find("\"type\":\"profiling.tasks\"") !=
+			std::string::npos);
+		assert(received.find("gamedevwebtools.update") != std::string::npos);
+		assert(received.find("gamedevwebtools.send") != std::string::npos);
+		transport.close(client);
+	}
+	
+	// Message statistics
+	{
+		using namespace gamedevwebtools;
+		
+		network::MemoryTransport transport;
+		Service service;
+		Service::NetworkOptions options;
+		options.transport = &transport;
+		options.messageStatistics = true;
+		service.init(Service::ApplicationInformation(),options);
+		
+		uint8_t data[16] = { 0 };
+		for(int i = 0;i < 3;++i)
+			service.send(Message("test.stats",Message::Field("i",i)),
+				data,sizeof(data));
+		service.send(Message("test.other"));
+		Service::MessageStatistics statistics;
+		assert(!service.messageStatistics("test.stats",statistics));
+		service.frameStart(0.0);
+		// The type is found by its name as well as by its address.
+		std::string type("test.stats");
+		assert(service.messageStatistics(type.c_str(),statistics));
+		assert(statistics.messages == 3);
+		assert(statistics.dataBytes == 3*sizeof(data));
+		assert(statistics.headerBytes == 3*(2 + 
+			strlen("{\"type\":\"test.stats\",\"i\":0,\"dataSize\":16}")));
+		Service::MessageStatistics all[8];
+		auto count = service.messageStatistics(all,8);
+		assert(count >= 2);
+		size_t total = 0;
+		for(size_t i = 0;i < count;++i) total += size_t(all[i].messages);
+		assert(total == 4);
+		service.resetMessageStatistics();
+		assert(service.messageStatistics("test.stats",statistics));
+		assert(statistics.messages == 0);
+	}
+	
+	// Steady state
+	{
+		using namespace gamedevwebtools;
+		
+		class CountingService : public Service {
+		public:
+			int allocations,errors;
+			
+			CountingService() : allocations(0), errors(0) {}
+			void *onMalloc(size_t size) override {
+				++allocations;
+				return malloc(size);
+			}
+			void onError(const char *) override { ++errors; }
+		};
+		auto request = "GET / HTTP/1.1\r\nUpgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n";
+		char response[64*1024];
+		
+		// Everything is allocated from the budget.
+		static uint8_t memory[256*1024];
+		network::MemoryTransport transport;
+		{
+			CountingService service;
+			Service::NetworkOptions options;
+			options.transport = &transport;
+			options.memoryBudget = memory;
+			options.memoryBudgetSize = sizeof(memory);
+			service.init(Service::ApplicationInformation(),options);
+			auto client = transport.connect();
+			client->write(request,strlen(request));
+			service.frameStart(0.0);
+			service.update();
+			assert(client->read(response,sizeof(response)) > 0);
+			assert(service.allocations == 0);
+			transport.close(client);
+		}
+		
+		// The full buffers drop the messages after the warmup, and the
+		// new clients reuse the buffers.
+		CountingService service;
+		Service::NetworkOptions options;
+		options.transport = &transport;
+		options.threadMessageBufferInitialSize = 1024;
+		service.init(Service::ApplicationInformation(),options);
+		auto client = transport.connect();
+		client->write(request,strlen(request));
+		for(int i = 0;i < 2;++i) {
+			service.frameStart(0.0);
+			service.send(Message("test.warmup",Message::Field("i",i)));
+			service.update();
+		}
+		service.warmupComplete();
+		service.frameStart(0.0);
+		for(int i = 0;i < 100;++i)
+			service.send(Message("test.overflow",Message::Field("i",i)));
+		assert(service.overflowedMessages() > 0);
+		assert(service.allocationsAfterWarmup() == 0);
+		service.update();
+		transport.close(client);
+		service.frameStart(0.0);
+		service.send(Message("test.disconnect"));
+		service.update();
+		assert(service.connectedClients() == 0);
+		client = transport.connect();
+		client->write(request,strlen(request));
+		for(int i = 0;i < 3;++i) {
+			service.frameStart(0.0);
+			service.send(Message("test.reconnect",Message::Field("i",i)));
+			service.update();
+		}
+		assert(service.connectedClients() == 1);
+		assert(client->read(response,sizeof(response)) > 0);
+		assert(service.allocationsAfterWarmup() == 0);
+		
+		// A large incoming message has to grow the read buffers, which is
+		// reported.
+		std::string frame("\x02\xFE\x40\x00\x00\x00\x00\x00",8);
+		frame.append(0x4000,'\0');
+		client->write(frame.data(),frame.size());
+		service.frameStart(0.0);
+		service.update();
+		assert(service.allocationsAfterWarmup() > 0);
+		auto errors = service.errors;
+		service.frameStart(0.0);
+		assert(service.errors == errors + 1);
+		transport.close(client);
+	}
+	
+	// Overflow policies
+	{
+		using namespace gamedevwebtools;
+		
+		auto request = "GET / HTTP/1.1\r\nUpgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n";
+		network::MemoryTransport transport;
+		
+		// The oldest low priority messages make room for the new ones.
+		{
+			Service service;
+			Service::NetworkOptions options;
+			options.transport = &transport;
+			options.threadMessageBufferLimit = 512;
+			options.overflowPolicy = Service::DropOldest;
+			service.init(Service::ApplicationInformation(),options);
+			service.frameStart(0.0);
+			for(int i = 0;i < 40;++i) {
+				service.send(Message("test.low",Message::Field("i",i))
+					.setPriority(Message::Low));
+			}
+			for(int i = 0;i < 10;++i) {
+				service.send(Message("test.high",Message::Field("i",i))
+					.setPriority(Message::High));
+			}
+			assert(service.queuedBytes() <= 512);
+			assert(service.overflowedMessages() > 0);
+			
+			auto client = transport.connect();
+			client->write(request,strlen(request));
+			for(int i = 0;i < 2;++i) {
+				service.frameStart(0.0);
+				service.update();
+			}
+			static char response[64*1024];
+			auto size = client->read(response,sizeof(response));
+			std::string received(response,size);
+			assert(received.find("\"test.high\",\"i\":0}") != 
+				std::string::npos);
+			assert(received.find("\"test.high\",\"i\":9}") != 
+				std::string::npos);
+			assert(received.find("\"test.low\",\"i\":0}") == 
+				std::string::npos);
+			assert(received.find("\"test.low\",\"i\":39}") != 
+				std::string::npos);
+			assert(received.find("\"type\":\"monitoring.overflow\"") != 
+				std::string::npos);
+			transport.close(client);
+		}
+		
+		// The messages which don't fit are written to the capture.
+		{
+			Service service;
+			Service::NetworkOptions options;
+			options.transport = &transport;
+			options.threadMessageBufferLimit = 256;
+			options.overflowPolicy = Service::SpillToCapture;
+			service.init(Service::ApplicationInformation(),options);
+			auto filename = "gamedevwebtools-test.capture";
+			assert(service.startCapture(filename));
+			service.frameStart(0.0);
+			for(int i = 0;i < 40;++i)
+				service.send(Message("test.spill",Message::Field("i",i)));
+			assert(service.queuedBytes() <= 256);
+			assert(service.overflowedMessages() == 0);
+			// The spilled messages don't allocate after the warmup.
+			service.update();
+			service.warmupComplete();
+			service.frameStart(0.0);
+			for(int i = 40;i < 80;++i)
+				service.send(Message("test.spill",Message::Field("i",i)));
+			assert(service.overflowedMessages() == 0);
+			assert(service.allocationsAfterWarmup() == 0);
+			service.stopCapture();
+			
+			auto file = fopen(filename,"rb");
+			assert(file);
+			static char data[64*1024];
+			auto size = fread(data,1,sizeof(data),file);
+			fclose(file);
+			remove(filename);
+			std::string captured(data,size);
+			assert(captured.find("\"test.spill\",\"i\":39}") != 
+				std::string::npos);
+			assert(captured.find("\"test.spill\",\"i\":79}") != 
+				std::string::npos);
+		}
+	}
+	
+	// Priority classes
+	{
+		using namespace gamedevwebtools;
+		
+		network::MemoryTransport::Options transportOptions;
+		transportOptions.bufferSize = 8*1024;
+		network::MemoryTransport transport(transportOptions);
+		Service service;
+		Service::NetworkOptions options;
+		options.transport = &transport;
+		service.init(Service::ApplicationInformation(),options);
+		
+		auto client = transport.connect();
+		auto request = "GET / HTTP/1.1\r\nUpgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n";
+		client->write(request,strlen(request));
+		service.frameStart(0.0);
+		service.update();
+		
+		// The bulk data is queued, as it doesn't fit into the connection.
+		static uint8_t payload[1024];
+		memset(payload,'x',sizeof(payload));
+		for(int i = 0;i < 200;++i) {
+			service.send(Message("test.bulk",Message::Field("i",i))
+				.setPriority(Message::Low),payload,sizeof(payload));
+		}
+		service.frameStart(1.0);
+		service.update();
+		
+		// The high priority message overtakes the queued bulk data.
+		service.send(Message("test.frame",Message::Field("id",1))
+			.setPriority(Message::High));
+		service.frameStart(2.0);
+		std::string received;
+		for(int i = 0;i < 1000;++i) {
+			static char response[16*1024];
+			auto size = client->read(response,sizeof(response));
+			received.append(response,size);
+			if(received.find("\"test.frame\"") != std::string::npos) 
+				break;
+			service.update();
+		}
+		assert(received.find("\"test.frame\"") != std::string::npos);
+		assert(received.find("\"test.bulk\",\"i\":0,") != 
+			std::string::npos);
+		assert(received.find("\"test.bulk\",\"i\":199,") == 
+			std::string::npos);
+		transport.close(client);
+	}
+	
+	// Adaptive sampling
+	{
+		using namespace gamedevwebtools;
+		
+		network::MemoryTransport::Options transportOptions;
+		transportOptions.bufferSize = 4*1024;
+		network::MemoryTransport transport(transportOptions);
+		Service service;
+		Service::NetworkOptions options;
+		options.transport = &transport;
+		options.pingInterval = 1e-9; // Each update.
+		options.maxClientLag = 0.01;
+		service.init(Service::ApplicationInformation(),options);
+		service.sampleAdaptively("test.sampled");
+		
+		auto client = transport.connect();
+		auto request = "GET / HTTP/1.1\r\nUpgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n";
+		client->write(request,strlen(request));
+		
+		// The client doesn't read, so it falls behind.
+		static uint8_t payload[1024];
+		memset(payload,'x',sizeof(payload));
+		Service::ClientStatistics statistics;
+		double time = 0.0;
+		for(int i = 0;i < 2000;++i) {
+			service.frameStart(time += 0.01);
+			transport.setTime(time);
+			for(int j = 0;j < 8;++j) {
+				service.send(Message("test.bulk").setPriority(Message::Low),
+					payload,sizeof(payload));
+			}
+			service.update();
+			assert(service.clientStatistics(0,statistics));
+			if(statistics.samplingInterval > 1) break;
+		}
+		assert(statistics.samplingInterval > 1);
+		assert(statistics.queuedBytes > 0);
+		for(int i = 0;i < 16;++i) {
+			service.frameStart(time += 0.01);
+			transport.setTime(time);
+			service.send(Message("test.sampled",Message::Field("i",i)));
+			service.send(Message("test.kept",Message::Field("i",i)));
+			service.update();
+		}
+		
+		// The full detail is restored once the client catches up.
+		std::string received;
+		for(int i = 0;i < 10000;++i) {
+			static char response[64*1024];
+			auto size = client->read(response,sizeof(response));
+			received.append(response,size);
+			service.frameStart(time += 0.01);
+			transport.setTime(time);
+			service.update();
+			service.clientStatistics(0,statistics);
+			if(!size && statistics.samplingInterval == 1) break;
+		}
+		assert(statistics.samplingInterval == 1);
+		auto count = [&](const char *type) {
+			size_t n = 0;
+			for(auto i = received.find(type);i != std::string::npos;
+				i = received.find(type,i + 1)) ++n;
+			return n;
+		};
+		assert(count("\"test.kept\"") == 16);
+		assert(count("\"test.sampled\"") < 16);
+		assert(!service.clientStatistics(1,statistics));
+		transport.close(client);
+	}
+	
+	// Pings and the clock offset
+	{
+		using namespace gamedevwebtools;
+		
+		network::MemoryTransport transport;
+		Service service;
+		Service::NetworkOptions options;
+		options.transport = &transport;
+		options.pingInterval = 1e-9; // Each update.
+		service.init(Service::ApplicationInformation(),options);
+		
+		auto client = transport.connect();
+		auto request = "GET / HTTP/1.1\r\nUpgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n";
+		client->write(request,strlen(request));
+		transport.setTime(0.99);
+		service.frameStart(100.0);
+		service.update();
+		transport.setTime(1.0);
+		service.update();
+		
+		// Find the websocket ping and the network.ping message.
+		static uint8_t response[16*1024];
+		auto size = client->read(response,sizeof(response));
+		std::string received((const char*)response,size);
+		auto offset = received.find("\r\n\r\n") + 4;
+		std::string ping,id;
+		while(offset + 2 <= size) {
+			auto opcode = response[offset] & 0x0F;
+			size_t length = response[offset + 1] & 0x7F,header = 2;
+			if(length == 126) {
+				length = size_t(response[offset + 2])*256 + response[offset + 3];
+				header = 4;
+			}
+			std::string payload((const char*)response + offset + header,
+				length);
+			if(opcode == 0x9) ping = payload;
+			auto field = payload.find("\"network.ping\",\"id\":");
+			if(field != std::string::npos) {
+				auto begin = payload.find(':',field) + 1;
+				id = payload.substr(begin,payload.find('}',begin) - begin);
+			}
+			offset += header + length;
+		}
+		assert(ping.size() == 8);
+		assert(!id.empty());
+		
+		// The client's clock is 5 seconds ahead, and it answers after 20ms.
+		transport.setTime(1.02);
+		auto writeFrame = [&](uint8_t opcode,const std::string &payload) {
+			std::string frame;
+			frame += char(0x80 | opcode);
+			frame += char(0x80 | payload.size());
+			frame += std::string(4,'\0'); // The mask.
+			frame += payload;
+			client->write(frame.data(),frame.size());
+		};
+		writeFrame(0xA,ping);
+		char json[256];
+		snprintf(json,sizeof(json),"{\"type\":\"network.pong\",\"id\":%s,"
+			"\"t1\":%.9f,\"t2\":%.9f}",id.c_str(),105.02,105.02);
+		std::string message(2,'\0');
+		message[0] = char(strlen(json));
+		message += json;
+		writeFrame(0x2,message);
+		service.update();
+		
+		Service::ClientStatistics statistics;
+		assert(service.clientStatistics(0,statistics));
+		auto rttError = statistics.rtt - 0.02;
+		assert(rttError > -1e-6 && rttError < 1e-6);
+		assert(statistics.rttMin == statistics.rtt);
+		assert(statistics.rttMax == statistics.rtt);
+		assert(statistics.clockSamples == 1);
+		auto error = statistics.clockOffset - 5.0;
+		assert(error > -1e-6 && error < 1e-6);
+		error = statistics.clockDelay - 0.02;
+		assert(error > -1e-6 && error < 1e-6);
+		service.update();
+		size = client->read(response,sizeof(response));
+		received.assign((const char*)response,size);
+		auto clock = received.find("\"type\":\"network.clock\",\"offset\":");
+		assert(clock != std::string::npos);
+		error = atof(received.c_str() + received.find(':',clock + 7) + 1) - 5.0;
+		assert(error > -1e-6 && error < 1e-6);
+		
+		// A client which doesn't respond is disconnected, but a stall of 
+		// the service isn't counted.
+		transport.close(client);
+		Service::NetworkOptions timeoutOptions = options;
+		timeoutOptions.pingInterval = 0.1;
+		timeoutOptions.pingTimeout = 1.0;
+		struct TimeoutService : Service {
+			int errors;
+			TimeoutService() : errors(0) {}
+			void onError(const char *) { ++errors; }
+		} timeoutService;
+		timeoutService.init(Service::ApplicationInformation(),timeoutOptions);
+		client = transport.connect();
+		client->write(request,strlen(request));
+		transport.setTime(2.0);
+		timeoutService.update();
+		assert(timeoutService.connectedClients() == 1);
+		transport.setTime(10.0);
+		timeoutService.update();
+		assert(timeoutService.connectedClients() == 1);
+		double time = 10.0;
+		while(time < 10.75) {
+			transport.setTime(time += 0.1);
+			timeoutService.update();
+			assert(timeoutService.connectedClients() == 1);
+		}
+		while(time < 11.55) {
+			transport.setTime(time += 0.1);
+			timeoutService.update();
+		}
+		assert(timeoutService.connectedClients() == 0);
+		assert(timeoutService.errors == 1);
+		transport.close(client);
+		
+		// A reused client's activity starts at the transport's time, so
+		// a client which doesn't send the handshake is disconnected too.
+		client = transport.connect();
+		transport.setTime(time += 0.1);
+		timeoutService.update();
+		assert(timeoutService.connectedClients() == 1);
+		auto connected = time;
+		while(time < connected + 1.15) {
+			transport.setTime(time += 0.1);
+			timeoutService.update();
+		}
+		assert(timeoutService.connectedClients() == 0);
+		assert(timeoutService.errors == 2);
+		transport.close(client);
+	}
+	
+	// Inbound message queue
+	{
+		using namespace gamedevwebtools;
+		
+		network::MemoryTransport transport;
+		struct QueueService : Service {
+			int errors;
+			QueueService() : errors(0) {}
+			void onError(const char *) { ++errors; }
+		} service;
+		Service::NetworkOptions options;
+		options.transport = &transport;
+		options.pingInterval = 0.0;
+		options.inboundQueueSize = 1024;
+		service.init(Service::ApplicationInformation(),options);
+		
+		struct Handler {
+			std::atomic<int> count;
+			int32_t last;
+			bool valid;
+			Handler() : count(0), last(-1), valid(true) {}
+			void handle(const Message &message) {
+				// The strings are owned by the queue.
+				auto fields = message.fields();
+				valid = valid && message.fieldCount() == 2 &&
+					!strcmp(fields[0].name(),"name") &&
+					!strcmp(fields[0].asString(),"command") &&
+					fields[1].asInteger() == last + 1;
+				last = fields[1].asInteger();
+				count.fetch_add(1);
+			}
+		} handler;
+		service.connect("test.cmd",handler,&Handler::handle);
+		
+		auto client = transport.connect();
+		auto request = "GET / HTTP/1.1\r\nUpgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n";
+		client->write(request,strlen(request));
+		service.update();
+		static uint8_t response[16*1024];
+		client->read(response,sizeof(response));
+		int32_t sent = 0;
+		auto sendCommands = [&](int n) {
+			for(int i = 0;i < n;++i,++sent) {
+				char json[128];
+				snprintf(json,sizeof(json),"{\"type\":\"test.cmd\","
+					"\"name\":\"command\",\"seq\":%d}",int(sent));
+				std::string frame;
+				frame += char(0x82);
+				frame += char(0x80 | (strlen(json) + 2));
+				frame += std::string(4,'\0'); // The mask.
+				frame += char(strlen(json));
+				frame += '\0';
+				frame += json;
+				client->write(frame.data(),frame.size());
+			}
+		};
+		
+		// The handlers are called only by dispatchMessages.
+		sendCommands(3);
+		service.update();
+		assert(handler.count == 0);
+		assert(service.dispatchMessages() == 3);
+		assert(handler.count == 3);
+		assert(service.dispatchMessages() == 0);
+		
+		// The entries wrap around the ring.
+		for(int i = 0;i < 32;++i) {
+			sendCommands(4);
+			service.update();
+			assert(service.dispatchMessages() == 4);
+		}
+		assert(handler.valid && handler.count == 3 + 32*4);
+		
+		// The time budget.
+		sendCommands(3);
+		service.update();
+		assert(service.dispatchMessages(1e-9) == 1);
+		assert(service.dispatchMessages() == 2);
+		
+		// The messages are dropped when the queue is full, and the drops
+		// are reported once by the next frame.
+		sendCommands(32);
+		service.update();
+		assert(service.errors == 0);
+		service.frameStart(1.0);
+		assert(service.errors == 1);
+		service.frameStart(2.0);
+		assert(service.errors == 1);
+		auto dispatched = service.dispatchMessages();
+		assert(dispatched > 0 && dispatched < 32);
+		
+		// Dispatch on another thread while update is running.
+		handler.valid = true;
+		handler.last = sent - 1;
+		service.errors = 0;
+		auto expected = handler.count + 256;
+		std::atomic<bool> done(false);
+		std::thread consumer([&]() {
+			while(!done) service.dispatchMessages();
+		});
+		for(int i = 0;i < 64;++i) {
+			sendCommands(4);
+			service.update();
+			while(handler.count.load() < expected - 256 + (i + 1)*4) 
+				std::this_thread::yield();
+		}
+		done = true;
+		consumer.join();
+		assert(handler.valid && handler.count == expected);
+		assert(service.errors == 0);
+		transport.close(client);
+	}
+	
+	// Multiple subscribers and prefix routing
+	{
+		using namespace gamedevwebtools;
+		
+		network::MemoryTransport transport;
+		Service service;
+		Service::NetworkOptions options;
+		options.transport = &transport;
+		options.pingInterval = 0.0;
+		service.init(Service::ApplicationInformation(),options);
+		
+		static std::string calls;
+		struct Subscriber {
+			char id;
+			void handle(const Message &message) {
+				calls += id;
+				calls += message.type();
+				calls += ';';
+			}
+		} a = { 'a' }, b = { 'b' }, c = { 'c' }, d = { 'd' };
+		service.connect("input.keydown",a,&Subscriber::handle);
+		service.connect("input.*",c,&Subscriber::handle);
+		service.connect("input.keydown",b,&Subscriber::handle);
+		service.connect("application.service.*",c,&Subscriber::handle);
+		service.connect("*",d,&Subscriber::handle);
+		
+		auto client = transport.connect();
+		auto request = "GET / HTTP/1.1\r\nUpgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n";
+		client->write(request,strlen(request));
+		service.update();
+		static uint8_t response[16*1024];
+		client->read(response,sizeof(response));
+		auto receive = [&](const char *type) {
+			char json[128];
+			snprintf(json,sizeof(json),"{\"type\":\"%s\"}",type);
+			std::string frame;
+			frame += char(0x82);
+			frame += char(0x80 | (strlen(json) + 2));
+			frame += std::string(4,'\0'); // The mask.
+			frame += char(strlen(json));
+			frame += '\0';
+			frame += json;
+			client->write(frame.data(),frame.size());
+			calls.clear();
+			service.update();
+			return calls;
+		};
+		assert(receive("input.keydown") == 
+			"ainput.keydown;binput.keydown;dinput.keydown;cinput.keydown;");
+		assert(receive("input.keyup") == "dinput.keyup;cinput.keyup;");
+		assert(receive("application.service.pause") == 
+			"dapplication.service.pause;capplication.service.pause;");
+		assert(receive("application.quit") == "dapplication.quit;");
+		assert(receive("inp") == "dinp;");
+		
+		// A handler which connects the handlers moves the handler arena,
+		// and the rest of the chain is still called.
+		struct Connector {
+			Service *service;
+			Subscriber *subscriber;
+			void handle() {
+				for(int i = 0;i < 256;++i) {
+					service->connect("test.connected",*subscriber,
+						&Subscriber::handle);
+				}
+			}
+		} connector = { &service,&a };
+		service.connect("test.connect",connector,&Connector::handle);
+		service.connect("test.connect",b,&Subscriber::handle);
+		assert(receive("test.connect") == "btest.connect;dtest.connect;");
+		assert(receive("test.connected").size() == 
+			257*strlen("atest.connected;"));
+		transport.close(client);
+	}
+	
+	// Compile time type hashes and the frozen dispatch table
+	{
+		using namespace gamedevwebtools;
+		
+		GAMEDEVWEBTOOLS_CONSTEXPR MessageType keydown("input.keydown");
+		assert(keydown.hash == core::HashTable::hashKey("input.keydown"));
+		assert(MessageType("").hash == core::HashTable::hashKey(""));
+		
+		network::MemoryTransport transport;
+		Service service;
+		Service::NetworkOptions options;
+		options.transport = &transport;
+		options.pingInterval = 0.0;
+		service.init(Service::ApplicationInformation(),options);
+		
+		struct Counter {
+			int count;
+			void handle() { ++count; }
+		} exact = { 0 }, prefix = { 0 }, late = { 0 };
+		std::vector<std::string> types;
+		for(int i = 0;i < 200;++i) {
+			char name[32];
+			snprintf(name,sizeof(name),"test.type%d",i);
+			types.push_back(name);
+		}
+		for(auto &type : types) 
+			service.connect(type.c_str(),exact,&Counter::handle);
+		service.connect(keydown,exact,&Counter::handle);
+		service.connect("input.*",prefix,&Counter::handle);
+		service.freezeHandlers();
+		
+		auto client = transport.connect();
+		auto request = "GET / HTTP/1.1\r\nUpgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n";
+		client->write(request,strlen(request));
+		service.update();
+		static uint8_t response[16*1024];
+		client->read(response,sizeof(response));
+		auto receive = [&](const char *type) {
+			char json[128];
+			snprintf(json,sizeof(json),"{\"type\":\"%s\"}",type);
+			std::string frame;
+			frame += char(0x82);
+			frame += char(0x80 | (strlen(json) + 2));
+			frame += std::string(4,'\0'); // The mask.
+			frame += char(strlen(json));
+			frame += '\0';
+			frame += json;
+			client->write(frame.data(),frame.size());
+			service.update();
+		};
+		for(auto &type : types) receive(type.c_str());
+		assert(exact.count == 200);
+		receive("input.keydown");
+		assert(exact.count == 201 && prefix.count == 1);
+		receive("input.keyup");
+		assert(exact.count == 201 && prefix.count == 2);
+		
+		// The unknown types aren't handled.
+		receive("test.type200");
+		receive("test.type");
+		assert(exact.count == 201);
+		service.frameStart(0.0);
+		service.update();
+		auto size = client->read(response,sizeof(response));
+		std::string received((const char*)response,size);
+		assert(received.find("\"msgtype\":\"test.type200\"") != 
+			std::string::npos);
+		
+		// Connecting a handler rebuilds the table.
+		service.connect("test.late",late,&Counter::handle);
+		service.connect("input.*",late,&Counter::handle);
+		receive("test.late");
+		receive("input.keydown");
+		assert(late.count == 2 && exact.count == 202 && prefix.count == 3);
+		
+		// A handler which connects a handler doesn't rebuild the table 
+		// while it's used, but after the dispatch.
+		struct Connector {
+			Service *service;
+			Counter *counter;
+			bool connected;
+			void handle() {
+				if(connected) return;
+				connected = true;
+				service->connect("test.added",*counter,&Counter::handle);
+				service->connect("input.*",*counter,&Counter::handle);
+			}
+		} connector = { &service,&late,false };
+		service.connect(keydown,connector,&Connector::handle);
+		receive("input.keydown");
+		assert(exact.count == 203 && prefix.count == 4 && late.count == 4);
+		receive("test.added");
+		assert(late.count == 5);
+		
+		// The hash 0 is mapped to 1, as 0 marks the empty slots.
+		assert(MessageType("test.zero.ggetasx").hash == 1);
+		service.connect("test.zero.ggetasx",exact,&Counter::handle);
+		receive("test.zero.ggetasx");
+		assert(exact.count == 204);
+		
+		// The types with the same hash are dispatched without the table.
+		assert(MessageType("costarring").hash == MessageType("liquid").hash);
+		service.connect("costarring",exact,&Counter::handle);
+		service.connect("liquid",late,&Counter::handle);
+		service.freezeHandlers();
+		receive("costarring");
+		receive("liquid");
+		receive("input.keyup");
+		assert(exact.count == 205 && late.count == 8 && prefix.count == 5);
+		transport.close(client);
+	}
+	
+	// Requests
+	{
+		using namespace gamedevwebtools;
+		
+		network::MemoryTransport transport;
+		Service service;
+		Service::NetworkOptions options;
+		options.transport = &transport;
+		options.pingInterval = 0.0;
+		options.requestTimeout = 0.05;
+		service.init(Service::ApplicationInformation(),options);
+		
+		struct Inspector {
+			Service *service;
+			std::vector<Service::Request> later;
+			void inspect(const Service::Request &request,
+				const Message &message) 
+			{
+				auto entity = message.fields()[1].asInteger();
+				if(entity < 0) {
+					later.push_back(request);
+					return;
+				}
+				uint8_t data[4] = { 1, 2, 3, 4 };
+				assert(service->respond(request,Message("entity.info",
+					Message::Field("entity",entity)),data,sizeof(data)));
+				assert(!service->respond(request,Message("entity.info")));
+			}
+		} inspector = { &service,{} };
+		service.connectRequest("entity.inspect",inspector,
+			&Inspector::inspect);
+		
+		auto request = "GET / HTTP/1.1\r\nUpgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n";
+		auto client = transport.connect();
+		auto other = transport.connect();
+		client->write(request,strlen(request));
+		other->write(request,strlen(request));
+		service.update();
+		service.update();
+		static uint8_t response[16*1024];
+		client->read(response,sizeof(response));
+		other->read(response,sizeof(response));
+		auto write = [&](network::Connection *from,int id,int entity) {
+			char json[128];
+			snprintf(json,sizeof(json),"{\"type\":\"entity.inspect\","
+				"\"requestId\":%d,\"entity\":%d}",id,entity);
+			std::string frame;
+			frame += char(0x82);
+			frame += char(0x80 | (strlen(json) + 2));
+			frame += std::string(4,'\0'); // The mask.
+			frame += char(strlen(json));
+			frame += '\0';
+			frame += json;
+			from->write(frame.data(),frame.size());
+		};
+		auto send = [&](int id,int entity) {
+			write(client,id,entity);
+			service.update();
+			service.update();
+			auto size = client->read(response,sizeof(response));
+			return std::string((const char*)response,size);
+		};
+		
+		// The response goes only to the requesting client.
+		auto received = send(7,42);
+		assert(received.find("{\"type\":\"entity.info\",\"requestId\":7,"
+			"\"entity\":42,\"dataSize\":4}\x01\x02\x03\x04") != 
+			std::string::npos);
+		assert(!other->read(response,sizeof(response)));
+		
+		// A response in a later frame.
+		assert(send(8,-1).find("requestId") == std::string::npos);
+		assert(inspector.later.size() == 1);
+		assert(service.respond(inspector.later[0],Message("entity.info")));
+		service.update();
+		received.assign((const char*)response,
+			client->read(response,sizeof(response)));
+		assert(received.find("\"requestId\":8}") != std::string::npos);
+		
+		// The requests which aren't answered time out.
+		send(9,-1);
+		transport.setTime(0.06);
+		service.update();
+		received.assign((const char*)response,
+			client->read(response,sizeof(response)));
+		assert(received.find("{\"type\":\"rpc.error\",\"requestId\":9,") != 
+			std::string::npos);
+		assert(!service.respond(inspector.later[1],Message("entity.info")));
+		
+		// The messages without a requestId don't expect a response.
+		send(0,-1);
+		assert(inspector.later.size() == 3 && !inspector.later[2].id);
+		assert(!service.fail(inspector.later[2],"Nothing to answer"));
+		
+		// The requests of a client which disconnects are dropped, so they
+		// don't take up the pending requests (64).
+		for(int i = 0;i < 64;++i) write(other,100 + i,-1);
+		service.update();
+		assert(inspector.later.size() == 3 + 64);
+		transport.close(other);
+		service.send(Message("test.closed"));
+		service.frameStart(1.0);
+		service.update();
+		assert(service.connectedClients() == 1);
+		assert(!service.respond(inspector.later.back(),Message("entity.info")));
+		received = send(200,42);
+		assert(received.find("{\"type\":\"entity.info\",\"requestId\":200,")
+			!= std::string::npos);
+		
+		// The requests beyond the pending requests are refused.
+		for(int i = 0;i < 64;++i) write(client,300 + i,-1);
+		service.update();
+		received = send(364,-1);
+		assert(received.find("{\"type\":\"rpc.error\",\"requestId\":364,"
+			"\"error\":\"Too many pending requests\"}") != std::string::npos);
+		assert(inspector.later.size() == 3 + 64 + 64);
+		transport.close(client);
+	}
+	
+	// Typed message builder
+	{
+		using namespace gamedevwebtools;
+		
+		char json[64];
+		auto end = encoding::put(json,StringView("a\"b\n\x01zzz",5));
+		assert(std::string(json,end) == "\"a\\\"b\\n\\u0001\"");
+		assert(encoding::size(StringView("a\"b\n\x01",5)) == 
+			size_t(end - json));
+		end = encoding::put(json,int64_t(-9223372036854775807LL - 1));
+		assert(std::string(json,end) == "-9223372036854775808");
+		end = encoding::put(json,uint64_t(18446744073709551615ULL));
+		assert(std::string(json,end) == "18446744073709551615");
+		size_t offset = 0;
+		end = encoding::putFields(json,offset,field("ok",true),
+			field("f",0.5f));
+		assert(offset == 0);
+		assert(std::string(json,end) == ",\"ok\":true,\"f\":0.5");
+		assert(encoding::fieldsSize(field("ok",true),field("f",0.5f)) >=
+			size_t(end - json));
+		
+		auto request = "GET / HTTP/1.1\r\nUpgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n";
+		network::MemoryTransport transport;
+		Service service;
+		Service::NetworkOptions options;
+		options.transport = &transport;
+		options.lateJoinerMaxValues = 16;
+		service.init(Service::ApplicationInformation(),options);
+		service.snapshotLastValue("test.entity","id");
+		
+		// The key fields of the typed and the plain messages match.
+		service.frameStart(0.0);
+		service.send(Message("test.entity",Message::Field("id",1),
+			Message::Field("x",1.0)));
+		service.sendFields("test.entity",field("id",2),field("x",2.0));
+		service.sendFields("test.entity",field("id",1),field("x",3.0));
+		service.frameStart(0.0);
+		service.update();
+		
+		auto client = transport.connect();
+		client->write(request,strlen(request));
+		std::string text(6000,'x');
+		text[10] = '"';
+		uint8_t data[4] = { 1, 2, 3, 4 };
+		service.frameStart(0.0);
+		service.update();
+		service.sendFields("test.fields",field("a",1),field("b",2u),
+			field("c",int64_t(-3)),field("d",size_t(4)),field("e",false),
+			field("f",0.25),field("g","str"),
+			field("h",StringView("view it",4)));
+		service.sendFields(Message::High,"test.data",data,sizeof(data),
+			field("text",text.c_str()));
+		for(int i = 0;i < 2;++i) {
+			service.frameStart(0.0);
+			service.update();
+		}
+		static char response[64*1024];
+		auto size = client->read(response,sizeof(response));
+		std::string received(response,size);
+		assert(received.find("{\"type\":\"test.entity\",\"id\":2,\"x\":2}") != 
+			std::string::npos);
+		assert(received.find("{\"type\":\"test.entity\",\"id\":1,\"x\":3}") != 
+			std::string::npos);
+		assert(received.find("\"id\":1,\"x\":1}") == std::string::npos);
+		assert(received.find("{\"type\":\"test.fields\",\"a\":1,\"b\":2,"
+			"\"c\":-3,\"d\":4,\"e\":false,\"f\":0.25,\"g\":\"str\","
+			"\"h\":\"view\"}") != std::string::npos);
+		// The long strings aren't truncated.
+		auto escaped = text;
+		escaped.replace(10,1,"\\\"");
+		assert(received.find("{\"type\":\"test.data\",\"text\":\"" + escaped + 
+			"\",\"dataSize\":4}\x01\x02\x03\x04") != std::string::npos);
+		transport.close(client);
+	}
+	
+	// Message templates
+	{
+		using namespace gamedevwebtools;
+		
+		static const auto frame = MessageTemplate<size_t,double,const char*>(
+			"test.\"frame\"","id","dt","name").setPriority(Message::High);
+		assert(frame.priority() == Message::High);
+		char json[256];
+		size_t binarySize;
+		auto end = frame.encode(json,binarySize,size_t(7),0.5,"a\nb");
+		assert(binarySize == 0);
+		assert(std::string(json,end) == "{\"type\":\"test.\\\"frame\\\"\","
+			"\"id\":7,\"dt\":0.5,\"name\":\"a\\nb\"}");
+		assert(frame.size(size_t(7),0.5,"a\nb") >= size_t(end - json));
+		MessageTemplate<> empty("test.empty");
+		end = empty.encode(json,binarySize);
+		assert(std::string(json,end) == "{\"type\":\"test.empty\"}");
+		assert(empty.size() == size_t(end - json));
+		// The names are escaped, and the templates which don't fit are 
+		// invalid.
+		MessageTemplate<int32_t> quoted("test.quoted","a\"b");
+		end = quoted.encode(json,binarySize,1);
+		assert(std::string(json,end) == 
+			"{\"type\":\"test.quoted\",\"a\\\"b\":1}");
+		auto longType = std::string(MessageTemplate<>::kMaxTextLength,'x');
+		MessageTemplate<int32_t> tooLong(longType.c_str(),"v");
+		assert(quoted.isValid() && !tooLong.isValid());
+		
+		auto request = "GET / HTTP/1.1\r\nUpgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n";
+		network::MemoryTransport transport;
+		Service service;
+		Service::NetworkOptions options;
+		options.transport = &transport;
+		options.lateJoinerMaxValues = 16;
+		service.init(Service::ApplicationInformation(),options);
+		service.snapshotLastValue("test.entity","id");
+		
+		// The key of the snapshot is found among the template's values.
+		MessageTemplate<int32_t,double> entity("test.entity","id","x");
+		service.frameStart(0.0);
+		service.send(entity,1,1.0);
+		service.send(entity,2,2.0);
+		service.sendFields("test.entity",field("id",1),field("x",3.0));
+		service.frameStart(0.0);
+		service.update();
+		
+		auto client = transport.connect();
+		client->write(request,strlen(request));
+		service.frameStart(0.0);
+		service.update();
+		for(int i = 0;i < 3;++i) service.send(entity,10 + i,0.25);
+		service.send(tooLong,1);
+		for(int i = 0;i < 2;++i) {
+			service.frameStart(0.0);
+			service.update();
+		}
+		static char response[64*1024];
+		auto size = client->read(response,sizeof(response));
+		std::string received(response,size);
+		assert(received.find("{\"type\":\"test.entity\",\"id\":2,\"x\":2}") != 
+			std::string::npos);
+		assert(received.find("{\"type\":\"test.entity\",\"id\":1,\"x\":3}") != 
+			std::string::npos);
+		assert(received.find("\"id\":1,\"x\":1}") == std::string::npos);
+		assert(received.find("{\"type\":\"test.entity\",\"id\":12,"
+			"\"x\":0.25}") != std::string::npos);
+		assert(received.find(longType) == std::string::npos);
+		transport.close(client);
+	}
+	
+	// Binary fields
+	{
+		using namespace gamedevwebtools;
+		
+		auto request = "GET / HTTP/1.1\r\nUpgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n";
+		network::MemoryTransport transport;
+		Service service;
+		Service::NetworkOptions options;
+		options.transport = &transport;
+		service.init(Service::ApplicationInformation(),options);
+		auto client = transport.connect();
+		client->write(request,strlen(request));
+		service.frameStart(0.0);
+		service.update();
+		
+		// The binary values follow the message's binary data.
+		float position[4] = { 1.0f, 2.0f, 3.0f, 4.0f };
+		uint8_t data[2] = { 0xAA, 0xBB };
+		service.send(Message("test.binary",Message::Field("id",Int64(-2)),
+			Message::Field("v",ArrayView<float>(position)),
+			Message::Field("n",1)),data,sizeof(data));
+		uint32_t histogram[3] = { 5, 6, 7 };
+		service.sendFields("test.typed",field("h",ArrayView<uint32_t>(
+			histogram,3)),field("u",Uint64(~uint64_t(0))));
+		static const MessageTemplate<int32_t,ArrayView<uint8_t>> heatmap(
+			"test.template","w","cells");
+		service.send(heatmap,2,ArrayView<uint8_t>(data));
+		for(int i = 0;i < 2;++i) {
+			service.frameStart(0.0);
+			service.update();
+		}
+		static char response[64*1024];
+		auto size = client->read(response,sizeof(response));
+		std::string received(response,size);
+		
+		auto expected = std::string("{\"type\":\"test.binary\","
+			"\"id\":{\"binary\":\"i64\",\"offset\":2},"
+			"\"v\":{\"binary\":\"f32\",\"count\":4,\"offset\":10},"
+			"\"n\":1,\"dataSize\":26}\xAA\xBB");
+		int64_t id = -2;
+		expected.append((const char*)&id,8);
+		expected.append((const char*)position,16);
+		assert(received.find(expected) != std::string::npos);
+		
+		expected = "{\"type\":\"test.typed\","
+			"\"h\":{\"binary\":\"u32\",\"count\":3,\"offset\":0},"
+			"\"u\":{\"binary\":\"u64\",\"offset\":12},\"dataSize\":20}";
+		expected.append((const char*)histogram,12);
+		expected.append(8,'\xFF');
+		assert(received.find(expected) != std::string::npos);
+		
+		expected = "{\"type\":\"test.template\",\"w\":2,"
+			"\"cells\":{\"binary\":\"u8\",\"count\":2,\"offset\":0},"
+			"\"dataSize\":2}\xAA\xBB";
+		assert(received.find(expected) != std::string::npos);
+		transport.close(client);
+	}
+	
+	// Profiling task batches
+	{
+		using namespace gamedevwebtools;
+		
+		auto request = "GET / HTTP/1.1\r\nUpgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n";
+		network::MemoryTransport transport;
+		Service service;
+		Service::NetworkOptions options;
+		options.transport = &transport;
+		service.init(Service::ApplicationInformation(),options);
+		auto client = transport.connect();
+		client->write(request,strlen(request));
+		service.frameStart(0.0);
+		service.update();
+		
+		// The tasks of a frame are sent as columns at the next frame.
+		const char *frame = "frame";
+		service.profileTask(frame,0,0,0.0,0.5);
+		service.profileTask("io",1,1,0.25,0.125);
+		service.profileTask(frame,2,0,0.5,0.25);
+		for(int i = 0;i < 3;++i) {
+			service.frameStart(0.0);
+			service.update();
+		}
+		static char response[64*1024];
+		auto size = client->read(response,sizeof(response));
+		std::string received(response,size);
+		
+		auto expected = std::string("{\"type\":\"profiling.tasks\","
+			"\"frame\":1,\"count\":3,"
+			"\"names\":{\"binary\":\"u8\",\"count\":9,\"offset\":0},"
+			"\"name\":{\"binary\":\"u32\",\"count\":3,\"offset\":9},"
+			"\"thread\":{\"binary\":\"u32\",\"count\":3,\"offset\":21},"
+			"\"depth\":{\"binary\":\"i32\",\"count\":3,\"offset\":33},"
+			"\"t\":{\"binary\":\"f64\",\"count\":3,\"offset\":45},"
+			"\"dt\":{\"binary\":\"f64\",\"count\":3,\"offset\":69},"
+			"\"dataSize\":93}");
+		expected.append("frame\0io\0",9);
+		uint32_t names[3] = { 0, 1, 0 };
+		uint32_t threads[3] = { 0, 1, 2 };
+		int32_t depths[3] = { 0, 1, 0 };
+		double times[3] = { 0.0, 0.25, 0.5 };
+		double durations[3] = { 0.5, 0.125, 0.25 };
+		expected.append((const char*)names,sizeof(names));
+		expected.append((const char*)threads,sizeof(threads));
+		expected.append((const char*)depths,sizeof(depths));
+		expected.append((const char*)times,sizeof(times));
+		expected.append((const char*)durations,sizeof(durations));
+		assert(received.find(expected) != std::string::npos);
+		
+		// The frames without tasks don't send a batch.
+		auto first = received.find("\"type\":\"profiling.tasks\"");
+		assert(received.find("\"type\":\"profiling.tasks\"",first + 1) ==
+			std::string::npos);
+		transport.close(client);
+	}
+	
+	// Delta encoding
+	{
+		using namespace gamedevwebtools;
+		
+		auto request = "GET / HTTP/1.1\r\nUpgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n";
+		network::MemoryTransport transport;
+		Service service;
+		Service::NetworkOptions options;
+		options.transport = &transport;
+		options.deltaKeyframeInterval = 3;
+		service.init(Service::ApplicationInformation(),options);
+		service.encodeDeltas("test.counters","name");
+		auto client = transport.connect();
+		client->write(request,strlen(request));
+		service.frameStart(0.0);
+		service.update();
+		
+		auto counters = [&](const char *name,int draws,const char *label) {
+			Message::Field fields[] = {
+				Message::Field("name",name), Message::Field("draws",draws),
+				Message::Field("t",0.5), Message::Field("label",label),
+				Message::Field("on",true)
+			};
+			service.send(Message("test.counters",fields,5));
+		};
+		counters("a",10,"x");
+		counters("a",12,"xy");
+		counters("a",12,"xy");
+		counters("a",11,"xy");
+		counters("b",1,"x");
+		// The different fields need a keyframe.
+		service.send(Message("test.counters",Message::Field("name","a"),
+			Message::Field("draws",11)));
+		for(int i = 0;i < 3;++i) {
+			service.frameStart(0.0);
+			service.update();
+		}
+		// The keyframes are sent periodically, and for a new client.
+		service.send(Message("test.counters",Message::Field("name","a"),
+			Message::Field("draws",11)));
+		service.update();
+		auto other = transport.connect();
+		other->write(request,strlen(request));
+		service.update();
+		service.send(Message("test.counters",Message::Field("name","a"),
+			Message::Field("draws",11)));
+		service.frameStart(0.0);
+		service.update();
+		static char response[64*1024];
+		auto size = client->read(response,sizeof(response));
+		std::string received(response,size);
+		
+		assert(received.find("{\"type\":\"test.counters\",\"name\":\"a\","
+			"\"draws\":10,\"t\":0.5,\"label\":\"x\",\"on\":true,"
+			"\"keyframe\":{\"seq\":1,\"key\":\"name\",\"types\":\"sifsb\"}}")
+			!= std::string::npos);
+		// The changed fields are draws (+2 is zig-zag 4) and label.
+		assert(received.find(std::string("{\"type\":\"test.counters\","
+			"\"name\":\"a\",\"deltaSeq\":2,\"dataSize\":5}\x0A\x04\x02xy")) != 
+			std::string::npos);
+		assert(received.find(std::string("{\"type\":\"test.counters\","
+			"\"name\":\"a\",\"deltaSeq\":3,\"dataSize\":1}\x00",62)) != 
+			std::string::npos);
+		assert(received.find(std::string("{\"type\":\"test.counters\","
+			"\"name\":\"a\",\"deltaSeq\":4,\"dataSize\":2}\x02\x01")) != 
+			std::string::npos);
+		assert(received.find("\"name\":\"b\",\"draws\":1,\"t\":0.5,"
+			"\"label\":\"x\",\"on\":true,\"keyframe\":{\"seq\":1,") != 
+			std::string::npos);
+		for(int seq = 5;seq <= 7;++seq) {
+			char keyframe[128];
+			snprintf(keyframe,sizeof(keyframe),"{\"type\":\"test.counters\","
+				"\"name\":\"a\",\"draws\":11,\"keyframe\":{\"seq\":%d,"
+				"\"key\":\"name\",\"types\":\"si\"}}",seq);
+			assert(received.find(keyframe) != std::string::npos);
+		}
+		transport.close(client);
+		transport.close(other);
+	}
+	
+	// Ordered thread messages
+	{
+		using namespace gamedevwebtools;
+		
+		auto request = "GET / HTTP/1.1\r\nUpgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n";
+		network::MemoryTransport transport;
+		struct ThreadedService : Service {
+			size_t thread;
+			ThreadedService() : thread(0) {}
+			size_t currentThreadId() const { return thread; }
+		} service;
+		Service::NetworkOptions options;
+		options.transport = &transport;
+		options.pingInterval = 0.0;
+		options.orderedThreadMessages = true;
+		service.init(Service::ApplicationInformation(),options,3);
+		auto client = transport.connect();
+		client->write(request,strlen(request));
+		service.frameStart(0.0);
+		service.update();
+		
+		// The messages are written in the order in which they were sent,
+		// the higher priority classes first.
+		size_t threads[] = { 0, 1, 1, 2, 0, 2, 1, 0 };
+		for(int i = 0;i < 8;++i) {
+			service.thread = threads[i];
+			if(i == 6) {
+				// Two encoded messages count as two.
+				std::string encoded;
+				for(int j = 6;j < 8;++j) {
+					char json[64];
+					auto length = snprintf(json,sizeof(json),
+						"{\"type\":\"test.order\",\"i\":%d}",j);
+					encoded += char(length);
+					encoded += char(0);
+					encoded.append(json,size_t(length));
+				}
+				service.sendEncoded(encoded.data(),encoded.size());
+				continue;
+			}
+			auto j = i == 7? 8 : i;
+			service.send(Message("test.order",Message::Field("i",j)));
+		}
+		service.thread = 2;
+		service.send(Message("test.urgent").setPriority(Message::High));
+		service.thread = 0;
+		service.frameStart(0.0);
+		service.update();
+		static char response[64*1024];
+		auto size = client->read(response,sizeof(response));
+		std::string received(response,size);
+		
+		auto last = received.find("{\"type\":\"test.urgent\"}");
+		assert(last != std::string::npos);
+		for(int i = 0;i <= 8;++i) {
+			char json[64];
+			snprintf(json,sizeof(json),"{\"type\":\"test.order\",\"i\":%d}",i);
+			auto position = received.find(json);
+			assert(position != std::string::npos && position > last);
+			last = position;
+		}
+		
+		// A last integer field named dataSize doesn't throw off the merge,
+		// which doesn't allocate after the warmup.
+		service.warmupComplete();
+		service.thread = 1;
+		service.send(Message("test.size",Message::Field("dataSize",1000)));
+		service.thread = 2;
+		service.send(Message("test.after"));
+		service.thread = 0;
+		service.frameStart(0.0);
+		service.update();
+		size = client->read(response,sizeof(response));
+		received.assign(response,size);
+		auto position = received.find("\"dataSize\":1000}");
+		assert(position != std::string::npos);
+		assert(received.find("{\"type\":\"test.after\"}") > position);
+		assert(service.allocationsAfterWarmup() == 0);
+		transport.close(client);
+	}
+	
+	// Capture and replay
+	{
+		using namespace gamedevwebtools;
+		
+		auto request = "GET / HTTP/1.1\r\nUpgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n";
+		network::MemoryTransport transport;
+		auto filename = "gamedevwebtools-replay-test.capture";
+		{
+			Service service;
+			Service::NetworkOptions options;
+			options.transport = &transport;
+			service.init(Service::ApplicationInformation(),options);
+			assert(service.startCapture(filename));
+			for(int i = 1;i <= 3;++i) {
+				service.frameStart(double(i)*0.5);
+				service.send(Message("test.capture",Message::Field("i",i)));
+				service.update();
+			}
+			service.frameStart(2.0);
+			service.update();
+			service.stopCapture();
+		}
+		
+		auto file = fopen(filename,"rb");
+		assert(file);
+		static uint8_t data[64*1024];
+		auto size = fread(data,1,sizeof(data),file);
+		fclose(file);
+		remove(filename);
+		capture::FileHeader header;
+		memcpy(&header,data,sizeof(header));
+		assert(header.magic == capture::kFileMagic);
+		assert(header.indexOffset && header.indexOffset < size);
+		capture::IndexHeader index;
+		memcpy(&index,data + header.indexOffset,sizeof(index));
+		assert(index.magic == capture::kIndexMagic && index.count == 3);
+		auto entries = (const capture::IndexEntry*)
+			(data + header.indexOffset + sizeof(index));
+		
+		// Each frame is labelled with the frame in which it was sent.
+		for(size_t i = 0;i < index.count;++i) {
+			capture::FrameHeader frame;
+			memcpy(&frame,data + entries[i].offset,sizeof(frame));
+			assert(frame.magic == capture::kFrameMagic);
+			assert(frame.frameId == i + 1 && entries[i].frameId == i + 1);
+			assert(frame.time == double(i + 1)*0.5);
+			std::string messages((const char*)data + entries[i].offset + 
+				sizeof(frame),size_t(frame.size));
+			char json[64];
+			snprintf(json,sizeof(json),"{\"type\":\"test.capture\",\"i\":%d}",
+				int(i + 1));
+			assert(messages.find(json) != std::string::npos);
+			assert(messages.find("\"test.capture\"") == 
+				messages.rfind("\"test.capture\""));
+		}
+		
+		// Seek to the second frame and replay the rest to a single client.
+		size_t position = 0;
+		while(position < index.count && entries[position].frameId < 2) 
+			++position;
+		assert(position == 1);
+		Service replay;
+		Service::NetworkOptions options;
+		options.transport = &transport;
+		replay.init(Service::ApplicationInformation(),options);
+		network::Connection *clients[2];
+		for(int i = 0;i < 2;++i) {
+			clients[i] = transport.connect();
+			clients[i]->write(request,strlen(request));
+			replay.update();
+		}
+		assert(replay.connectedClients() == 2);
+		for(;position < index.count;++position) {
+			capture::FrameHeader frame;
+			memcpy(&frame,data + entries[position].offset,sizeof(frame));
+			replay.sendEncodedTo(replay.clientId(1),data + 
+				entries[position].offset + sizeof(frame),size_t(frame.size));
+		}
+		replay.sendTo(replay.clientId(1),Message("replay.position",
+			Message::Field("frame",2)));
+		replay.update();
+		static char response[64*1024];
+		std::string received[2];
+		for(int i = 0;i < 2;++i) {
+			auto n = clients[i]->read(response,sizeof(response));
+			received[i].assign(response,n);
+		}
+		assert(received[0].find("\"test.capture\"") == std::string::npos);
+		assert(received[0].find("\"replay.position\"") == std::string::npos);
+		auto second = received[1].find("{\"type\":\"test.capture\",\"i\":2}");
+		auto third = received[1].find("{\"type\":\"test.capture\",\"i\":3}");
+		assert(second != std::string::npos && third != std::string::npos);
+		assert(second < third);
+		assert(received[1].find("\"i\":1}") == std::string::npos);
+		assert(received[1].find("{\"type\":\"replay.position\",\"frame\":2}") != 
+			std::string::npos);
+		for(int i = 0;i < 2;++i) transport.close(clients[i]);
+	}
+	
+	// Flight recorder
+	{
+		using namespace gamedevwebtools;
+		using namespace gamedevwebtools::capture;
+		
+		auto filename = "gamedevwebtools-test.flight";
+		auto readFile = [&](std::vector<uint8_t> &data) {
+			auto file = fopen(filename,"rb");
+			assert(file);
+			data.resize(64*1024);
+			data.resize(fread(data.data(),1,data.size(),file));
+			fclose(file);
+		};
+		auto ringsOffset = (sizeof(FlightRecorderHeader) + 63) & ~size_t(63);
+		
+		// The records after the wrap around are recovered - the end of the
+		// ring is padded even when it's shorter than a record header.
+		{
+			const size_t ringSize = 256;
+			FlightRecorder recorder;
+			assert(recorder.open(filename,1,ringSize));
+			uint64_t head = 0;
+			bool shortPadding = false;
+			uint32_t count = 0;
+			for(uint32_t i = 0;i < 64;++i,++count) {
+				uint8_t message[64];
+				auto length = 4 + (i*12)%40;
+				memcpy(message,&i,4);
+				memset(message + 4,int(i),length - 4);
+				auto recordSize = (sizeof(FlightRecorderRecord) + length + 7) & 
+					~size_t(7);
+				auto rest = ringSize - size_t(head%ringSize);
+				if(recordSize > rest) {
+					shortPadding = shortPadding || 
+						rest < sizeof(FlightRecorderRecord);
+					head += rest;
+				}
+				head += recordSize;
+				recorder.frame(i/4,double(i));
+				recorder.record(0,message,length);
+			}
+			assert(shortPadding);
+			// Too large for the ring.
+			static uint8_t large[ringSize];
+			recorder.record(0,large,sizeof(large));
+			recorder.close();
+			
+			std::vector<uint8_t> data;
+			readFile(data);
+			auto header = (const FlightRecorderHeader*)data.data();
+			assert(header->running == 0 && header->ringSize == ringSize);
+			auto ring = (const FlightRecorderRing*)(data.data() + ringsOffset);
+			assert(ring->head == head && ring->dropped == 1);
+			auto position = ring->tail;
+			uint32_t expected = 0,recovered = 0;
+			while(auto rec = readRecord(data.data() + ring->offset,ringSize,
+				position,ring->head)) 
+			{
+				uint32_t i;
+				memcpy(&i,rec + 1,4);
+				if(!recovered) expected = i;
+				assert(i == expected && rec->size == 4 + (i*12)%40);
+				assert(rec->frameId == i/4 && rec->time == double(i));
+				++expected;
+				++recovered;
+			}
+			assert(position == ring->head);
+			assert(expected == count && recovered > 4);
+		}
+		
+		// A clean shutdown of the service is marked in the file.
+		{
+			network::MemoryTransport transport;
+			Service::NetworkOptions options;
+			options.transport = &transport;
+			options.flightRecorderFile = filename;
+			options.flightRecorderThreadSize = 4096;
+			std::vector<uint8_t> data;
+			{
+				Service service;
+				service.init(Service::ApplicationInformation(),options);
+				service.frameStart(0.0);
+				service.send(Message("test.flight"));
+				readFile(data);
+				assert(((const FlightRecorderHeader*)data.data())->running == 1);
+			}
+			readFile(data);
+			assert(((const FlightRecorderHeader*)data.data())->running == 0);
+		}
+		remove(filename);
+	}
+	
+	// Logging limits
+	{
+		using namespace gamedevwebtools;
+		
+		auto request = "GET / HTTP/1.1\r\nUpgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n";
+		network::MemoryTransport transport;
+		Service service;
+		Service::NetworkOptions options;
+		options.transport = &transport;
+		options.pingInterval = 0.0;
+		service.init(Service::ApplicationInformation(),options);
+		auto client = transport.connect();
+		client->write(request,strlen(request));
+		service.frameStart(0.0);
+		service.update();
+		
+		// The duplicates from one call site are collapsed into a 
+		// logging.repeat message, and the rate limits drop the rest.
+		static logging::Category category("test.category",1.0,1.0);
+		service.setLogDuplicateLimit(2);
+		service.setLogRateLimit(logging::Warning,1.0,2.0);
+		for(int i = 0;i < 5;++i)
+			GAMEDEVWEBTOOLS_LOG(service,logging::Information,"repeat %d",i);
+		for(int i = 0;i < 2;++i) {
+			GAMEDEVWEBTOOLS_LOG(service,logging::Warning,"warning %d",i);
+			GAMEDEVWEBTOOLS_LOG(service,logging::Warning,"other %d",i);
+			GAMEDEVWEBTOOLS_LOG_CATEGORY(service,category,logging::Debug,
+				"category %d",i);
+		}
+		// The limits are reported at the start of the next frame.
+		for(int i = 0;i < 2;++i) {
+			service.frameStart(0.0);
+			service.update();
+		}
+		static char response[64*1024];
+		auto size = client->read(response,sizeof(response));
+		std::string received(response,size);
+		auto count = [&](const char *type) {
+			size_t n = 0;
+			for(auto i = received.find(type);i != std::string::npos;
+				i = received.find(type,i + 1)) ++n;
+			return n;
+		};
+		// 2 repeats, 2 warnings and 1 message of the category.
+		assert(count("\"logging.fmsg\"") == 5);
+		assert(count("\"logging.repeat\"") == 1);
+		assert(received.find("{\"type\":\"logging.repeat\",\"id\":1,"
+			"\"count\":3}") != std::string::npos);
+		assert(count("\"logging.dropped\"") == 2);
+		char json[128];
+		snprintf(json,sizeof(json),"{\"type\":\"logging.dropped\",\"lvl\":%d,"
+			"\"count\":2}",int(logging::Warning));
+		assert(received.find(json) != std::string::npos);
+		assert(received.find("{\"type\":\"logging.dropped\","
+			"\"category\":\"test.category\",\"count\":1}") != 
+			std::string::npos);
+		
+		// Nothing is reported for a frame without the dropped messages.
+		service.frameStart(1.0);
+		service.update();
+		service.frameStart(1.0);
+		service.update();
+		size = client->read(response,sizeof(response));
+		received.assign(response,size);
+		assert(count("\"logging.repeat\"") == 0);
+		assert(count("\"logging.dropped\"") == 0);
+		transport.close(client);
+	}
+	
+	// Late joiner snapshot
+	{
+		using namespace gamedevwebtools;
+		
+		auto request = "GET / HTTP/1.1\r\nUpgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n";
+		network::MemoryTransport transport;
+		Service service;
+		Service::NetworkOptions options;
+		options.transport = &transport;
+		options.pingInterval = 0.0;
+		options.lateJoinerMaxValues = 64;
+		options.lateJoinerHistorySize = 4096;
+		service.init(Service::ApplicationInformation(),options);
+		service.snapshotHistory("logging.fmsg");
+		auto early = transport.connect();
+		early->write(request,strlen(request));
+		
+		// The values of the frames which were written before the client
+		// connected are in the snapshot, the older ones are replaced.
+		double time = 0.0;
+		for(int i = 0;i < 40;++i) {
+			char name[16];
+			snprintf(name,sizeof(name),"pool%d",i%20);
+			service.frameStart(time += 0.1);
+			if(!i) GAMEDEVWEBTOOLS_LOG(service,logging::Warning,"Pools: %d",20);
+			service.send(Message("monitoring.memory",
+				Message::Field("name",name),Message::Field("t",time),
+				Message::Field("size",i)));
+			service.update();
+		}
+		service.frameStart(time += 0.1);
+		service.update();
+		static char response[64*1024];
+		std::string received(response,early->read(response,sizeof(response)));
+		assert(received.find("\"logging.format\"") != std::string::npos);
+		
+		auto client = transport.connect();
+		client->write(request,strlen(request));
+		for(int i = 0;i < 3;++i) {
+			service.frameStart(time += 0.1);
+			service.update();
+		}
+		// The formats are written only to the new client.
+		received.assign(response,early->read(response,sizeof(response)));
+		assert(received.find("\"logging.format\"") == std::string::npos);
+		auto size = client->read(response,sizeof(response));
+		received.assign(response,size);
+		auto count = [&](const std::string &text) {
+			size_t n = 0;
+			for(auto i = received.find(text);i != std::string::npos;
+				i = received.find(text,i + 1)) ++n;
+			return n;
+		};
+		// Each pool has been sent once with its last size.
+		for(int i = 0;i < 20;++i) {
+			char name[32],value[32];
+			snprintf(name,sizeof(name),"\"name\":\"pool%d\"",i);
+			snprintf(value,sizeof(value),",\"size\":%d}",i + 20);
+			assert(count(name) == 1);
+			auto begin = received.find(name);
+			auto end = received.find('}',begin) + 1;
+			assert(received.compare(end - strlen(value),strlen(value),
+				value) == 0);
+		}
+		// The logs in the snapshot follow their formats.
+		auto format = received.find("\"logging.format\"");
+		assert(format != std::string::npos);
+		assert(count("\"logging.format\"") == 1);
+		assert(format < received.find("\"logging.fmsg\""));
+		transport.close(client);
+		transport.close(early);
+	}
+	
 	printf("Done\n");
 	return 0;
 }